@@ -5,31 +5,27 @@
 #include "addrman.h"
 #include "hash.h"
 
+#include <map>
+#include <set>
+
 int CAddrInfo::GetTriedBucket(const std::vector<unsigned char> &nKey) const
 {
-    CDataStream ss1(SER_GETHASH, 0);
+    // -- hashed as it streams, same result as Hash() over a CDataStream
     std::vector<unsigned char> vchKey = GetKey();
-    ss1 << nKey << vchKey;
-    uint64_t hash1 = Hash(ss1.begin(), ss1.end()).Get64();
+    uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << vchKey).GetHash().Get64();
 
-    CDataStream ss2(SER_GETHASH, 0);
     std::vector<unsigned char> vchGroupKey = GetGroup();
-    ss2 << nKey << vchGroupKey << (hash1 % ADDRMAN_TRIED_BUCKETS_PER_GROUP);
-    uint64_t hash2 = Hash(ss2.begin(), ss2.end()).Get64();
+    uint64_t hash2 = (CHashWriter(SER_GETHASH, 0) << nKey << vchGroupKey << (hash1 % ADDRMAN_TRIED_BUCKETS_PER_GROUP)).GetHash().Get64();
     return hash2 % ADDRMAN_TRIED_BUCKET_COUNT;
 }
 
 int CAddrInfo::GetNewBucket(const std::vector<unsigned char> &nKey, const CNetAddr& src) const
 {
-    CDataStream ss1(SER_GETHASH, 0);
     std::vector<unsigned char> vchGroupKey = GetGroup();
     std::vector<unsigned char> vchSourceGroupKey = src.GetGroup();
-    ss1 << nKey << vchGroupKey << vchSourceGroupKey;
-    uint64_t hash1 = Hash(ss1.begin(), ss1.end()).Get64();
+    uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << vchGroupKey << vchSourceGroupKey).GetHash().Get64();
 
-    CDataStream ss2(SER_GETHASH, 0);
-    ss2 << nKey << vchSourceGroupKey << (hash1 % ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP);
-    uint64_t hash2 = Hash(ss2.begin(), ss2.end()).Get64();
+    uint64_t hash2 = (CHashWriter(SER_GETHASH, 0) << nKey << vchSourceGroupKey << (hash1 % ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP)).GetHash().Get64();
     return hash2 % ADDRMAN_NEW_BUCKET_COUNT;
 }
 
@@ -76,29 +72,130 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+size_t CAddrMan::IndexSlot(const CNetAddr& addr) const
+{
+    unsigned char vch[16];
+    for (int i = 0; i < 16; i++)
+        vch[i] = addr.GetByte(15 - i);
+    uint64_t nHash = CSipHasher(nIndexK0, nIndexK1).Write(vch, sizeof(vch)).Finalize();
+    return nHash & (vIndex.size() - 1);
+}
+
+int CAddrMan::FindId(const CNetAddr& addr) const
+{
+    // the index is never more than half used, there is always an empty slot to stop at
+    size_t nMask = vIndex.size() - 1;
+    for (size_t i = IndexSlot(addr); ; i = (i + 1) & nMask)
+    {
+        int nId = vIndex[i];
+        if (nId == ADDRMAN_INDEX_EMPTY)
+            return -1;
+        if (nId >= 0 && (const CNetAddr&)vInfo[nId] == addr)
+            return nId;
+    }
+}
+
+void CAddrMan::IndexInsert(int nId)
+{
+    if ((nIndexUsed + 1) * 2 > vIndex.size())
+        IndexRebuild(vRandom.size() + 1);
+
+    size_t nMask = vIndex.size() - 1;
+    size_t i = IndexSlot(vInfo[nId]);
+    while (vIndex[i] >= 0)
+        i = (i + 1) & nMask;
+    if (vIndex[i] == ADDRMAN_INDEX_EMPTY)
+        nIndexUsed++;
+    vIndex[i] = nId;
+}
+
+void CAddrMan::IndexErase(int nId)
+{
+    size_t nMask = vIndex.size() - 1;
+    for (size_t i = IndexSlot(vInfo[nId]); vIndex[i] != ADDRMAN_INDEX_EMPTY; i = (i + 1) & nMask)
+    {
+        if (vIndex[i] == nId)
+        {
+            vIndex[i] = ADDRMAN_INDEX_DELETED;
+            return;
+        }
+    }
+}
+
+void CAddrMan::IndexRebuild(size_t nCount)
+{
+    // deleted slots are dropped, the new index is at most a quarter used
+    size_t nSize = ADDRMAN_INDEX_MIN_SIZE;
+    while (nSize < nCount * 4)
+        nSize *= 2;
+    vIndex.assign(nSize, ADDRMAN_INDEX_EMPTY);
+    nIndexUsed = 0;
+
+    size_t nMask = nSize - 1;
+    for (std::vector<int>::const_iterator it = vRandom.begin(); it != vRandom.end(); it++)
+    {
+        size_t i = IndexSlot(vInfo[*it]);
+        while (vIndex[i] != ADDRMAN_INDEX_EMPTY)
+            i = (i + 1) & nMask;
+        vIndex[i] = *it;
+        nIndexUsed++;
+    }
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
-    if (it == mapAddr.end())
+    int nId = FindId(addr);
+    if (nId < 0)
         return NULL;
     if (pnId)
-        *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+        *pnId = nId;
+    return &vInfo[nId];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
-    mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    int nId;
+    if (vFreeIds.empty())
+    {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    } else
+    {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    }
+    IndexInsert(nId);
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
+}
+
+void CAddrMan::Delete(int nId)
+{
+    CAddrInfo &info = vInfo[nId];
+    assert(info.nRandomPos >= 0 && !info.fInTried && info.nRefCount == 0);
+
+    SwapRandom(info.nRandomPos, vRandom.size()-1);
+    vRandom.pop_back();
+    IndexErase(nId);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
+    nNew--;
+}
+
+void CAddrMan::Clear_()
+{
+    vInfo.clear();
+    vFreeIds.clear();
+    vRandom.clear();
+    IndexRebuild(0);
+    vvTried.assign(ADDRMAN_TRIED_BUCKET_COUNT, CAddrTriedBucket());
+    vvNew.assign(ADDRMAN_NEW_BUCKET_COUNT, CAddrNewBucket());
+    nTried = 0;
+    nNew = 0;
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -111,11 +208,8 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
-
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -123,7 +217,7 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 int CAddrMan::SelectTried(int nKBucket)
 {
-    std::vector<int> &vTried = vvTried[nKBucket];
+    CAddrTriedBucket &vTried = vvTried[nKBucket];
 
     // random shuffle the first few elements (using the entire list)
     // find the least recently tried among them
@@ -135,8 +229,7 @@ int CAddrMan::SelectTried(int nKBucket)
         int nTemp = vTried[nPos];
         vTried[nPos] = vTried[i];
         vTried[i] = nTemp;
-        assert(nOldest == -1 || mapInfo.count(nTemp) == 1);
-        if (nOldest == -1 || mapInfo[nTemp].nLastSuccess < mapInfo[nOldest].nLastSuccess) {
+        if (nOldest == -1 || vInfo[nTemp].nLastSuccess < vInfo[nOldest].nLastSuccess) {
            nOldest = nTemp;
            nOldestPos = nPos;
         }
@@ -148,53 +241,33 @@ int CAddrMan::SelectTried(int nKBucket)
 int CAddrMan::ShrinkNew(int nUBucket)
 {
     assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
-    std::set<int> &vNew = vvNew[nUBucket];
+    CAddrNewBucket &vNew = vvNew[nUBucket];
 
     // first look for deletable items
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (unsigned int i = 0; i < vNew.size(); i++)
     {
-        assert(mapInfo.count(*it));
-        CAddrInfo &info = mapInfo[*it];
+        int nId = vNew[i];
+        CAddrInfo &info = vInfo[nId];
         if (info.IsTerrible())
         {
+            vNew.erase(nId);
             if (--info.nRefCount == 0)
-            {
-                SwapRandom(info.nRandomPos, vRandom.size()-1);
-                vRandom.pop_back();
-                mapAddr.erase(info);
-                mapInfo.erase(*it);
-                nNew--;
-            }
-            vNew.erase(it);
+                Delete(nId);
             return 0;
         }
     }
 
     // otherwise, select four randomly, and pick the oldest of those to replace
-    int n[4] = {GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size())};
-    int nI = 0;
     int nOldest = -1;
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (int n = 0; n < 4; n++)
     {
-        if (nI == n[0] || nI == n[1] || nI == n[2] || nI == n[3])
-        {
-            assert(nOldest == -1 || mapInfo.count(*it) == 1);
-            if (nOldest == -1 || mapInfo[*it].nTime < mapInfo[nOldest].nTime)
-                nOldest = *it;
-        }
-        nI++;
-    }
-    assert(mapInfo.count(nOldest) == 1);
-    CAddrInfo &info = mapInfo[nOldest];
-    if (--info.nRefCount == 0)
-    {
-        SwapRandom(info.nRandomPos, vRandom.size()-1);
-        vRandom.pop_back();
-        mapAddr.erase(info);
-        mapInfo.erase(nOldest);
-        nNew--;
+        int nId = vNew[GetRandInt(vNew.size())];
+        if (nOldest == -1 || vInfo[nId].nTime < vInfo[nOldest].nTime)
+            nOldest = nId;
     }
     vNew.erase(nOldest);
+    if (--vInfo[nOldest].nRefCount == 0)
+        Delete(nOldest);
 
     return 1;
 }
@@ -204,7 +277,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     assert(vvNew[nOrigin].count(nId) == 1);
 
     // remove the entry from all new buckets
-    for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    for (std::vector<CAddrNewBucket>::iterator it = vvNew.begin(); it != vvNew.end() && info.nRefCount > 0; it++)
     {
         if ((*it).erase(nId))
             info.nRefCount--;
@@ -215,12 +288,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // what tried bucket to move the entry to
     int nKBucket = info.GetTriedBucket(nKey);
-    std::vector<int> &vTried = vvTried[nKBucket];
+    CAddrTriedBucket &vTried = vvTried[nKBucket];
 
     // first check whether there is place to just add it
-    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
+    if (!vTried.full())
     {
-        vTried.push_back(nId);
+        vTried.insert(nId);
         nTried++;
         info.fInTried = true;
         return;
@@ -230,18 +303,17 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     int nPos = SelectTried(nKBucket);
 
     // find which new bucket it belongs to
-    assert(mapInfo.count(vTried[nPos]) == 1);
-    int nUBucket = mapInfo[vTried[nPos]].GetNewBucket(nKey);
-    std::set<int> &vNew = vvNew[nUBucket];
+    CAddrInfo& infoOld = vInfo[vTried[nPos]];
+    int nUBucket = infoOld.GetNewBucket(nKey);
+    CAddrNewBucket &vNew = vvNew[nUBucket];
 
     // remove the to-be-replaced tried entry from the tried set
-    CAddrInfo& infoOld = mapInfo[vTried[nPos]];
     infoOld.fInTried = false;
     infoOld.nRefCount = 1;
     // do not update nTried, as we are going to move something else there immediately
 
     // check whether there is place in that one,
-    if (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE)
+    if (!vNew.full())
     {
         // if so, move it back there
         vNew.insert(vTried[nPos]);
@@ -290,8 +362,7 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
     for (unsigned int n = 0; n < vvNew.size(); n++)
     {
         int nB = (n+nRnd) % vvNew.size();
-        std::set<int> &vNew = vvNew[nB];
-        if (vNew.count(nId))
+        if (vvNew[nB].count(nId))
         {
             nUBucket = nB;
             break;
@@ -356,13 +427,13 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
     };
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
-    std::set<int> &vNew = vvNew[nUBucket];
+    CAddrNewBucket &vNew = vvNew[nUBucket];
     if (!vNew.count(nId))
     {
         pinfo->nRefCount++;
-        if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
+        if (vNew.full())
             ShrinkNew(nUBucket);
-        vvNew[nUBucket].insert(nId);
+        vNew.insert(nId);
     };
     return fNew;
 }
@@ -386,28 +457,57 @@ void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
     info.nAttempts++;
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+// -- insecure_rand with its state on the stack, Select_ runs on several threads at once under the shared lock
+class CSelectRand
+{
+public:
+    CSelectRand()
+    {
+        // the seed values have some unlikely fixed points which are avoided, as seed_insecure_rand
+        do {
+            Rz = GetRand(0x100000000ULL);
+        } while (Rz == 0 || Rz == 0x9068ffffU);
+        do {
+            Rw = GetRand(0x100000000ULL);
+        } while (Rw == 0 || Rw == 0x464fffffU);
+    }
+
+    uint32_t operator()()
+    {
+        Rz = 36969 * (Rz & 65535) + (Rz >> 16);
+        Rw = 18000 * (Rw & 65535) + (Rw >> 16);
+        return (Rw << 16) + Rz;
+    }
+
+private:
+    uint32_t Rz;
+    uint32_t Rw;
+};
+
+CAddress CAddrMan::Select_(int nUnkBias) const
 {
     if (size() == 0)
         return CAddress();
     
     int nTries = fTestNet ? 100 : 100000;
+    int64_t nNow = GetAdjustedTime();
     
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
+    // the tries below draw from a CSelectRand, a few dozen GetRandInt calls per Select were most of its cost
+    CSelectRand rng;
     if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
     {
         // use a tried node
         double fChanceFactor = 1.0;
         for (int i = 0; i < nTries; ++i)
         {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
+            int nKBucket = rng() % vvTried.size();
+            const CAddrTriedBucket &vTried = vvTried[nKBucket];
             if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
+            int nPos = rng() % vTried.size();
+            const CAddrInfo &info = vInfo[vTried[nPos]];
+            if ((rng() & ((1<<30)-1)) < fChanceFactor*info.GetChance(nNow)*(1<<30))
                 return info;
             fChanceFactor *= fTestNet ? 12 : 1.2;
         };
@@ -417,16 +517,12 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         for (int i = 0; i < nTries; ++i)
         {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
+            int nUBucket = rng() % vvNew.size();
+            const CAddrNewBucket &vNew = vvNew[nUBucket];
             if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
+            int nPos = rng() % vNew.size();
+            const CAddrInfo &info = vInfo[vNew[nPos]];
+            if ((rng() & ((1<<30)-1)) < fChanceFactor*info.GetChance(nNow)*(1<<30))
                 return info;
             fChanceFactor *= fTestNet ? 12 : 1.2;
         };
@@ -436,17 +532,18 @@ CAddress CAddrMan::Select_(int nUnkBias)
 }
 
 #ifdef DEBUG_ADDRMAN
-int CAddrMan::Check_()
+int CAddrMan::Check_() const
 {
     std::set<int> setTried;
     std::map<int, int> mapNew;
 
     if (vRandom.size() != nTried + nNew) return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (unsigned int n = 0; n < vInfo.size(); n++)
     {
-        int n = (*it).first;
-        CAddrInfo &info = (*it).second;
+        const CAddrInfo &info = vInfo[n];
+        if (info.nRandomPos < 0)
+            continue;
         if (info.fInTried)
         {
 
@@ -459,8 +556,8 @@ int CAddrMan::Check_()
             if (!info.nRefCount) return -4;
             mapNew[n] = info.nRefCount;
         };
-        if (mapAddr[info] != n) return -5;
-        if (info.nRandomPos<0 || info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != n) return -14;
+        if (FindId(info) != (int)n) return -5;
+        if (info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != n) return -14;
         if (info.nLastTry < 0) return -6;
         if (info.nLastSuccess < 0) return -8;
     };
@@ -468,24 +565,24 @@ int CAddrMan::Check_()
     if (setTried.size() != nTried) return -9;
     if (mapNew.size() != nNew) return -10;
 
-    for (int n=0; n<vvTried.size(); n++)
+    for (unsigned int n=0; n<vvTried.size(); n++)
     {
-        std::vector<int> &vTried = vvTried[n];
-        for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
+        const CAddrTriedBucket &vTried = vvTried[n];
+        for (unsigned int i = 0; i < vTried.size(); i++)
         {
-            if (!setTried.count(*it)) return -11;
-            setTried.erase(*it);
+            if (!setTried.count(vTried[i])) return -11;
+            setTried.erase(vTried[i]);
         };
     };
 
-    for (int n=0; n<vvNew.size(); n++)
+    for (unsigned int n=0; n<vvNew.size(); n++)
     {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        const CAddrNewBucket &vNew = vvNew[n];
+        for (unsigned int i = 0; i < vNew.size(); i++)
         {
-            if (!mapNew.count(*it)) return -12;
-            if (--mapNew[*it] == 0)
-                mapNew.erase(*it);
+            if (!mapNew.count(vNew[i])) return -12;
+            if (--mapNew[vNew[i]] == 0)
+                mapNew.erase(vNew[i]);
         };
     };
 
@@ -496,19 +593,21 @@ int CAddrMan::Check_()
 }
 #endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
+void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr) const
 {
     int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
 
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
+    // perform a random shuffle over the first nNodes elements of a copy of vRandom (selecting from all),
+    // vRandom itself is left alone as the lock is shared
+    std::vector<int> vIds(vRandom);
+    vAddr.reserve(nNodes);
     for (int n = 0; n<nNodes; n++)
     {
-        int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        int nRndPos = GetRandInt(vIds.size() - n) + n;
+        std::swap(vIds[n], vIds[nRndPos]);
+        vAddr.push_back(vInfo[vIds[n]]);
     }
 }
 
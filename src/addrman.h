@@ -10,9 +10,10 @@
 #include "sync.h"
 
 
-#include <map>
 #include <vector>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <openssl/rand.h>
 
 
@@ -38,7 +39,7 @@ private:
     // in tried set? (memory only)
     bool fInTried;
 
-    // position in vRandom
+    // position in vRandom, -1 if the nId is unused (memory only)
     int nRandomPos;
 
     friend class CAddrMan;
@@ -118,6 +119,10 @@ public:
 //      be observable by adversaries.
 //    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
 //      consistency checks for the entire data structure.
+//  * Entries live in a flat vector indexed by nId, found by address through an open addressing hash table.
+//    Buckets are fixed arrays of nIds, so picking a random entry from one is O(1).
+//  * Select, GetAddr and serialization only read the tables and share the lock, connection attempts don't wait
+//    on each other or on a peers.dat dump, only on Add, Good, Attempt and Connected.
 
 // total number of buckets for tried addresses
 #define ADDRMAN_TRIED_BUCKET_COUNT 64
@@ -161,24 +166,78 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// smallest size of the address index, it is kept at most half full
+#define ADDRMAN_INDEX_MIN_SIZE 64
+
+/** Fixed size bucket of nIds, filled from the front */
+template<unsigned int N>
+class CAddrBucket
+{
+private:
+    unsigned int nSize;
+    int vId[N];
+
+public:
+    CAddrBucket() : nSize(0) {}
+
+    unsigned int size() const { return nSize; }
+    bool full() const { return nSize == N; }
+    int operator[](unsigned int i) const { return vId[i]; }
+    int& operator[](unsigned int i) { return vId[i]; }
+
+    bool count(int nId) const
+    {
+        for (unsigned int i = 0; i < nSize; ++i)
+            if (vId[i] == nId)
+                return true;
+        return false;
+    }
+
+    // @pre !full()
+    void insert(int nId)
+    {
+        assert(nSize < N);
+        vId[nSize++] = nId;
+    }
+
+    // Returns false if nId isn't in the bucket, the last entry takes its place
+    bool erase(int nId)
+    {
+        for (unsigned int i = 0; i < nSize; ++i)
+        {
+            if (vId[i] != nId)
+                continue;
+            vId[i] = vId[--nSize];
+            return true;
+        };
+        return false;
+    }
+};
+
+typedef CAddrBucket<ADDRMAN_TRIED_BUCKET_SIZE> CAddrTriedBucket;
+typedef CAddrBucket<ADDRMAN_NEW_BUCKET_SIZE> CAddrNewBucket;
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
 private:
-    // critical section to protect the inner data structures
-    mutable CCriticalSection cs;
+    // lock to protect the inner data structures, shared by readers
+    mutable boost::shared_mutex cs;
 
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
 
-    // last used nId
-    int nIdCount;
+    // secret keys for the address index
+    uint64_t nIndexK0, nIndexK1;
 
-    // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    // table with information about all nIds, unused nIds are kept in vFreeIds
+    std::vector<CAddrInfo> vInfo;
+    std::vector<int> vFreeIds;
 
-    // find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    // find an nId based on its network address, open addressing with linear probing
+    // slots hold an nId, ADDRMAN_INDEX_EMPTY or ADDRMAN_INDEX_DELETED
+    std::vector<int> vIndex;
+    unsigned int nIndexUsed;
 
     // randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -187,16 +246,38 @@ private:
     int nTried;
 
     // list of "tried" buckets
-    std::vector<std::vector<int> > vvTried;
+    std::vector<CAddrTriedBucket> vvTried;
 
     // number of (unique) "new" entries
     int nNew;
 
     // list of "new" buckets
-    std::vector<std::set<int> > vvNew;
+    std::vector<CAddrNewBucket> vvNew;
+
+    // count of changes, peers.dat need not be written again if unchanged
+    uint64_t nModified;
+
+    enum
+    {
+        ADDRMAN_INDEX_EMPTY = -1,
+        ADDRMAN_INDEX_DELETED = -2,
+    };
 
 protected:
 
+    // Position of a network address in vIndex, before probing.
+    size_t IndexSlot(const CNetAddr& addr) const;
+
+    // Find an nId based on its network address, -1 if not present.
+    int FindId(const CNetAddr& addr) const;
+
+    // Add or remove an nId in the address index, the entry must be in vInfo.
+    void IndexInsert(int nId);
+    void IndexErase(int nId);
+
+    // Rebuild the address index from vRandom, sized for nCount entries.
+    void IndexRebuild(size_t nCount);
+
     // Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int *pnId = NULL);
 
@@ -204,6 +285,12 @@ protected:
     // nTime and nServices of found node is updated, if necessary.
     CAddrInfo* Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId = NULL);
 
+    // Delete an entry that is in no bucket.
+    void Delete(int nId);
+
+    // Empty all tables.
+    void Clear_();
+
     // Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
@@ -230,15 +317,15 @@ protected:
 
     // Select an address to connect to.
     // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
+    CAddress Select_(int nUnkBias) const;
 
 #ifdef DEBUG_ADDRMAN
     // Perform consistency check. Returns an error code or zero.
-    int Check_();
+    int Check_() const;
 #endif
 
     // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
+    void GetAddr_(std::vector<CAddress> &vAddr) const;
 
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
@@ -259,7 +346,7 @@ public:
         //   * number of elements
         //   * for each element: index
         //
-        // Notice that vvTried, mapAddr and vVector are never encoded explicitly;
+        // Notice that vvTried, the address index and vRandom are never encoded explicitly;
         // they are instead reconstructed from the other information.
         //
         // vvNew is serialized, but only used if ADDRMAN_UNKOWN_BUCKET_COUNT didn't change,
@@ -267,140 +354,159 @@ public:
         //
         // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
+        CAddrMan *am = const_cast<CAddrMan*>(this);
+        if (!fRead)
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             unsigned char nVersion = 0;
             READWRITE(nVersion);
             READWRITE(nKey);
             READWRITE(nNew);
             READWRITE(nTried);
 
-            CAddrMan *am = const_cast<CAddrMan*>(this);
-            if (fWrite)
+            int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
+            READWRITE(nUBuckets);
+            std::vector<int> vUnkIds(vInfo.size(), 0);
+            int nIds = 0;
+            for (unsigned int nId = 0; nId < vInfo.size(); nId++)
             {
-                int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
-                READWRITE(nUBuckets);
-                std::map<int, int> mapUnkIds;
-                int nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                if (nIds == nNew) break; // this means nNew was wrong, oh ow
+                CAddrInfo &info = am->vInfo[nId];
+                if (info.nRandomPos >= 0 && info.nRefCount)
                 {
-                    if (nIds == nNew) break; // this means nNew was wrong, oh ow
-                    mapUnkIds[(*it).first] = nIds;
-                    CAddrInfo &info = (*it).second;
-                    if (info.nRefCount)
-                    {
-                        READWRITE(info);
-                        nIds++;
-                    }
+                    vUnkIds[nId] = nIds;
+                    READWRITE(info);
+                    nIds++;
                 }
-                nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+            }
+            nIds = 0;
+            for (unsigned int nId = 0; nId < vInfo.size(); nId++)
+            {
+                if (nIds == nTried) break; // this means nTried was wrong, oh ow
+                CAddrInfo &info = am->vInfo[nId];
+                if (info.nRandomPos >= 0 && info.fInTried)
                 {
-                    if (nIds == nTried) break; // this means nTried was wrong, oh ow
-                    CAddrInfo &info = (*it).second;
-                    if (info.fInTried)
-                    {
-                        READWRITE(info);
-                        nIds++;
-                    }
+                    READWRITE(info);
+                    nIds++;
                 }
-                for (std::vector<std::set<int> >::iterator it = am->vvNew.begin(); it != am->vvNew.end(); it++)
+            }
+            for (std::vector<CAddrNewBucket>::const_iterator it = vvNew.begin(); it != vvNew.end(); it++)
+            {
+                const CAddrNewBucket &vNew = (*it);
+                int nSize = vNew.size();
+                READWRITE(nSize);
+                for (int i = 0; i < nSize; i++)
                 {
-                    const std::set<int> &vNew = (*it);
-                    int nSize = vNew.size();
-                    READWRITE(nSize);
-                    for (std::set<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
-                    {
-                        int nIndex = mapUnkIds[*it2];
-                        READWRITE(nIndex);
-                    }
+                    int nIndex = vUnkIds[vNew[i]];
+                    READWRITE(nIndex);
                 }
-            } else {
-                int nUBuckets = 0;
-                READWRITE(nUBuckets);
-                am->nIdCount = 0;
-                am->mapInfo.clear();
-                am->mapAddr.clear();
-                am->vRandom.clear();
-                am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
-                am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
-                for (int n = 0; n < am->nNew; n++)
+            }
+        } else {
+            boost::unique_lock<boost::shared_mutex> lock(am->cs);
+            unsigned char nVersion = 0;
+            READWRITE(nVersion);
+            READWRITE(am->nKey);
+            READWRITE(am->nNew);
+            READWRITE(am->nTried);
+
+            int nUBuckets = 0;
+            READWRITE(nUBuckets);
+            int nNewIn = am->nNew;
+            int nTriedIn = am->nTried;
+            am->Clear_();
+            for (int n = 0; n < nNewIn; n++)
+            {
+                CAddrInfo info;
+                READWRITE(info);
+                int nId = am->vInfo.size();
+                am->vInfo.push_back(info);
+                if (am->FindId(info) < 0)
+                    am->IndexInsert(nId);
+                am->vInfo[nId].nRandomPos = am->vRandom.size();
+                am->vRandom.push_back(nId);
+                am->nNew++;
+                if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
                 {
-                    CAddrInfo &info = am->mapInfo[n];
-                    READWRITE(info);
-                    am->mapAddr[info] = n;
-                    info.nRandomPos = vRandom.size();
-                    am->vRandom.push_back(n);
-                    if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
+                    CAddrNewBucket &vNew = am->vvNew[info.GetNewBucket(am->nKey)];
+                    if (!vNew.full())
                     {
-                        am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
-                        info.nRefCount++;
+                        vNew.insert(nId);
+                        am->vInfo[nId].nRefCount++;
                     }
                 }
-                am->nIdCount = am->nNew;
-                int nLost = 0;
-                for (int n = 0; n < am->nTried; n++)
+            }
+            for (int n = 0; n < nTriedIn; n++)
+            {
+                CAddrInfo info;
+                READWRITE(info);
+                CAddrTriedBucket &vTried = am->vvTried[info.GetTriedBucket(am->nKey)];
+                if (!vTried.full() && am->FindId(info) < 0)
                 {
-                    CAddrInfo info;
-                    READWRITE(info);
-                    std::vector<int> &vTried = am->vvTried[info.GetTriedBucket(am->nKey)];
-                    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
-                    {
-                        info.nRandomPos = vRandom.size();
-                        info.fInTried = true;
-                        am->vRandom.push_back(am->nIdCount);
-                        am->mapInfo[am->nIdCount] = info;
-                        am->mapAddr[info] = am->nIdCount;
-                        vTried.push_back(am->nIdCount);
-                        am->nIdCount++;
-                    } else {
-                        nLost++;
-                    }
+                    int nId = am->vInfo.size();
+                    info.fInTried = true;
+                    am->vInfo.push_back(info);
+                    am->IndexInsert(nId);
+                    am->vInfo[nId].nRandomPos = am->vRandom.size();
+                    am->vRandom.push_back(nId);
+                    vTried.insert(nId);
+                    am->nTried++;
                 }
-                am->nTried -= nLost;
-                for (int b = 0; b < nUBuckets; b++)
+            }
+            for (int b = 0; b < nUBuckets; b++)
+            {
+                int nSize = 0;
+                READWRITE(nSize);
+                for (int n = 0; n < nSize; n++)
                 {
-                    std::set<int> &vNew = am->vvNew[b];
-                    int nSize = 0;
-                    READWRITE(nSize);
-                    for (int n = 0; n < nSize; n++)
+                    int nIndex = 0;
+                    READWRITE(nIndex);
+                    if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT || nIndex < 0 || nIndex >= nNewIn)
+                        continue;
+                    CAddrNewBucket &vNew = am->vvNew[b];
+                    CAddrInfo &info = am->vInfo[nIndex];
+                    if (info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS && !vNew.full() && !vNew.count(nIndex))
                     {
-                        int nIndex = 0;
-                        READWRITE(nIndex);
-                        CAddrInfo &info = am->mapInfo[nIndex];
-                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
-                        {
-                            info.nRefCount++;
-                            vNew.insert(nIndex);
-                        }
+                        info.nRefCount++;
+                        vNew.insert(nIndex);
                     }
                 }
             }
+            // drop new entries that didn't make it into any bucket
+            for (int nId = 0; nId < nNewIn; nId++)
+                if (am->vInfo[nId].nRefCount == 0)
+                    am->Delete(nId);
         }
     });)
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+    CAddrMan() : vvTried(ADDRMAN_TRIED_BUCKET_COUNT), vvNew(ADDRMAN_NEW_BUCKET_COUNT)
     {
          nKey.resize(32);
          RAND_bytes(&nKey[0], 32);
+         RAND_bytes((unsigned char*)&nIndexK0, sizeof(nIndexK0));
+         RAND_bytes((unsigned char*)&nIndexK1, sizeof(nIndexK1));
 
-         nIdCount = 0;
-         nTried = 0;
-         nNew = 0;
+         nModified = 0;
+         Clear_();
     }
 
     // Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
         return vRandom.size();
     }
 
-    // Consistency check
-    void Check()
+    // Return the count of changes made, to skip writing peers.dat when nothing changed
+    uint64_t GetModified() const
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs);
+        return nModified;
+    }
+
+    // Consistency check, cs must be held
+    void Check() const
     {
 #ifdef DEBUG_ADDRMAN
         {
-            LOCK(cs);
             int err;
             if ((err=Check_()))
                 LogPrintf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
@@ -413,9 +519,10 @@ public:
     {
         bool fRet = false;
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
+            nModified++;
             Check();
         }
         if (fRet)
@@ -428,10 +535,11 @@ public:
     {
         int nAdd = 0;
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
                 nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+            nModified++;
             Check();
         }
         if (nAdd)
@@ -443,9 +551,10 @@ public:
     void Good(const CService &addr, int64_t nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Good_(addr, nTime);
+            nModified++;
             Check();
         }
     }
@@ -454,37 +563,36 @@ public:
     void Attempt(const CService &addr, int64_t nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Attempt_(addr, nTime);
+            nModified++;
             Check();
         }
     }
 
     // Choose an address to connect to.
     // nUnkBias determines how much "new" entries are favored over "tried" ones (0-100).
-    CAddress Select(int nUnkBias = 50)
+    CAddress Select(int nUnkBias = 50) const
     {
         CAddress addrRet;
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             Check();
             addrRet = Select_(nUnkBias);
-            Check();
         }
         return addrRet;
     }
 
     // Return a bunch of addresses, selected at random.
-    std::vector<CAddress> GetAddr()
+    std::vector<CAddress> GetAddr() const
     {
-        Check();
         std::vector<CAddress> vAddr;
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
+            Check();
             GetAddr_(vAddr);
         }
-        Check();
         return vAddr;
     }
 
@@ -492,9 +600,10 @@ public:
     void Connected(const CService &addr, int64_t nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Connected_(addr, nTime);
+            nModified++;
             Check();
         }
     }
@@ -9,6 +9,7 @@
 #include <string>
 #ifndef Q_MOC_RUN
 #include <boost/thread/mutex.hpp>
+#include <boost/pool/singleton_pool.hpp>
 #endif
 #include <map>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
@@ -267,6 +268,63 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+//
+// Allocator that serves single-object requests (hash table and tree nodes)
+// from a per-size free list, so containers with heavy insert/erase churn
+// don't go through the general heap for every entry.  Array requests
+// (bucket tables) fall through to std::allocator.
+// Freed nodes are kept by the pool for reuse and never returned to the OS.
+//
+struct node_pool_tag { };
+
+template<typename T>
+struct node_pool_allocator : public std::allocator<T>
+{
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    node_pool_allocator() throw() {}
+    node_pool_allocator(const node_pool_allocator& a) throw() : base(a) {}
+    template <typename U>
+    node_pool_allocator(const node_pool_allocator<U>& a) throw() : base(a) {}
+    ~node_pool_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef node_pool_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        if (n != 1)
+            return std::allocator<T>::allocate(n);
+        T *p = static_cast<T*>(boost::singleton_pool<node_pool_tag, sizeof(T)>::malloc());
+        if (p == NULL)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (p == NULL)
+            return;
+        if (n != 1)
+        {
+            std::allocator<T>::deallocate(p, n);
+            return;
+        };
+        boost::singleton_pool<node_pool_tag, sizeof(T)>::free(p);
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(const node_pool_allocator<T>&, const node_pool_allocator<U>&) { return true; }
+template<typename T, typename U>
+inline bool operator!=(const node_pool_allocator<T>&, const node_pool_allocator<U>&) { return false; }
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -14,10 +14,11 @@
 extern const char tor_git_revision[];
 const char tor_git_revision[] = "";
 
+// Tor's state is kept in the node's data directory, per network, so it is reused across runs
 char const* anonymize_tor_data_directory(
 ) {
     static std::string const retrieved = (
-        GetDefaultDataDir(
+        GetDataDir(
         ) / "tor"
     ).string(
     );
@@ -28,8 +29,8 @@ char const* anonymize_tor_data_directory(
 char const* anonymize_service_directory(
 ) {
     static std::string const retrieved = (
-        GetDefaultDataDir(
-        ) / "onion"
+        GetDataDir(
+        ) / "tor" / "onion"
     ).string(
     );
     return retrieved.c_str(
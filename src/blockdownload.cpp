@@ -0,0 +1,207 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockdownload.h"
+
+#include "util.h"
+
+CBlockDownload blockDownload;
+
+CBlockDownload::CEntry* CBlockDownload::Find(const uint256& hash)
+{
+    std::map<uint256, uint64_t>::iterator mi = mapQueued.find(hash);
+    if (mi == mapQueued.end())
+        return NULL;
+    return &vQueue[mi->second - nPopped];
+}
+
+void CBlockDownload::Release(CEntry& entry)
+{
+    if (entry.nState != BLOCK_IN_FLIGHT)
+        return;
+
+    std::map<NodeId, int>::iterator mi = mapPeerInFlight.find(entry.nodeId);
+    if (mi != mapPeerInFlight.end()
+        && --mi->second <= 0)
+        mapPeerInFlight.erase(mi);
+
+    entry.nState = BLOCK_WANTED;
+    entry.nodeId = -1;
+    entry.nTimeBlocked = 0;
+}
+
+void CBlockDownload::Clear()
+{
+    vQueue.clear();
+    mapQueued.clear();
+    mapPeerInFlight.clear();
+    setStalling.clear();
+    setMisbehaving.clear();
+    nPopped = 0;
+}
+
+bool CBlockDownload::AddHeader(const uint256& hash, const uint256& hashPrev, int nHeight,
+    int64_t nBlockTime, unsigned int nBits, bool fProofOfStake, NodeId nodeFrom)
+{
+    if (mapQueued.count(hash))
+        return false;
+
+    if (!vQueue.empty()
+        && (hashPrev != vQueue.back().hash || nHeight != vQueue.back().nHeight + 1))
+        return false;
+
+    CEntry entry;
+    entry.hash = hash;
+    entry.hashPrev = hashPrev;
+    entry.nHeight = nHeight;
+    entry.nBlockTime = nBlockTime;
+    entry.nBits = nBits;
+    entry.fProofOfStake = fProofOfStake;
+    entry.nodeFrom = nodeFrom;
+    entry.nState = BLOCK_WANTED;
+    entry.nodeId = -1;
+    entry.nTime = 0;
+    entry.nTimeBlocked = 0;
+    entry.nRetries = 0;
+
+    vQueue.push_back(entry);
+    mapQueued[hash] = nPopped + vQueue.size() - 1;
+    return true;
+}
+
+bool CBlockDownload::HaveHeader(const uint256& hash) const
+{
+    return mapQueued.count(hash);
+}
+
+void CBlockDownload::PopFront()
+{
+    if (vQueue.empty())
+        return;
+
+    Release(vQueue.front());
+    mapQueued.erase(vQueue.front().hash);
+    vQueue.pop_front();
+    nPopped++;
+}
+
+void CBlockDownload::GetBlocksToRequest(NodeId nodeId, int64_t nNow, std::vector<uint256>& vHashes)
+{
+    if (vQueue.empty())
+        return;
+
+    int nInFlight = GetInFlight(nodeId);
+    int nWindowEnd = vQueue.front().nHeight + BLOCK_DOWNLOAD_WINDOW;
+
+    std::deque<CEntry>::iterator it;
+    for (it = vQueue.begin();
+         it != vQueue.end() && it->nHeight < nWindowEnd && nInFlight < MAX_BLOCKS_IN_FLIGHT_PER_PEER; ++it)
+    {
+        if (it->nState != BLOCK_WANTED)
+            continue;
+
+        it->nState = BLOCK_IN_FLIGHT;
+        it->nodeId = nodeId;
+        it->nTime = nNow;
+        vHashes.push_back(it->hash);
+        nInFlight++;
+    };
+
+    if (nInFlight > 0)
+        mapPeerInFlight[nodeId] = nInFlight;
+
+    // -- this peer could take more, but the window ends before another peer's front block arrives
+    CEntry& front = vQueue.front();
+    if (nInFlight < MAX_BLOCKS_IN_FLIGHT_PER_PEER
+        && it != vQueue.end()
+        && front.nState == BLOCK_IN_FLIGHT
+        && front.nodeId != nodeId
+        && front.nTimeBlocked == 0)
+        front.nTimeBlocked = nNow;
+}
+
+int CBlockDownload::GetInFlight(NodeId nodeId) const
+{
+    std::map<NodeId, int>::const_iterator mi = mapPeerInFlight.find(nodeId);
+    return mi == mapPeerInFlight.end() ? 0 : mi->second;
+}
+
+bool CBlockDownload::MarkReceived(const uint256& hash, int64_t nNow)
+{
+    CEntry* pentry = Find(hash);
+    if (!pentry)
+        return false;
+
+    Release(*pentry);
+    pentry->nState = BLOCK_RECEIVED;
+    pentry->nTime = nNow;
+    return true;
+}
+
+bool CBlockDownload::CheckTimeouts(int64_t nNow)
+{
+    if (vQueue.empty())
+        return true;
+
+    CEntry& front = vQueue.front();
+    bool fFailed = false;
+    if (front.nState == BLOCK_IN_FLIGHT
+        && front.nTimeBlocked != 0
+        && nNow - front.nTimeBlocked > BLOCK_STALLING_TIMEOUT)
+    {
+        // -- nTimeBlocked is only set by another peer able to take the block over.
+        //    A block that stalled before may not exist, its next peers are not blamed for it.
+        LogPrint("net", "Block download stalled on %s by peer %d\n", front.hash.ToString(), front.nodeId);
+        if (front.nRetries == 0)
+            setStalling.insert(front.nodeId);
+        ReleasePeer(front.nodeId);
+        fFailed = true;
+    } else
+    if (front.nState == BLOCK_RECEIVED
+        && nNow - front.nTime > BLOCK_STALLING_TIMEOUT)
+    {
+        // -- received but never connected, it was rejected or dropped from the orphan pool
+        front.nState = BLOCK_WANTED;
+        fFailed = true;
+    };
+
+    if (fFailed
+        && ++front.nRetries > MAX_BLOCK_DOWNLOAD_RETRIES)
+    {
+        // -- honest peers can't serve a block that doesn't exist, blame the header chain, not them
+        NodeId nodeFrom = front.nodeFrom;
+        LogPrintf("Block %s at height %d failed %d times, dropping the download queue from peer %d.\n",
+            front.hash.ToString(), front.nHeight, front.nRetries, nodeFrom);
+        Clear();
+        setMisbehaving.insert(nodeFrom);
+        return false;
+    };
+
+    int nWindowEnd = front.nHeight + BLOCK_DOWNLOAD_WINDOW;
+    for (std::deque<CEntry>::iterator it = vQueue.begin(); it != vQueue.end() && it->nHeight < nWindowEnd; ++it)
+    {
+        if (it->nState == BLOCK_IN_FLIGHT
+            && nNow - it->nTime > BLOCK_DOWNLOAD_TIMEOUT)
+            Release(*it);
+    };
+
+    return true;
+}
+
+bool CBlockDownload::PopStalling(NodeId nodeId)
+{
+    return setStalling.erase(nodeId);
+}
+
+bool CBlockDownload::PopMisbehaving(NodeId nodeId)
+{
+    return setMisbehaving.erase(nodeId);
+}
+
+void CBlockDownload::ReleasePeer(NodeId nodeId)
+{
+    for (std::deque<CEntry>::iterator it = vQueue.begin(); it != vQueue.end() && GetInFlight(nodeId) > 0; ++it)
+        if (it->nState == BLOCK_IN_FLIGHT && it->nodeId == nodeId)
+            Release(*it);
+}
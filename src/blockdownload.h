@@ -0,0 +1,120 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef TPAY_BLOCKDOWNLOAD_H
+#define TPAY_BLOCKDOWNLOAD_H
+
+#include "net.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+/** Headers-first block download for full nodes.
+ *
+ *  Headers are fetched ahead of the block chain from one peer, the blocks they
+ *  name are then requested from all headers-first peers at once. Blocks that
+ *  arrive ahead of their parent wait in the orphan pool, so validation still
+ *  proceeds in chain order.
+ */
+
+/** Blocks requested from a single peer at once */
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+/** Blocks are only requested this far ahead of the best block, bounds the orphan pool */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds the download window may be held up by the next block to connect before its peer is treated as stalling */
+static const int64_t BLOCK_STALLING_TIMEOUT = 10;
+/** Seconds before any block request is given to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 120;
+/** Times a block is fetched again before the header chain is given up on and its sender blamed */
+static const int MAX_BLOCK_DOWNLOAD_RETRIES = 3;
+/** Headers queued ahead of the best block, more are fetched when half are used */
+static const unsigned int MAX_HEADERS_AHEAD = 20000;
+/** Seconds without headers from the sync peer before another is used */
+static const int64_t HEADERS_SYNC_TIMEOUT = 60;
+/** Blocks behind a peer before headers-first sync starts, smaller gaps are left to inv/getblocks */
+static const int HEADERS_FIRST_MIN_BEHIND = 144;
+
+/** Download queue of headers not yet connected as blocks, guarded by cs_main */
+class CBlockDownload
+{
+public:
+    enum
+    {
+        BLOCK_WANTED,
+        BLOCK_IN_FLIGHT,
+        BLOCK_RECEIVED,
+    };
+
+    class CEntry
+    {
+    public:
+        uint256 hash;
+        uint256 hashPrev;
+        int nHeight;
+        int64_t nBlockTime;
+        unsigned int nBits;
+        bool fProofOfStake;
+        NodeId nodeFrom;        // peer the header came from
+        int nState;
+        NodeId nodeId;
+        int64_t nTime;
+        int64_t nTimeBlocked;   // when another peer first found the window closed behind this block, 0 if not
+        int nRetries;
+    };
+
+private:
+    std::deque<CEntry> vQueue;              // chain order, front is the next block to connect
+    std::map<uint256, uint64_t> mapQueued;  // hash -> sequence number, nPopped + position in vQueue
+    std::map<NodeId, int> mapPeerInFlight;
+    std::set<NodeId> setStalling;
+    std::set<NodeId> setMisbehaving;
+    uint64_t nPopped;
+
+    CEntry* Find(const uint256& hash);
+    void Release(CEntry& entry);
+
+public:
+    CBlockDownload()
+    {
+        nPopped = 0;
+    }
+
+    void Clear();
+
+    /** Append a header, hashPrev must be the last header queued unless the queue is empty */
+    bool AddHeader(const uint256& hash, const uint256& hashPrev, int nHeight,
+        int64_t nBlockTime, unsigned int nBits, bool fProofOfStake, NodeId nodeFrom);
+    bool HaveHeader(const uint256& hash) const;
+    size_t Size() const { return vQueue.size(); }
+    bool Empty() const { return vQueue.empty(); }
+    const CEntry& Front() const { return vQueue.front(); }
+    const CEntry& Back() const { return vQueue.back(); }
+    const CEntry& At(size_t n) const { return vQueue[n]; }
+    void PopFront();
+
+    /** Pick the next wanted blocks within the download window for nodeId and mark them in flight */
+    void GetBlocksToRequest(NodeId nodeId, int64_t nNow, std::vector<uint256>& vHashes);
+    int GetInFlight(NodeId nodeId) const;
+
+    /** Returns true if the block was queued */
+    bool MarkReceived(const uint256& hash, int64_t nNow);
+
+    /** Return timed out requests to the queue and note the peer holding back the window.
+     *  Returns false if the front block failed too often, the queue is then cleared and the
+     *  peer that sent its header noted as misbehaving.
+     */
+    bool CheckTimeouts(int64_t nNow);
+
+    /** True once for each peer found stalling by CheckTimeouts */
+    bool PopStalling(NodeId nodeId);
+    /** True once for each peer whose headers named blocks that couldn't be downloaded */
+    bool PopMisbehaving(NodeId nodeId);
+    void ReleasePeer(NodeId nodeId);
+};
+
+extern CBlockDownload blockDownload;
+
+#endif // TPAY_BLOCKDOWNLOAD_H
@@ -0,0 +1,171 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header = block.GetBlockHeaderOnly();
+    vchBlockSig = block.vchBlockSig;
+    nonce = GetRand(std::numeric_limits<uint64_t>::max());
+    fShortIdKeys = false;
+
+    for (unsigned int i = 0; i < block.vtx.size(); ++i)
+    {
+        const CTransaction& tx = block.vtx[i];
+
+        // -- the coinstake is needed to check the block signature before reconstruction,
+        //    anon txns are rarely in the receiver's mempool when they arrive together
+        if (i == 0
+            || tx.IsCoinStake()
+            || tx.nVersion == ANON_TXN_VERSION)
+        {
+            prefilledIndexes.vIndexes.push_back(i);
+            vPrefilledTxn.push_back(tx);
+            continue;
+        };
+
+        vShortTxIds.push_back(GetShortID(tx.GetHash()));
+    };
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIdKeys() const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << header << nonce;
+    uint256 hashKey = ss.GetHash();
+    nShortIdK0 = hashKey.Get64(0);
+    nShortIdK1 = hashKey.Get64(1);
+    fShortIdKeys = true;
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    if (!fShortIdKeys)
+        FillShortIdKeys();
+    return SipHashUint256(nShortIdK0, nShortIdK1, txhash) & 0xffffffffffffULL;
+}
+
+
+ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull()
+        || (cmpctblock.vShortTxIds.empty() && cmpctblock.vPrefilledTxn.empty()))
+        return READ_STATUS_INVALID;
+
+    // -- smallest possible txn is well over 60 bytes
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 60)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    vtxAvailable.clear();
+    vtxAvailable.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+    nPrefilled = nMempool = 0;
+
+    const std::vector<uint16_t>& vIndexes = cmpctblock.prefilledIndexes.vIndexes;
+    for (size_t i = 0; i < vIndexes.size(); ++i)
+    {
+        if (vIndexes[i] >= vtxAvailable.size()
+            || cmpctblock.vPrefilledTxn[i].IsNull())
+            return READ_STATUS_INVALID;
+        vtxAvailable[vIndexes[i]] = cmpctblock.vPrefilledTxn[i];
+        vHave[vIndexes[i]] = true;
+        nPrefilled++;
+    };
+
+    // -- slots not prefilled are filled by short id, in order
+    std::map<uint64_t, uint16_t> mapShortIds;
+    uint16_t nIndex = 0;
+    for (size_t i = 0; i < cmpctblock.vShortTxIds.size(); ++i)
+    {
+        while (nIndex < vHave.size() && vHave[nIndex])
+            nIndex++;
+        if (nIndex >= vHave.size())
+            return READ_STATUS_INVALID;
+        if (!mapShortIds.insert(std::make_pair(cmpctblock.vShortTxIds[i], nIndex)).second)
+            return READ_STATUS_FAILED; // duplicate short id, the full block is needed
+        nIndex++;
+    };
+
+    std::vector<bool> vCollided(vtxAvailable.size(), false);
+    {
+        LOCK(pool.cs);
+        for (CTxMemPool::txMap::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            std::map<uint64_t, uint16_t>::const_iterator si = mapShortIds.find(cmpctblock.GetShortID(mi->first));
+            if (si == mapShortIds.end())
+                continue;
+
+            if (vCollided[si->second])
+                continue;
+
+            if (vHave[si->second])
+            {
+                // -- two mempool txns share a short id, leave the slot for getblocktxn
+                vHave[si->second] = false;
+                vtxAvailable[si->second].SetNull();
+                vCollided[si->second] = true;
+                nMempool--;
+                continue;
+            };
+
+            vtxAvailable[si->second] = mi->second;
+            vHave[si->second] = true;
+            nMempool++;
+        };
+    }
+
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(size_t nIndex) const
+{
+    return nIndex < vHave.size() && vHave[nIndex];
+}
+
+void CPartialBlock::GetMissing(std::vector<uint16_t>& vMissing) const
+{
+    vMissing.clear();
+    for (size_t i = 0; i < vHave.size(); ++i)
+        if (!vHave[i])
+            vMissing.push_back(i);
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const
+{
+    block.SetNull();
+    *(CBlockHeader*)&block = header;
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.resize(vtxAvailable.size());
+
+    size_t nMissing = 0;
+    for (size_t i = 0; i < vtxAvailable.size(); ++i)
+    {
+        if (vHave[i])
+        {
+            block.vtx[i] = vtxAvailable[i];
+            continue;
+        };
+
+        if (nMissing >= vtxMissing.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vtxMissing[nMissing++];
+    };
+
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // -- a mismatch is most likely a short id collision, not the sender's fault
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    return READ_STATUS_OK;
+}
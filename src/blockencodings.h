@@ -0,0 +1,193 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef TPAY_BLOCKENCODINGS_H
+#define TPAY_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <ios>
+
+class CTxMemPool;
+
+/** Compact block relay, after BIP152.
+ *
+ *  A block is announced as its header, the block signature, the prefilled
+ *  coinbase, coinstake and anon txns and 6 byte short ids for the rest. The
+ *  receiver rebuilds the block from its mempool and fetches what it is missing
+ *  with getblocktxn/blocktxn.
+ */
+
+/** Protocol version of the sendcmpct message */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Only serve getblocktxn for blocks this close to the tip, else send the full block */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Partially received compact blocks held at once */
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+/** Seconds to wait for a blocktxn before the full block is requested instead */
+static const int64_t PARTIAL_BLOCK_TIMEOUT = 30;
+/** Peers asked to push compact blocks without an inv round trip */
+static const int MAX_CMPCT_ANNOUNCE_PEERS = 3;
+
+/** Differentially encoded list of indexes, as in getblocktxn and the prefilled txns */
+class CTxIndexes
+{
+public:
+    std::vector<uint16_t> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        uint64_t nCount = vIndexes.size();
+        READWRITE(VARINT(nCount));
+        if (fRead)
+        {
+            if (nCount > MAX_BLOCK_SIZE / 60)
+                throw std::ios_base::failure("CTxIndexes: too many indexes");
+            const_cast<CTxIndexes*>(this)->vIndexes.resize(nCount);
+        };
+
+        uint64_t nOffset = 0;
+        for (uint64_t i = 0; i < nCount; ++i)
+        {
+            uint64_t nDiff = fRead ? 0 : vIndexes[i] - (i > 0 ? vIndexes[i-1] + 1 : 0);
+            READWRITE(VARINT(nDiff));
+            if (fRead)
+            {
+                nOffset += nDiff;
+                if (nOffset > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("CTxIndexes: index overflowed 16 bits");
+                const_cast<CTxIndexes*>(this)->vIndexes[i] = nOffset++;
+            };
+        };
+    )
+};
+
+/** getblocktxn: the transactions of a block missing from the receiver's mempool */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    CTxIndexes indexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(indexes);
+    )
+};
+
+/** blocktxn: reply to getblocktxn, txns in the requested order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/** cmpctblock message */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortIdK0, nShortIdK1;
+    mutable bool fShortIdKeys;
+
+    void FillShortIdKeys() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+    uint64_t nonce;
+    std::vector<uint64_t> vShortTxIds;
+    CTxIndexes prefilledIndexes;
+    std::vector<CTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs()
+    {
+        nonce = 0;
+        fShortIdKeys = false;
+    }
+
+    /** Prefills the coinbase, coinstake and anon txns */
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const
+    {
+        return vShortTxIds.size() + vPrefilledTxn.size();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nonce);
+
+        uint64_t nShortIds = vShortTxIds.size();
+        READWRITE(VARINT(nShortIds));
+        if (fRead)
+        {
+            if (nShortIds > MAX_BLOCK_SIZE / 60)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs: too many short ids");
+            const_cast<CBlockHeaderAndShortTxIDs*>(this)->vShortTxIds.resize(nShortIds);
+            const_cast<CBlockHeaderAndShortTxIDs*>(this)->fShortIdKeys = false;
+        };
+
+        // -- short ids are 6 bytes on the wire
+        for (uint64_t i = 0; i < nShortIds; ++i)
+        {
+            uint32_t nLow = vShortTxIds[i] & 0xffffffff;
+            uint16_t nHigh = (vShortTxIds[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (fRead)
+                const_cast<CBlockHeaderAndShortTxIDs*>(this)->vShortTxIds[i] = ((uint64_t)nHigh << 32) | nLow;
+        };
+
+        READWRITE(prefilledIndexes);
+        READWRITE(vPrefilledTxn);
+        if (fRead && prefilledIndexes.vIndexes.size() != vPrefilledTxn.size())
+            throw std::ios_base::failure("CBlockHeaderAndShortTxIDs: prefilled index count mismatch");
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // peer misbehaved
+    READ_STATUS_FAILED,  // short id collision or similar, request the full block
+};
+
+/** A compact block being filled from the mempool and blocktxn */
+class CPartialBlock
+{
+private:
+    std::vector<CTransaction> vtxAvailable;
+    std::vector<bool> vHave;
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    unsigned int nPrefilled, nMempool;
+
+    CPartialBlock()
+    {
+        nPrefilled = nMempool = 0;
+    }
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+    bool IsTxAvailable(size_t nIndex) const;
+    void GetMissing(std::vector<uint16_t>& vMissing) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+};
+
+#endif // TPAY_BLOCKENCODINGS_H
@@ -5,9 +5,12 @@
 #include "bloom.h"
 
 #include "main.h"
+#include "hash.h"
 #include "script.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <limits>
 #include <math.h>
 #include <stdlib.h>
 
@@ -214,3 +217,96 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    double logFPRate = log(nFPRate);
+    // The ideal number of hash functions is log(fp rate) / log(0.5), kept within 1 - MAX_HASH_FUNCS
+    nHashFuncs = max(1, min((int)(logFPRate / log(0.5) + 0.5), (int)MAX_HASH_FUNCS));
+
+    // Between 2 and 3 generations of nElements / 2 entries are held
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+
+    // fp rate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs, solved for nFilterBits
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFPRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) * 2);
+    reset();
+}
+
+void CRollingBloomFilter::Insert(uint64_t nHash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        if (++nGeneration == 4)
+            nGeneration = 1;
+
+        // -- clear the slots of the generation number being reused
+        uint64_t nMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        for (size_t p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nMask1) | (p2 ^ nMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        };
+    };
+    nEntriesThisGeneration++;
+
+    uint32_t h1 = (uint32_t)nHash;
+    uint32_t h2 = (uint32_t)(nHash >> 32);
+    for (unsigned int i = 0; i < nHashFuncs; ++i, h1 += h2)
+    {
+        int bit = h1 & 63;
+        uint32_t pos = (uint32_t)(((uint64_t)h1 * data.size()) >> 32);
+        data[pos & ~1] = (data[pos & ~1] & ~((uint64_t)1 << bit)) | ((uint64_t)(nGeneration & 1) << bit);
+        data[pos | 1] = (data[pos | 1] & ~((uint64_t)1 << bit)) | ((uint64_t)(nGeneration >> 1) << bit);
+    };
+}
+
+bool CRollingBloomFilter::Contains(uint64_t nHash) const
+{
+    uint32_t h1 = (uint32_t)nHash;
+    uint32_t h2 = (uint32_t)(nHash >> 32);
+    for (unsigned int i = 0; i < nHashFuncs; ++i, h1 += h2)
+    {
+        int bit = h1 & 63;
+        uint32_t pos = (uint32_t)(((uint64_t)h1 * data.size()) >> 32);
+        // -- slot is empty if both bits are 0
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    };
+    return true;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    Insert(CSipHasher(k0, k1).Write(vKey.empty() ? NULL : &vKey[0], vKey.size()).Finalize());
+}
+
+void CRollingBloomFilter::insert(const uint256& hash, uint32_t nExtra)
+{
+    Insert(SipHashUint256Extra(k0, k1, hash, nExtra));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return Contains(CSipHasher(k0, k1).Write(vKey.empty() ? NULL : &vKey[0], vKey.size()).Finalize());
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash, uint32_t nExtra) const
+{
+    return Contains(SipHashUint256Extra(k0, k1, hash, nExtra));
+}
+
+void CRollingBloomFilter::reset()
+{
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
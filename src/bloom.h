@@ -99,4 +99,48 @@ public:
     void UpdateEmptyFull();
 };
 
+
+/**
+ * RollingBloomFilter keeps track of the most recently inserted items, it
+ * replaces an mruset where only membership is needed.
+ *
+ * Construct it with the number of items to keep track of and a false positive
+ * rate. contains(item) always returns true if item was one of the last nElements
+ * inserted, items inserted before that are forgotten a generation at a time
+ * (somewhere between nElements and 1.5 * nElements ago). Memory use is fixed at
+ * construction and nothing is allocated on insert.
+ *
+ * Each slot of the filter holds a 2 bit generation number (1-3, 0 is empty),
+ * bit i of a slot is in data[pos + i] so one uint64_t pair holds 64 slots.
+ * Starting a new generation clears the slots of the oldest.
+ *
+ * Keys are hashed once with SipHash under a random key, the nHashFuncs slot
+ * positions are derived from that by double hashing.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash, uint32_t nExtra = 0);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash, uint32_t nExtra = 0) const;
+
+    void reset();
+
+    size_t GetMemoryUsage() const { return data.size() * sizeof(uint64_t); };
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    unsigned int nHashFuncs;
+    uint64_t k0, k1;
+    std::vector<uint64_t> data;
+
+    void Insert(uint64_t nHash);
+    bool Contains(uint64_t nHash) const;
+};
+
 #endif /* BITCOIN_BLOOM_H */
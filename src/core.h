@@ -77,6 +77,52 @@ public:
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
 
+/** A key image held inline, for use as a map key where an ec_point would
+ * cost a heap allocation per entry.
+ */
+class CKeyImage
+{
+public:
+    uint8_t data[EC_COMPRESSED_SIZE];
+
+    CKeyImage() { SetNull(); }
+    explicit CKeyImage(const ec_point& vchImage) { Set(vchImage); }
+
+    IMPLEMENT_SERIALIZE( READWRITE(FLATDATA(data)); )
+
+    void SetNull() { memset(data, 0, sizeof(data)); }
+
+    void Set(const ec_point& vchImage)
+    {
+        if (vchImage.size() != EC_COMPRESSED_SIZE)
+        {
+            SetNull();
+            return;
+        };
+        memcpy(data, &vchImage[0], EC_COMPRESSED_SIZE);
+    }
+
+    ec_point Get() const
+    {
+        return ec_point(data, data + EC_COMPRESSED_SIZE);
+    }
+
+    friend bool operator<(const CKeyImage& a, const CKeyImage& b)
+    {
+        return memcmp(a.data, b.data, EC_COMPRESSED_SIZE) < 0;
+    }
+
+    friend bool operator==(const CKeyImage& a, const CKeyImage& b)
+    {
+        return memcmp(a.data, b.data, EC_COMPRESSED_SIZE) == 0;
+    }
+
+    friend bool operator!=(const CKeyImage& a, const CKeyImage& b)
+    {
+        return !(a == b);
+    }
+};
+
 
 
 /** An input of a transaction.  It contains the location of the previous
@@ -168,6 +214,12 @@ public:
         kiOut[32] = prevout.n & 0xFF;
     };
 
+    void ExtractKeyImage(CKeyImage& kiOut) const
+    {
+        memcpy(&kiOut.data[0], prevout.hash.begin(), 32);
+        kiOut.data[32] = prevout.n & 0xFF;
+    };
+
     int ExtractRingSize() const
     {
         return (prevout.n >> 16) & 0xFFFF;
@@ -0,0 +1,74 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef TPAY_HASHMAP_H
+#define TPAY_HASHMAP_H
+
+#include "allocators.h"
+#include "core.h"
+#include "hash.h"
+#include "uint256.h"
+
+#include <functional>
+#include <limits>
+
+#ifndef Q_MOC_RUN
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#endif
+
+/** Hash functor for the node's hash tables.
+ *
+ * Keys seen on the network (txids, block hashes, outpoints, key images and key ids)
+ * are chosen by remote peers, so buckets are selected with SipHash keyed by a
+ * secret drawn per hasher instance; a peer can't grind keys into one bucket.
+ */
+class CSaltedHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CSaltedHasher()
+    {
+        k0 = GetRand(std::numeric_limits<uint64_t>::max());
+        k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    }
+
+    size_t operator()(const uint256& hash) const
+    {
+        return SipHashUint256(k0, k1, hash);
+    }
+
+    size_t operator()(const uint160& hash) const
+    {
+        return CSipHasher(k0, k1).Write(hash.begin(), 20).Finalize();
+    }
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+
+    size_t operator()(const CKeyImage& ki) const
+    {
+        return CSipHasher(k0, k1).Write(ki.data, sizeof(ki.data)).Finalize();
+    }
+};
+
+/** Unordered map keyed with CSaltedHasher, entries are drawn from node_pool_allocator.
+ *  References to elements stay valid across rehashing, as with std::map.
+ */
+template<typename K, typename V>
+using salted_hash_map = boost::unordered_map<K, V, CSaltedHasher, std::equal_to<K>,
+    node_pool_allocator<std::pair<const K, V> > >;
+
+template<typename K, typename V>
+using salted_hash_multimap = boost::unordered_multimap<K, V, CSaltedHasher, std::equal_to<K>,
+    node_pool_allocator<std::pair<const K, V> > >;
+
+template<typename K>
+using salted_hash_set = boost::unordered_set<K, CSaltedHasher, std::equal_to<K>,
+    node_pool_allocator<K> >;
+
+#endif // TPAY_HASHMAP_H
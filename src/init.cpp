@@ -15,6 +15,7 @@
 #include "smessage.h"
 #include "ringsig.h"
 #include "miner.h"
+#include "anonymize.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -99,6 +100,10 @@ bool Finalise()
     
     StopNode();
     
+    // -- only once loaded, else a partial pool would replace mempool.dat
+    if (fMempoolLoaded && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+    
     if (pwalletMain)
     {
         {
@@ -254,6 +259,8 @@ std::string HelpMessage()
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n";
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 37347 or testnet: 37111)") + "\n";
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
+    strUsage += "  -useepoll              " + _("Use epoll instead of select for socket events, Linux only (default: 1)") + "\n";
+    strUsage += "  -msghandlerthreads=<n> " + _("Number of threads processing peer messages, up to 16 (default: 4, or fewer on small machines)") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
@@ -264,6 +271,7 @@ std::string HelpMessage()
     strUsage += "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n";
     strUsage += "  -dnsseed               " + _("Find peers using DNS lookup (default: 1)") + "\n";
     strUsage += "  -onionseed             " + _("Find peers using .onion seeds (default: 1 unless -connect)") + "\n";
+    strUsage += "  -parallelconnect=<n>   " + strprintf(_("Make up to <n> outbound connection attempts at once, up to %d (default: %d)"), MAX_PARALLEL_CONNECTS, DEFAULT_PARALLEL_CONNECTS) + "\n";
     strUsage += "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n";
     strUsage += "  -minstakeinterval=<n>  " + _("Minimum time in seconds between successful stakes (default: 30)") + "\n";
     strUsage += "  -minersleep=<n>        " + _("Milliseconds between stake attempts. Lowering this param will not result in more stakes. (default: 500)") + "\n";
@@ -273,6 +281,8 @@ std::string HelpMessage()
     strUsage += "  -softbantime=<n>       " + _("Number of seconds to keep soft banned peers from reconnecting (default: 3600)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + _("Tries to keep outbound traffic under the given target, in MiB per 24h, historical blocks are served until all but a fifth is used. 0 = no limit (default: 0)") + "\n";
+    strUsage += "  -maxpeeruploadrate=<n> " + _("Limit historical blocks served to each peer to <n> KiB per second, 0 = no limit (default: 0)") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -327,6 +337,8 @@ std::string HelpMessage()
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocksmib=<n> " + strprintf(_("Keep at most <n> MiB of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";    
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000?.dat files on startup") + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
+    strUsage += "  -txprevalidatethreads=<n> " + strprintf(_("Verify received transactions on <n> threads outside the main lock, 0 to disable (default: number of cores, up to %d)"), MAX_TX_PREVALIDATE_THREADS) + "\n";
 
     strUsage += "\n" + _("Thin options:") + "\n";
     strUsage += "  -thinmode              " + _("Operate in less secure, less resource hungry 'thin' mode") + "\n";
@@ -335,6 +347,9 @@ std::string HelpMessage()
 
     strUsage += "  -nothinssupport        " + _("Disable supporting thin nodes. (default: 0)") + "\n";
     strUsage += "  -nothinstealth         " + _("Disable forwarding, or requesting all stealth txns. (default: 0)") + "\n";
+    strUsage += "  -nocompactblocks       " + _("Disable compact block relay. (default: 0)") + "\n";
+    strUsage += "  -notxreconciliation    " + _("Announce every transaction to every peer, without set reconciliation. (default: 0)") + "\n";
+    strUsage += "  -nocompression         " + _("Don't compress or accept compressed block and header messages. (default: 0)") + "\n";
     strUsage += "  -maxthinpeers=<n>      " + _("Don't connect to more than <n> thin peers (default: 8)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
@@ -352,6 +367,8 @@ std::string HelpMessage()
     strUsage += "  -nosmsg                                  " + _("Disable secure messaging.") + "\n";
     strUsage += "  -debugsmsg                               " + _("Log extra debug messages.") + "\n";
     strUsage += "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
+    strUsage += "  -smsgpowthreads=<n>                      " + _("Threads for the proof of work of sent messages (default: number of cores)") + "\n";
+    strUsage += "  -smsgdbcache=<n>                         " + _("Size of the secure message database cache in megabytes (default: 8)") + "\n";
     
     return strUsage;
 }
@@ -610,6 +627,13 @@ bool AppInit2(boost::thread_group& threadGroup)
         Step 4.5: adjust parameters for nNodeMode
     ********************************************************* */
 
+    // -- thin nodes keep compression, they receive headers and mblkt
+    if (GetBoolArg("-nocompression"))
+    {
+        LogPrintf("Message compression disabled.\n");
+        nLocalServices &= ~(NODE_COMPRESS);
+    };
+
     switch (nNodeMode)
     {
         case NT_FULL:
@@ -624,6 +648,18 @@ bool AppInit2(boost::thread_group& threadGroup)
                 LogPrintf("Thin stealth support disabled.\n");
                 nLocalServices &= ~(THIN_STEALTH);
             };
+
+            if (GetBoolArg("-nocompactblocks"))
+            {
+                LogPrintf("Compact block relay disabled.\n");
+                nLocalServices &= ~(NODE_COMPACT);
+            };
+
+            if (GetBoolArg("-notxreconciliation"))
+            {
+                LogPrintf("Transaction reconciliation disabled.\n");
+                nLocalServices &= ~(NODE_TXRECON);
+            };
             break;
         case NT_THIN:
             SetBoolArg("-staking", false);
@@ -633,6 +669,8 @@ bool AppInit2(boost::thread_group& threadGroup)
             nLocalServices &= ~(THIN_SUPPORT);
             nLocalServices &= ~(THIN_STAKE);
             nLocalServices &= ~(THIN_STEALTH);
+            nLocalServices &= ~(NODE_COMPACT);
+            nLocalServices &= ~(NODE_TXRECON);
 
             nLocalRequirements |= (THIN_SUPPORT);
 
@@ -714,6 +752,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     nMaxThinPeers = GetArg("-maxthinpeers", 8);
 
     nBloomFilterElements = GetArg("-bloomfilterelements", 1536);
+
+    CNode::SetMaxOutboundTarget(std::max((int64_t)0, GetArg("-maxuploadtarget", 0)) * 1024 * 1024);
+    nMaxPeerUploadRate = std::max((int64_t)0, GetArg("-maxpeeruploadrate", 0)) * 1024;
     
     // Tor implementation
     
@@ -766,6 +807,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         return InitError(_("Failed to listen on any port."));
     
     if (!(mapArgs.count("-tor") && mapArgs["-tor"] != "0")) {
+        PrepareTorDataDir();
         if (!NewThread(&StartTor, NULL))
             return InitError(_("Error: could not start tor node"));
     }
@@ -782,7 +824,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     } else 
     {
         string automatic_onion;
-        filesystem::path hostname_path = GetDataDir() / "tor" / "onion" / "hostname";
+        filesystem::path hostname_path = filesystem::path(anonymize_service_directory()) / "hostname";
 
         int attempts = 0;
         while (1) {
@@ -798,6 +840,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         ifstream file(hostname_path.string().c_str());
         file >> automatic_onion;
         AddLocal(CService(automatic_onion, GetListenPort(), fNameLookup), LOCAL_MANUAL);
+        MarkTorStartup(TOR_HOSTNAME);
     }
 
     if (mapArgs.count("-reservebalance")) // ppcoin: reserve balance amount
@@ -1019,6 +1062,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         return false;
 
     RandAddSeedPerfmon();
+    // addrman draws connection candidates from insecure_rand, don't start every node from the same state
+    seed_insecure_rand();
 
     //// debug print
     LogPrintf("mapBlockIndex.size() = %u\n",            mapBlockIndex.size());
@@ -1028,6 +1073,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapWallet.size() = %u\n",                pwalletMain->mapWallet.size());
     LogPrintf("mapAddressBook.size() = %u\n",           pwalletMain->mapAddressBook.size());
 
+    if (nNodeMode == NT_FULL)
+        StartTxPreValidation(threadGroup);
+
     StartNode(threadGroup);
     
     if (fServer)
@@ -1036,7 +1084,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     // ********************************************************* Step 12: finished
     
     // Add wallet transactions that aren't already in a block to mapTransactions
-    pwalletMain->ReacceptWalletTransactions();
+    if (nNodeMode == NT_FULL && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+    {
+        // -- reload mempool.dat first, wallet txns are re-accepted after in the same thread
+        threadGroup.create_thread(boost::bind(&ThreadLoadMempool, pwalletMain));
+    } else
+    {
+        pwalletMain->ReacceptWalletTransactions();
+    };
     
     // Run a thread to flush wallet periodically
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)(const std::string&), const std::string&>, "wflush", &ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
@@ -16,6 +16,8 @@
 #include "ui_interface.h"
 #include "kernel.h"
 #include "smessage.h"
+#include "blockencodings.h"
+#include "blockdownload.h"
 #include "walletdb.h"
 
 
@@ -60,6 +62,7 @@ CBlockThinIndex* pindexBestHeader;
 
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
+std::atomic<bool> fMempoolLoaded(false); // set by the loader thread, read by savemempool and shutdown
 bool fAddressIndex = true;
 bool fTimestampIndex = true;
 bool fSpentIndex = true;
@@ -72,13 +75,13 @@ std::map<int64_t, CAnonOutputCount> mapAnonOutputStats; // display only, not 100
 
 std::multimap<uint256, CBlockThin*> mapOrphanBlockThinsByPrev;
 
-map<uint256, COrphanBlock*> mapOrphanBlocks;
-multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
+salted_hash_map<uint256, COrphanBlock*> mapOrphanBlocks;
+salted_hash_multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 size_t nOrphanBlocksSize = 0;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+salted_hash_map<uint256, CTransaction> mapOrphanTransactions;
+salted_hash_map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
 
 
@@ -513,12 +516,13 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     unsigned int nEvicted = 0;
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        // Evict a random orphan, bucket placement is salted so the first
+        // entry from a random non-empty bucket is as good as any:
+        size_t nBuckets = mapOrphanTransactions.bucket_count();
+        size_t nBucket = GetRand(nBuckets);
+        while (mapOrphanTransactions.bucket_size(nBucket) == 0)
+            nBucket = (nBucket + 1) % nBuckets;
+        EraseOrphanTx(mapOrphanTransactions.begin(nBucket)->first);
         ++nEvicted;
     }
     return nEvicted;
@@ -923,22 +927,26 @@ int64_t CTransaction::GetMinFee(unsigned int nBlockSize, enum GetMinFee_mode mod
     return nMinFee;
 }
 
-bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB &txdb, bool *pfMissingInputs)
+bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB &txdb, bool *pfMissingInputs, bool fPreValidated)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
-    if (!tx.CheckTransaction())
-        return error("AcceptToMemoryPool() : CheckTransaction failed");
+    // -- fPreValidated: PreValidateTransaction() passed, the context free checks needn't run again
+    if (!fPreValidated)
+    {
+        if (!tx.CheckTransaction())
+            return error("AcceptToMemoryPool() : CheckTransaction failed");
 
-    // Coinbase is only valid in a block, not as a loose transaction
-    if (tx.IsCoinBase())
-        return tx.DoS(100, error("AcceptToMemoryPool() : coinbase as individual tx"));
+        // Coinbase is only valid in a block, not as a loose transaction
+        if (tx.IsCoinBase())
+            return tx.DoS(100, error("AcceptToMemoryPool() : coinbase as individual tx"));
 
-    // ppcoin: coinstake is also only valid in a block, not as a loose transaction
-    if (tx.IsCoinStake())
-        return tx.DoS(100, error("AcceptToMemoryPool() : coinstake as individual tx"));
+        // ppcoin: coinstake is also only valid in a block, not as a loose transaction
+        if (tx.IsCoinStake())
+            return tx.DoS(100, error("AcceptToMemoryPool() : coinstake as individual tx"));
+    };
 
     // Rather not work on nonstandard transactions (unless -testnet)
     //if (!fTestNet && !tx.IsStandard())
@@ -1077,6 +1085,244 @@ bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB &txdb, bool *p
     return true;
 }
 
+static bool VerifyAnonInputSig(const CTxIn &txin, int nRingSize, std::vector<uint8_t> &vchImage, uint256 &preimage, bool fAB);
+
+bool PreValidateTransaction(CTransaction &tx)
+{
+    // - everything here is independent of cs_main and the pool lock, AcceptToMemoryPool
+    //   repeats the stateful checks and finds the signatures in the caches
+
+    // -- may have been accepted from another peer while queued
+    if (mempool.exists(tx.GetHash()))
+    {
+        LogPrint("mempool", "PreValidateTransaction() : %s already in mempool\n", tx.GetHash().ToString());
+        return false;
+    };
+
+    if (!tx.CheckTransaction())
+        return error("PreValidateTransaction() : CheckTransaction failed");
+
+    if (tx.IsCoinBase())
+        return tx.DoS(100, error("PreValidateTransaction() : coinbase as individual tx"));
+
+    if (tx.IsCoinStake())
+        return tx.DoS(100, error("PreValidateTransaction() : coinstake as individual tx"));
+
+    if (!tx.IsStandard())
+        return error("PreValidateTransaction() : nonstandard transaction type");
+
+    uint256 preimage;
+    bool fHavePreImage = false;
+    if (tx.nVersion == ANON_TXN_VERSION && pwalletMain)
+        fHavePreImage = pwalletMain->GetTxnPreImage(tx, preimage) == 0;
+
+    CTxDB txdb("r");
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const CTxIn &txin = tx.vin[i];
+
+        if (tx.nVersion == ANON_TXN_VERSION
+            && txin.IsAnonInput())
+        {
+            // -- ring members are read from the txdb later, the signature covers only the scriptSig
+            if (!fHavePreImage)
+                continue;
+
+            const CScript &s = txin.scriptSig;
+            int nRingSize = txin.ExtractRingSize();
+            if (nRingSize < 1
+                || nRingSize > (int)std::max(MAX_RING_SIZE, MAX_RING_SIZE_OLD))
+                continue;
+
+            bool fAB = nRingSize > 1 && s.size() == 2 + EC_SECRET_SIZE + (EC_SECRET_SIZE + EC_COMPRESSED_SIZE) * nRingSize;
+            if (!fAB && s.size() < 2 + (EC_COMPRESSED_SIZE + EC_SECRET_SIZE + EC_SECRET_SIZE) * nRingSize)
+                continue;
+
+            std::vector<uint8_t> vchImage;
+            txin.ExtractKeyImage(vchImage);
+            if (!VerifyAnonInputSig(txin, nRingSize, vchImage, preimage, fAB))
+                return tx.DoS(100, error("PreValidateTransaction() : %s input %u ring signature failed", tx.GetHash().ToString(), i));
+            continue;
+        };
+
+        // -- speculative, inputs not found now are left to ConnectInputs
+        CTransaction txPrev;
+        if (!mempool.lookup(txin.prevout.hash, txPrev))
+        {
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(txin.prevout.hash, txindex)
+                || !txPrev.ReadFromDisk(txindex.pos))
+                continue;
+        };
+
+        if (txin.prevout.n >= txPrev.vout.size())
+            continue;
+
+        if (!VerifySignature(txPrev, tx, i, MANDATORY_SCRIPT_VERIFY_FLAGS, 0))
+            return tx.DoS(100, error("PreValidateTransaction() : %s VerifySignature failed", tx.GetHash().ToString()));
+    };
+
+    return true;
+}
+
+static void ProcessTransaction(CTransaction &tx, CTxDB &txdb, bool fPreValidated)
+{
+    AssertLockHeld(cs_main);
+
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+
+    uint256 txHash = tx.GetHash();
+    bool fMissingInputs = false;
+
+    if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs, fPreValidated))
+    {
+        SyncWithWallets(tx, NULL, true);
+        RelayTransaction(tx, txHash);
+        vWorkQueue.push_back(txHash);
+        vEraseQueue.push_back(txHash);
+
+        // Recursively process any orphan transactions that depended on this one
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            salted_hash_map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanTxHash = *mi;
+                CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
+                bool fMissingInputs2 = false;
+
+                if (AcceptToMemoryPool(mempool, orphanTx, txdb, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
+                    SyncWithWallets(tx, NULL, true);
+                    RelayTransaction(orphanTx, orphanTxHash);
+                    vWorkQueue.push_back(orphanTxHash);
+                    vEraseQueue.push_back(orphanTxHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    // invalid or too-little-fee orphan
+                    vEraseQueue.push_back(orphanTxHash);
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
+                }
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx);
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Transaction pre-validation
+//
+
+// -- txns received from peers wait here for a worker, setTxPreValidate holds
+//    the hashes queued or in flight so they aren't requested again meanwhile
+static boost::mutex cs_txPreValidate;
+static boost::condition_variable condTxPreValidate;
+static std::deque<std::pair<CNode*, CTransaction> > queueTxPreValidate;
+static std::set<uint256> setTxPreValidate;
+static int nTxPreValidateThreads = 0;
+
+static void ThreadTxPreValidate()
+{
+    for (;;)
+    {
+        std::pair<CNode*, CTransaction> item;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_txPreValidate);
+            while (queueTxPreValidate.empty())
+                condTxPreValidate.wait(lock);
+            item = queueTxPreValidate.front();
+            queueTxPreValidate.pop_front();
+        }
+
+        CNode *pfrom = item.first;
+        CTransaction &tx = item.second;
+        uint256 hash = tx.GetHash();
+
+        bool fValid = PreValidateTransaction(tx);
+        {
+            LOCK(cs_main);
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, hash));
+            if (fValid)
+            {
+                CTxDB txdb("r");
+                ProcessTransaction(tx, txdb, true);
+            };
+
+            if (tx.nDoS)
+                pfrom->Misbehaving(tx.nDoS);
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs_txPreValidate);
+            setTxPreValidate.erase(hash);
+        }
+        {
+            LOCK(cs_vNodes);
+            pfrom->Release();
+        }
+    };
+}
+
+void StartTxPreValidation(boost::thread_group& threadGroup)
+{
+    int nDefault = std::min((int)boost::thread::hardware_concurrency(), MAX_TX_PREVALIDATE_THREADS);
+    nTxPreValidateThreads = std::max(0, (int)GetArg("-txprevalidatethreads", nDefault));
+    if (nTxPreValidateThreads > MAX_TX_PREVALIDATE_THREADS)
+        nTxPreValidateThreads = MAX_TX_PREVALIDATE_THREADS;
+
+    LogPrintf("Using %d threads for transaction pre-validation\n", nTxPreValidateThreads);
+
+    for (int i = 0; i < nTxPreValidateThreads; ++i)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "txval", &ThreadTxPreValidate));
+}
+
+static bool QueueTxPreValidate(CNode *pfrom, const CTransaction &tx, const uint256 &hash)
+{
+    // - returns false when the caller must process tx inline
+    if (nTxPreValidateThreads < 1)
+        return false;
+
+    {
+        LOCK(cs_vNodes); // nRefCount, messages are handled on several threads
+        boost::unique_lock<boost::mutex> lock(cs_txPreValidate);
+        if (setTxPreValidate.count(hash))
+            return true;
+        if (queueTxPreValidate.size() >= MAX_TX_PREVALIDATE_QUEUE)
+            return false;
+        setTxPreValidate.insert(hash);
+        queueTxPreValidate.push_back(std::make_pair(pfrom->AddRef(), tx));
+    }
+    condTxPreValidate.notify_one();
+    return true;
+}
+
+static bool IsTxPreValidating(const uint256 &hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs_txPreValidate);
+    return setTxPreValidate.count(hash) > 0;
+}
+
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes)
 {
     if (!fTimestampIndex)
@@ -1132,6 +1378,9 @@ bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb)
                     ::AcceptToMemoryPool(mempool, tx, txdb);
             };
         };
+        // -- may already have been restored from mempool.dat
+        if (mempool.exists(GetHash()))
+            return false;
         return ::AcceptToMemoryPool(mempool, *this, txdb);
     }
     return false;
@@ -1852,13 +2101,13 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 
 uint256 static GetOrphanRoot(const uint256& hash)
 {
-    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
+    salted_hash_map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
     if (it == mapOrphanBlocks.end())
         return hash;
 
     // Work back to the first block in the orphan chain
     do {
-        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
+        salted_hash_map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
         if (it2 == mapOrphanBlocks.end())
             return it->first;
         it = it2;
@@ -1922,12 +2171,12 @@ void static PruneOrphanBlocks()
     {
         // Pick a random orphan block.
         int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
-        std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
+        salted_hash_multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
         while (pos--) it++;
 
         // As long as this block has other orphans depending on it, move to one of those successors.
         do {
-            std::multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
+            salted_hash_multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
             if (it2 == mapOrphanBlocksByPrev.end())
                 break;
             it = it2;
@@ -1960,34 +2209,22 @@ const CBlockThinIndex* GetLastBlockThinIndex(const CBlockThinIndex* pindex, bool
     return pindex;
 }
 
-unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+// Target for the block after nHeightLast from the last two blocks of its kind
+static unsigned int GetNextTarget(const CBigNum& bnTargetLimit, int nHeightLast, unsigned int nBitsPrev, int64_t nTimePrev, int64_t nTimePrevPrev)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
-
-
-    if (pindexLast == NULL)
-        return bnTargetLimit.GetCompact(); // genesis block
-
-    const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
-    if (pindexPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // first block
-    const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
-    if (pindexPrevPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // second block
-
-    int64_t nTargetSpacing = GetTargetSpacing(pindexLast->nHeight);
-    int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
+    int64_t nTargetSpacing = GetTargetSpacing(nHeightLast);
+    int64_t nActualSpacing = nTimePrev - nTimePrevPrev;
     if (nActualSpacing < 0)
         nActualSpacing = nTargetSpacing;
 
-    if (Params().IsProtocolV3(pindexLast->nHeight)) {
+    if (Params().IsProtocolV3(nHeightLast)) {
         if (nActualSpacing > nTargetSpacing * 10)
             nActualSpacing = nTargetSpacing * 10;
     }
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
     CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bnNew.SetCompact(nBitsPrev);
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
     bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
     bnNew /= ((nInterval + 1) * nTargetSpacing);
@@ -1998,6 +2235,24 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
     return bnNew.GetCompact();
 }
 
+unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+{
+    CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
+
+
+    if (pindexLast == NULL)
+        return bnTargetLimit.GetCompact(); // genesis block
+
+    const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
+    if (pindexPrev->pprev == NULL)
+        return bnTargetLimit.GetCompact(); // first block
+    const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
+    if (pindexPrevPrev->pprev == NULL)
+        return bnTargetLimit.GetCompact(); // second block
+
+    return GetNextTarget(bnTargetLimit, pindexLast->nHeight, pindexPrev->nBits, pindexPrev->GetBlockTime(), pindexPrevPrev->GetBlockTime());
+}
+
 unsigned int GetNextTargetRequiredThin(const CBlockThinIndex* pindexLast, bool fProofOfStake)
 {
     CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
@@ -2243,6 +2498,83 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     return true;
 }
 
+// Valid ring signature cache, the ring members are carried in the scriptSig so
+// a signature can be verified before the ring is looked up in the txdb, and a
+// txn pre-validated off cs_main is not verified again when accepted.
+class CRingSigCache
+{
+private:
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_ringsigcache;
+
+public:
+    bool Get(const uint256 &entry)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_ringsigcache);
+        return setValid.count(entry) > 0;
+    }
+
+    void Set(const uint256 &entry)
+    {
+        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+        if (nMaxCacheSize <= 0)
+            return;
+
+        boost::unique_lock<boost::shared_mutex> lock(cs_ringsigcache);
+
+        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        {
+            // -- evict a random entry, as CSignatureCache
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        };
+
+        setValid.insert(entry);
+    }
+};
+
+static CRingSigCache ringSigCache;
+
+static bool VerifyAnonInputSig(const CTxIn &txin, int nRingSize, std::vector<uint8_t> &vchImage, uint256 &preimage, bool fAB)
+{
+    // - preimage commits to the key images and ring members, hashToEC depends on the protocol version
+    const CScript &s = txin.scriptSig;
+    bool fV3 = Params().IsProtocolV3(nBestHeight);
+    uint8_t nFlags = (fAB ? 1 : 0) | (fV3 ? 2 : 0);
+    uint256 entry = Hash(preimage.begin(), preimage.end(), s.begin(), s.end(), &nFlags, &nFlags + 1);
+
+    if (ringSigCache.Get(entry))
+        return true;
+
+    int rv;
+    if (fAB)
+    {
+        ec_point pSigC;
+        pSigC.resize(EC_SECRET_SIZE);
+        memcpy(&pSigC[0], &s[2], EC_SECRET_SIZE);
+        const unsigned char *pSigS    = &s[2 + EC_SECRET_SIZE];
+        const unsigned char *pPubkeys = &s[2 + EC_SECRET_SIZE + EC_SECRET_SIZE * nRingSize];
+        rv = verifyRingSignatureAB(vchImage, preimage, nRingSize, pPubkeys, pSigC, pSigS);
+    } else
+    {
+        const unsigned char *pPubkeys = &s[2];
+        const unsigned char *pSigc    = &s[2 + EC_COMPRESSED_SIZE * nRingSize];
+        const unsigned char *pSigr    = &s[2 + (EC_COMPRESSED_SIZE + EC_SECRET_SIZE) * nRingSize];
+        rv = verifyRingSignature(vchImage, preimage, nRingSize, pPubkeys, pSigc, pSigr);
+    };
+
+    if (rv != 0)
+        return false;
+
+    // -- don't cache across the fork height, the result may not hold on the other side
+    if (fV3 == Params().IsProtocolV3(nBestHeight))
+        ringSigCache.Set(entry);
+
+    return true;
+}
+
 static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSize, std::vector<uint8_t> &vchImage, uint256 &preimage, int64_t &nCoinValue)
 {
     const CScript &s = txin.scriptSig;
@@ -2251,10 +2583,6 @@ static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSiz
     CAnonOutput ao;
     CTxIndex txindex;
 
-    ec_point pSigC;
-    pSigC.resize(EC_SECRET_SIZE);
-    memcpy(&pSigC[0], &s[2], EC_SECRET_SIZE);
-    const unsigned char *pSigS    = &s[2 + EC_SECRET_SIZE];
     const unsigned char *pPubkeys = &s[2 + EC_SECRET_SIZE + EC_SECRET_SIZE * nRingSize];
     for (int ri = 0; ri < nRingSize; ++ri)
     {
@@ -2283,7 +2611,7 @@ static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSiz
         };
     };
 
-    if (verifyRingSignatureAB(vchImage, preimage, nRingSize, pPubkeys, pSigC, pSigS) != 0)
+    if (!VerifyAnonInputSig(txin, nRingSize, vchImage, preimage, true))
     {
         LogPrintf("CheckAnonInputsAB(): Error input %d verifyRingSignatureAB() failed.\n", i);
         return false;
@@ -2382,8 +2710,6 @@ bool CTransaction::CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInval
         CAnonOutput ao;
         CTxIndex txindex;
         const unsigned char* pPubkeys = &s[2];
-        const unsigned char* pSigc    = &s[2 + EC_COMPRESSED_SIZE * nRingSize];
-        const unsigned char* pSigr    = &s[2 + (EC_COMPRESSED_SIZE + EC_SECRET_SIZE) * nRingSize];
         for (int ri = 0; ri < nRingSize; ++ri)
         {
             pkRingCoin = CPubKey(&pPubkeys[ri * EC_COMPRESSED_SIZE], EC_COMPRESSED_SIZE);
@@ -2411,7 +2737,7 @@ bool CTransaction::CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInval
             };
         };
 
-        if (verifyRingSignature(vchImage, preimage, nRingSize, pPubkeys, pSigc, pSigr) != 0)
+        if (!VerifyAnonInputSig(txin, nRingSize, vchImage, preimage, false))
         {
             LogPrintf("CheckAnonInputs(): Error input %d verifyRingSignature() failed.\n", i);
             fInvalid = true; return false;
@@ -3850,10 +4176,33 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        CInv inv(MSG_BLOCK, hash);
+        CSharedMessage msgCmpctBlock; // serialized once for all peers
+        RecordBlockRelayed();
+
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nChainHeight != -1 ? pnode->nChainHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nChainHeight != -1 ? pnode->nChainHeight - 2000 : nBlockEstimate))
+                continue;
+
+            // -- peers that asked for announcements get the compact block without an inv round trip
+            bool fKnown;
+            {
+                LOCK(pnode->cs_inventory);
+                fKnown = pnode->filterInventoryKnown.contains(inv.hash, inv.type);
+            }
+            if (pnode->fPreferCompact && !fKnown)
+            {
+                if (!msgCmpctBlock)
+                    msgCmpctBlock = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*this));
+                pnode->PushMessage(msgCmpctBlock);
+                pnode->AddInventoryKnown(inv);
+                continue;
+            };
+
+            pnode->PushInventory(inv);
+        };
     }
 
     return true;
@@ -3897,6 +4246,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
 {
     AssertLockHeld(cs_main);
 
+    blockDownload.MarkReceived(hash, GetTime());
+
     // Check for duplicate
     //uint256 hash = pblock->GetHash();
     std::string strHash = fDebug ? hash.ToString() : hash.ToString().substr(0,20);
@@ -3947,12 +4298,16 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
             PruneOrphanBlocks();
             const COrphanBlock* orphan = AddOrphanBlock(pblock);
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(orphan)));
+            // -- blocks from the headers-first queue arrive out of order, their parents are already requested
+            if (!blockDownload.HaveHeader(hash))
+            {
+                // Ask this guy to fill in what we're missing
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(orphan)));
+            };
         }
         return true;
     }
@@ -3967,9 +4322,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        std::pair<salted_hash_multimap<uint256, COrphanBlock*>::iterator,
+                  salted_hash_multimap<uint256, COrphanBlock*>::iterator> range = mapOrphanBlocksByPrev.equal_range(hashPrev);
+        for (salted_hash_multimap<uint256, COrphanBlock*>::iterator mi = range.first; mi != range.second; ++mi)
         {
             CBlock block;
             {
@@ -4547,50 +4902,280 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     }
 }
 
+void ThreadLoadMempool(CWallet* pwallet)
+{
+    RenameThread("tokenpay-loadmempool");
+
+    try {
+        LoadMempool();
+    } catch (boost::thread_interrupted)
+    {
+        LogPrintf("LoadMempool() interrupted\n");
+        throw;
+    };
+
+    fMempoolLoaded = !ShutdownRequested();
+
+    // -- wallet txns found in mempool.dat are now skipped
+    if (pwallet)
+        pwallet->ReacceptWalletTransactions();
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// CAlert
+// mempool.dat
 //
 
-extern map<uint256, CAlert> mapAlerts;
-extern CCriticalSection cs_mapAlerts;
+static const int MEMPOOL_DUMP_VERSION = 1;
 
-string GetWarnings(string strFor)
+static void AddMempoolTxOrdered(const CTxMemPool::txMap& mapTx, const uint256& hash,
+    std::set<uint256>& setDone, std::vector<CTransaction>& vtx)
 {
-    int nPriority = 0;
-    string strStatusBar;
-    string strRPC;
+    // -- parents must be written, and so re-accepted, before their children
+    if (!setDone.insert(hash).second)
+        return;
 
-    if (GetBoolArg("-testsafemode"))
-        strRPC = "test";
+    CTxMemPool::txMap::const_iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
 
-    // Misc warnings like out of disk space and clock is wrong
-    if (strMiscWarning != "")
+    const CTransaction& tx = mi->second;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        nPriority = 1000;
-        strStatusBar = strMiscWarning;
-    }
+        if (txin.IsAnonInput())
+            continue;
+        if (mapTx.count(txin.prevout.hash))
+            AddMempoolTxOrdered(mapTx, txin.prevout.hash, setDone, vtx);
+    };
 
-    // Alerts
+    vtx.push_back(tx);
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<CTransaction> vtx;
+    std::vector<std::pair<CKeyImage, CKeyImageSpent> > vKeyImages;
     {
-        LOCK(cs_mapAlerts);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
-        {
-            const CAlert& alert = item.second;
-            if (alert.AppliesToMe() && alert.nPriority > nPriority)
-            {
-                nPriority = alert.nPriority;
-                strStatusBar = alert.strStatusBar;
-                if (nPriority > 1000)
-                    strRPC = strStatusBar;
-            }
-        }
+        LOCK(mempool.cs);
+        std::set<uint256> setDone;
+        vtx.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txMap::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            AddMempoolTxOrdered(mempool.mapTx, mi->first, setDone, vtx);
+
+        vKeyImages.reserve(mempool.mapKeyImage.size());
+        for (CTxMemPool::keyImageMap::const_iterator mi = mempool.mapKeyImage.begin(); mi != mempool.mapKeyImage.end(); ++mi)
+            vKeyImages.push_back(*mi);
     }
 
-    if (strFor == "statusbar")
-        return strStatusBar;
-    else if (strFor == "rpc")
+    int64_t nCopied = GetTimeMillis();
+
+    // serialize transactions, checksum data up to that point, then append csum
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(Params().MessageStart());
+    ss << MEMPOOL_DUMP_VERSION;
+    ss << vtx;
+    ss << vKeyImages;
+    uint256 hash = Hash(ss.begin(), ss.end());
+    ss << hash;
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("%s : open failed", __func__);
+
+    try {
+        fileout << ss;
+    } catch (std::exception &e)
+    {
+        return error("%s : I/O error %s", __func__, e.what());
+    };
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("%s : Rename-into-place failed", __func__);
+
+    LogPrintf("Dumped mempool: %u txns, %u key images, %dms to copy, %dms to dump\n",
+        vtx.size(), vKeyImages.size(), nCopied - nStart, GetTimeMillis() - nCopied);
+    return true;
+}
+
+static void PrefetchMempoolInputs(const std::vector<CTransaction>& vtx, size_t nBegin, size_t nEnd)
+{
+    // -- pull the previous txns of a batch into the db and os caches without
+    //    holding cs_main, so the batch spends little time in FetchInputs
+    CTxDB txdb("r");
+    std::set<uint256> setSeen;
+    for (size_t i = nBegin; i < nEnd; ++i)
+    {
+        BOOST_FOREACH(const CTxIn& txin, vtx[i].vin)
+        {
+            if (txin.IsAnonInput()
+                || !setSeen.insert(txin.prevout.hash).second)
+                continue;
+
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                continue;
+            CTransaction txPrev;
+            txPrev.ReadFromDisk(txindex.pos);
+        };
+    };
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        LogPrintf("No mempool.dat found, starting with an empty mempool.\n");
+        return false;
+    };
+
+    int64_t fileSize = boost::filesystem::file_size(pathMempool);
+    int64_t dataSize = fileSize - sizeof(uint256);
+    if (dataSize < 0)
+        dataSize = 0;
+    std::vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    } catch (std::exception &e)
+    {
+        return error("%s : I/O error or stream data corrupted", __func__);
+    };
+    filein.fclose();
+
+    CDataStream ss(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ss.begin(), ss.end()))
+        return error("%s : checksum mismatch; data corrupted", __func__);
+
+    std::vector<CTransaction> vtx;
+    std::vector<std::pair<CKeyImage, CKeyImageSpent> > vKeyImages;
+    try {
+        unsigned char pchMsgTmp[4];
+        int nVersion;
+        ss >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("%s : invalid network magic number", __func__);
+        ss >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s : unknown version %d", __func__, nVersion);
+        ss >> vtx;
+        ss >> vKeyImages;
+    } catch (std::exception &e)
+    {
+        return error("%s : deserialize failed %s", __func__, e.what());
+    };
+
+    // -- group reservations by spending txn, restored once the txn is back in the pool
+    std::multimap<uint256, const std::pair<CKeyImage, CKeyImageSpent>*> mapKeyImagesByTx;
+    for (size_t i = 0; i < vKeyImages.size(); ++i)
+        mapKeyImagesByTx.insert(std::make_pair(vKeyImages[i].second.txnHash, &vKeyImages[i]));
+
+    int nAccepted = 0, nFailed = 0, nAlready = 0, nKeyImages = 0;
+    for (size_t nBegin = 0; nBegin < vtx.size(); nBegin += MEMPOOL_LOAD_BATCH)
+    {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+
+        size_t nEnd = std::min(vtx.size(), nBegin + MEMPOOL_LOAD_BATCH);
+        PrefetchMempoolInputs(vtx, nBegin, nEnd);
+
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        for (size_t i = nBegin; i < nEnd; ++i)
+        {
+            CTransaction& tx = vtx[i];
+            uint256 hash = tx.GetHash();
+            if (mempool.exists(hash))
+            {
+                nAlready++;
+                continue;
+            };
+
+            if (!AcceptToMemoryPool(mempool, tx, txdb))
+            {
+                nFailed++;
+                continue;
+            };
+            nAccepted++;
+
+            if (tx.nVersion != ANON_TXN_VERSION)
+                continue;
+
+            std::multimap<uint256, const std::pair<CKeyImage, CKeyImageSpent>*>::iterator mi;
+            for (mi = mapKeyImagesByTx.lower_bound(hash); mi != mapKeyImagesByTx.upper_bound(hash); ++mi)
+            {
+                CKeyImageSpent kis = mi->second->second;
+                mempool.insertKeyImage(mi->second->first, kis);
+                nKeyImages++;
+            };
+        };
+    };
+
+    LogPrintf("Imported mempool transactions from disk: %d succeeded, %d failed, %d already there, %d key images, %dms\n",
+        nAccepted, nFailed, nAlready, nKeyImages, GetTimeMillis() - nStart);
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CAlert
+//
+
+extern map<uint256, CAlert> mapAlerts;
+extern CCriticalSection cs_mapAlerts;
+
+string GetWarnings(string strFor)
+{
+    int nPriority = 0;
+    string strStatusBar;
+    string strRPC;
+
+    if (GetBoolArg("-testsafemode"))
+        strRPC = "test";
+
+    // Misc warnings like out of disk space and clock is wrong
+    if (strMiscWarning != "")
+    {
+        nPriority = 1000;
+        strStatusBar = strMiscWarning;
+    }
+
+    // Alerts
+    {
+        LOCK(cs_mapAlerts);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+        {
+            const CAlert& alert = item.second;
+            if (alert.AppliesToMe() && alert.nPriority > nPriority)
+            {
+                nPriority = alert.nPriority;
+                strStatusBar = alert.strStatusBar;
+                if (nPriority > 1000)
+                    strRPC = strStatusBar;
+            }
+        }
+    }
+
+    if (strFor == "statusbar")
+        return strStatusBar;
+    else if (strFor == "rpc")
         return strRPC;
     assert(!"GetWarnings() : invalid parameter");
     return "error";
@@ -4608,6 +5193,15 @@ string GetWarnings(string strFor)
 // Messages
 //
 
+// Compact blocks waiting on a blocktxn from the peer that announced them, guarded by cs_main
+class CPartialBlockRequest
+{
+public:
+    NodeId nodeId;
+    int64_t nTime;
+    CPartialBlock partialBlock;
+};
+static std::map<uint256, CPartialBlockRequest> mapPartialBlocks;
 
 bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
@@ -4619,12 +5213,15 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
         txInMap = mempool.exists(inv.hash);
         return txInMap ||
                mapOrphanTransactions.count(inv.hash) ||
+               IsTxPreValidating(inv.hash) ||
                txdb.ContainsTx(inv.hash);
         }
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapPartialBlocks.count(inv.hash) ||
+               blockDownload.HaveHeader(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -4655,7 +5252,27 @@ bool static AlreadyHaveThin(CTxDB& txdb, const CInv& inv)
     return true;
 }
 
-static void ProcessGetData(CNode* pfrom)
+// Messages for blocks served recently, a new block is fetched by many peers at once. Guarded by cs_main
+static const unsigned int MAX_RECENT_BLOCK_MESSAGES = 16;
+static std::deque<std::pair<std::pair<std::string, uint256>, CSharedMessage> > vRecentBlockMessages;
+
+static CSharedMessage GetRecentBlockMessage(const std::string& strCommand, const uint256& hash)
+{
+    for (size_t i = 0; i < vRecentBlockMessages.size(); ++i)
+        if (vRecentBlockMessages[i].first.second == hash
+            && vRecentBlockMessages[i].first.first == strCommand)
+            return vRecentBlockMessages[i].second;
+    return CSharedMessage();
+}
+
+static void AddRecentBlockMessage(const std::string& strCommand, const uint256& hash, const CSharedMessage& msg)
+{
+    if (vRecentBlockMessages.size() >= MAX_RECENT_BLOCK_MESSAGES)
+        vRecentBlockMessages.pop_front();
+    vRecentBlockMessages.push_back(std::make_pair(std::make_pair(strCommand, hash), msg));
+}
+
+static void ProcessGetDataQueued(CNode* pfrom)
 {
     if (fDebugNet)
         LogPrintf("ProcessGetData\n");
@@ -4666,7 +5283,6 @@ static void ProcessGetData(CNode* pfrom)
     vector<CInv> vNotFound;
     vector<CInv> vMerkleBlocks;
 
-    LOCK(cs_main);
     std::vector<CBlock> vMultiBlock;
     std::vector<CMBlkThinElement> vMultiBlockThin; // TODO: split ProcessGetDataThinPeer from ProcessGetData
     uint32_t nMultiBlockBytes = 0;
@@ -4690,7 +5306,8 @@ static void ProcessGetData(CNode* pfrom)
         };
 
         if (inv.type == MSG_BLOCK
-            || inv.type == MSG_FILTERED_BLOCK)
+            || inv.type == MSG_FILTERED_BLOCK
+            || inv.type == MSG_CMPCT_BLOCK)
         {
             bool send = false;
             CBlockIndex *pBlockIndex;
@@ -4728,36 +5345,104 @@ static void ProcessGetData(CNode* pfrom)
                 };
             };
 
+            // -- old blocks are served within the upload target and the peer's upload rate, and only while
+            //    its send queue is short, so new blocks and txns relayed to it don't wait behind them
+            bool fHistorical = send
+                && pBlockIndex->GetBlockTime() < GetAdjustedTime() - HISTORICAL_BLOCK_AGE;
+            if (fHistorical)
+            {
+                if (CNode::OutboundTargetReached(true))
+                {
+                    LogPrint("net", "Historical block serving limit reached, disconnect peer %d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    break;
+                };
+
+                int64_t nNow = GetTimeMicros();
+                int64_t nWait = pfrom->uploadBucket.TimeUntilAvailable(nNow);
+                if (nWait == 0 && pfrom->nSendSize >= SendBufferSize() / 2)
+                    nWait = GETDATA_DEFER_INTERVAL;
+                if (nWait > 0)
+                {
+                    // -- leave the inv queued, the message handler tries again after nGetDataDeferUntil
+                    it--;
+                    pfrom->nGetDataDeferUntil = nNow + nWait;
+                    pfrom->nGetDataDeferred++;
+                    break;
+                };
+            };
+
             if (send)
             {
+                // -- messages that hold just this block can be shared with the other peers fetching it,
+                //    getblocktxn is only served near the tip, compact requests for older blocks get them whole
+                const char* pszShared = NULL;
+                if (inv.type == MSG_CMPCT_BLOCK)
+                    pszShared = pBlockIndex->nHeight >= nBestHeight - MAX_BLOCKTXN_DEPTH ? "cmpctblock" : "block";
+                else
+                if (inv.type == MSG_BLOCK && pfrom->nVersion < MIN_MBLK_VERSION)
+                    pszShared = "block";
+                else
+                if (inv.type == MSG_BLOCK && vMultiBlock.empty() && it == pfrom->vRecvGetData.end())
+                    pszShared = "mblk";
+
+                CSharedMessage msgBlock;
+                if (pszShared)
+                    msgBlock = GetRecentBlockMessage(pszShared, inv.hash);
+                uint64_t nServedBytes = 0; // filtered blocks are not counted
+
                 // Send block from disk
                 CBlock block;
-                if (!block.ReadFromDisk(pBlockIndex))
+                if (!msgBlock && !block.ReadFromDisk(pBlockIndex))
                 {
                     LogPrintf("Error: block.ReadFromDisk failed - Terminating.");
                     exit(1);
                 };
 
-                if (inv.type == MSG_BLOCK)
+                if (pszShared)
                 {
-                    if (pfrom->nVersion >= MIN_MBLK_VERSION)
+                    if (!msgBlock)
                     {
-                        uint32_t nBlockBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+                        if (strcmp(pszShared, "cmpctblock") == 0)
+                            msgBlock = MakeSharedMessage(pszShared, CBlockHeaderAndShortTxIDs(block));
+                        else
+                        if (strcmp(pszShared, "mblk") == 0)
+                            msgBlock = MakeSharedMessage(pszShared, std::vector<CBlock>(1, block));
+                        else
+                            msgBlock = MakeSharedMessage(pszShared, block);
+                        AddRecentBlockMessage(pszShared, inv.hash, msgBlock);
+                    };
 
-                        if (vMultiBlock.size() >= MAX_MULTI_BLOCK_ELEMENTS
-                            || nMultiBlockBytes + nBlockBytes > MAX_MULTI_BLOCK_SIZE)
+                    // -- compressed once too, kept next to the plain message
+                    if (pfrom->fCompress && IsCompressibleCommand(pszShared))
+                    {
+                        std::string strCompressed = std::string("lz4:") + pszShared;
+                        CSharedMessage msgCompressed = GetRecentBlockMessage(strCompressed, inv.hash);
+                        if (!msgCompressed)
                         {
-                            pfrom->PushMessage("mblk", vMultiBlock);
-                            vMultiBlock.clear();
-                            nMultiBlockBytes = 0;
-                        }
+                            msgCompressed = CompressSharedMessage(msgBlock);
+                            AddRecentBlockMessage(strCompressed, inv.hash, msgCompressed);
+                        };
+                        msgBlock = msgCompressed;
+                    };
+                    pfrom->PushMessage(msgBlock);
+                    nServedBytes = msgBlock->size();
+                } else
+                if (inv.type == MSG_BLOCK)
+                {
+                    uint32_t nBlockBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+                    nServedBytes = nBlockBytes;
 
-                        vMultiBlock.push_back(block);
-                        nMultiBlockBytes += nBlockBytes;
-                    } else
+                    if (vMultiBlock.size() >= MAX_MULTI_BLOCK_ELEMENTS
+                        || nMultiBlockBytes + nBlockBytes > MAX_MULTI_BLOCK_SIZE)
                     {
-                        pfrom->PushMessage("block", block);
+                        pfrom->PushMessage("mblk", vMultiBlock);
+                        vMultiBlock.clear();
+                        nMultiBlockBytes = 0;
                     }
+
+                    vMultiBlock.push_back(block);
+                    nMultiBlockBytes += nBlockBytes;
                 } else
                 {
                     // MSG_FILTERED_BLOCK)
@@ -4776,7 +5461,7 @@ static void ProcessGetData(CNode* pfrom)
 
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                             {
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second, MSG_TX))
                                 {
                                     nBlockBytes += ::GetSerializeSize(block.vtx[pair.first], SER_NETWORK, PROTOCOL_VERSION);
                                     mbElem.vtx.push_back(block.vtx[pair.first]);
@@ -4806,7 +5491,7 @@ static void ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                             {
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second, MSG_TX))
                                 {
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                                 };
@@ -4817,6 +5502,12 @@ static void ProcessGetData(CNode* pfrom)
                         // no response
                 };
 
+                if (fHistorical)
+                {
+                    pfrom->uploadBucket.Consume(nServedBytes, GetTimeMicros());
+                    pfrom->nHistoricalBytes += nServedBytes;
+                };
+
                 // Trigger them to send a getblocks request for the next batch of inventory
                 if (inv.hash == pfrom->hashContinue)
                 {
@@ -4836,9 +5527,9 @@ static void ProcessGetData(CNode* pfrom)
             bool pushed = false;
             {
                 LOCK(cs_mapRelay);
-                std::map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                std::map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                 if (mi != mapRelay.end()) {
-                    pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                    pfrom->PushMessage(mi->second);
                     pushed = true;
                 }
             }
@@ -4879,7 +5570,7 @@ static void ProcessGetData(CNode* pfrom)
             };
         } else
         {
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         };
     };
@@ -4907,6 +5598,29 @@ static void ProcessGetData(CNode* pfrom)
         LogPrintf("ProcessGetData - End\n");
 }
 
+static void ProcessGetData(CNode* pfrom)
+{
+    // -- txns are served from mapRelay and the mempool, which have their own locks
+    bool fNeedMain = false;
+    BOOST_FOREACH(const CInv& inv, pfrom->vRecvGetData)
+    {
+        if (inv.type != MSG_TX)
+        {
+            fNeedMain = true;
+            break;
+        };
+    };
+
+    if (!fNeedMain)
+    {
+        ProcessGetDataQueued(pfrom);
+        return;
+    };
+
+    LOCK(cs_main);
+    ProcessGetDataQueued(pfrom);
+}
+
 static int ProcessMerkleBlock(CNode* pfrom, CMerkleBlockIncoming& merkleBlock, std::vector<CTransaction>* pvTxns)
 {
     if (fDebugNet)
@@ -5179,6 +5893,312 @@ static bool SetNodeType(CNode* pfrom, int nTypeInd)
     return true;
 }
 
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    std::vector<CInv> vGetData;
+    vGetData.push_back(CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+static void ProcessReconstructedBlock(CNode* pfrom, CBlock& block)
+{
+    AssertLockHeld(cs_main);
+
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+
+    if (ProcessBlock(pfrom, &block, hashBlock))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    if (fSecMsgEnabled)
+        SecureMsgScanBlock(block);
+}
+
+// Check the stake signature or proof of work of a compact block before it is rebuilt,
+// blockStub gets the header and leading prefilled txns
+static bool CheckCompactBlockProof(const CBlockHeaderAndShortTxIDs& cmpctblock, CBlock& blockStub)
+{
+    AssertLockHeld(cs_main);
+
+    blockStub.SetNull();
+    *(CBlockHeader*)&blockStub = cmpctblock.header;
+    blockStub.vchBlockSig = cmpctblock.vchBlockSig;
+
+    const std::vector<uint16_t>& vIndexes = cmpctblock.prefilledIndexes.vIndexes;
+    for (size_t i = 0; i < vIndexes.size() && i < 2 && vIndexes[i] == i; ++i)
+        blockStub.vtx.push_back(cmpctblock.vPrefilledTxn[i]);
+
+    if (blockStub.vtx.empty() || !blockStub.vtx[0].IsCoinBase())
+        return error("CheckCompactBlockProof() : first prefilled txn is not the coinbase");
+
+    if (blockStub.IsProofOfWork()
+        && !CheckProofOfWork(blockStub.GetHash(), blockStub.nBits))
+        return error("CheckCompactBlockProof() : proof of work failed");
+
+    if (!blockStub.CheckBlockSignature())
+        return error("CheckCompactBlockProof() : bad block signature");
+
+    return true;
+}
+
+static bool IsHeadersFirstPeer(const CNode* pnode)
+{
+    return nNodeMode == NT_FULL
+        && pnode->nTypeInd == NT_FULL
+        && pnode->nVersion >= HEADERS_FIRST_VERSION
+        && !pnode->fClient
+        && !pnode->fOneShot;
+}
+
+// Peer headers are being fetched from, -1 if none, guarded by cs_main
+static NodeId nodeHeadersSync = -1;
+static int64_t nTimeHeadersSync = 0;
+
+static void RequestHeaders(CNode* pfrom)
+{
+    AssertLockHeld(cs_main);
+
+    nodeHeadersSync = pfrom->GetId();
+    nTimeHeadersSync = GetTime();
+
+    CBlockLocator locator(pindexBest);
+    if (!blockDownload.Empty())
+        locator.SetThin(blockDownload.Back().hash);
+
+    LogPrint("net", "getheaders to peer %d from %s\n", pfrom->GetId(),
+        blockDownload.Empty() ? hashBestChain.ToString() : blockDownload.Back().hash.ToString());
+    pfrom->PushMessage("getheaders", locator, uint256(0));
+}
+
+// Walks back from a queued header over the download queue, then over the block index the queue extends
+class CQueuedHeaderCursor
+{
+public:
+    int nPos;                   // position in blockDownload, -1 once behind the queue front
+    const CBlockIndex* pindex;  // block index entry once behind the queue front
+    const CBlockIndex* pindexRoot;
+
+    CQueuedHeaderCursor(int nPosIn, const CBlockIndex* pindexIn)
+    {
+        nPos = nPosIn;
+        pindex = nPos < 0 ? pindexIn : NULL;
+        pindexRoot = pindexIn;
+    }
+
+    int GetHeight() const { return nPos < 0 ? pindex->nHeight : blockDownload.At(nPos).nHeight; }
+    int64_t GetBlockTime() const { return nPos < 0 ? pindex->GetBlockTime() : blockDownload.At(nPos).nBlockTime; }
+    unsigned int GetBits() const { return nPos < 0 ? pindex->nBits : blockDownload.At(nPos).nBits; }
+    bool IsProofOfStake() const { return nPos < 0 ? pindex->IsProofOfStake() : blockDownload.At(nPos).fProofOfStake; }
+
+    bool HasPrev() const
+    {
+        if (nPos > 0)
+            return true;
+        return nPos == 0 ? pindexRoot != NULL : pindex->pprev != NULL;
+    }
+
+    void Prev()
+    {
+        if (nPos < 0)
+            pindex = pindex->pprev;
+        else
+        if (--nPos < 0)
+            pindex = pindexRoot;
+    }
+
+    int64_t GetPastTimeLimit() const
+    {
+        if (Params().IsProtocolV2(GetHeight()))
+            return GetBlockTime();
+
+        std::vector<int64_t> vTimes;
+        CQueuedHeaderCursor cursor = *this;
+        for (int i = 0; i < CBlockIndex::nMedianTimeSpan; i++)
+        {
+            vTimes.push_back(cursor.GetBlockTime());
+            if (!cursor.HasPrev())
+                break;
+            cursor.Prev();
+        };
+        std::sort(vTimes.begin(), vTimes.end());
+        return vTimes[vTimes.size() / 2];
+    }
+
+    // GetNextTargetRequired over the queued headers
+    unsigned int GetNextTargetRequired(bool fProofOfStake) const
+    {
+        CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit(GetHeight()) : Params().ProofOfWorkLimit();
+
+        CQueuedHeaderCursor cursor = *this;
+        while (cursor.HasPrev() && cursor.IsProofOfStake() != fProofOfStake)
+            cursor.Prev();
+        if (!cursor.HasPrev())
+            return bnTargetLimit.GetCompact(); // first block
+
+        unsigned int nBitsPrev = cursor.GetBits();
+        int64_t nTimePrev = cursor.GetBlockTime();
+        cursor.Prev();
+        while (cursor.HasPrev() && cursor.IsProofOfStake() != fProofOfStake)
+            cursor.Prev();
+        if (!cursor.HasPrev())
+            return bnTargetLimit.GetCompact(); // second block
+
+        return GetNextTarget(bnTargetLimit, GetHeight(), nBitsPrev, nTimePrev, cursor.GetBlockTime());
+    }
+};
+
+// Queue headers from a full peer for parallel download, they must extend the queue or the block index
+static void ProcessHeadersFirst(CNode* pfrom, std::vector<CBlockThin>& vHeaders)
+{
+    AssertLockHeld(cs_main);
+
+    if (pfrom->GetId() == nodeHeadersSync)
+        nTimeHeadersSync = GetTime();
+
+    unsigned int nAdded = 0;
+    BOOST_FOREACH(CBlockThin& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        if (mapBlockIndex.count(hash)
+            || blockDownload.HaveHeader(hash))
+            continue;
+
+        int nHeight;
+        std::map<uint256, CBlockIndex*>::iterator mi;
+        if (!blockDownload.Empty()
+            && header.hashPrevBlock == blockDownload.Back().hash)
+        {
+            nHeight = blockDownload.Back().nHeight + 1;
+            mi = mapBlockIndex.find(blockDownload.Front().hashPrev);
+            if (mi == mapBlockIndex.end())
+            {
+                LogPrintf("Download queue from %s doesn't extend the block index.\n", blockDownload.Front().hashPrev.ToString());
+                break;
+            };
+        } else
+        if (blockDownload.Empty()
+            && (mi = mapBlockIndex.find(header.hashPrevBlock)) != mapBlockIndex.end())
+        {
+            nHeight = mi->second->nHeight + 1;
+        } else
+        {
+            // -- another branch, left to the inv/getblocks path once the queue drains
+            LogPrint("net", "headers from peer %d don't extend the download queue at %s\n", pfrom->GetId(), hash.ToString());
+            break;
+        };
+
+        header.nDoS = 0;
+        if (!header.CheckBlockThin())
+        {
+            pfrom->Misbehaving(header.nDoS);
+            break;
+        };
+
+        if (header.GetBlockTime() > FutureDrift(GetAdjustedTime(), nHeight))
+        {
+            LogPrintf("Header %s from peer %d is too far in the future.\n", hash.ToString(), pfrom->GetId());
+            break;
+        };
+
+        // -- the checks of AcceptBlock a header can be held to, so peers are only asked for blocks that may exist
+        CQueuedHeaderCursor prev((int)blockDownload.Size() - 1, mi->second);
+
+        if (header.nVersion > CBlockHeader::CURRENT_VERSION)
+        {
+            LogPrintf("Header %s from peer %d has unknown version %d.\n", hash.ToString(), pfrom->GetId(), header.nVersion);
+            break;
+        };
+
+        if (header.IsProofOfWork() && nHeight > Params().LastPOWBlock())
+        {
+            pfrom->Misbehaving(100);
+            LogPrintf("Header %s from peer %d is proof-of-work at height %d.\n", hash.ToString(), pfrom->GetId(), nHeight);
+            break;
+        };
+
+        if (header.nBits != prev.GetNextTargetRequired(header.IsProofOfStake()))
+        {
+            pfrom->Misbehaving(100);
+            LogPrintf("Header %s from peer %d has incorrect %s target.\n", hash.ToString(), pfrom->GetId(),
+                header.IsProofOfWork() ? "proof-of-work" : "proof-of-stake");
+            break;
+        };
+
+        if (header.GetBlockTime() <= prev.GetPastTimeLimit()
+            || FutureDrift(header.GetBlockTime(), nHeight) < prev.GetBlockTime())
+        {
+            LogPrintf("Header %s from peer %d has a timestamp too early.\n", hash.ToString(), pfrom->GetId());
+            break;
+        };
+
+        if (!Checkpoints::CheckHardened(nHeight, hash))
+        {
+            pfrom->Misbehaving(100);
+            LogPrintf("Header %s from peer %d fails checkpoint at height %d.\n", hash.ToString(), pfrom->GetId(), nHeight);
+            break;
+        };
+
+        if (!Checkpoints::CheckSync(nHeight))
+        {
+            LogPrintf("Header %s from peer %d is rejected by the synchronized checkpoint.\n", hash.ToString(), pfrom->GetId());
+            break;
+        };
+
+        blockDownload.AddHeader(hash, header.hashPrevBlock, nHeight,
+            header.GetBlockTime(), header.nBits, header.IsProofOfStake(), pfrom->GetId());
+        nAdded++;
+    };
+
+    if (fDebugChain)
+        LogPrintf("Queued %u of %u headers from peer %d, %u queued.\n", nAdded, vHeaders.size(), pfrom->GetId(), blockDownload.Size());
+
+    // -- a full batch means the peer has more
+    if (vHeaders.size() == MAX_GETHEADERS_SZ
+        && nAdded > 0
+        && blockDownload.Size() < MAX_HEADERS_AHEAD)
+    {
+        RequestHeaders(pfrom);
+        return;
+    };
+
+    if (pfrom->GetId() == nodeHeadersSync)
+        nodeHeadersSync = -1;
+}
+
+// requires LOCK(pnode->cs_inventory)
+static void TxReconDropKnown(CNode* pnode)
+{
+    std::map<uint32_t, uint256>& mapSet = pnode->txrecon.mapSet;
+    for (std::map<uint32_t, uint256>::iterator mi = mapSet.begin(); mi != mapSet.end(); )
+    {
+        if (pnode->filterInventoryKnown.contains(mi->second, MSG_TX))
+            mapSet.erase(mi++);
+        else
+            ++mi;
+    };
+}
+
+// Inv txns found missing by reconciliation, bypasses vInventoryToSend so they aren't reconciled again
+static void PushTxReconAnnounce(CNode* pnode, const std::vector<uint256>& vHashes)
+{
+    if (vHashes.empty())
+        return;
+
+    std::vector<CInv> vInv;
+    {
+        LOCK(pnode->cs_inventory);
+        BOOST_FOREACH(const uint256& hash, vHashes)
+        {
+            if (pnode->filterInventoryKnown.contains(hash, MSG_TX))
+                continue;
+            pnode->filterInventoryKnown.insert(hash, MSG_TX);
+            vInv.push_back(CInv(MSG_TX, hash));
+        };
+    }
+
+    if (!vInv.empty())
+        pnode->PushMessage("inv", vInv);
+}
 
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -5274,6 +6294,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushVersion();
 
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+        pfrom->fCompress = (nLocalServices & NODE_COMPRESS) && (pfrom->nServices & NODE_COMPRESS);
 
         int64_t nTimeOffset = nTime - GetTime();
         pfrom->nTimeOffset = nTimeOffset;
@@ -5301,6 +6322,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->fGetAddr = true;
             }
             addrman.Good(pfrom->addr);
+            MarkTorStartup(TOR_FIRST_PEER);
         } else {
             if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
             {
@@ -5314,9 +6336,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (nNodeMode == NT_FULL)
         {
+            // -- peers far ahead that serve headers are synced headers-first from SendMessages
             if (pfrom->nTypeInd == NT_FULL && !pfrom->fClient &&
                !pfrom->fOneShot && !fImporting &&
                (pfrom->nChainHeight > (nBestHeight - 144)) &&
+               !(IsHeadersFirstPeer(pfrom) && pfrom->nChainHeight > nBestHeight + HEADERS_FIRST_MIN_BEHIND) &&
                (nAskedForBlocks < 1 || vNodes.size() <= 1))
             {
                 nAskedForBlocks++;
@@ -5378,6 +6402,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(pwalletMain->cs_wallet);
             pfrom->PushMessage("filterload", *pwalletMain->pBloomFilter);
         };
+
+        if (nNodeMode == NT_FULL
+            && (nLocalServices & NODE_COMPACT)
+            && (pfrom->nServices & NODE_COMPACT))
+        {
+            // -- ask the first few outbound peers to push new blocks as cmpctblock
+            bool fAnnounce = false;
+            if (!pfrom->fInbound)
+            {
+                int nAnnouncing = 0;
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (pnode != pfrom && !pnode->fInbound && pnode->fSupportsCompact)
+                        nAnnouncing++;
+                fAnnounce = nAnnouncing < MAX_CMPCT_ANNOUNCE_PEERS;
+            };
+            pfrom->PushMessage("sendcmpct", fAnnounce, CMPCTBLOCKS_VERSION);
+        };
+
+        if (nNodeMode == NT_FULL
+            && (nLocalServices & NODE_TXRECON)
+            && (pfrom->nServices & NODE_TXRECON))
+            pfrom->PushMessage("sendtxrcncl", TXRECON_VERSION, pfrom->txrecon.nLocalSalt);
     } else
     if (strCommand == "addr")
     {
@@ -5411,7 +6458,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -5621,8 +6668,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return false;
         };
 
-        // -- full nodes don't request headers
+        // -- only full nodes syncing headers first request headers as full peers
         if (pfrom->nTypeInd == NT_FULL
+            && pfrom->nVersion < HEADERS_FIRST_VERSION
             && !SetNodeType(pfrom, NT_THIN))
             return false;
 
@@ -5650,151 +6698,108 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pindex = pindex->pnext;
         }
 
-        vector<CBlock> vHeaders;
+        vector<CBlockThin> vHeaders;
         int nLimit = MAX_GETHEADERS_SZ;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            vHeaders.push_back(pindex->GetBlockThinOnly());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
-        pfrom->PushMessage("headers", vHeaders);
-    }
-
-
-    else if (strCommand == "tx")
-    {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-
-        CTransaction tx;
-        vRecv >> tx;
-
-        LOCK(cs_main);
-
-        CTxDB txdb("r");
-
-        if (nNodeMode == NT_FULL)
-        {
-            CInv inv(MSG_TX, tx.GetHash());
-            pfrom->AddInventoryKnown(inv);
-
-            bool fMissingInputs = false;
-
-            mapAlreadyAskedFor.erase(inv);
+        pfrom->PushMessage("headers", vHeaders);
+    }
 
-            if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
-            {
-                SyncWithWallets(tx, NULL, true);
-                RelayTransaction(tx, inv.hash);
-                vWorkQueue.push_back(inv.hash);
-                vEraseQueue.push_back(inv.hash);
 
-                // Recursively process any orphan transactions that depended on this one
-                for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-                {
-                    map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                    if (itByPrev == mapOrphanTransactionsByPrev.end())
-                        continue;
-                    for (set<uint256>::iterator mi = itByPrev->second.begin();
-                         mi != itByPrev->second.end();
-                         ++mi)
-                    {
-                        const uint256& orphanTxHash = *mi;
-                        CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                        bool fMissingInputs2 = false;
+    else if (strCommand == "tx")
+    {
+        CTransaction tx;
+        vRecv >> tx;
 
-                        if (AcceptToMemoryPool(mempool, orphanTx, txdb, &fMissingInputs2))
-                        {
-                            LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                            SyncWithWallets(tx, NULL, true);
-                            RelayTransaction(orphanTx, orphanTxHash);
-                            vWorkQueue.push_back(orphanTxHash);
-                            vEraseQueue.push_back(orphanTxHash);
-                        }
-                        else if (!fMissingInputs2)
-                        {
-                            // invalid or too-little-fee orphan
-                            vEraseQueue.push_back(orphanTxHash);
-                            LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                        }
-                    }
-                }
+        uint256 txHash = tx.GetHash();
+        CInv inv(MSG_TX, txHash);
+        pfrom->AddInventoryKnown(inv);
 
-                BOOST_FOREACH(uint256 hash, vEraseQueue)
-                    EraseOrphanTx(hash);
-            }
-            else if (fMissingInputs)
-            {
-                AddOrphanTx(tx);
+        // -- full nodes verify signatures on a worker, cs_main is taken there to accept and clear the request,
+        //    txns already in the pool are dropped before any checks
+        bool fHave = false;
+        bool fQueued = false;
+        if (nNodeMode == NT_FULL)
+        {
+            fHave = mempool.exists(txHash);
+            if (fHave)
+                LogPrint("mempool", "%s already in mempool\n", txHash.ToString());
+            else
+                fQueued = QueueTxPreValidate(pfrom, tx, txHash);
+        };
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-                if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-            }
-        } else
+        if (!fQueued)
         {
-            uint256 txHash = tx.GetHash();
+            LOCK(cs_main);
+
+            CTxDB txdb("r");
 
-            CInv inv(MSG_TX, txHash);
-            pfrom->AddInventoryKnown(inv);
             mapAlreadyAskedFor.erase(inv);
 
-            bool fProcessed = false;
-            std::vector<CMerkleBlockIncoming>::iterator it;
-            for (it = vIncomingMerkleBlocks.begin(); !fProcessed && it < vIncomingMerkleBlocks.end(); ++it)
+            if (nNodeMode == NT_FULL)
+            {
+                if (!fHave)
+                    ProcessTransaction(tx, txdb, false);
+            } else
             {
-                for (uint32_t i = 0; i < it->vMatch.size(); ++i)
+                bool fProcessed = false;
+                std::vector<CMerkleBlockIncoming>::iterator it;
+                for (it = vIncomingMerkleBlocks.begin(); !fProcessed && it < vIncomingMerkleBlocks.end(); ++it)
                 {
-                    if (it->vMatch[i] != txHash)
-                        continue;
+                    for (uint32_t i = 0; i < it->vMatch.size(); ++i)
+                    {
+                        if (it->vMatch[i] != txHash)
+                            continue;
 
-                    //LogPrintf("Found match.\n");
-                    uint256 blockhash = it->header.GetHash();
+                        //LogPrintf("Found match.\n");
+                        uint256 blockhash = it->header.GetHash();
 
-                    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-                        pwallet->AddToWalletIfInvolvingMe(tx, txHash, (void*)&blockhash, true);
+                        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+                            pwallet->AddToWalletIfInvolvingMe(tx, txHash, (void*)&blockhash, true);
 
-                    it->nProcessed++;
-                    fProcessed = true;
-                    if (it->nProcessed == it->vMatch.size())
-                        vIncomingMerkleBlocks.erase(it);
-                    break;
+                        it->nProcessed++;
+                        fProcessed = true;
+                        if (it->nProcessed == it->vMatch.size())
+                            vIncomingMerkleBlocks.erase(it);
+                        break;
 
-                    //LogPrintf("vMatch %d %s\n", i, it->vMatch[i].ToString().c_str());
+                        //LogPrintf("vMatch %d %s\n", i, it->vMatch[i].ToString().c_str());
+                    };
                 };
-            };
 
-            if (!fProcessed)
-            {
-                if (fDebugChain)
-                    LogPrintf("txn %s not found in merkleblock, adding to mempool.\n", txHash.ToString().c_str());
+                if (!fProcessed)
+                {
+                    if (fDebugChain)
+                        LogPrintf("txn %s not found in merkleblock, adding to mempool.\n", txHash.ToString().c_str());
 
-                // TODO: this is wasteful, test timedout first?
+                    // TODO: this is wasteful, test timedout first?
 
-                bool fMissingInputs = false;
-                if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
-                {
-                    //SyncWithWallets(tx, NULL, true);
+                    bool fMissingInputs = false;
+                    if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
+                    {
+                        //SyncWithWallets(tx, NULL, true);
 
-                    bool added = false;
-                    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-                        added = added | pwallet->AddToWalletIfInvolvingMe(tx, txHash, NULL, true);
+                        bool added = false;
+                        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+                            added = added | pwallet->AddToWalletIfInvolvingMe(tx, txHash, NULL, true);
 
-                    if (added)
-                        RelayTransaction(tx, inv.hash);
-                    else
-                        // -- not interested in txn if not for this wallet
-                        mempool.remove(tx);
+                        if (added)
+                            RelayTransaction(tx, inv.hash);
+                        else
+                            // -- not interested in txn if not for this wallet
+                            mempool.remove(tx);
+                    }
                 }
             }
-        }
-
-        if (tx.nDoS)
-            pfrom->Misbehaving(tx.nDoS);
 
+            if (tx.nDoS)
+                pfrom->Misbehaving(tx.nDoS);
+        };
     } else
     if (strCommand == "mblk" && !fImporting && !fReindexing)  // Ignore blocks received while importing
     {
@@ -5906,6 +6911,272 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (fSecMsgEnabled)
             SecureMsgScanBlock(block);
     } else
+    if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce;
+        uint64_t nCmpctVersion;
+        vRecv >> fAnnounce >> nCmpctVersion;
+
+        if (nNodeMode == NT_FULL
+            && (nLocalServices & NODE_COMPACT)
+            && nCmpctVersion == CMPCTBLOCKS_VERSION)
+        {
+            pfrom->fSupportsCompact = true;
+            pfrom->fPreferCompact = fAnnounce;
+        };
+    } else
+    if (strCommand == "sendtxrcncl")
+    {
+        uint32_t nReconVersion;
+        uint64_t nRemoteSalt;
+        vRecv >> nReconVersion >> nRemoteSalt;
+
+        if (nNodeMode == NT_FULL
+            && (nLocalServices & NODE_TXRECON)
+            && (pfrom->nServices & NODE_TXRECON)
+            && nReconVersion == TXRECON_VERSION
+            && pfrom->fRelayTxes)
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->txrecon.fEnabled)
+                pfrom->txrecon.Init(!pfrom->fInbound, nRemoteSalt, GetTimeMicros());
+        };
+    } else
+    if (strCommand == "reqrecon")
+    {
+        uint16_t nSetSize, nQ;
+        vRecv >> nSetSize >> nQ;
+
+        std::vector<uint32_t> vSyndromes;
+        bool fResponded;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->txrecon.fEnabled || pfrom->txrecon.fInitiator)
+                return true;
+            TxReconDropKnown(pfrom);
+            fResponded = pfrom->txrecon.RespondRound(GetTimeMicros(), nSetSize, nQ, vSyndromes);
+        }
+
+        if (!fResponded)
+        {
+            // -- the peer's round times out and its set is announced by inv
+            pfrom->Misbehaving(1);
+            return error("reqrecon sooner than the reconciliation interval, peer %d", pfrom->GetId());
+        };
+        pfrom->PushMessage("sketch", vSyndromes);
+    } else
+    if (strCommand == "sketch")
+    {
+        std::vector<uint32_t> vSyndromes;
+        vRecv >> vSyndromes;
+
+        if (vSyndromes.size() > MAX_SKETCH_CAPACITY)
+        {
+            pfrom->Misbehaving(20);
+            return error("sketch capacity %u too large, peer %d", vSyndromes.size(), pfrom->GetId());
+        };
+
+        bool fSuccess;
+        std::vector<uint256> vAnnounce;
+        std::vector<uint32_t> vAsk;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->txrecon.fEnabled || !pfrom->txrecon.fInitiator || !pfrom->txrecon.fRoundActive)
+                return true;
+            fSuccess = pfrom->txrecon.FinishRound(vSyndromes, vAnnounce, vAsk);
+        }
+
+        LogPrint("net", "reconciliation with peer %d %s, announcing %u, asking for %u\n",
+            pfrom->GetId(), fSuccess ? "succeeded" : "failed", vAnnounce.size(), vAsk.size());
+        pfrom->PushMessage("reconcildiff", fSuccess, vAsk);
+        PushTxReconAnnounce(pfrom, vAnnounce);
+    } else
+    if (strCommand == "reconcildiff")
+    {
+        bool fSuccess;
+        std::vector<uint32_t> vAsk;
+        vRecv >> fSuccess >> vAsk;
+
+        if (vAsk.size() > MAX_SKETCH_CAPACITY)
+        {
+            pfrom->Misbehaving(20);
+            return error("reconcildiff size %u too large, peer %d", vAsk.size(), pfrom->GetId());
+        };
+
+        std::vector<uint256> vAnnounce;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->txrecon.fEnabled || pfrom->txrecon.fInitiator)
+                return true;
+            pfrom->txrecon.FinishResponse(fSuccess, vAsk, vAnnounce);
+        }
+        PushTxReconAnnounce(pfrom, vAnnounce);
+    } else
+    if (strCommand == "cmpctblock" && !fImporting && !fReindexing)
+    {
+        if (nNodeMode != NT_FULL)
+        {
+            LogPrintf("[rem] strCommand cmpctblock, !NT_FULL\n");
+            return 0;
+        };
+
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received cmpctblock %s\n", hashBlock.ToString());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
+        if (mapBlockIndex.count(hashBlock)
+            || mapOrphanBlocks.count(hashBlock)
+            || mapPartialBlocks.count(hashBlock))
+            return true;
+
+        // -- orphans go through the full block path
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        };
+
+        CBlock blockStub;
+        if (!CheckCompactBlockProof(cmpctblock, blockStub))
+        {
+            pfrom->Misbehaving(100);
+            return error("cmpctblock %s : invalid proof", hashBlock.ToString());
+        };
+
+        if (blockStub.IsProofOfStake()
+            && setStakeSeen.count(blockStub.GetProofOfStake())
+            && !mapOrphanBlocksByPrev.count(hashBlock))
+            return error("cmpctblock %s : duplicate proof-of-stake", hashBlock.ToString());
+
+        CPartialBlock partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("cmpctblock %s : invalid", hashBlock.ToString());
+        };
+        if (status == READ_STATUS_FAILED)
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        };
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        partialBlock.GetMissing(req.indexes.vIndexes);
+
+        LogPrint("net", "cmpctblock %s : %u prefilled, %u from mempool, %u missing\n",
+            hashBlock.ToString(), partialBlock.nPrefilled, partialBlock.nMempool, req.indexes.vIndexes.size());
+
+        if (req.indexes.vIndexes.empty())
+        {
+            CBlock block;
+            if (partialBlock.FillBlock(block, std::vector<CTransaction>()) != READ_STATUS_OK)
+            {
+                RequestFullBlock(pfrom, hashBlock);
+                return true;
+            };
+            ProcessReconstructedBlock(pfrom, block);
+            return true;
+        };
+
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        };
+
+        CPartialBlockRequest& partialRequest = mapPartialBlocks[hashBlock];
+        partialRequest.nodeId = pfrom->GetId();
+        partialRequest.nTime = GetTime();
+        partialRequest.partialBlock = partialBlock;
+
+        pfrom->PushMessage("getblocktxn", req);
+    } else
+    if (strCommand == "getblocktxn")
+    {
+        if (nNodeMode != NT_FULL)
+            return true;
+
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "getblocktxn for unknown block %s\n", req.blockhash.ToString());
+            return true;
+        };
+
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("getblocktxn : ReadFromDisk failed for %s", req.blockhash.ToString());
+
+        if (mi->second->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH)
+        {
+            pfrom->PushMessage("block", block);
+            return true;
+        };
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.indexes.vIndexes.size());
+        BOOST_FOREACH(uint16_t nIndex, req.indexes.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("getblocktxn : index %u out of range for %s", nIndex, req.blockhash.ToString());
+            };
+            resp.vtx.push_back(block.vtx[nIndex]);
+        };
+
+        pfrom->PushMessage("blocktxn", resp);
+    } else
+    if (strCommand == "blocktxn" && !fImporting && !fReindexing)
+    {
+        if (nNodeMode != NT_FULL)
+            return true;
+
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+
+        std::map<uint256, CPartialBlockRequest>::iterator mi = mapPartialBlocks.find(resp.blockhash);
+        if (mi == mapPartialBlocks.end()
+            || mi->second.nodeId != pfrom->GetId())
+        {
+            LogPrint("net", "blocktxn for %s was not requested from peer %d\n", resp.blockhash.ToString(), pfrom->GetId());
+            return true;
+        };
+
+        CBlock block;
+        ReadStatus status = mi->second.partialBlock.FillBlock(block, resp.vtx);
+        mapPartialBlocks.erase(mi);
+
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("blocktxn %s : invalid", resp.blockhash.ToString());
+        };
+        if (status == READ_STATUS_FAILED)
+        {
+            RequestFullBlock(pfrom, resp.blockhash);
+            return true;
+        };
+
+        ProcessReconstructedBlock(pfrom, block);
+    } else
     if (strCommand == "merkleblock")
     {
         if (nNodeState != NS_READY
@@ -5924,7 +7195,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     } else
     if (strCommand == "headers")
     {
-        if (nNodeMode == NT_FULL)
+        if (nNodeMode == NT_FULL
+            && !IsHeadersFirstPeer(pfrom))
         {
             LogPrintf("Warning: Peer sent headers to full node.\n");
             pfrom->Misbehaving(10);
@@ -5934,6 +7206,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<CBlockThin> vHeaders;
         vRecv >> vHeaders;
 
+        if (nNodeMode == NT_FULL)
+        {
+            if (vHeaders.size() > MAX_GETHEADERS_SZ)
+            {
+                LogPrintf("Warning: Peer sent too many headers %u.\n", vHeaders.size());
+                pfrom->Misbehaving(10);
+                return false;
+            };
+
+            LOCK(cs_main);
+            ProcessHeadersFirst(pfrom, vHeaders);
+            return true;
+        };
+
         if (fDebugChain)
             LogPrintf("Received %u headers\n", vHeaders.size());
 
@@ -5980,7 +7266,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if (addr.nTime > nCutOff)
@@ -6268,6 +7557,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
+// Commands whose handlers take any locks they need themselves, the rest run under cs_main
+static bool IsLockFreeCommand(const std::string& strCommand)
+{
+    return strCommand == "ping"
+        || strCommand == "pong"
+        || strCommand == "addr"
+        || strCommand == "getaddr"
+        || strCommand == "getdata"
+        || strCommand == "tx"
+        || strCommand == "filterload"
+        || strCommand == "filteradd"
+        || strCommand == "filterclear"
+        || strCommand == "reject"
+        || strCommand == "sendtxrcncl"
+        || strCommand == "reqrecon"
+        || strCommand == "sketch"
+        || strCommand == "reconcildiff"
+        || strCommand.compare(0, 4, "smsg") == 0;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -6285,11 +7594,15 @@ bool ProcessMessages(CNode* pfrom)
     bool fOk = true;
 
     // continue sending if inv is left over from last round (not enough space in send buffer)
-    if (!pfrom->vRecvGetData.empty())
+    int64_t nNow = GetTimeMicros();
+    if (!pfrom->vRecvGetData.empty()
+        && pfrom->nGetDataDeferUntil <= nNow)
         ProcessGetData(pfrom);
 
-    // this maintains the order of responses
-    if (!pfrom->vRecvGetData.empty()) return fOk;
+    // this maintains the order of responses, other messages aren't held up while
+    // historical blocks wait for the upload limits
+    if (!pfrom->vRecvGetData.empty()
+        && pfrom->nGetDataDeferUntil <= nNow) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -6345,11 +7658,32 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        if (strCommand == "lz4msg")
+        {
+            if (!(nLocalServices & NODE_COMPRESS)
+                || !DecompressMessage(vRecv, strCommand))
+            {
+                LogPrintf("ProcessMessages(%s, %u bytes) : bad compressed message from peer=%d\n",
+                    strCommand, nMessageSize, pfrom->GetId());
+                pfrom->Misbehaving(20);
+                continue;
+            };
+            nMessageSize = vRecv.size();
+        };
+
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsLockFreeCommand(strCommand))
+            {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else
+            {
+                LOCK(cs_main);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            };
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -6378,6 +7712,9 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        int64_t nTimeEnd = GetTimeMicros();
+        RecordMessageLatency(strCommand, nTimeEnd - msg.nTime, nTimeEnd - nTimeStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
 
@@ -6425,30 +7762,31 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
 
         pto->nPingNonceSent = nonce;
         pto->PushMessage("ping", nonce, nBestHeight);
-
-        // Resend wallet transactions that haven't gotten in a block yet
-        // Except during reindex, importing and IBD, when old wallet
-        // transactions become unconfirmed and spams other nodes.
-        if (!fReindexing && !IsInitialBlockDownload())
-        {
-            ResendWalletTransactions();
-        }
-
     }
 
     TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
     if (!lockMain)
         return true;
 
+    // Resend wallet transactions that haven't gotten in a block yet
+    // Except during reindex, importing and IBD, when old wallet
+    // transactions become unconfirmed and spams other nodes.
+    // -- under cs_main, SendMessages runs on several message handler threads
+    if (pingSend && !fReindexing && !IsInitialBlockDownload())
+        ResendWalletTransactions();
+
     // Address refresh broadcast
     static int64_t nLastRebroadcast;
     if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
     {
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            // Periodically clear setAddrKnown to allow refresh broadcasts
+            // Periodically clear filterAddrKnown to allow refresh broadcasts
             if (nLastRebroadcast)
-                pnode->setAddrKnown.clear();
+            {
+                LOCK(pnode->cs_addrSend);
+                pnode->filterAddrKnown.reset();
+            }
 
             // Rebroadcast our address
             if (!fNoListen)
@@ -6466,25 +7804,29 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
     //
     if (fSendTrickle)
     {
+        // -- other peers' "addr" relay pushes to vAddrToSend concurrently, take it under the lock
+        vector<CAddress> vAddrQueued;
         vector<CAddress> vAddr;
-        vAddr.reserve(pto->vAddrToSend.size());
-        BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
         {
-            // returns true if wasn't already contained in the set
-            if (pto->setAddrKnown.insert(addr).second)
+            LOCK(pto->cs_addrSend);
+            vAddrQueued.swap(pto->vAddrToSend);
+            vAddr.reserve(vAddrQueued.size());
+            BOOST_FOREACH(const CAddress& addr, vAddrQueued)
             {
-                vAddr.push_back(addr);
-                // receiver rejects addr messages larger than 1000
-                if (vAddr.size() >= 1000)
+                std::vector<unsigned char> vKey = addr.GetKey();
+                if (!pto->filterAddrKnown.contains(vKey))
                 {
-                    pto->PushMessage("addr", vAddr);
-                    vAddr.clear();
+                    pto->filterAddrKnown.insert(vKey);
+                    vAddr.push_back(addr);
                 }
             }
         }
-        pto->vAddrToSend.clear();
-        if (!vAddr.empty())
-            pto->PushMessage("addr", vAddr);
+        // receiver rejects addr messages larger than 1000
+        for (size_t i = 0; i < vAddr.size(); i += 1000)
+        {
+            vector<CAddress> vBatch(vAddr.begin() + i, vAddr.begin() + std::min(vAddr.size(), i + 1000));
+            pto->PushMessage("addr", vBatch);
+        }
     }
 
 
@@ -6500,7 +7842,7 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
         vInvWait.reserve(pto->vInventoryToSend.size());
         BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
         {
-            if (pto->setInventoryKnown.count(inv))
+            if (pto->filterInventoryKnown.contains(inv.hash, inv.type))
                 continue;
 
             // trickle out tx inv to protect privacy
@@ -6530,9 +7872,9 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
                 }
             }
 
-            // returns true if wasn't already contained in the set
-            if (pto->setInventoryKnown.insert(inv).second)
+            if (!pto->filterInventoryKnown.contains(inv.hash, inv.type))
             {
+                pto->filterInventoryKnown.insert(inv.hash, inv.type);
                 vInv.push_back(inv);
                 if (vInv.size() >= 1000)
                 {
@@ -6546,6 +7888,37 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
     if (!vInv.empty())
         pto->PushMessage("inv", vInv);
 
+    //
+    // Message: reqrecon (transaction reconciliation)
+    //
+    {
+        bool fRequest = false;
+        uint16_t nSetSize, nQ;
+        std::vector<uint256> vAnnounce;
+        {
+            LOCK(pto->cs_inventory);
+            CTxReconState& recon = pto->txrecon;
+            int64_t nNowMicros = GetTimeMicros();
+            if (recon.fEnabled)
+            {
+                if (recon.CheckTimeout(nNowMicros, vAnnounce))
+                    LogPrint("net", "reconciliation with peer %d timed out\n", pto->GetId());
+
+                if (recon.fInitiator
+                    && !recon.fRoundActive
+                    && nNowMicros >= recon.nNextRound)
+                {
+                    TxReconDropKnown(pto);
+                    recon.StartRound(nNowMicros, nSetSize, nQ);
+                    fRequest = true;
+                };
+            };
+        }
+        if (fRequest)
+            pto->PushMessage("reqrecon", nSetSize, nQ);
+        PushTxReconAnnounce(pto, vAnnounce);
+    }
+
     int64_t nTimeNow = GetTime();
     std::vector<CInv> vGetFilteredBlocks;
 
@@ -6718,6 +8091,30 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
     };
 
 
+    //
+    // Message: getdata (compact blocks the peer didn't complete)
+    //
+    for (std::map<uint256, CPartialBlockRequest>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+    {
+        int64_t nAge = GetTime() - mi->second.nTime;
+        if (mi->second.nodeId == pto->GetId()
+            && nAge > PARTIAL_BLOCK_TIMEOUT)
+        {
+            LogPrint("net", "blocktxn for %s timed out, requesting full block\n", mi->first.ToString());
+            RequestFullBlock(pto, mi->first);
+            mapPartialBlocks.erase(mi++);
+            continue;
+        };
+
+        // -- peer disconnected
+        if (nAge > 2 * PARTIAL_BLOCK_TIMEOUT)
+        {
+            mapPartialBlocks.erase(mi++);
+            continue;
+        };
+        ++mi;
+    };
+
     //
     // Message: getdata
     //
@@ -6735,6 +8132,12 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
             LogPrint("net", "sending getdata: %s\n", inv.ToString());
 
             vGetData.push_back(inv);
+
+            // -- new blocks from compact peers are fetched as cmpctblock
+            if (inv.type == MSG_BLOCK
+                && pto->fSupportsCompact
+                && !IsInitialBlockDownload())
+                vGetData.back().type = MSG_CMPCT_BLOCK;
             if (vGetData.size() >= 1000)
             {
                 pto->PushMessage("getdata", vGetData);
@@ -6748,9 +8151,55 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
     if (!vGetData.empty())
         pto->PushMessage("getdata", vGetData);
 
+    //
+    // Message: getheaders, getdata (headers-first block download)
+    //
+    if (IsHeadersFirstPeer(pto)
+        && !fImporting && !fReindexing)
+    {
+        while (!blockDownload.Empty()
+            && mapBlockIndex.count(blockDownload.Front().hash))
+            blockDownload.PopFront();
+
+        blockDownload.CheckTimeouts(nTimeNow);
+        if (blockDownload.PopMisbehaving(pto->GetId()))
+        {
+            LogPrintf("Peer %s sent headers for blocks that couldn't be downloaded.\n", pto->addr.ToString());
+            pto->Misbehaving(100);
+            return true;
+        };
+
+        if (blockDownload.PopStalling(pto->GetId()))
+        {
+            LogPrintf("Peer %s is stalling block download, disconnecting.\n", pto->addr.ToString());
+            pto->fDisconnect = true;
+            return true;
+        };
+
+        int nHeadersHeight = blockDownload.Empty() ? nBestHeight : blockDownload.Back().nHeight;
+        if ((nodeHeadersSync == -1 || nTimeNow - nTimeHeadersSync > HEADERS_SYNC_TIMEOUT)
+            && blockDownload.Size() < MAX_HEADERS_AHEAD / 2
+            && pto->nChainHeight > nHeadersHeight
+            && (!blockDownload.Empty() || pto->nChainHeight > nBestHeight + HEADERS_FIRST_MIN_BEHIND))
+            RequestHeaders(pto);
+
+        std::vector<uint256> vBlocks;
+        blockDownload.GetBlocksToRequest(pto->GetId(), nTimeNow, vBlocks);
+        if (!vBlocks.empty())
+        {
+            std::vector<CInv> vGetBlocks;
+            BOOST_FOREACH(const uint256& hash, vBlocks)
+                vGetBlocks.push_back(CInv(MSG_BLOCK, hash));
+
+            LogPrint("net", "requesting %u blocks from peer %d, %d in flight\n", vGetBlocks.size(), pto->GetId(), blockDownload.GetInFlight(pto->GetId()));
+            pto->PushMessage("getdata", vGetBlocks);
+        };
+    };
+
     // - If syncing and !get mblk in MBLK_RECEIVE_TIMEOUT send another getblocks to random peer
     if (nNodeMode == NT_FULL
         && nTimeLastMblkRecv > 0
+        && blockDownload.Empty()
         && pto->nChainHeight - nBestHeight > 256
         && nTimeNow - nTimeLastMblkRecv > MBLK_RECEIVE_TIMEOUT)
     {
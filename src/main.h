@@ -17,6 +17,7 @@
 #include "addressindex.h"
 #include "timestampindex.h"
 
+#include <atomic>
 #include <list>
 
 class CWallet;
@@ -41,12 +42,24 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocksmib, maximum number of memory to keep orphan blocks */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 40;
+/** Default for -persistmempool, dump the mempool to mempool.dat on shutdown and reload it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Number of transactions re-accepted per cs_main acquisition when loading mempool.dat */
+static const unsigned int MEMPOOL_LOAD_BATCH = 64;
+/** Upper limit and default for -txprevalidatethreads, when more cores are available */
+static const int MAX_TX_PREVALIDATE_THREADS = 8;
+/** Transactions waiting for pre-validation before the message handler processes them inline */
+static const unsigned int MAX_TX_PREVALIDATE_QUEUE = 5000;
 static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_GETHEADERS_SZ = 2000;
 
 static const unsigned int MAX_MULTI_BLOCK_SIZE = 5120000;    // 5MiB, most likely to hit MAX_MULTI_BLOCK_ELEMNTS first
 static const unsigned int MAX_MULTI_BLOCK_ELEMENTS = 64;     // processing larger blocks is cpu intensive
 static const unsigned int MAX_MULTI_BLOCK_THIN_ELEMENTS = 128;
+/** Blocks older than this are historical, served within -maxuploadtarget and -maxpeeruploadrate */
+static const int64_t HISTORICAL_BLOCK_AGE = 60 * 60 * 24;
+/** Micros before deferred historical getdata is tried again when the peer's send queue is the limit */
+static const int64_t GETDATA_DEFER_INTERVAL = 100 * 1000;
 
 static const bool DEFAULT_ADDRESSINDEX = false;
 static const bool DEFAULT_TIMESTAMPINDEX = false;
@@ -93,6 +106,7 @@ extern int64_t nLastCoinStakeSearchInterval;
 extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
+extern std::atomic<bool> fMempoolLoaded;
 extern bool fAddressIndex;
 extern bool fSpentIndex;
 extern bool fTimestampIndex;
@@ -104,7 +118,7 @@ struct COrphanBlock {
     std::pair<COutPoint, unsigned int> stake;
     std::vector<unsigned char> vchBlock;
 };
-extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
+extern salted_hash_map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern std::map<uint256, CBlockThin*> mapOrphanBlockThins;
 
 extern std::map<int64_t, CAnonOutputCount> mapAnonOutputStats;
@@ -143,6 +157,14 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
 
 bool LoadExternalBlockFile(int nFile, FILE* fileIn);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+void ThreadLoadMempool(CWallet* pwallet);
+
+/** Dump the mempool and its key image reservations to mempool.dat */
+bool DumpMempool();
+/** Re-accept the transactions in mempool.dat */
+bool LoadMempool();
+/** Start the workers verifying peer transactions before they are accepted under cs_main */
+void StartTxPreValidation(boost::thread_group& threadGroup);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -514,7 +536,9 @@ protected:
 };
 
 
-bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB& txdb, bool *pfMissingInputs=NULL);
+bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB& txdb, bool *pfMissingInputs=NULL, bool fPreValidated=false);
+/** Context free checks and ring signature/ECDSA verification, runs without cs_main */
+bool PreValidateTransaction(CTransaction &tx);
 
 
 
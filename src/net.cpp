@@ -8,11 +8,22 @@
 #include "init.h"
 #include "strlcpy.h"
 #include "addrman.h"
+#include "anonymize.h"
 #include "ui_interface.h"
+#include "lz4/lz4.h"
 #include <sys/stat.h>
+#include <atomic>
+#include <limits>
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #ifdef USE_UPNP
@@ -57,8 +68,15 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
+#ifdef __linux__
+static std::atomic<int> hEpollSocket(-1);   // epoll set of the socket thread, -1 when select is used
+static std::atomic<int> hSocketWake(-1);    // eventfd in hEpollSocket, wakes the socket thread
+static std::vector<CNode*> vNodesEpollNew;  // added to vNodes since the socket thread last looked, guarded by cs_vNodes
+#endif
 CCriticalSection cs_connectNode;
-map<CInv, CDataStream> mapRelay;
+static std::set<std::string> setConnecting;                                 // addresses being connected to, guarded by cs_connectNode
+static std::map<std::vector<unsigned char>, int> mapConnectingGroups;      // network groups of setConnecting
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -66,6 +84,48 @@ map<CInv, int64_t> mapAlreadyAskedFor;
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
 
+// requires LOCK(cs_vNodes)
+static void AddNode(CNode* pnode)
+{
+    vNodes.push_back(pnode);
+#ifdef __linux__
+    if (hEpollSocket >= 0)
+    {
+        vNodesEpollNew.push_back(pnode);
+        WakeSocketHandler();
+    };
+#endif
+}
+
+void WakeSocketHandler()
+{
+#ifdef __linux__
+    int hWake = hSocketWake;
+    uint64_t nOne = 1;
+    if (hWake >= 0
+        && write(hWake, &nOne, sizeof(nOne)) != sizeof(nOne)
+        && errno != EAGAIN)
+        LogPrintf("WakeSocketHandler write failed: %d\n", errno);
+#endif
+}
+
+#ifdef __linux__
+// requires LOCK(pnode->cs_vSend)
+static bool SetEpollEvents(CNode* pnode, int nOp, bool fOut)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (fOut ? (uint32_t)EPOLLOUT : 0);
+    ev.data.u64 = pnode->GetId();
+    if (epoll_ctl(hEpollSocket, nOp, pnode->hSocket, &ev) != 0)
+    {
+        LogPrint("net", "epoll_ctl %s failed for peer %d: %d\n", nOp == EPOLL_CTL_ADD ? "add" : "mod", pnode->GetId(), errno);
+        return false;
+    };
+    pnode->fEpollOut = fOut;
+    return true;
+}
+#endif
+
 set<CNetAddr> setservAddNodeAddresses;
 CCriticalSection cs_setservAddNodeAddresses;
 
@@ -372,6 +432,11 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundLimit = 0;
+int64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+
+int64_t nMaxPeerUploadRate = 0;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -407,25 +472,33 @@ CNode* FindNode(const CService& addr)
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     // ConnectNode is called from multiple threads (ThreadOpenConnections, ThreadOpenAddedConnections)
-    // each thread must run  duplicate, connect and push to vNodes together
-    // or it's possible to connect to the same peer twice
-    // don't want to lock cs_vNodes as ConnectSocket may be slow
-    LOCK(cs_connectNode);
+    // an address is claimed in setConnecting before connecting or it's possible to connect to
+    // the same peer twice, cs_connectNode isn't held while connecting as onion circuits take seconds
+    std::string strConnecting = pszDest ? std::string(pszDest) : addrConnect.ToStringIPPort();
+    {
+        LOCK(cs_connectNode);
 
-    if (pszDest == NULL) {
+        if (pszDest == NULL) {
 
-        if (IsLocal(addrConnect))
-            return NULL;
+            if (IsLocal(addrConnect))
+                return NULL;
 
-        // Look for an existing connection
-        CNode* pnode = FindNode((CService)addrConnect);
-        if (pnode)
-        {
-            pnode->AddRef();
-            return pnode;
+            // Look for an existing connection
+            CNode* pnode = FindNode((CService)addrConnect);
+            if (pnode)
+            {
+                pnode->AddRef();
+                return pnode;
+            }
         }
+
+        if (!setConnecting.insert(strConnecting).second)
+            return NULL;
+        if (pszDest == NULL)
+            mapConnectingGroups[addrConnect.GetGroup()]++;
     }
 
+    MarkTorStartup(TOR_FIRST_ATTEMPT);
 
     /// debug print
     LogPrint("net", "trying connection %s lastseen=%.1fhrs\n",
@@ -435,8 +508,25 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     // Connect
     SOCKET hSocket;
     bool proxyConnectionFailed = false;
-    if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
-                  ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
+    bool fConnected = pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
+                                ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed);
+
+    // -- failures aren't held against an address until Tor has made a connection, a bootstrapping
+    //    Tor fails circuits to peers that are fine
+    bool fTorReady = IsTorStartupMarked(TOR_FIRST_CONNECT);
+    if (fConnected)
+        MarkTorStartup(TOR_FIRST_CONNECT);
+
+    LOCK(cs_connectNode);
+    setConnecting.erase(strConnecting);
+    if (pszDest == NULL)
+    {
+        std::map<std::vector<unsigned char>, int>::iterator mi = mapConnectingGroups.find(addrConnect.GetGroup());
+        if (mi != mapConnectingGroups.end() && --mi->second <= 0)
+            mapConnectingGroups.erase(mi);
+    }
+
+    if (fConnected)
     {
         addrman.Attempt(addrConnect);
 
@@ -458,12 +548,12 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 
         {
             LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
+            AddNode(pnode);
         }
 
         pnode->nTimeConnected = GetTime();
         return pnode;
-    } else if (!proxyConnectionFailed) {
+    } else if (!proxyConnectionFailed && fTorReady) {
         // If connecting to the node failed, and failure is not caused by a problem connecting to
         // the proxy, mark this as an attempt.
         addrman.Attempt(addrConnect);
@@ -624,6 +714,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nMisbehavior);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nHistoricalBytes);
+    X(nGetDataDeferred);
+    stats.fTxReconcile = txrecon.fEnabled;
+    X(fCompress);
     stats.fSyncNode = (this == pnodeSync);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -678,31 +772,54 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvDirect(unsigned int& nBytes)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.complete()
+        || msg.hdr.nMessageSize - msg.nDataPos < MIN_RECV_DIRECT)
+        return NULL;
+
+    return msg.GetDataBuffer(nBytes);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedDirect(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.DataReceived(nBytes);
+    if (msg.complete())
+        msg.nTime = GetTimeMicros();
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    memcpy(&pchHdr[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (std::exception &e) {
-        return -1;
-    }
+    // fields are in the order and byte order CMessageHeader serializes them in
+    memcpy(hdr.pchMessageStart, &pchHdr[0], MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, &pchHdr[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    memcpy(&hdr.nMessageSize, &pchHdr[CMessageHeader::MESSAGE_SIZE_OFFSET], CMessageHeader::MESSAGE_SIZE_SIZE);
+    memcpy(&hdr.nChecksum, &pchHdr[CMessageHeader::CHECKSUM_OFFSET], CMessageHeader::CHECKSUM_SIZE);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
         return -1;
 
+    Reserve(std::min(hdr.nMessageSize, MAX_RECV_PREALLOC));
+
     // switch state to reading message data
     in_data = true;
 
@@ -714,48 +831,361 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    // -- space left over from a short direct read is filled first, the rest is appended,
+    //    the buffer is never resized ahead here so it needn't be cleared
+    unsigned int nFill = std::min(nCopy, (unsigned int)vRecv.size() - nDataPos);
+    if (nFill > 0)
+        memcpy(&vRecv[nDataPos], pch, nFill);
+
+    if (nCopy > nFill)
+    {
+        Reserve(nDataPos + nCopy);
+        vRecv.insert(vRecv.end(), pch + nFill, pch + nCopy);
+    };
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nBytes)
+{
+    if (vRecv.size() <= nDataPos)
+    {
+        // Allocate up to 256 KiB ahead, but never more than the total message size.
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + MAX_RECV_PREALLOC);
+        Reserve(nSize);
+        vRecv.resize(nSize);
+    };
+
+    nBytes = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::DataReceived(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    nDataPos += nBytes;
+}
+
+void CNetMessage::Reserve(unsigned int nSize)
+{
+    size_t nCapacity = vRecv.capacity();
+    if (nSize <= nCapacity)
+        return;
+
+    // -- at least double, large messages move a few times only
+    nSize = std::min(std::max((size_t)nSize, 2 * nCapacity), (size_t)hdr.nMessageSize);
+
+    CSerializeData vch;
+    netMessagePool.Get(vch, nSize);
+    vch.insert(vch.end(), vRecv.begin(), vRecv.end());
+    vRecv.swap_buffer(vch);
+    netMessagePool.Put(vch);
+}
+
+
+CNetMessagePool netMessagePool;
+
+// Smallest class holding nSize bytes
+static int GetPoolClass(size_t nSize)
+{
+    int n = CNetMessagePool::MIN_CLASS;
+    while (n <= CNetMessagePool::MAX_CLASS && ((size_t)1 << n) < nSize)
+        n++;
+    return n;
+}
+
+void CNetMessagePool::Get(CSerializeData& vch, size_t nSize)
+{
+    vch.clear();
+
+    int nClass = GetPoolClass(nSize);
+    {
+        LOCK(cs);
+        if (nClass <= MAX_CLASS
+            && !vFree[nClass - MIN_CLASS].empty())
+        {
+            std::vector<CSerializeData>& vList = vFree[nClass - MIN_CLASS];
+            vch.swap(vList.back());
+            vList.pop_back();
+            nFreeBytes -= vch.capacity();
+            nReused++;
+            return;
+        };
+        nAllocated++;
+    }
+
+    vch.reserve(nClass <= MAX_CLASS ? (size_t)1 << nClass : nSize);
+}
+
+void CNetMessagePool::Put(CSerializeData& vch)
+{
+    size_t nCapacity = vch.capacity();
+    if (nCapacity == 0)
+        return;
+
+    // -- largest class the buffer covers
+    int nClass = MIN_CLASS;
+    while (nClass < MAX_CLASS && ((size_t)1 << (nClass + 1)) <= nCapacity)
+        nClass++;
+
+    vch.clear();
+    {
+        LOCK(cs);
+        std::vector<CSerializeData>& vList = vFree[nClass - MIN_CLASS];
+        if (nCapacity >= ((size_t)1 << MIN_CLASS)
+            && nCapacity < ((size_t)2 << MAX_CLASS)
+            && nFreeBytes + nCapacity <= MAX_FREE_BYTES
+            && vList.size() < MAX_FREE_PER_CLASS)
+        {
+            vList.push_back(CSerializeData());
+            vList.back().swap(vch);
+            nFreeBytes += nCapacity;
+            return;
+        };
+        nDropped++;
+    }
+
+    CSerializeData().swap(vch);
+}
+
+size_t CNetMessagePool::GetFreeBytes()
+{
+    LOCK(cs);
+    return nFreeBytes;
+}
+
+
+
+
+
+
+
+
+
+void SetMessageHeaderChecksum(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+CSharedMessage FinishSharedMessage(CDataStream& ss)
+{
+    SetMessageHeaderChecksum(ss);
+    RecordSendQueued(&ss[MESSAGE_START_SIZE], ss.size(), false);
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.swap_buffer(*pdata);
+    return CSharedMessage(pdata);
+}
+
+
+static CCriticalSection cs_sendQueueStats;
+static CSendQueueStats sendQueueStats;
+
+static bool IsBlockCommand(const char* pchCommand)
+{
+    static const char* vBlockCommands[] = { "block", "mblk", "cmpctblock", "blocktxn" };
+    for (size_t i = 0; i < sizeof(vBlockCommands) / sizeof(vBlockCommands[0]); ++i)
+        if (strncmp(pchCommand, vBlockCommands[i], CMessageHeader::COMMAND_SIZE) == 0)
+            return true;
+    return false;
+}
+
+void RecordSendQueued(const char* pchCommand, size_t nBytes, bool fShared)
+{
+    if (nBytes >= CMessageHeader::HEADER_SIZE + CMessageHeader::COMMAND_SIZE
+        && strncmp(pchCommand, "lz4msg", CMessageHeader::COMMAND_SIZE) == 0)
+        pchCommand += CMessageHeader::HEADER_SIZE - MESSAGE_START_SIZE;
+    bool fBlock = IsBlockCommand(pchCommand);
+
+    LOCK(cs_sendQueueStats);
+    if (fShared)
+    {
+        sendQueueStats.nBytesShared += nBytes;
+        if (fBlock)
+            sendQueueStats.nBlockBytesShared += nBytes;
+    } else
+    {
+        sendQueueStats.nBytesCopied += nBytes;
+        if (fBlock)
+            sendQueueStats.nBlockBytesCopied += nBytes;
+    };
+}
+
+void RecordBlockRelayed()
+{
+    LOCK(cs_sendQueueStats);
+    sendQueueStats.nBlocksRelayed++;
+}
+
+void GetSendQueueStats(CSendQueueStats& stats)
+{
+    LOCK(cs_sendQueueStats);
+    stats = sendQueueStats;
+}
+
+
+static CCriticalSection cs_compressionStats;
+static CCompressionStats compressionStats;
+
+// -- lz4msg payload: command, payload size, LZ4 block
+static const unsigned int COMPRESS_HEADER_SIZE = CMessageHeader::COMMAND_SIZE + sizeof(uint32_t);
+
+bool IsCompressibleCommand(const char* pchCommand)
+{
+    static const char* vCompressCommands[] = { "block", "mblk", "mblkt", "headers" };
+    for (size_t i = 0; i < sizeof(vCompressCommands) / sizeof(vCompressCommands[0]); ++i)
+        if (strncmp(pchCommand, vCompressCommands[i], CMessageHeader::COMMAND_SIZE) == 0)
+            return true;
+    return false;
+}
+
+bool CompressMessage(CDataStream& ss)
+{
+    if (ss.size() < CMessageHeader::HEADER_SIZE + MIN_COMPRESS_SIZE
+        || ss.size() > CMessageHeader::HEADER_SIZE + MAX_SIZE
+        || !IsCompressibleCommand(&ss[MESSAGE_START_SIZE]))
+        return false;
+
+    uint32_t nRawSize = ss.size() - CMessageHeader::HEADER_SIZE;
+
+    CDataStream ssOut(ss.GetType(), ss.GetVersion());
+    ssOut << CMessageHeader("lz4msg", 0);
+    ssOut.write(&ss[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    ssOut << nRawSize;
+
+    // -- not worth the peer's time unless at least 1/16 is saved
+    size_t nOffset = ssOut.size();
+    int nMaxOut = nRawSize - nRawSize / 16 - COMPRESS_HEADER_SIZE;
+    ssOut.resize(nOffset + nMaxOut);
+    int nOut = LZ4_compress_limitedOutput(&ss[CMessageHeader::HEADER_SIZE], &ssOut[nOffset], nRawSize, nMaxOut);
+    if (nOut <= 0)
+    {
+        LOCK(cs_compressionStats);
+        compressionStats.nSentSkipped++;
+        return false;
+    };
+    ssOut.resize(nOffset + nOut);
+
+    {
+        LOCK(cs_compressionStats);
+        compressionStats.nSentRaw += nRawSize;
+        compressionStats.nSentWire += nOut + COMPRESS_HEADER_SIZE;
+    }
+
+    CSerializeData vch;
+    ssOut.swap_buffer(vch);
+    ss.swap_buffer(vch);
+    return true;
+}
+
+CSharedMessage CompressSharedMessage(const CSharedMessage& msg)
+{
+    if (!msg || msg->size() < CMessageHeader::HEADER_SIZE + MIN_COMPRESS_SIZE)
+        return msg;
 
+    CDataStream ss(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    if (!CompressMessage(ss))
+        return msg;
+    return FinishSharedMessage(ss);
+}
 
+bool DecompressMessage(CDataStream& vRecv, std::string& strCommand)
+{
+    if (vRecv.size() < COMPRESS_HEADER_SIZE)
+        return error("DecompressMessage() : short message");
+
+    // -- lz4msg can't nest and only carries commands that would have been compressed
+    const char* pchCommand = &vRecv[0];
+    if (!IsCompressibleCommand(pchCommand))
+        return error("DecompressMessage() : unexpected command");
+
+    uint32_t nRawSize;
+    memcpy(&nRawSize, &vRecv[CMessageHeader::COMMAND_SIZE], sizeof(nRawSize));
+
+    uint32_t nCompressed = vRecv.size() - COMPRESS_HEADER_SIZE;
+    if (nRawSize > MAX_SIZE
+        || nRawSize < nCompressed
+        || (uint64_t)nRawSize > (uint64_t)nCompressed * MAX_LZ4_RATIO + 16)
+        return error("DecompressMessage() : bad size %u, %u compressed", nRawSize, nCompressed);
+
+    CSerializeData vch;
+    netMessagePool.Get(vch, nRawSize);
+    vch.resize(nRawSize);
+    if (LZ4_decompress_safe(&vRecv[COMPRESS_HEADER_SIZE], &vch[0], nCompressed, nRawSize) != (int)nRawSize)
+    {
+        netMessagePool.Put(vch);
+        return error("DecompressMessage() : LZ4_decompress_safe failed");
+    };
 
+    strCommand = std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
 
+    // -- vRecv keeps the payload, its old buffer goes back to the pool
+    vRecv.swap_buffer(vch);
+    netMessagePool.Put(vch);
 
+    {
+        LOCK(cs_compressionStats);
+        compressionStats.nRecvRaw += nRawSize;
+        compressionStats.nRecvWire += nCompressed + COMPRESS_HEADER_SIZE;
+    }
+    return true;
+}
 
+void GetCompressionStats(CCompressionStats& stats)
+{
+    LOCK(cs_compressionStats);
+    stats = compressionStats;
+}
 
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+    while (!pnode->vSendMsg.empty())
+    {
+        size_t nWant;
+#ifdef WIN32
+        const CSerializeData &data = *pnode->vSendMsg.front();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
-        if (nBytes > 0) {
-            pnode->nLastSend = GetTime();
-            pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
-                pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
-            }
-        } else {
+        nWant = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // -- queued messages go out in one sendmsg, shared payloads are sent in place
+        struct iovec vIov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        nWant = 0;
+        for (std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
+            it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++it)
+        {
+            const CSerializeData &data = **it;
+            assert(data.size() > nOffset);
+            vIov[nIov].iov_base = (void*)&data[nOffset];
+            vIov[nIov].iov_len = data.size() - nOffset;
+            nWant += vIov[nIov].iov_len;
+            nIov++;
+            nOffset = 0;
+        };
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes <= 0)
+        {
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
@@ -767,112 +1197,294 @@ void SocketSendData(CNode *pnode)
             }
             // couldn't send anything at all
             break;
-        }
-    }
+        };
+
+        pnode->nLastSend = GetTime();
+        pnode->nSendBytes += nBytes;
+        pnode->RecordBytesSent(nBytes);
+
+        // -- drop the messages sent in full
+        size_t nSent = nBytes;
+        while (nSent > 0)
+        {
+            size_t nSize = pnode->vSendMsg.front()->size();
+            size_t nLeft = nSize - pnode->nSendOffset;
+            if (nSent < nLeft)
+            {
+                pnode->nSendOffset += nSent;
+                break;
+            };
+            nSent -= nLeft;
+            pnode->nSendOffset = 0;
+            pnode->nSendSize -= nSize;
+            pnode->vSendMsg.pop_front();
+        };
+
+        if ((size_t)nBytes < nWant)
+        {
+            // could not send full message; stop sending more
+            break;
+        };
+    };
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+#ifdef __linux__
+    // -- write interest only while data is queued, the epoll loop finishes partial sends
+    bool fWantOut = !pnode->vSendMsg.empty();
+    if (pnode->fEpollRegistered
+        && pnode->fEpollOut != fWantOut
+        && pnode->hSocket != INVALID_SOCKET)
+        SetEpollEvents(pnode, EPOLL_CTL_MOD, fWantOut);
+#endif
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void DisconnectNodes(std::vector<NodeId>* pvRemoved = NULL)
 {
-    unsigned int nPrevNodeCount = 0;
+    static unsigned int nPrevNodeCount = 0;
 
-    while (true)
+    //
+    // Disconnect nodes
+    //
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+#ifdef __linux__
+                vNodesEpollNew.erase(remove(vNodesEpollNew.begin(), vNodesEpollNew.end(), pnode), vNodesEpollNew.end());
+#endif
+                if (pvRemoved)
+                    pvRemoved->push_back(pnode->GetId());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
 
+static void AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
 
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            AddNode(pnode);
+        }
+    }
+}
+
+enum
+{
+    SOCKET_RECV_DONE,       // nothing more to read, or the node is disconnecting
+    SOCKET_RECV_MORE,       // the buffer was filled, more data may be waiting
+    SOCKET_RECV_BLOCKED,    // cs_vRecvMsg was busy, try again later
+};
+
+static int SocketRecvData(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return SOCKET_RECV_BLOCKED;
+
+    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+        pnode->CloseSocketDisconnect();
+        return SOCKET_RECV_DONE;
+    }
+
+    // -- the rest of a large message is read straight into it, small messages are
+    //    read in batches and copied out
+    unsigned int nDirect = 0;
+    char* pchDirect = pnode->GetRecvDirect(nDirect);
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    unsigned int nWant = pchDirect ? nDirect : sizeof(pchBuf);
+    int nBytes = recv(pnode->hSocket, pchDirect ? pchDirect : pchBuf, nWant, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchDirect)
+            pnode->ReceivedDirect(nBytes);
+        else
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+            WakeMessageHandler(pnode->GetId());
+        return nBytes == (int)nWant && pnode->hSocket != INVALID_SOCKET ? SOCKET_RECV_MORE : SOCKET_RECV_DONE;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return SOCKET_RECV_DONE;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+static void ThreadSocketHandlerSelect()
+{
+    while (true)
+    {
+        DisconnectNodes();
+
+        //
+        // Find which sockets have data to receive
+        //
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        bool have_fds = false;
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+            FD_SET(hListenSocket, &fdsetRecv);
+            hSocketMax = max(hSocketMax, hListenSocket);
+            have_fds = true;
+        }
+        {
+            LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
@@ -916,51 +1528,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -983,48 +1552,7 @@ void ThreadSocketHandler()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode);
 
             //
             // Send
@@ -1041,30 +1569,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-				else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1076,9 +1581,355 @@ void ThreadSocketHandler()
     } // main loop
 }
 
+#ifdef __linux__
+/** Edge triggered epoll loop.
+ *
+ *  Nodes are registered once, when they're added to vNodes, and only touched when epoll
+ *  reports them ready. SocketSendData sets write interest while data is queued. Edge
+ *  triggered events aren't repeated: nodes left readable after EPOLL_MAX_READS are read
+ *  again on the next pass, nodes whose cs_vRecvMsg or cs_vSend was held wait until the
+ *  holder wakes the loop through ReleaseSocketWait.
+ */
+static const int EPOLL_MAX_EVENTS = 256;
+static const int EPOLL_MAX_READS = 16;              // recv calls per node per pass, keeps busy peers from starving others
+static const int64_t EPOLL_HOUSEKEEPING_MS = 100;   // disconnects, inactivity and a retry for missed wakes
+static const uint64_t EPOLL_LISTEN_TAG = 1ULL << 63;
+static const uint64_t EPOLL_WAKE_TAG = 1ULL << 62;
+
+static void ThreadSocketHandlerEpoll()
+{
+    std::map<NodeId, CNode*> mapRegistered;         // valid until DisconnectNodes reports them removed
+    std::set<NodeId> setRecvReady;                  // readable, or data left after EPOLL_MAX_READS
+    std::set<NodeId> setRecvWaiting, setSendWaiting;    // lock was held, tried again when woken
+    std::vector<struct epoll_event> vEvents(EPOLL_MAX_EVENTS);
+    int64_t nNextHousekeeping = 0;
+    int64_t nLastInactivityCheck = 0;
+
+    for (unsigned int i = 0; i < vhListenSocket.size(); ++i)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EPOLL_LISTEN_TAG | i;
+        if (epoll_ctl(hEpollSocket, EPOLL_CTL_ADD, vhListenSocket[i], &ev) != 0)
+            LogPrintf("epoll_ctl add listen socket failed: %d\n", errno);
+    };
+
+    while (true)
+    {
+        //
+        // Register new nodes
+        //
+        std::vector<CNode*> vNew;
+        {
+            LOCK(cs_vNodes);
+            vNew.swap(vNodesEpollNew);
+        }
+        BOOST_FOREACH(CNode* pnode, vNew)
+        {
+            mapRegistered[pnode->GetId()] = pnode;
+
+            LOCK(pnode->cs_vSend);
+            if (pnode->hSocket == INVALID_SOCKET
+                || !SetEpollEvents(pnode, EPOLL_CTL_ADD, !pnode->vSendMsg.empty()))
+                continue;
+            pnode->fEpollRegistered = true;
+
+            // -- a new socket may already hold data, the edge was before it was registered
+            setRecvReady.insert(pnode->GetId());
+        };
+
+        bool fRetryWaiting = false;
+        int64_t nNowMillis = GetTimeMillis();
+        if (nNowMillis >= nNextHousekeeping)
+        {
+            nNextHousekeeping = nNowMillis + EPOLL_HOUSEKEEPING_MS;
+            fRetryWaiting = true;
+
+            // -- closed sockets leave the epoll set with the close
+            std::vector<NodeId> vRemoved;
+            DisconnectNodes(&vRemoved);
+            BOOST_FOREACH(NodeId id, vRemoved)
+            {
+                mapRegistered.erase(id);
+                setRecvReady.erase(id);
+                setRecvWaiting.erase(id);
+                setSendWaiting.erase(id);
+            };
+
+            int64_t nNow = GetTime();
+            if (nNow != nLastInactivityCheck)
+            {
+                nLastInactivityCheck = nNow;
+                for (std::map<NodeId, CNode*>::iterator mi = mapRegistered.begin(); mi != mapRegistered.end(); ++mi)
+                    InactivityCheck(mi->second);
+            };
+        };
+
+        int nTimeout = setRecvReady.empty() ? (int)std::max((int64_t)0, nNextHousekeeping - GetTimeMillis()) : 0;
+        int nEvents = epoll_wait(hEpollSocket, &vEvents[0], vEvents.size(), nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            };
+            nEvents = 0;
+        };
+
+        std::set<NodeId> setSendReady;
+        for (int i = 0; i < nEvents; ++i)
+        {
+            const struct epoll_event& ev = vEvents[i];
+            if (ev.data.u64 & EPOLL_WAKE_TAG)
+            {
+                uint64_t nCount;
+                if (read(hSocketWake, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                    LogPrintf("socket wake read failed: %d\n", errno);
+                fRetryWaiting = true;
+                continue;
+            };
+
+            if (ev.data.u64 & EPOLL_LISTEN_TAG)
+            {
+                unsigned int nListen = ev.data.u64 & ~EPOLL_LISTEN_TAG;
+                if (nListen < vhListenSocket.size())
+                    AcceptConnection(vhListenSocket[nListen]);
+                continue;
+            };
+
+            NodeId id = ev.data.u64;
+            if (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                setRecvReady.insert(id);
+            if (ev.events & EPOLLOUT)
+                setSendReady.insert(id);
+        };
+
+        if (fRetryWaiting)
+        {
+            setRecvReady.insert(setRecvWaiting.begin(), setRecvWaiting.end());
+            setRecvWaiting.clear();
+            setSendReady.insert(setSendWaiting.begin(), setSendWaiting.end());
+            setSendWaiting.clear();
+        };
+
+        //
+        // Receive
+        //
+        for (std::set<NodeId>::iterator it = setRecvReady.begin(); it != setRecvReady.end(); )
+        {
+            std::map<NodeId, CNode*>::iterator mi = mapRegistered.find(*it);
+            if (mi == mapRegistered.end())
+            {
+                setRecvReady.erase(it++);
+                continue;
+            };
+
+            // -- set before trying the lock, so a holder releasing it after a failed try wakes the loop
+            CNode* pnode = mi->second;
+            pnode->fSocketWaiting = true;
+
+            int nResult = SOCKET_RECV_DONE;
+            for (int nReads = 0; nReads < EPOLL_MAX_READS && pnode->hSocket != INVALID_SOCKET; ++nReads)
+                if ((nResult = SocketRecvData(pnode)) != SOCKET_RECV_MORE)
+                    break;
+
+            if (nResult == SOCKET_RECV_BLOCKED)
+            {
+                setRecvWaiting.insert(*it);
+                setRecvReady.erase(it++);
+                continue;
+            };
+
+            if (!setSendWaiting.count(*it))
+                pnode->fSocketWaiting = false;
+
+            if (nResult == SOCKET_RECV_DONE || pnode->hSocket == INVALID_SOCKET)
+                setRecvReady.erase(it++);
+            else
+                ++it;
+        };
+
+        //
+        // Send
+        //
+        BOOST_FOREACH(NodeId id, setSendReady)
+        {
+            std::map<NodeId, CNode*>::iterator mi = mapRegistered.find(id);
+            if (mi == mapRegistered.end())
+                continue;
+
+            CNode* pnode = mi->second;
+            pnode->fSocketWaiting = true;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend)
+            {
+                setSendWaiting.insert(id);
+                continue;
+            };
+            if (!setRecvWaiting.count(id))
+                pnode->fSocketWaiting = false;
+
+            // -- a partial send leaves write interest set, epoll reports when the buffer drains
+            if (pnode->hSocket != INVALID_SOCKET)
+                SocketSendData(pnode);
+        };
+    } // main loop
+}
+#endif // __linux__
+
+void ThreadSocketHandler()
+{
+#ifdef __linux__
+    if (GetBoolArg("-useepoll", true))
+    {
+        int hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        int hWake = hEpoll >= 0 ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = EPOLL_WAKE_TAG;
+        if (hWake >= 0
+            && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWake, &ev) == 0)
+        {
+            LogPrintf("ThreadSocketHandler using epoll\n");
+            {
+                LOCK(cs_vNodes);
+                hEpollSocket = hEpoll;
+                hSocketWake = hWake;
+                vNodesEpollNew = vNodes;
+            }
+            try
+            {
+                ThreadSocketHandlerEpoll();
+            } catch (...)
+            {
+                {
+                    LOCK(cs_vNodes);
+                    hEpollSocket = -1;
+                    hSocketWake = -1;
+                    vNodesEpollNew.clear();
+                }
+                close(hWake);
+                close(hEpoll);
+                throw;
+            }
+            return;
+        };
+        LogPrintf("epoll setup failed: %d, falling back to select\n", errno);
+        if (hWake >= 0)
+            close(hWake);
+        if (hEpoll >= 0)
+            close(hEpoll);
+    };
+#endif
+
+    ThreadSocketHandlerSelect();
+}
+
 
 /* Tor implementation ---------------------------------*/
 
+static int64_t nNetStartTime = GetTimeMillis();
+static CCriticalSection cs_torStartup;
+static CTorStartupTimes torStartup;
+
+void MarkTorStartup(int nPhase)
+{
+    LOCK(cs_torStartup);
+    if (torStartup.vPhase[nPhase] != 0)
+        return;
+    torStartup.vPhase[nPhase] = std::max((int64_t)1, GetTimeMillis() - nNetStartTime);
+    LogPrint("net", "Startup phase %s reached after %dms\n", GetTorStartupPhaseName(nPhase), torStartup.vPhase[nPhase]);
+}
+
+bool IsTorStartupMarked(int nPhase)
+{
+    LOCK(cs_torStartup);
+    return torStartup.vPhase[nPhase] != 0;
+}
+
+void GetTorStartupTimes(CTorStartupTimes& times)
+{
+    LOCK(cs_torStartup);
+    times = torStartup;
+}
+
+const char* GetTorStartupPhaseName(int nPhase)
+{
+    switch (nPhase)
+    {
+        case TOR_LAUNCHED:          return "tor_launched";
+        case TOR_HOSTNAME:          return "onion_hostname";
+        case TOR_SEEDED:            return "onion_seeded";
+        case TOR_FIRST_ATTEMPT:     return "first_attempt";
+        case TOR_FIRST_CONNECT:     return "first_connect";
+        case TOR_FIRST_PEER:        return "first_peer";
+    };
+    return "unknown";
+}
+
+/** Check the Tor state kept in the data directory between runs before Tor starts.
+ *  Returns true if Tor can start from its cached consensus instead of a full bootstrap.
+ */
+bool PrepareTorDataDir()
+{
+    fs::path tor_dir(anonymize_tor_data_directory());
+    fs::path onion_dir(anonymize_service_directory());
+
+    bool fWarm = false;
+    try
+    {
+        fs::create_directories(onion_dir);
+#ifndef WIN32
+        // -- Tor won't start on directories others can read, as left by a restored backup
+        chmod(tor_dir.string().c_str(), S_IRWXU);
+        chmod(onion_dir.string().c_str(), S_IRWXU);
+#endif
+
+        // -- a hostname without its key is left by an interrupted first run, Tor makes both again
+        if (fs::exists(onion_dir / "hostname")
+            && !fs::exists(onion_dir / "private_key")
+            && !fs::exists(onion_dir / "hs_ed25519_secret_key"))
+        {
+            LogPrintf("Tor: removing onion hostname without a key\n");
+            fs::remove(onion_dir / "hostname");
+        };
+
+        // -- directory caches truncated by a crash are removed and fetched again
+        int64_t nNow = GetTime();
+        for (fs::directory_iterator it(tor_dir); it != fs::directory_iterator(); ++it)
+        {
+            std::string strName = it->path().filename().string();
+            if (strName.compare(0, 7, "cached-") != 0
+                || !fs::is_regular_file(it->status()))
+                continue;
+
+            if (fs::file_size(it->path()) == 0)
+            {
+                LogPrintf("Tor: removing empty %s\n", strName);
+                fs::remove(it->path());
+                continue;
+            };
+
+            if ((strName == "cached-microdesc-consensus" || strName == "cached-consensus")
+                && nNow - (int64_t)fs::last_write_time(it->path()) < TOR_CONSENSUS_MAX_AGE)
+                fWarm = true;
+        };
+    } catch (const fs::filesystem_error& e)
+    {
+        LogPrintf("Tor: checking %s failed: %s\n", tor_dir.string(), e.what());
+    };
+
+    LogPrintf("Tor: %s start from %s\n", fWarm ? "warm" : "cold", tor_dir.string());
+    {
+        LOCK(cs_torStartup);
+        torStartup.fWarmStart = fWarm;
+    }
+    return fWarm;
+}
+
 // hidden service seeds
 static const char *strMainNetOnionSeed[][1] = {
     {"cvb2ovc6tcntozc5.onion"},
@@ -1120,6 +1971,7 @@ void ThreadOnionSeed()
         addrman.Add(addr, parsed);
     }
 
+    MarkTorStartup(TOR_SEEDED);
     printf("%d addresses found from .onion seeds\n", found);
 }
 
@@ -1169,10 +2021,17 @@ void ThreadOnionSeed()
 
 void DumpAddresses()
 {
+    // -- peers.dat is only rewritten if the address tables changed since the last dump
+    static uint64_t nLastModified = std::numeric_limits<uint64_t>::max();
+    uint64_t nModified = addrman.GetModified();
+    if (nModified == nLastModified)
+        return;
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+        nLastModified = nModified;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1196,6 +2055,8 @@ void static ProcessOneShot()
     }
 }
 
+void static ThreadOpenConnectionsLoop();
+
 void ThreadOpenConnections()
 {
     // Connect to specific addresses
@@ -1217,7 +2078,28 @@ void ThreadOpenConnections()
         }
     }
 
-    // Initiate network connections
+    // Initiate network connections, several at once as each onion circuit takes seconds to build.
+    // Until Tor has bootstrapped the attempts go to peers.dat entries, failures aren't counted against them.
+    int nThreads = GetArg("-parallelconnect", DEFAULT_PARALLEL_CONNECTS);
+    nThreads = std::max(1, std::min(nThreads, MAX_PARALLEL_CONNECTS));
+
+    boost::thread_group threadConnect;
+    for (int i = 1; i < nThreads; ++i)
+        threadConnect.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnectionsLoop));
+
+    try
+    {
+        ThreadOpenConnectionsLoop();
+    } catch (boost::thread_interrupted)
+    {
+        threadConnect.interrupt_all();
+        threadConnect.join_all();
+        throw;
+    };
+}
+
+void static ThreadOpenConnectionsLoop()
+{
     int64_t nStart = GetTime();
     while (true)
     {
@@ -1230,11 +2112,11 @@ void ThreadOpenConnections()
 
         // Add seed nodes if DNS seeds are all down (an infrastructure attack?).
         if (addrman.size() == 0 && (GetTime() - nStart > 60)) {
-            static bool done = false;
-            if (!done) {
+            // several opener threads run this loop, only the first to get here adds them
+            static std::atomic<bool> done(false);
+            if (!done.exchange(true)) {
                 LogPrintf("Adding fixed seed nodes as DNS doesn't seem to be available.\n");
                 addrman.Add(Params().FixedSeeds(), CNetAddr("127.0.0.1"));
-                done = true;
             }
         }
 
@@ -1256,6 +2138,12 @@ void ThreadOpenConnections()
                 }
             }
         }
+        {
+            // groups other threads are connecting to
+            LOCK(cs_connectNode);
+            for (std::map<std::vector<unsigned char>, int>::iterator mi = mapConnectingGroups.begin(); mi != mapConnectingGroups.end(); ++mi)
+                setConnected.insert(mi->first);
+        }
 
         int64_t nANow = GetAdjustedTime();
 
@@ -1402,68 +2290,244 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/** Nodes held for the message handler workers, released once the last work item is done */
+class CNodeSnapshot
+{
+public:
+    std::vector<CNode*> vNodes;
+
+    CNodeSnapshot()
+    {
+        LOCK(cs_vNodes);
+        vNodes = ::vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->AddRef();
+    }
+
+    ~CNodeSnapshot()
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->Release();
+    }
+};
+
+class CMessageWork
+{
+public:
+    CNode* pnode;
+    bool fTrickle;
+    boost::shared_ptr<CNodeSnapshot> pSnapshot;
+};
+
+// -- guards the work queue and wake sets, taken last, no other lock is acquired while held
+static boost::mutex mutexMsgHand;
+static boost::condition_variable condMsgHandWake;   // dispatcher
+static boost::condition_variable condMsgHandWork;   // workers
+static std::set<NodeId> setMsgHandWake;             // nodes with complete messages since the last dispatch
+static std::set<NodeId> setMsgHandBusy;             // queued or being processed, one worker per node at a time
+static std::set<NodeId> setMsgHandRewake;           // woken while busy, dispatched again when done
+static std::deque<CMessageWork> vMsgHandQueue;
+
+static CCriticalSection cs_msgLatency;
+static std::map<std::string, CMessageLatency> mapMsgLatency;
+
+void WakeMessageHandler(NodeId nodeId)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+    setMsgHandWake.insert(nodeId);
+    condMsgHandWake.notify_one();
+}
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nLatency, int64_t nProcess)
+{
+    LOCK(cs_msgLatency);
+    std::map<std::string, CMessageLatency>::iterator mi = mapMsgLatency.find(strCommand);
+    if (mi == mapMsgLatency.end())
+    {
+        // -- command names come from the peer, bound the map
+        if (mapMsgLatency.size() >= MAX_MSG_LATENCY_COMMANDS)
+            mi = mapMsgLatency.insert(std::make_pair(std::string("other"), CMessageLatency())).first;
+        else
+            mi = mapMsgLatency.insert(std::make_pair(strCommand, CMessageLatency())).first;
+    };
+    mi->second.Add(nLatency, nProcess);
+}
+
+void GetMessageLatency(std::map<std::string, CMessageLatency>& mapLatency)
+{
+    LOCK(cs_msgLatency);
+    mapLatency = mapMsgLatency;
+}
+
+static bool HaveMessageWork(CNode* pnode)
+{
+    if (pnode->fDisconnect
+        || pnode->nSendSize >= SendBufferSize())
+        return false;
+
+    // -- messages wait behind queued getdata unless it's deferred by the upload limits
+    if (!pnode->vRecvGetData.empty()
+        && pnode->nGetDataDeferUntil <= GetTimeMicros())
+        return true;
+
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete();
+}
+
+// Returns true if the node has more messages waiting
+static bool ProcessNodeMessages(CMessageWork& work)
+{
+    CNode* pnode = work.pnode;
+    if (pnode->fDisconnect)
+        return false;
+
+    bool fMore = false;
+    {
+        LOCK(pnode->cs_vRecvMsg);
+        for (int i = 0; i < MSGHANDLER_BATCH_SIZE; ++i)
+        {
+            if (!ProcessMessages(pnode))
+            {
+                pnode->CloseSocketDisconnect();
+                break;
+            };
+
+            boost::this_thread::interruption_point();
+
+            if (!HaveMessageWork(pnode))
+                break;
+        };
+        fMore = HaveMessageWork(pnode);
+    } // cs_vRecvMsg
+
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SendMessages(pnode, work.pSnapshot->vNodes, work.fTrickle);
+    } // cs_vSend
+    pnode->ReleaseSocketWait();
+
+    return fMore;
+}
+
+static void ThreadMessageWorker()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
-        boost::this_thread::interruption_point();
-        vector<CNode*> vNodesCopy;
+        CMessageWork work;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        } // cs_vNodes
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            while (vMsgHandQueue.empty())
+                condMsgHandWork.wait(lock);
+            work = vMsgHandQueue.front();
+            vMsgHandQueue.pop_front();
+        }
+
+        bool fMore = ProcessNodeMessages(work);
+
+        NodeId nodeId = work.pnode->GetId();
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            setMsgHandBusy.erase(nodeId);
+            if (setMsgHandRewake.erase(nodeId) || fMore)
+            {
+                setMsgHandWake.insert(nodeId);
+                condMsgHandWake.notify_one();
+            };
+        }
+    };
+}
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+/** Hands nodes to the worker threads.
+ *  Every node is queued each 100ms for the send side and trickle, nodes woken by the
+ *  socket thread with complete messages are queued immediately.
+ */
+void ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
 
-        bool fSleep = true;
+    int nThreads = GetArg("-msghandlerthreads", std::min(4, (int)boost::thread::hardware_concurrency()));
+    nThreads = std::max(1, std::min(nThreads, MAX_MSGHANDLER_THREADS));
+    LogPrintf("Using %d message handler threads\n", nThreads);
 
-        //BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    boost::thread_group threadWorkers;
+    for (int i = 0; i < nThreads; ++i)
+        threadWorkers.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
 
-        size_t r = GetRandInt(vNodesCopy.size()-1); // randomise the order
-        for (size_t i = 0; i < vNodesCopy.size(); ++i)
+    int64_t nNextPass = 0;
+    try
+    {
+        while (true)
         {
-            CNode *pnode = vNodesCopy[(i + r) % vNodesCopy.size()];
+            boost::this_thread::interruption_point();
+
+            std::set<NodeId> setWake;
+            {
+                boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+                int64_t nWait = nNextPass - GetTimeMillis();
+                if (setMsgHandWake.empty() && nWait > 0)
+                    condMsgHandWake.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+                setWake.swap(setMsgHandWake);
+            }
 
-            if (pnode->fDisconnect)
+            bool fPass = GetTimeMillis() >= nNextPass;
+            if (fPass)
+                nNextPass = GetTimeMillis() + 100;
+            else
+            if (setWake.empty())
+                continue;
+
+            boost::shared_ptr<CNodeSnapshot> pSnapshot(new CNodeSnapshot());
+            std::vector<CNode*>& vNodesCopy = pSnapshot->vNodes;
+            if (vNodesCopy.empty())
                 continue;
 
-            // Receive messages
+            CNode* pnodeTrickle = fPass ? vNodesCopy[GetRand(vNodesCopy.size())] : NULL;
+
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            size_t r = GetRandInt(vNodesCopy.size()-1); // randomise the order
+            for (size_t i = 0; i < vNodesCopy.size(); ++i)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                CNode *pnode = vNodesCopy[(i + r) % vNodesCopy.size()];
+                NodeId nodeId = pnode->GetId();
 
-                    if (pnode->nSendSize < SendBufferSize() && (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())))
-                        fSleep = false;
-                }
-            } // cs_vRecvMsg
+                if (pnode->fDisconnect)
+                    continue;
 
-            boost::this_thread::interruption_point();
+                bool fWoken = setWake.count(nodeId);
+                if (!fPass && !fWoken)
+                    continue;
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, vNodesCopy, pnode == pnodeTrickle);
-            } // cs_vSend
+                if (setMsgHandBusy.count(nodeId))
+                {
+                    if (fWoken)
+                        setMsgHandRewake.insert(nodeId);
+                    continue;
+                };
+
+                CMessageWork work;
+                work.pnode = pnode;
+                work.fTrickle = pnode == pnodeTrickle;
+                work.pSnapshot = pSnapshot;
+                vMsgHandQueue.push_back(work);
+                setMsgHandBusy.insert(nodeId);
+            };
+            condMsgHandWork.notify_all();
         };
+    } catch (boost::thread_interrupted)
+    {
+        threadWorkers.interrupt_all();
+        threadWorkers.join_all();
 
+        // -- release the node snapshots outside mutexMsgHand
+        std::deque<CMessageWork> vQueue;
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
-        } // cs_vNodes
-
-        if (fSleep)
-            MilliSleep(100);
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            vQueue.swap(vMsgHandQueue);
+            setMsgHandBusy.clear();
+        }
+        throw;
     };
 }
 
@@ -1597,7 +2661,8 @@ static void run_tor() {
     }
 #endif
 
-    fs::path tor_dir = GetDataDir() / "tor";
+    // -- state is kept between runs, see PrepareTorDataDir
+    fs::path tor_dir(anonymize_tor_data_directory());
     fs::create_directory(tor_dir);
     fs::path log_file = tor_dir / "tor.log";
 
@@ -1618,7 +2683,7 @@ static void run_tor() {
     argv.push_back("--GeoIPv6File");
     argv.push_back((tor_dir / "geoipv6").string());
     argv.push_back("--HiddenServiceDir");
-    argv.push_back((tor_dir / "onion").string());
+    argv.push_back(anonymize_service_directory());
     argv.push_back("--HiddenServicePort");
     argv.push_back("8801");
 
@@ -1641,6 +2706,7 @@ void StartTor(void *nothing)
 {
     // Make this thread recognisable as the tor thread
     RenameThread("onion");
+    MarkTorStartup(TOR_LAUNCHED);
 
     try
     {
@@ -1665,6 +2731,11 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    {
+        LOCK(cs_torStartup);
+        torStartup.nCachedAddresses = addrman.size();
+    }
+
     //
     // Start threads
     //
@@ -1747,12 +2818,29 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // peers requesting it are sent the same buffer
+        mapRelay.insert(std::make_pair(inv, MakeSharedMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
     LOCK(cs_vNodes);
+
+    // -- reconciling peers get the txn by inv only if they're among the few outbound peers
+    //    picked for it, lowest short id first as each peer has its own keys
+    std::vector<std::pair<uint32_t, CNode*> > vFloodOutbound;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->fInbound || !pnode->fRelayTxes)
+            continue;
+        LOCK(pnode->cs_inventory);
+        if (pnode->txrecon.fEnabled)
+            vFloodOutbound.push_back(std::make_pair(pnode->txrecon.GetShortID(hash), pnode));
+    };
+    std::sort(vFloodOutbound.begin(), vFloodOutbound.end());
+    if (vFloodOutbound.size() > (size_t)TXRECON_FLOOD_OUTBOUND)
+        vFloodOutbound.resize(TXRECON_FLOOD_OUTBOUND);
+
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
         if(!pnode->fRelayTxes)
@@ -1764,7 +2852,12 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
                 pnode->PushInventory(inv);
         } else
         {
-            pnode->PushInventory(inv);
+            bool fFlood = false;
+            for (size_t i = 0; i < vFloodOutbound.size(); ++i)
+                fFlood |= vFloodOutbound[i].second == pnode;
+
+            if (fFlood || !pnode->PushTxReconcile(hash))
+                pnode->PushInventory(inv);
         };
     };
 }
@@ -1779,6 +2872,15 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    int64_t nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < nNow)
+    {
+        // -- new cycle
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    };
+    nMaxOutboundTotalBytesSentInCycle += bytes;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1792,3 +2894,110 @@ uint64_t CNode::GetTotalBytesSent()
     LOCK(cs_totalBytesSent);
     return nTotalBytesSent;
 }
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < GetTime())
+        return false; // a new cycle starts with the next send
+
+    uint64_t nLimit = nMaxOutboundLimit;
+    if (fHistoricalBlockServingLimit)
+        nLimit -= nMaxOutboundLimit / UPLOAD_TARGET_RESERVE;
+
+    return nMaxOutboundTotalBytesSentInCycle >= nLimit;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < GetTime())
+        return nMaxOutboundLimit;
+
+    return nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit
+        ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+int64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    int64_t nCycleEnd = nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME;
+    int64_t nNow = GetTime();
+    return nCycleEnd < nNow ? 0 : nCycleEnd - nNow;
+}
+
+
+void CTokenBucket::SetRate(int64_t nRateIn, int64_t nBurstIn)
+{
+    nRate = nRateIn;
+    nBurst = nBurstIn;
+    nTokens = nBurst;
+    nLastFill = 0;
+}
+
+void CTokenBucket::Fill(int64_t nTimeMicros)
+{
+    if (nLastFill == 0 || nTimeMicros < nLastFill)
+    {
+        nLastFill = nTimeMicros;
+        return;
+    };
+
+    int64_t nElapsed = nTimeMicros - nLastFill;
+    int64_t nAdd = nElapsed >= 60 * 1000000 ? nBurst - nTokens : nElapsed * nRate / 1000000;
+    if (nAdd < 1)
+        return;
+
+    // -- only the time taken by whole bytes is used, the rest counts towards the next
+    nTokens += nAdd;
+    nLastFill += nAdd * 1000000 / nRate;
+    if (nTokens >= nBurst)
+    {
+        nTokens = nBurst;
+        nLastFill = nTimeMicros;
+    };
+}
+
+bool CTokenBucket::Available(int64_t nTimeMicros)
+{
+    if (nRate == 0)
+        return true;
+    Fill(nTimeMicros);
+    return nTokens > 0;
+}
+
+void CTokenBucket::Consume(uint64_t nBytes, int64_t nTimeMicros)
+{
+    if (nRate == 0)
+        return;
+    Fill(nTimeMicros);
+    nTokens -= nBytes;
+}
+
+int64_t CTokenBucket::TimeUntilAvailable(int64_t nTimeMicros)
+{
+    if (Available(nTimeMicros))
+        return 0;
+    return (1 - nTokens) * 1000000 / nRate + 1;
+}
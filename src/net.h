@@ -5,10 +5,13 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include <atomic>
 #include <deque>
+#include <limits>
 #ifndef Q_MOC_RUN
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #endif
 #include <openssl/rand.h>
@@ -17,13 +20,14 @@
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
 #include "bloom.h"
 #include "state.h"
 #include "hash.h"
+#include "txreconciliation.h"
 
 
 #ifndef MSG_NOSIGNAL
@@ -46,6 +50,29 @@ extern CCriticalSection cs_nLastNodeId;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Queued messages gathered into one sendmsg call */
+static const int MAX_SEND_IOV = 64;
+/** Maximum number of message handler worker threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** Messages processed for one node before the worker moves on to the next */
+static const int MSGHANDLER_BATCH_SIZE = 8;
+/** Latency histogram buckets, bucket n counts messages handled in under 2^n microseconds */
+static const int MSG_LATENCY_BUCKETS = 24;
+/** Commands tracked separately in the latency stats, the rest are counted as "other" */
+static const unsigned int MAX_MSG_LATENCY_COMMANDS = 64;
+/** Window the -maxuploadtarget applies to, in seconds */
+static const int64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Part of the upload target held back for new blocks and txns, historical blocks stop at target - target / n */
+static const uint64_t UPLOAD_TARGET_RESERVE = 5;
+/** Addresses remembered as known to each peer, false positives hold back an addr */
+static const unsigned int ADDR_KNOWN_FILTER_SIZE = 5000;
+/** Inventory remembered as known to each peer, false positives hold back an inv */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 10000;
+/** -parallelconnect default, outbound connection attempts made at once, an onion circuit takes seconds to build */
+static const int DEFAULT_PARALLEL_CONNECTS = 4;
+static const int MAX_PARALLEL_CONNECTS = 8;
+/** Seconds a cached Tor consensus is used to start from, older means a full bootstrap */
+static const int64_t TOR_CONSENSUS_MAX_AGE = 24 * 60 * 60;
 /** -upnp default */
 #ifdef USE_UPNP
 static const bool DEFAULT_UPNP = USE_UPNP;
@@ -66,10 +93,47 @@ CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
+bool PrepareTorDataDir();
 void StartTor(void *);
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeMessageHandler(NodeId nodeId);
+void WakeSocketHandler();
+
+/** Tor and P2P startup phases */
+enum
+{
+    TOR_LAUNCHED,           // bundled Tor started
+    TOR_HOSTNAME,           // onion hostname known
+    TOR_SEEDED,             // .onion seeds added
+    TOR_FIRST_ATTEMPT,      // first outbound connection attempt
+    TOR_FIRST_CONNECT,      // first outbound connection made through the proxy
+    TOR_FIRST_PEER,         // first outbound peer finished the version handshake
+    TOR_PHASE_MAX,
+};
+
+class CTorStartupTimes
+{
+public:
+    int64_t vPhase[TOR_PHASE_MAX];  // milliseconds after startup, 0 if not reached yet
+    bool fWarmStart;                // Tor's data directory held a fresh consensus
+    int nCachedAddresses;           // peers.dat addresses when connections started
+
+    CTorStartupTimes()
+    {
+        for (int i = 0; i < TOR_PHASE_MAX; ++i)
+            vPhase[i] = 0;
+        fWarmStart = false;
+        nCachedAddresses = 0;
+    }
+};
+
+/** Record the time a phase was first reached, later calls are ignored */
+void MarkTorStartup(int nPhase);
+bool IsTorStartupMarked(int nPhase);
+void GetTorStartupTimes(CTorStartupTimes& times);
+const char* GetTorStartupPhaseName(int nPhase);
 
 // Signals for message handling
 struct CNodeSignals
@@ -81,6 +145,155 @@ struct CNodeSignals
 CNodeSignals& GetNodeSignals();
 
 
+/** A complete message, header and payload, queued by reference.
+ *  Built once by MakeSharedMessage it can be queued to any number of peers without copying.
+ *  The payload is serialized at PROTOCOL_VERSION, only share messages that don't depend on
+ *  the peer's version.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Fill in the size and checksum of the message header at the front of ss */
+void SetMessageHeaderChecksum(CDataStream& ss);
+/** Takes the buffer of ss, a header and payload */
+CSharedMessage FinishSharedMessage(CDataStream& ss);
+
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    return FinishSharedMessage(ss);
+}
+
+/** Payloads smaller than this are never compressed */
+static const unsigned int MIN_COMPRESS_SIZE = 1024;
+/** Largest ratio LZ4 can reach, a larger declared size is rejected before allocating */
+static const unsigned int MAX_LZ4_RATIO = 255;
+
+/** Message compression between peers that both set NODE_COMPRESS.
+ *  block, mblk, mblkt and headers payloads of MIN_COMPRESS_SIZE or more are sent as lz4msg:
+ *  the original command (COMMAND_SIZE bytes), the payload size (4 bytes) and the payload as
+ *  one LZ4 block. Small and latency critical messages are always sent as they are.
+ */
+bool IsCompressibleCommand(const char* pchCommand);
+/** Replace the message in ss, header and payload, with an lz4msg.
+ *  Returns false and leaves ss alone if the command isn't compressed or too little would be saved.
+ */
+bool CompressMessage(CDataStream& ss);
+/** Compressed copy of a shared message, or msg itself */
+CSharedMessage CompressSharedMessage(const CSharedMessage& msg);
+/** Replace the lz4msg payload in vRecv with the original payload, strCommand gets its command.
+ *  The payload is never allowed to grow past MAX_SIZE.
+ */
+bool DecompressMessage(CDataStream& vRecv, std::string& strCommand);
+
+class CCompressionStats
+{
+public:
+    uint64_t nSentRaw;          // payload bytes before compression
+    uint64_t nSentWire;         // lz4msg payload bytes sent for them
+    uint64_t nSentSkipped;      // messages sent uncompressed, they didn't compress well
+    uint64_t nRecvRaw;
+    uint64_t nRecvWire;
+
+    CCompressionStats()
+    {
+        nSentRaw = nSentWire = nSentSkipped = 0;
+        nRecvRaw = nRecvWire = 0;
+    }
+};
+
+void GetCompressionStats(CCompressionStats& stats);
+
+/** Bytes written to send queues, copied once per peer or queued by reference */
+class CSendQueueStats
+{
+public:
+    uint64_t nBytesCopied;
+    uint64_t nBytesShared;
+    uint64_t nBlockBytesCopied;     // block, mblk, cmpctblock and blocktxn messages
+    uint64_t nBlockBytesShared;
+    uint64_t nBlocksRelayed;        // new blocks announced to peers
+
+    CSendQueueStats()
+    {
+        nBytesCopied = nBytesShared = 0;
+        nBlockBytesCopied = nBlockBytesShared = 0;
+        nBlocksRelayed = 0;
+    }
+};
+
+/** Token bucket in bytes, refilled at nRate bytes a second up to nBurst.
+ *  A message may take the bucket below zero, the next waits until it is refilled.
+ */
+class CTokenBucket
+{
+private:
+    int64_t nRate;      // bytes per second, 0 is unlimited
+    int64_t nBurst;
+    int64_t nTokens;
+    int64_t nLastFill;  // micros
+
+    void Fill(int64_t nTimeMicros);
+
+public:
+    CTokenBucket()
+    {
+        SetRate(0, 0);
+    }
+
+    void SetRate(int64_t nRateIn, int64_t nBurstIn);
+    int64_t GetRate() const { return nRate; }
+
+    bool Available(int64_t nTimeMicros);
+    void Consume(uint64_t nBytes, int64_t nTimeMicros);
+    /** Micros until Available, 0 if it already is */
+    int64_t TimeUntilAvailable(int64_t nTimeMicros);
+};
+
+/** -maxpeeruploadrate in bytes per second, historical blocks served to each peer, 0 is unlimited */
+extern int64_t nMaxPeerUploadRate;
+
+/** pchCommand points at the command in the message header, lz4msg is counted under the command it carries */
+void RecordSendQueued(const char* pchCommand, size_t nBytes, bool fShared);
+void RecordBlockRelayed();
+void GetSendQueueStats(CSendQueueStats& stats);
+
+
+/** Time taken to handle messages of one command */
+class CMessageLatency
+{
+public:
+    uint64_t nCount;
+    int64_t nTimeProcess;       // microseconds spent in the handler, total
+    int64_t nLatencyMax;        // microseconds from receipt to handled
+    uint64_t vBuckets[MSG_LATENCY_BUCKETS];
+
+    CMessageLatency()
+    {
+        nCount = 0;
+        nTimeProcess = 0;
+        nLatencyMax = 0;
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+
+    void Add(int64_t nLatency, int64_t nProcess)
+    {
+        int n = 0;
+        while (n < MSG_LATENCY_BUCKETS - 1 && nLatency >= ((int64_t)1 << n))
+            n++;
+        vBuckets[n]++;
+        nCount++;
+        nTimeProcess += nProcess;
+        if (nLatency > nLatencyMax)
+            nLatencyMax = nLatency;
+    }
+};
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nLatency, int64_t nProcess);
+void GetMessageLatency(std::map<std::string, CMessageLatency>& mapLatency);
+
+
 enum
 {
     LOCAL_NONE,   // unknown
@@ -163,7 +376,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -207,6 +420,10 @@ public:
     int nMisbehavior;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    uint64_t nHistoricalBytes;
+    uint64_t nGetDataDeferred;
+    bool fTxReconcile;
+    bool fCompress;
     bool fSyncNode;
     double dPingTime;
     double dPingWait;
@@ -214,29 +431,84 @@ public:
 };
 
 
+/** Message data is allocated this far ahead of what has been received */
+static const unsigned int MAX_RECV_PREALLOC = 256 * 1024;
+/** Message data remaining before the socket reads straight into the message */
+static const unsigned int MIN_RECV_DIRECT = 8 * 1024;
+
+/** Free message data buffers by capacity, powers of two from 2^MIN_CLASS to 2^MAX_CLASS bytes.
+ *  Buffers are kept for the next message rather than freed, so received data is neither
+ *  cleansed by zero_after_free_allocator nor allocated again for every message.
+ */
+class CNetMessagePool
+{
+public:
+    enum
+    {
+        MIN_CLASS = 8,
+        MAX_CLASS = 22,
+        NUM_CLASSES = MAX_CLASS - MIN_CLASS + 1,
+    };
+
+    static const size_t MAX_FREE_BYTES = 32 * 1024 * 1024;
+    static const size_t MAX_FREE_PER_CLASS = 256;
+
+    uint64_t nAllocated;    // buffers created
+    uint64_t nReused;       // buffers taken from the free lists
+    uint64_t nDropped;      // buffers freed, the free list was full or they were outside the classes
+
+    CNetMessagePool()
+    {
+        nAllocated = nReused = nDropped = 0;
+        nFreeBytes = 0;
+        for (int i = 0; i < NUM_CLASSES; ++i)
+            vFree[i].reserve(MAX_FREE_PER_CLASS);
+    }
+
+    /** Swap an empty buffer with capacity for at least nSize bytes into vch */
+    void Get(CSerializeData& vch, size_t nSize);
+    /** Take back the buffer of vch, vch is left empty */
+    void Put(CSerializeData& vch);
+    size_t GetFreeBytes();
+
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree[NUM_CLASSES];
+    size_t nFreeBytes;
+};
+
+extern CNetMessagePool netMessagePool;
+
+
 class CNetMessage
 {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char pchHdr[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, buffer from netMessagePool
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    ~CNetMessage()
+    {
+        CSerializeData vch;
+        vRecv.swap_buffer(vch);
+        netMessagePool.Put(vch);
+    }
+
     bool complete() const
     {
         if (!in_data)
@@ -246,12 +518,18 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Space for the next part of the message data, nBytes is set to its size */
+    char* GetDataBuffer(unsigned int& nBytes);
+    void DataReceived(unsigned int nBytes);
+
+private:
+    void Reserve(unsigned int nSize);
 };
 
 
@@ -266,6 +544,9 @@ public:
         lastMatched     = 0;
         ignoreUntil     = 0;
         nWakeCounter    = 0;
+        nVersion        = 0;
+        nLocalNonce     = GetRand(std::numeric_limits<uint64_t>::max());
+        nPeerNonce      = 0;
         fEnabled        = false;
     };
     
@@ -276,7 +557,17 @@ public:
     int64_t                     lastMatched;
     int64_t                     ignoreUntil;
     uint32_t                    nWakeCounter;
+    uint32_t                    nVersion;       // from smsgPing/smsgPong, 0 for peers that don't send it
+    uint64_t                    nLocalNonce;    // sent in smsgPing/smsgPong
+    uint64_t                    nPeerNonce;     // from smsgPing/smsgPong
+    std::map<int64_t, uint32_t> mapReconSent;   // bucket time -> local set hash when last reconciled with the peer
     bool                        fEnabled;
+
+    /** Short id salt of the connection, the same on both sides */
+    uint64_t GetReconSalt() const
+    {
+        return nLocalNonce ^ nPeerNonce;
+    }
     
 };
 
@@ -291,10 +582,17 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
+    bool fEpollRegistered;              // socket is in the epoll set, guarded by cs_vSend
+    bool fEpollOut;                     // write interest is registered, guarded by cs_vSend
+    std::atomic<bool> fSocketWaiting;   // the socket thread found cs_vSend or cs_vRecvMsg held
 
     std::deque<CInv> vRecvGetData;
+    int64_t nGetDataDeferUntil; // micros, historical blocks wait for the upload bucket
+    uint64_t nGetDataDeferred;
+    uint64_t nHistoricalBytes;  // old blocks served, counted against uploadBucket
+    CTokenBucket uploadBucket;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -320,6 +618,9 @@ public:
     bool fSuccessfullyConnected;
     bool fDisconnect;
     bool fRelayTxes;
+    bool fSupportsCompact; // sent sendcmpct
+    bool fCompress; // both sides set NODE_COMPRESS, see CompressMessage
+    bool fPreferCompact;   // wants new blocks pushed as cmpctblock, without an inv
     CSemaphoreGrant grantOutbound;
     int nRefCount;
     NodeId id;
@@ -345,13 +646,15 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
+    CCriticalSection cs_addrSend;   // guards vAddrToSend and filterAddrKnown, "addr" is relayed without cs_main
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    CTxReconState txrecon;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -371,7 +674,8 @@ public:
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+        filterAddrKnown(ADDR_KNOWN_FILTER_SIZE, 0.001), filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -380,6 +684,10 @@ public:
         nLastRecv = 0;
         nSendBytes = 0;
         nRecvBytes = 0;
+        nGetDataDeferUntil = 0;
+        nGetDataDeferred = 0;
+        nHistoricalBytes = 0;
+        uploadBucket.SetRate(nMaxPeerUploadRate, nMaxPeerUploadRate);
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
         nTimeOffset = 0;
@@ -396,9 +704,15 @@ public:
         fSuccessfullyConnected = false;
         fDisconnect = false;
         fRelayTxes = false;
+        fSupportsCompact = false;
+        fCompress = false;
+        fPreferCompact = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fEpollRegistered = false;
+        fEpollOut = false;
+        fSocketWaiting = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         pindexLastGetBlockThinsBegin = 0;
@@ -406,7 +720,6 @@ public:
         nChainHeight = -1;
         fGetAddr = false;
         nMisbehavior = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = NULL;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -439,6 +752,11 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Upload target, bytes sent in the current cycle of MAX_UPLOAD_TIMEFRAME
+    static uint64_t nMaxOutboundLimit;
+    static int64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -463,6 +781,14 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // The rest of a large message is read from the socket into its own buffer, returns NULL
+    // when the next read should go through ReceiveMsgBytes
+    char* GetRecvDirect(unsigned int& nBytes);
+
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedDirect(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -486,7 +812,8 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_addrSend);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -494,7 +821,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
+        LOCK(cs_addrSend);
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey()))
             vAddrToSend.push_back(addr);
     }
 
@@ -503,7 +831,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash, inv.type);
         }
     }
 
@@ -511,11 +839,22 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash, inv.type))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    // Returns false if the txn must be announced by inv
+    bool PushTxReconcile(const uint256& hash)
+    {
+        LOCK(cs_inventory);
+        if (!txrecon.fEnabled)
+            return false;
+        if (filterInventoryKnown.contains(hash, MSG_TX))
+            return true;
+        return txrecon.AddToSet(hash);
+    }
+
     void AskFor(const CInv& inv)
     {
         // We're using mapAskFor as a priority queue,
@@ -571,28 +910,65 @@ public:
             return;
         }
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        if (fCompress)
+            CompressMessage(ssSend);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        SetMessageHeaderChecksum(ssSend);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        RecordSendQueued(&ssSend[MESSAGE_START_SIZE], ssSend.size(), false);
+
+        // -- large messages hand over their buffer, small ones are copied so ssSend keeps its capacity
+        CSerializeData* pdata = new CSerializeData();
+        if (ssSend.size() >= 0x10000)
+            ssSend.swap_buffer(*pdata);
+        else
+            ssSend.GetAndClear(*pdata);
+        vSendMsg.push_back(CSharedMessage(pdata));
+        nSendSize += pdata->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
+        ReleaseSocketWait();
+    }
+
+    void PushMessage(const CSharedMessage& msg)
+    {
+        if (!msg || msg->size() < CMessageHeader::HEADER_SIZE)
+            return;
+
+        {
+            LOCK(cs_vSend);
+            if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+            {
+                LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+                return;
+            }
+
+            LogPrint("net", "sending: %s (%d bytes, shared)\n",
+                std::string(&(*msg)[MESSAGE_START_SIZE], strnlen(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE)),
+                msg->size() - CMessageHeader::HEADER_SIZE);
+
+            RecordSendQueued(&(*msg)[MESSAGE_START_SIZE], msg->size(), true);
+
+            vSendMsg.push_back(msg);
+            nSendSize += msg->size();
+
+            if (vSendMsg.size() == 1)
+                SocketSendData(this);
+        }
+        ReleaseSocketWait();
+    }
+
+    // Wake the socket thread if it gave up on a lock of this node while the caller held it
+    void ReleaseSocketWait()
+    {
+        if (fSocketWaiting.exchange(false))
+            WakeSocketHandler();
     }
 
     void PushVersion();
@@ -842,6 +1218,14 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // -maxuploadtarget, 0 is no limit
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    /** True once the target is reached, or for historical blocks once the reserve is reached */
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+    static uint64_t GetOutboundTargetBytesLeft();
+    static int64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 class CTransaction;
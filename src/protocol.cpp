@@ -16,7 +16,8 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "cmpctblock"
 };
 
 CMessageHeader::CMessageHeader()
@@ -74,7 +74,7 @@ public:
             QDateTime received_datetime;
 
             std::string sPrefix("im");
-            leveldb::Iterator* it = dbSmsg.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbSmsg.NewIterator();
             while (dbSmsg.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
@@ -130,7 +130,7 @@ public:
             delete it;
 
             sPrefix = "sm";
-            it = dbSmsg.pdb->NewIterator(leveldb::ReadOptions());
+            it = dbSmsg.NewIterator();
             while (dbSmsg.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
@@ -600,9 +600,13 @@ static void NotifySecMsgOutbox(MessageModel *messageModel, SecMsgStored outboxHd
                               Q_ARG(SecMsgStored, outboxHdr));
 }
 
-static void NotifySecMsgWallet(MessageModel *messageModel)
+static void NotifySecMsgWallet(MessageModel *messageModel, uint32_t nScanned, uint32_t nTotal)
 {
-    messageModel->setEncryptionStatus(WalletModel::Unlocked);
+    // Called from the smsg thread, reload once all messages received while locked are in
+    if (nScanned < nTotal)
+        return;
+    QMetaObject::invokeMethod(messageModel, "setEncryptionStatus", Qt::QueuedConnection,
+                              Q_ARG(int, WalletModel::Unlocked));
 }
 
 void MessageModel::subscribeToCoreSignals()
@@ -612,7 +616,7 @@ void MessageModel::subscribeToCoreSignals()
     // Connect signals
     NotifySecMsgInboxChanged.connect(boost::bind(NotifySecMsgInbox, this, _1));
     NotifySecMsgOutboxChanged.connect(boost::bind(NotifySecMsgOutbox, this, _1));
-    NotifySecMsgWalletUnlocked.connect(boost::bind(NotifySecMsgWallet, this));
+    NotifySecMsgWalletUnlocked.connect(boost::bind(NotifySecMsgWallet, this, _1, _2));
 
     connect(walletModel, SIGNAL(encryptionStatusChanged(int)), this, SLOT(setEncryptionStatus(int)));
 }
@@ -622,7 +626,7 @@ void MessageModel::unsubscribeFromCoreSignals()
     // Disconnect signals
     NotifySecMsgInboxChanged.disconnect(boost::bind(NotifySecMsgInbox, this, _1));
     NotifySecMsgOutboxChanged.disconnect(boost::bind(NotifySecMsgOutbox, this, _1));
-    NotifySecMsgWalletUnlocked.disconnect(boost::bind(NotifySecMsgWallet, this));
+    NotifySecMsgWalletUnlocked.disconnect(boost::bind(NotifySecMsgWallet, this, _1, _2));
 
     disconnect(walletModel, SIGNAL(encryptionStatusChanged(int)), this, SLOT(setEncryptionStatus(int)));
 }
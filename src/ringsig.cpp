@@ -15,11 +15,24 @@
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 
+#include <boost/thread/tss.hpp>
+
 
 static EC_GROUP *ecGrp   = NULL;
-static BN_CTX   *bnCtx   = NULL;
 static BIGNUM   *bnOrder = NULL;
 
+// - BN_CTX is scratch space and must not be shared, transactions are verified
+//   on several threads so each thread gets its own, freed on thread exit.
+static boost::thread_specific_ptr<BN_CTX> tspBnCtx(BN_CTX_free);
+
+static BN_CTX *GetThreadBnCtx()
+{
+    BN_CTX *ctx = tspBnCtx.get();
+    if (!ctx && (ctx = BN_CTX_new()))
+        tspBnCtx.reset(ctx);
+    return ctx;
+}
+
 
 int initialiseRingSigs()
 {
@@ -31,7 +44,8 @@ int initialiseRingSigs()
     if (!(ecGrp = EC_GROUP_new_by_curve_name(NID_secp256k1)))
         return errorN(1, "initialiseRingSigs(): EC_GROUP_new_by_curve_name failed.");
 
-    if (!(bnCtx = BN_CTX_new()))
+    BN_CTX *bnCtx;
+    if (!(bnCtx = GetThreadBnCtx()))
         return errorN(1, "initialiseRingSigs(): BN_CTX_new failed.");
 
     BN_CTX_start(bnCtx);
@@ -52,11 +66,10 @@ int finaliseRingSigs()
         LogPrintf("finaliseRingSigs()\n");
 
     BN_free(bnOrder);
-    BN_CTX_free(bnCtx);
+    tspBnCtx.reset();
     EC_GROUP_clear_free(ecGrp);
 
     ecGrp   = NULL;
-    bnCtx   = NULL;
     bnOrder = NULL;
 
     return 0;
@@ -109,6 +122,10 @@ int splitAmount(int64_t nValue, std::vector<int64_t>& vOut)
 
 int getOldKeyImage(CPubKey &publicKey, ec_point &keyImage)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     // - PublicKey * Hash(PublicKey)
     if (publicKey.size() != EC_COMPRESSED_SIZE)
         return errorN(1, "%s: Invalid publicKey.", __func__);
@@ -161,6 +178,10 @@ int getOldKeyImage(CPubKey &publicKey, ec_point &keyImage)
 
 static int hashToEC(const uint8_t *p, uint32_t len, BIGNUM *bnTmp, EC_POINT *ptRet, bool fNew=false)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     // - bn(hash(data)) * (G + bn1)
     int count = 0;
     uint256 pkHash = Hash(p, p + len);
@@ -190,6 +211,10 @@ static int hashToEC(const uint8_t *p, uint32_t len, BIGNUM *bnTmp, EC_POINT *ptR
 
 int generateKeyImage(ec_point &publicKey, ec_secret secret, ec_point &keyImage)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     // - keyImage = secret * hash(publicKey) * G
 
     if (publicKey.size() != EC_COMPRESSED_SIZE)
@@ -242,6 +267,10 @@ int generateKeyImage(ec_point &publicKey, ec_secret secret, ec_point &keyImage)
 
 int generateRingSignature(data_chunk &keyImage, uint256 &txnHash, int nRingSize, int nSecretOffset, ec_secret secret, const uint8_t *pPubkeys, uint8_t *pSigc, uint8_t *pSigr)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     if (fDebugRingSig)
         LogPrintf("%s: Ring size %d.\n", __func__, nRingSize);
 
@@ -508,6 +537,10 @@ int generateRingSignature(data_chunk &keyImage, uint256 &txnHash, int nRingSize,
 
 int verifyRingSignature(data_chunk &keyImage, uint256 &txnHash, int nRingSize, const uint8_t *pPubkeys, const uint8_t *pSigc, const uint8_t *pSigr)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     int rv = 0;
 
     BN_CTX_start(bnCtx);
@@ -688,6 +721,10 @@ int verifyRingSignature(data_chunk &keyImage, uint256 &txnHash, int nRingSize, c
 
 int generateRingSignatureAB(data_chunk &keyImage, uint256 &txnHash, int nRingSize, int nSecretOffset, ec_secret secret, const uint8_t *pPubkeys, data_chunk &sigC, uint8_t *pSigS)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     // https://bitcointalk.org/index.php?topic=972541.msg10619684
 
     if (fDebugRingSig)
@@ -963,6 +1000,10 @@ int generateRingSignatureAB(data_chunk &keyImage, uint256 &txnHash, int nRingSiz
 
 int verifyRingSignatureAB(data_chunk &keyImage, uint256 &txnHash, int nRingSize, const uint8_t *pPubkeys, const data_chunk &sigC, const uint8_t *pSigS)
 {
+    BN_CTX *bnCtx = GetThreadBnCtx();
+    if (!bnCtx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
     // https://bitcointalk.org/index.php?topic=972541.msg10619684
 
     // forall_{i=1..n} compute e_i=s_i*G+c_i*P_i and E_i=s_i*H(P_i)+c_i*I_j and c_{i+1}=h(P_1,...,P_n,e_i,E_i)
@@ -425,6 +425,25 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "Dumps the mempool to disk.");
+
+    if (nNodeMode != NT_FULL || !GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        throw JSONRPCError(RPC_MISC_ERROR, "Mempool persistence is disabled (-persistmempool=0 or a thin node)");
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return Value::null;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -768,7 +787,7 @@ Value rewindchain(const Array& params, bool fHelp)
             mapBlockIndex.erase(mi);
         };
 
-        std::map<uint256, COrphanBlock*>::iterator miOph = mapOrphanBlocks.find(hashblock);
+        salted_hash_map<uint256, COrphanBlock*>::iterator miOph = mapOrphanBlocks.find(hashblock);
         if (miOph != mapOrphanBlocks.end())
         {
             LogPrintf("block is an orphan.\n");
@@ -842,7 +861,7 @@ Value nextorphan(const Array& params, bool fHelp)
 
     //mapOrphanBlocks.clear();
     uint256 besthash = *pindexBest->phashBlock;
-    std::map<uint256, COrphanBlock*>::iterator it;
+    salted_hash_map<uint256, COrphanBlock*>::iterator it;
     for (it = mapOrphanBlocks.begin(); it != mapOrphanBlocks.end(); ++it)
     {
         if (it->second->hashPrev == besthash)
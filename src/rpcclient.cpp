@@ -180,6 +180,10 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getaddressdeltas", 0 },
     { "getaddressutxos", 0 },
     { "getaddressmempool", 0 },
+    { "smsginbox", 2 },
+    { "smsginbox", 3 },
+    { "smsgoutbox", 2 },
+    { "smsgoutbox", 3 },
 };
 
 class CRPCConvertTable
@@ -80,6 +80,10 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("lastrecv", (int64_t)stats.nLastRecv));
         obj.push_back(Pair("bytessent", (int64_t)stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", (int64_t)stats.nRecvBytes));
+        obj.push_back(Pair("historicalbytessent", (int64_t)stats.nHistoricalBytes));
+        obj.push_back(Pair("getdatadeferred", (int64_t)stats.nGetDataDeferred));
+        obj.push_back(Pair("txreconciliation", stats.fTxReconcile));
+        obj.push_back(Pair("compression", stats.fCompress));
         obj.push_back(Pair("conntime", (int64_t)stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
@@ -299,12 +303,99 @@ Value getnettotals(const Array& params, bool fHelp)
         throw runtime_error(
             "getnettotals\n"
             "Returns information about network traffic, including bytes in, bytes out,\n"
-            "and current time.");
+            "and current time.\n"
+            "queuedbytescopied/queuedbytesshared: bytes serialized for one peer, or queued from a buffer\n"
+            "shared between peers. The block figures cover block, mblk, cmpctblock and blocktxn messages,\n"
+            "blockcopiedperrelay is block bytes copied per new block relayed.\n"
+            "uploadtarget: -maxuploadtarget state, historical blocks are no longer served once\n"
+            "serve_historical_blocks is false. peeruploadrate is -maxpeeruploadrate in bytes per second.\n"
+            "txreconciliation: rounds run as initiator, failed rounds, sketch bytes sent and received,\n"
+            "txns announced and short ids asked for after reconciling, txns cancelled out as both sides had them.\n"
+            "compression: block and header payload bytes before and after LZ4 compression, sent and received,\n"
+            "skipped is messages sent uncompressed as they didn't compress well.");
+
+    CSendQueueStats stats;
+    GetSendQueueStats(stats);
 
     Object obj;
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("queuedbytescopied", stats.nBytesCopied));
+    obj.push_back(Pair("queuedbytesshared", stats.nBytesShared));
+    obj.push_back(Pair("blockbytescopied", stats.nBlockBytesCopied));
+    obj.push_back(Pair("blockbytesshared", stats.nBlockBytesShared));
+    obj.push_back(Pair("blocksrelayed", stats.nBlocksRelayed));
+    obj.push_back(Pair("blockcopiedperrelay", stats.nBlocksRelayed ? stats.nBlockBytesCopied / stats.nBlocksRelayed : 0));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    outboundLimit.push_back(Pair("peeruploadrate", nMaxPeerUploadRate));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    CTxReconStats reconStats;
+    GetTxReconStats(reconStats);
+    Object recon;
+    recon.push_back(Pair("rounds", reconStats.nRounds));
+    recon.push_back(Pair("failed", reconStats.nFailed));
+    recon.push_back(Pair("sketchbytes", reconStats.nSketchBytes));
+    recon.push_back(Pair("announced", reconStats.nAnnounced));
+    recon.push_back(Pair("asked", reconStats.nAsked));
+    recon.push_back(Pair("cancelled", reconStats.nCancelled));
+    obj.push_back(Pair("txreconciliation", recon));
+
+    CCompressionStats compressStats;
+    GetCompressionStats(compressStats);
+    Object compress;
+    compress.push_back(Pair("sentraw", compressStats.nSentRaw));
+    compress.push_back(Pair("sentcompressed", compressStats.nSentWire));
+    compress.push_back(Pair("skipped", compressStats.nSentSkipped));
+    compress.push_back(Pair("recvraw", compressStats.nRecvRaw));
+    compress.push_back(Pair("recvcompressed", compressStats.nRecvWire));
+    obj.push_back(Pair("compression", compress));
+    return obj;
+}
+
+
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "Returns the time taken to handle received messages, by command.\n"
+            "count: messages handled\n"
+            "avgprocessus: average microseconds in the handler\n"
+            "maxlatencyus: most microseconds from receipt to handled\n"
+            "latency: histogram of microseconds from receipt to handled, entry n counts messages under 2^n");
+
+    std::map<std::string, CMessageLatency> mapLatency;
+    GetMessageLatency(mapLatency);
+
+    Object obj;
+    for (std::map<std::string, CMessageLatency>::iterator mi = mapLatency.begin(); mi != mapLatency.end(); ++mi)
+    {
+        const CMessageLatency& stats = mi->second;
+
+        int nLast = MSG_LATENCY_BUCKETS - 1;
+        while (nLast > 0 && stats.vBuckets[nLast] == 0)
+            nLast--;
+        Array histogram;
+        for (int i = 0; i <= nLast; ++i)
+            histogram.push_back((uint64_t)stats.vBuckets[i]);
+
+        Object entry;
+        entry.push_back(Pair("count", (uint64_t)stats.nCount));
+        entry.push_back(Pair("avgprocessus", stats.nCount ? stats.nTimeProcess / (int64_t)stats.nCount : 0));
+        entry.push_back(Pair("maxlatencyus", stats.nLatencyMax));
+        entry.push_back(Pair("latency", histogram));
+        obj.push_back(Pair(mi->first, entry));
+    };
+
     return obj;
 }
 
@@ -360,7 +451,17 @@ Value getnetworkinfo(const Array& params, bool fHelp)
             "    \"score\": xxx                         (numeric) relative score\n"
             "  }\n"
             "  ,...\n"
-            "  ]\n"
+            "  ],\n"
+            "  \"startup\": {                         (object) milliseconds after startup each phase was reached, 0 if not yet\n"
+            "    \"warmstart\": true|false,           (boolean) Tor started from a cached consensus\n"
+            "    \"cachedaddresses\": xxx,            (numeric) peers.dat addresses when connections started\n"
+            "    \"tor_launched\": xxx,               (numeric) bundled Tor started\n"
+            "    \"onion_hostname\": xxx,             (numeric) onion hostname known\n"
+            "    \"onion_seeded\": xxx,               (numeric) .onion seeds added\n"
+            "    \"first_attempt\": xxx,              (numeric) first outbound connection attempt\n"
+            "    \"first_connect\": xxx,              (numeric) first outbound connection through the proxy\n"
+            "    \"first_peer\": xxx                  (numeric) first outbound peer finished the handshake\n"
+            "  }\n"
             "}\n"
         );
 
@@ -388,6 +489,15 @@ Value getnetworkinfo(const Array& params, bool fHelp)
         }
     }
     obj.push_back(Pair("localaddresses", localAddresses));
+
+    CTorStartupTimes times;
+    GetTorStartupTimes(times);
+    Object startup;
+    startup.push_back(Pair("warmstart", times.fWarmStart));
+    startup.push_back(Pair("cachedaddresses", times.nCachedAddresses));
+    for (int i = 0; i < TOR_PHASE_MAX; ++i)
+        startup.push_back(Pair(GetTorStartupPhaseName(i), times.vPhase[i]));
+    obj.push_back(Pair("startup", startup));
     return obj;
 }
 
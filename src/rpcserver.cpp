@@ -278,6 +278,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,      false },
     { "ping",                   &ping,                   true,      false,     false },
     { "getnettotals",           &getnettotals,           true,      true,      false },
+    { "getmessagestats",        &getmessagestats,        true,      true,      false },
     { "getdifficulty",          &getdifficulty,          true,      false,     false },
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getsubsidy",             &getsubsidy,             true,      true,      false },
@@ -312,6 +313,7 @@ static const CRPCCommand vRPCCommands[] =
     { "createmultisig",         &createmultisig,         true,      false,     true  },
     { "addredeemscript",        &addredeemscript,        false,     false,     false },
     { "getrawmempool",          &getrawmempool,          true,      false,     false },
+    { "savemempool",            &savemempool,            true,      true,      false },
     { "getblock",               &getblock,               false,     false,     false },
     { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
     { "setbestblockbyheight",   &setbestblockbyheight,   false,     false,     false },
@@ -384,6 +386,7 @@ static const CRPCCommand vRPCCommands[] =
     { "smsginbox",              &smsginbox,              false,     false,     false },
     { "smsgoutbox",             &smsgoutbox,             false,     false,     false },
     { "smsgbuckets",            &smsgbuckets,            false,     false,     false },
+    { "smsginfo",               &smsginfo,               true,      true,      false },
     
     
     { "thinscanmerkleblocks",   &thinscanmerkleblocks,   false,     false,     false },
@@ -10,6 +10,7 @@
 #include <string>
 
 #include "smessage.h"
+#include "smsgpow.h"
 #include "init.h"
 #include "util.h"
 
@@ -264,6 +265,8 @@ Value smsglocalkeys(const Array& params, bool fHelp)
             return result;
         };
 
+        SecureMsgReceiveKeysChanged();
+
         std::string sInfo;
         sInfo = std::string("Receive ") + (it->fReceiveEnabled ? "on, " : "off,");
         sInfo += std::string("Anon ") + (it->fReceiveAnon ? "on" : "off");
@@ -311,6 +314,8 @@ Value smsglocalkeys(const Array& params, bool fHelp)
             return result;
         };
 
+        SecureMsgReceiveKeysChanged();
+
         std::string sInfo;
         sInfo = std::string("Receive ") + (it->fReceiveEnabled ? "on, " : "off,");
         sInfo += std::string("Anon ") + (it->fReceiveAnon ? "on" : "off");
@@ -589,12 +594,27 @@ Value smsgsendanon(const Array& params, bool fHelp)
     return result;
 }
 
+static void GetPagingParams(const Array& params, std::string& sAddress, uint32_t& nCount, uint32_t& nSkip)
+{
+    // -- [address] [count] [skip] after the mode, * for any address
+    if (params.size() > 1)
+        sAddress = params[1].get_str();
+    if (sAddress == "*")
+        sAddress = "";
+    if (params.size() > 2)
+        nCount = std::max(0, params[2].get_int());
+    if (params.size() > 3)
+        nSkip = std::max(0, params[3].get_int());
+};
+
 Value smsginbox(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 4) // defaults to read
         throw std::runtime_error(
-            "smsginbox [all|unread|clear]\n"
+            "smsginbox [all|unread|clear] [address] [count] [skip]\n"
             "Decrypt and display all received messages.\n"
+            "address (* for any) limits the list to messages received from it, count and skip page through it.\n"
+            "Messages are listed newest first.\n"
             "Warning: clear will delete all messages.");
 
     if (!fSecMsgEnabled)
@@ -609,6 +629,10 @@ Value smsginbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     };
 
+    std::string sAddress;
+    uint32_t nCount = 0, nSkip = 0;
+    GetPagingParams(params, sAddress, nCount, nSkip);
+
 
     Object result;
 
@@ -634,7 +658,7 @@ Value smsginbox(const Array& params, bool fHelp)
         {
             dbInbox.TxnBegin();
 
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbInbox.NewIterator();
             while (dbInbox.NextSmesgKey(it, sPrefix, chKey))
             {
                 dbInbox.EraseSmesg(chKey);
@@ -653,17 +677,40 @@ Value smsginbox(const Array& params, bool fHelp)
             SecMsgStored smsgStored;
             MessageData msg;
 
-            dbInbox.TxnBegin();
+            // -- the unread filter on an address list is applied after reading, page after it
+            std::vector<std::vector<uint8_t> > vKeys;
+            bool fPageAfter = fCheckReadStatus && !sAddress.empty();
+            if (!sAddress.empty())
+                dbInbox.ListSmesgByAddress(sPrefix, sAddress, fPageAfter ? 0 : nSkip, fPageAfter ? 0 : nCount, vKeys);
+            else
+            if (fCheckReadStatus)
+                dbInbox.ListSmesgUnread(nSkip, nCount, vKeys);
+            else
+                dbInbox.ListSmesg(sPrefix, nSkip, nCount, vKeys);
 
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
             Array messageList;
+            std::vector<std::pair<std::vector<uint8_t>, SecMsgStored> > vMarkRead;
 
-            while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            for (size_t i = 0; i < vKeys.size(); ++i)
             {
+                if (!dbInbox.ReadSmesg(&vKeys[i][0], smsgStored))
+                    continue;
+
                 if (fCheckReadStatus
                     && !(smsgStored.status & SMSG_MASK_UNREAD))
                     continue;
 
+                if (fPageAfter)
+                {
+                    if (nSkip > 0)
+                    {
+                        nSkip--;
+                        continue;
+                    };
+                    if (nCount > 0 && nMessages >= nCount)
+                        break;
+                };
+
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
                 if (SecureMsgDecrypt(false, smsgStored.sAddrTo, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
                 {
@@ -686,12 +733,18 @@ Value smsginbox(const Array& params, bool fHelp)
                 if (fCheckReadStatus)
                 {
                     smsgStored.status &= ~SMSG_MASK_UNREAD;
-                    dbInbox.WriteSmesg(chKey, smsgStored);
+                    vMarkRead.push_back(std::make_pair(vKeys[i], smsgStored));
                 };
                 nMessages++;
             };
-            delete it;
-            dbInbox.TxnCommit();
+
+            if (!vMarkRead.empty())
+            {
+                dbInbox.TxnBegin();
+                for (size_t i = 0; i < vMarkRead.size(); ++i)
+                    dbInbox.WriteSmesg(&vMarkRead[i].first[0], vMarkRead[i].second);
+                dbInbox.TxnCommit();
+            };
 
 
             result.push_back(Pair("messages", messageList));
@@ -709,10 +762,12 @@ Value smsginbox(const Array& params, bool fHelp)
 
 Value smsgoutbox(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 4) // defaults to read
         throw std::runtime_error(
-            "smsgoutbox [all|clear]\n"
+            "smsgoutbox [all|clear] [address] [count] [skip]\n"
             "Decrypt and display all sent messages.\n"
+            "address (* for any) limits the list to messages sent to it, count and skip page through it.\n"
+            "Messages are listed newest first.\n"
             "Warning: clear will delete all sent messages.");
 
     if (!fSecMsgEnabled)
@@ -727,6 +782,10 @@ Value smsgoutbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     }
 
+    std::string sAddress;
+    uint32_t nCount = 0, nSkip = 0;
+    GetPagingParams(params, sAddress, nCount, nSkip);
+
 
     Object result;
 
@@ -749,7 +808,7 @@ Value smsgoutbox(const Array& params, bool fHelp)
         {
             dbOutbox.TxnBegin();
 
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbOutbox.NewIterator();
             while (dbOutbox.NextSmesgKey(it, sPrefix, chKey))
             {
                 dbOutbox.EraseSmesg(chKey);
@@ -765,12 +824,20 @@ Value smsgoutbox(const Array& params, bool fHelp)
         {
             SecMsgStored smsgStored;
             MessageData msg;
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+
+            std::vector<std::vector<uint8_t> > vKeys;
+            if (!sAddress.empty())
+                dbOutbox.ListSmesgByAddress(sPrefix, sAddress, nSkip, nCount, vKeys);
+            else
+                dbOutbox.ListSmesg(sPrefix, nSkip, nCount, vKeys);
 
             Array messageList;
 
-            while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            for (size_t i = 0; i < vKeys.size(); ++i)
             {
+                if (!dbOutbox.ReadSmesg(&vKeys[i][0], smsgStored))
+                    continue;
+
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
 
                 if (SecureMsgDecrypt(false, smsgStored.sAddrOutbox, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
@@ -791,7 +858,6 @@ Value smsgoutbox(const Array& params, bool fHelp)
                 };
                 nMessages++;
             };
-            delete it;
 
             result.push_back(Pair("messages" ,messageList));
             result.push_back(Pair("result", strprintf("%u", nMessages)));
@@ -842,7 +908,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 std::string sBucket = boost::lexical_cast<std::string>(it->first);
                 std::string sFile = sBucket + "_01.dat";
 
-                std::string sHash = boost::lexical_cast<std::string>(it->second.hash);
+                std::string sHash = boost::lexical_cast<std::string>(it->second.GetHash());
 
                 nBuckets++;
                 nMessages += tokenSet.size();
@@ -897,16 +963,18 @@ Value smsgbuckets(const Array& params, bool fHelp)
     {
         {
             LOCK(cs_smsg);
+            SecureMsgFlushStore();
+
             std::map<int64_t, SecMsgBucket>::iterator it;
             it = smsgBuckets.begin();
 
             for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
             {
-                std::string sFile = boost::lexical_cast<std::string>(it->first) + "_01.dat";
+                std::string sBucket = boost::lexical_cast<std::string>(it->first);
 
                 try {
-                    boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
-                    boost::filesystem::remove(fullPath);
+                    boost::filesystem::remove(GetDataDir() / "smsgStore" / (sBucket + "_01.dat"));
+                    boost::filesystem::remove(GetDataDir() / "smsgStore" / (sBucket + "_01.idx"));
                 } catch (const boost::filesystem::filesystem_error& ex)
                 {
                     //objM.push_back(Pair("file size, error", ex.what()));
@@ -927,3 +995,40 @@ Value smsgbuckets(const Array& params, bool fHelp)
 
     return result;
 };
+
+Value smsginfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "smsginfo\n"
+            "Returns secure messaging state.\n"
+            "pow: threads used, messages waiting in the outbox for proof of work, messages solved,\n"
+            "hashes tried, hashes per second overall and over the last batch.\n"
+            "sync: full token lists sent, bucket reconciliations answered and failed, tokens listed to peers.");
+
+    SecMsgPowStats powStats;
+    GetSecMsgPowStats(powStats);
+
+    Object pow;
+    pow.push_back(Pair("threads", powStats.nThreads));
+    pow.push_back(Pair("queued", powStats.nQueued));
+    pow.push_back(Pair("solved", powStats.nSolved));
+    pow.push_back(Pair("hashes", powStats.nHashes));
+    pow.push_back(Pair("hashespersec", powStats.nTime > 0 ? powStats.nHashes * 1000000.0 / powStats.nTime : 0.0));
+    pow.push_back(Pair("lasthashespersec", powStats.dLastRate));
+
+    SecMsgSyncStats syncStats;
+    GetSecMsgSyncStats(syncStats);
+
+    Object sync;
+    sync.push_back(Pair("show", syncStats.nShow));
+    sync.push_back(Pair("recon", syncStats.nRecon));
+    sync.push_back(Pair("reconfailed", syncStats.nReconFailed));
+    sync.push_back(Pair("tokenssent", syncStats.nTokensSent));
+
+    Object result;
+    result.push_back(Pair("enabled", fSecMsgEnabled));
+    result.push_back(Pair("pow", pow));
+    result.push_back(Pair("sync", sync));
+    return result;
+};
@@ -51,24 +51,31 @@ Notes:
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
 
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
 #include "base58.h"
 #include "db.h"
 #include "init.h" // pwalletMain
 #include "txdb.h"
 #include "sync.h"
 #include "eckey.h"
+#include "hash.h"
+#include "hashmap.h"
+#include "smsgpow.h"
 
 #include "lz4/lz4.c"
 
+#define XXH_INLINE_ALL
 #include "xxhash/xxhash.h"
-#include "xxhash/xxhash.c"
 
 
 boost::thread_group threadGroupSmsg;
+static void ThreadSecureMsgUnlocked();
 
 boost::signals2::signal<void (SecMsgStored& inboxHdr)>  NotifySecMsgInboxChanged;
 boost::signals2::signal<void (SecMsgStored& outboxHdr)> NotifySecMsgOutboxChanged;
-boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
+boost::signals2::signal<void (uint32_t nScanned, uint32_t nTotal)> NotifySecMsgWalletUnlocked;
 
 bool fSecMsgEnabled = false;
 
@@ -82,6 +89,7 @@ CCriticalSection cs_smsgDB;
 CCriticalSection cs_smsgThreads;
 
 leveldb::DB *smsgDB = NULL;
+static leveldb::Options smsgDBOptions;  // holds the block cache and filter of smsgDB
 
 
 namespace fs = boost::filesystem;
@@ -162,38 +170,169 @@ bool SecMsgCrypter::Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector
     return true;
 };
 
-void SecMsgBucket::hashBucket()
+uint64_t SecureMsgTokenHash(const SecMsgToken& token, uint64_t nSeed)
 {
-    if (fDebugSmsg)
-        LogPrintf("SecMsgBucket::hashBucket()\n");
-
+    // -- the token as sent in smsgHave
+    uint8_t vchToken[16];
+    memcpy(&vchToken[0], &token.timestamp, 8);
+    memcpy(&vchToken[8], token.sample, 8);
+    return XXH3_64bits_withSeed(vchToken, 16, nSeed);
+};
 
-    std::set<SecMsgToken>::iterator it;
+uint32_t SecureMsgTokenShortId(const SecMsgToken& token, uint64_t nSalt)
+{
+    uint32_t nId = SecureMsgTokenHash(token, nSalt) >> 32;
+    return nId == 0 ? 1 : nId;
+};
 
-    void* state = XXH32_init(1);
+static uint32_t SecureMsgOrderedHash(const std::set<SecMsgToken>& setTokens)
+{
+    // -- samples are gathered on the stack and fed in blocks, the state needs no allocation
+    XXH32_state_t state;
+    XXH32_reset(&state, 1);
 
-    for (it = setTokens.begin(); it != setTokens.end(); ++it)
+    uint8_t vchBlock[64 * 8];
+    size_t nBlock = 0;
+    for (std::set<SecMsgToken>::const_iterator it = setTokens.begin(); it != setTokens.end(); ++it)
     {
-        XXH32_update(state, it->sample, 8);
+        memcpy(&vchBlock[nBlock], it->sample, 8);
+        nBlock += 8;
+        if (nBlock == sizeof(vchBlock))
+        {
+            XXH32_update(&state, vchBlock, nBlock);
+            nBlock = 0;
+        };
     };
+    XXH32_update(&state, vchBlock, nBlock);
+
+    return XXH32_digest(&state);
+};
+
+void SecMsgBucket::hashBucket()
+{
+    if (fDebugSmsg)
+        LogPrintf("SecMsgBucket::hashBucket()\n");
 
-    uint32_t hash_new = XXH32_digest(state);
+    uint32_t hash_new = SecureMsgOrderedHash(setTokens);
 
-    if(hash != hash_new)
+    uint64_t nSetHashNew = 0;
+    for (std::set<SecMsgToken>::iterator it = setTokens.begin(); it != setTokens.end(); ++it)
+        nSetHashNew += SecureMsgTokenHash(*it);
+
+    if (hash != hash_new
+        || nSetHash != nSetHashNew)
     {
 
-        if(fDebugSmsg)
+        if (fDebugSmsg)
             LogPrintf("Bucket hash updated from %u to %u.\n", hash, hash_new);
 
-        hash = hash_new; //use memcpy here?
+        hash = hash_new;
+        nSetHash = nSetHashNew;
 
         timeChanged = GetTime();
     }
+    fHashStale = false;
 
     if (fDebugSmsg)
         LogPrintf("Hashed %u messages, hash %u\n", setTokens.size(), hash_new);
 };
 
+bool SecMsgBucket::AddToken(const SecMsgToken& token)
+{
+    if (!setTokens.insert(token).second)
+        return false;
+
+    nSetHash += SecureMsgTokenHash(token);
+    fHashStale = true;
+    timeChanged = GetTime();
+    return true;
+};
+
+uint32_t SecMsgBucket::GetHash()
+{
+    // -- only peers without reconciliation need the ordered hash, it's recomputed when they ask
+    if (fHashStale)
+    {
+        hash = SecureMsgOrderedHash(setTokens);
+        fHashStale = false;
+    };
+    return hash;
+};
+
+CReconSketch SecMsgBucket::GetSketch(unsigned int nCapacity, uint64_t nSalt) const
+{
+    CReconSketch sketch(nCapacity);
+    for (std::set<SecMsgToken>::const_iterator it = setTokens.begin(); it != setTokens.end(); ++it)
+        sketch.Add(SecureMsgTokenShortId(*it, nSalt));
+    return sketch;
+};
+
+bool SecMsgBucket::Reconcile(const std::vector<uint32_t>& vPeerSyndromes, std::vector<SecMsgToken>& vMissing, uint64_t nSalt) const
+{
+    vMissing.clear();
+
+    std::vector<uint32_t> vDiff;
+    CReconSketch sketchPeer;
+    bool fDecoded = sketchPeer.SetSyndromes(vPeerSyndromes, vPeerSyndromes.size());
+    if (fDecoded)
+    {
+        CReconSketch sketch = GetSketch(vPeerSyndromes.size(), nSalt);
+        sketch.Merge(sketchPeer);
+        fDecoded = sketch.Decode(vDiff);
+    };
+
+    // -- the peer only sketches a bucket that differs, no difference means tokens with
+    //    equal short ids cancelled out
+    if (vDiff.empty())
+        fDecoded = false;
+
+    std::set<uint32_t> setDiff(vDiff.begin(), vDiff.end());
+    for (std::set<SecMsgToken>::const_iterator it = setTokens.begin(); it != setTokens.end(); ++it)
+        if (!fDecoded || setDiff.count(SecureMsgTokenShortId(*it, nSalt)))
+            vMissing.push_back(*it);
+
+    return fDecoded;
+};
+
+static CCriticalSection cs_smsgSyncStats;
+static SecMsgSyncStats smsgSyncStats;
+
+void GetSecMsgSyncStats(SecMsgSyncStats& stats)
+{
+    LOCK(cs_smsgSyncStats);
+    stats = smsgSyncStats;
+};
+
+
+// -- key spaces of smsgDB, by the first two bytes of the key
+//    pk public keys, sc chain scan checkpoint: rebuilt by scanning the chain, written without sync
+//    im inbox, sm outbox, qm queue, and the index keys written with them: synced
+static bool SmsgKeySync(const std::string& sKey)
+{
+    return !(sKey.size() >= 2
+        && ((sKey[0] == 'p' && sKey[1] == 'k')
+            || (sKey[0] == 's' && sKey[1] == 'c')));
+};
+
+static leveldb::WriteOptions SmsgWriteOptions(bool fSync)
+{
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = fSync;
+    return writeOptions;
+};
+
+static void SecureMsgCloseDB()
+{
+    LOCK(cs_smsgDB);
+    delete smsgDB;
+    smsgDB = NULL;
+
+    // -- the db must be closed first
+    delete smsgDBOptions.block_cache;
+    smsgDBOptions.block_cache = NULL;
+    delete smsgDBOptions.filter_policy;
+    smsgDBOptions.filter_policy = NULL;
+};
 
 bool SecMsgDB::Open(const char* pszMode)
 {
@@ -215,13 +354,21 @@ bool SecMsgDB::Open(const char* pszMode)
         return false;
     };
 
-    leveldb::Options options;
-    options.create_if_missing = fCreate;
-    leveldb::Status s = leveldb::DB::Open(options, fullpath.string(), &smsgDB);
+    // -- messages are looked up by key, public keys mostly for addresses not in the db
+    int nCacheSizeMB = std::max(1, (int)GetArg("-smsgdbcache", SMSG_DB_CACHE));
+    smsgDBOptions = leveldb::Options();
+    smsgDBOptions.create_if_missing = fCreate;
+    smsgDBOptions.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    smsgDBOptions.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    leveldb::Status s = leveldb::DB::Open(smsgDBOptions, fullpath.string(), &smsgDB);
 
     if (!s.ok())
     {
         LogPrintf("SecMsgDB::open() - Error opening db: %s.\n", s.ToString().c_str());
+        delete smsgDBOptions.block_cache;
+        smsgDBOptions.block_cache = NULL;
+        delete smsgDBOptions.filter_policy;
+        smsgDBOptions.filter_policy = NULL;
         return false;
     };
 
@@ -291,6 +438,7 @@ bool SecMsgDB::TxnBegin()
     if (activeBatch)
         return true;
     activeBatch = new leveldb::WriteBatch();
+    fSyncBatch = false;
     return true;
 };
 
@@ -299,11 +447,11 @@ bool SecMsgDB::TxnCommit()
     if (!activeBatch)
         return false;
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status status = pdb->Write(writeOptions, activeBatch);
+    // -- one write for the batch, synced only if it holds messages
+    leveldb::Status status = pdb->Write(SmsgWriteOptions(fSyncBatch), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    fSyncBatch = false;
 
     if (!status.ok())
     {
@@ -318,9 +466,17 @@ bool SecMsgDB::TxnAbort()
 {
     delete activeBatch;
     activeBatch = NULL;
+    fSyncBatch = false;
     return true;
 };
 
+leveldb::Iterator* SecMsgDB::NewIterator(bool fFillCache)
+{
+    leveldb::ReadOptions readOptions;
+    readOptions.fill_cache = fFillCache;
+    return pdb->NewIterator(readOptions);
+};
+
 bool SecMsgDB::ReadPK(CKeyID& addr, CPubKey& pubkey)
 {
     if (!pdb)
@@ -386,9 +542,7 @@ bool SecMsgDB::WritePK(CKeyID& addr, CPubKey& pubkey)
         return true;
     };
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    leveldb::Status s = pdb->Put(SmsgWriteOptions(SmsgKeySync(ssKey.str())), ssKey.str(), ssValue.str());
     if (!s.ok())
     {
         LogPrintf("SecMsgDB write failure: %s\n", s.ToString().c_str());
@@ -424,6 +578,287 @@ bool SecMsgDB::ExistsPK(CKeyID& addr)
 };
 
 
+bool SecMsgDB::ReadScanCheckpoint(uint256& hashBlock)
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 's';
+    ssKey << 'c';
+    std::string strValue;
+
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+    if (!s.ok())
+    {
+        if (!s.IsNotFound())
+            LogPrintf("LevelDB read failure: %s\n", s.ToString().c_str());
+        return false;
+    };
+
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> hashBlock;
+    } catch (std::exception& e) {
+        LogPrintf("SecMsgDB::ReadScanCheckpoint() unserialize threw: %s.\n", e.what());
+        return false;
+    }
+
+    return true;
+};
+
+bool SecMsgDB::WriteScanCheckpoint(const uint256& hashBlock)
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 's';
+    ssKey << 'c';
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashBlock;
+
+    if (activeBatch)
+    {
+        activeBatch->Put(ssKey.str(), ssValue.str());
+        return true;
+    };
+
+    leveldb::Status s = pdb->Put(SmsgWriteOptions(SmsgKeySync(ssKey.str())), ssKey.str(), ssValue.str());
+    if (!s.ok())
+    {
+        LogPrintf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
+    };
+
+    return true;
+};
+
+bool SecMsgDB::EraseScanCheckpoint()
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 's';
+    ssKey << 'c';
+
+    if (activeBatch)
+    {
+        activeBatch->Delete(ssKey.str());
+        return true;
+    };
+
+    leveldb::Status s = pdb->Delete(SmsgWriteOptions(SmsgKeySync(ssKey.str())), ssKey.str());
+
+    if (s.ok() || s.IsNotFound())
+        return true;
+    LogPrintf("SecMsgDB erase failed: %s\n", s.ToString().c_str());
+    return false;
+};
+
+
+// -- secondary keys of inbox ("im") and outbox ("sm") messages, the values are empty
+//    it/st, timestamp, primary key: all messages, oldest first
+//    ia/sa, address length, address, timestamp, primary key: inbox by sender, outbox by the address sent to
+//    iu, timestamp, primary key: unread inbox messages, oldest first
+//    timestamps are big endian so keys sort by time, primary keys hold them little endian
+static const uint32_t SMSG_INDEX_VERSION = 2;
+
+static bool SmesgIndexBox(const uint8_t* chKey, char& chBox)
+{
+    if (chKey[1] != 'm'
+        || (chKey[0] != 'i' && chKey[0] != 's'))
+        return false;
+    chBox = chKey[0];
+    return true;
+};
+
+static std::string SmesgTimeIndexKey(char chBox)
+{
+    std::string sKey;
+    sKey += chBox;
+    sKey += 't';
+    return sKey;
+};
+
+static const std::string& SmesgIndexAddress(char chBox, const SecMsgStored& smsgStored)
+{
+    // -- empty for inbox messages received with an anon key, they weren't decrypted
+    return chBox == 'i' ? smsgStored.sAddrFrom : smsgStored.sAddrTo;
+};
+
+static std::string SmesgAddressIndexKey(char chBox, const std::string& sAddress)
+{
+    std::string sKey;
+    sKey += chBox;
+    sKey += 'a';
+    sKey += (char) std::min(sAddress.size(), (size_t)255);
+    sKey.append(sAddress, 0, 255);
+    return sKey;
+};
+
+static std::string SmesgIndexSuffix(const uint8_t* chKey)
+{
+    int64_t timestamp;
+    memcpy(&timestamp, &chKey[2], 8);
+
+    std::string sKey;
+    for (int i = 7; i >= 0; --i)
+        sKey += (char) ((timestamp >> (i * 8)) & 0xFF);
+    sKey.append((const char*)chKey, 18);
+    return sKey;
+};
+
+static void WriteSmesgIndex(leveldb::WriteBatch* pbatch, const uint8_t* chKey, const SecMsgStored& smsgStored)
+{
+    char chBox;
+    if (!SmesgIndexBox(chKey, chBox))
+        return;
+
+    std::string sSuffix = SmesgIndexSuffix(chKey);
+    pbatch->Put(SmesgTimeIndexKey(chBox) + sSuffix, "");
+    const std::string& sAddress = SmesgIndexAddress(chBox, smsgStored);
+    if (!sAddress.empty())
+        pbatch->Put(SmesgAddressIndexKey(chBox, sAddress) + sSuffix, "");
+    if (chBox != 'i')
+        return;
+    if (smsgStored.status & SMSG_MASK_UNREAD)
+        pbatch->Put(std::string("iu") + sSuffix, "");
+    else
+        pbatch->Delete(std::string("iu") + sSuffix);
+};
+
+static void ListSmesgIndex(leveldb::DB* pdb, const std::string& sIndex, uint32_t nSkip, uint32_t nCount,
+    std::vector<std::vector<uint8_t> >& vKeys)
+{
+    // -- newest first, from past the end of the range back
+    leveldb::Iterator* it = pdb->NewIterator(leveldb::ReadOptions());
+    it->Seek(sIndex + std::string(8 + 18 + 1, '\xff'));
+    if (it->Valid())
+        it->Prev();
+    else
+        it->SeekToLast();
+
+    for (; it->Valid(); it->Prev())
+    {
+        leveldb::Slice key = it->key();
+        if (key.size() != sIndex.size() + 8 + 18
+            || memcmp(key.data(), sIndex.data(), sIndex.size()) != 0)
+            break;
+
+        if (nSkip > 0)
+        {
+            nSkip--;
+            continue;
+        };
+
+        vKeys.push_back(std::vector<uint8_t>(key.data() + key.size() - 18, key.data() + key.size()));
+        if (nCount > 0 && vKeys.size() >= nCount)
+            break;
+    };
+    delete it;
+};
+
+bool SecMsgDB::ListSmesg(const std::string& prefix, uint32_t nSkip, uint32_t nCount, std::vector<std::vector<uint8_t> >& vKeys)
+{
+    char chBox;
+    if (!pdb
+        || prefix.size() != 2
+        || !SmesgIndexBox((const uint8_t*)prefix.data(), chBox))
+        return false;
+
+    ListSmesgIndex(pdb, SmesgTimeIndexKey(chBox), nSkip, nCount, vKeys);
+    return true;
+};
+
+bool SecMsgDB::ListSmesgByAddress(const std::string& prefix, const std::string& sAddress, uint32_t nSkip, uint32_t nCount,
+    std::vector<std::vector<uint8_t> >& vKeys)
+{
+    char chBox;
+    if (!pdb
+        || prefix.size() != 2
+        || !SmesgIndexBox((const uint8_t*)prefix.data(), chBox))
+        return false;
+
+    ListSmesgIndex(pdb, SmesgAddressIndexKey(chBox, sAddress), nSkip, nCount, vKeys);
+    return true;
+};
+
+bool SecMsgDB::ListSmesgUnread(uint32_t nSkip, uint32_t nCount, std::vector<std::vector<uint8_t> >& vKeys)
+{
+    if (!pdb)
+        return false;
+
+    ListSmesgIndex(pdb, "iu", nSkip, nCount, vKeys);
+    return true;
+};
+
+bool SecMsgDB::BuildSmesgIndex()
+{
+    // -- once, for dbs written before the index keys were or with an older index
+    if (!pdb)
+        return false;
+
+    std::string sMarker("ix");
+    std::string strValue;
+    if (pdb->Get(leveldb::ReadOptions(), sMarker, &strValue).ok())
+    {
+        uint32_t nVersion = 0;
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> nVersion;
+        } catch (std::exception& e) {
+            LogPrintf("%s: unserialize threw: %s.\n", __func__, e.what());
+        }
+        if (nVersion == SMSG_INDEX_VERSION)
+            return true;
+
+        // -- version 1 keyed the inbox by the address received with, drop every index key
+        leveldb::WriteBatch batch;
+        const char* aIndexes[] = {"ia", "sa", "iu", "it", "st"};
+        for (int i = 0; i < 5; ++i)
+        {
+            leveldb::Iterator* it = NewIterator();
+            for (it->Seek(aIndexes[i]); it->Valid() && it->key().starts_with(aIndexes[i]); it->Next())
+                batch.Delete(it->key());
+            delete it;
+        };
+        if (!pdb->Write(SmsgWriteOptions(false), &batch).ok())
+            return error("%s: Write failed.", __func__);
+    };
+
+    int64_t nStart = GetTimeMillis();
+    uint32_t nMessages = 0;
+    uint8_t chKey[18];
+    SecMsgStored smsgStored;
+    const char* aPrefixes[] = {"im", "sm"};
+    for (int i = 0; i < 2; ++i)
+    {
+        std::string sPrefix(aPrefixes[i]);
+        leveldb::WriteBatch batch;
+        leveldb::Iterator* it = NewIterator();
+        while (NextSmesg(it, sPrefix, chKey, smsgStored))
+        {
+            WriteSmesgIndex(&batch, chKey, smsgStored);
+            nMessages++;
+        };
+        delete it;
+
+        if (!pdb->Write(SmsgWriteOptions(false), &batch).ok())
+            return error("%s: Write failed.", __func__);
+    };
+
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << SMSG_INDEX_VERSION;
+    if (!pdb->Put(SmsgWriteOptions(true), sMarker, ssValue.str()).ok())
+        return error("%s: Write failed.", __func__);
+
+    LogPrintf("Indexed %u stored messages in %d ms.\n", nMessages, GetTimeMillis() - nStart);
+    return true;
+};
+
+
 bool SecMsgDB::NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* chKey, SecMsgStored& smsgStored)
 {
     if (!pdb)
@@ -524,15 +959,19 @@ bool SecMsgDB::WriteSmesg(uint8_t* chKey, SecMsgStored& smsgStored)
     CDataStream ssValue(SER_DISK, CLIENT_VERSION);
     ssValue << smsgStored;
 
+    // -- the message and its index keys are written together
+    leveldb::WriteBatch batch;
+    leveldb::WriteBatch* pbatch = activeBatch ? activeBatch : &batch;
+    pbatch->Put(ssKey.str(), ssValue.str());
+    WriteSmesgIndex(pbatch, chKey, smsgStored);
+
     if (activeBatch)
     {
-        activeBatch->Put(ssKey.str(), ssValue.str());
+        fSyncBatch = true;
         return true;
     };
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    leveldb::Status s = pdb->Write(SmsgWriteOptions(true), &batch);
     if (!s.ok())
     {
         LogPrintf("SecMsgDB write failed: %s\n", s.ToString().c_str());
@@ -570,15 +1009,41 @@ bool SecMsgDB::EraseSmesg(uint8_t* chKey)
     CDataStream ssKey(SER_DISK, CLIENT_VERSION);
     ssKey.write((const char*)chKey, 18);
 
+    leveldb::WriteBatch batch;
+    leveldb::WriteBatch* pbatch = activeBatch ? activeBatch : &batch;
+    pbatch->Delete(ssKey.str());
+
+    char chBox;
+    if (SmesgIndexBox(chKey, chBox))
+    {
+        // -- the address key needs the stored message, read past any active batch
+        //    a message written and erased in the same batch leaves its address key behind
+        pbatch->Delete(SmesgTimeIndexKey(chBox) + SmesgIndexSuffix(chKey));
+        std::string strValue;
+        if (pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue).ok())
+        {
+            try {
+                SecMsgStored smsgStored;
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> smsgStored;
+                const std::string& sAddress = SmesgIndexAddress(chBox, smsgStored);
+                if (!sAddress.empty())
+                    pbatch->Delete(SmesgAddressIndexKey(chBox, sAddress) + SmesgIndexSuffix(chKey));
+            } catch (std::exception& e) {
+                LogPrintf("SecMsgDB::EraseSmesg() unserialize threw: %s.\n", e.what());
+            }
+        };
+        if (chBox == 'i')
+            pbatch->Delete(std::string("iu") + SmesgIndexSuffix(chKey));
+    };
+
     if (activeBatch)
     {
-        activeBatch->Delete(ssKey.str());
+        fSyncBatch = true;
         return true;
     };
 
-    leveldb::WriteOptions writeOptions;
-    writeOptions.sync = true;
-    leveldb::Status s = pdb->Delete(writeOptions, ssKey.str());
+    leveldb::Status s = pdb->Write(SmsgWriteOptions(true), &batch);
 
     if (s.ok() || s.IsNotFound())
         return true;
@@ -606,6 +1071,8 @@ void ThreadSecureMsg()
         int64_t cutoffTime = now - SMSG_RETENTION;
         {
             LOCK(cs_smsg);
+            SecureMsgFlushStore();
+
             for (std::map<int64_t, SecMsgBucket>::iterator it(smsgBuckets.begin()); it != smsgBuckets.end(); )
             {
                 //if (fDebugSmsg)
@@ -631,6 +1098,16 @@ void ThreadSecureMsg()
                         LogPrintf("Path %s does not exist \n", fullPath.string().c_str());
                     };
 
+                    fullPath = GetDataDir() / "smsgStore" / (fileName + "_01.idx");
+                    if (fs::exists(fullPath))
+                    {
+                        try { fs::remove(fullPath);
+                        } catch (const fs::filesystem_error& ex)
+                        {
+                            LogPrintf("Error removing bucket index %s.\n", ex.what());
+                        };
+                    };
+
                     // -- look for a wl file, it stores incoming messages when wallet is locked
                     fullPath = GetDataDir() / "smsgStore" / (fileName + "_01_wl.dat");
                     if (fs::exists(fullPath))
@@ -708,55 +1185,89 @@ void ThreadSecureMsgPow()
 {
     // -- proof of work thread
 
-    int rv;
-    std::vector<uint8_t> vchKey;
-    SecMsgStored smsgStored;
-
     std::string sPrefix("qm");
-    uint8_t chKey[18];
 
+    int nThreads = GetSecMsgPowThreads();
+    LogPrintf("Using %d threads for secure message proof of work\n", nThreads);
 
     while (fSecMsgEnabled)
     {
         // -- sleep at end, then fSecMsgEnabled is tested on wake
 
         SecMsgDB dbOutbox;
-        leveldb::Iterator* it;
+
+        // -- fifo (smallest key first), a batch is read then the lock is released, the work takes long
+        std::vector<SecMsgStored> vStored;
+        std::vector<std::vector<uint8_t> > vKeys;
+        uint64_t nQueued = 0;
         {
             LOCK(cs_smsgDB);
 
             if (!dbOutbox.Open("cr+"))
                 continue;
 
-            // -- fifo (smallest key first)
-            it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbOutbox.NewIterator();
+            uint8_t chKey[18];
+            SecMsgStored smsgStored;
+            while (vStored.size() < SMSG_POW_BATCH
+                && dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            {
+                vStored.push_back(smsgStored);
+                vKeys.push_back(std::vector<uint8_t>(chKey, chKey + 18));
+            };
+            nQueued = vStored.size();
+            if (nQueued == SMSG_POW_BATCH)
+                while (dbOutbox.NextSmesgKey(it, sPrefix, chKey))
+                    nQueued++;
+            delete it;
         }
-        // -- break up lock, SecureMsgSetHash will take long
+        SetSecMsgPowQueued(nQueued);
 
-        for (;;)
+        if (vStored.empty())
         {
-            {
-                LOCK(cs_smsgDB);
-                if (!dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
-                    break;
-            }
+            // -- shutdown thread waits 5 seconds, this should be less
+            MilliSleep(2000); // seconds
+            continue;
+        };
 
-            uint8_t* pHeader = &smsgStored.vchMessage[0];
-            uint8_t* pPayload = &smsgStored.vchMessage[SMSG_HDR_LEN];
+        std::vector<SecMsgPowJob> vJobs;
+        for (size_t i = 0; i < vStored.size(); ++i)
+        {
+            uint8_t* pHeader = &vStored[i].vchMessage[0];
             SecureMessage* psmsg = (SecureMessage*) pHeader;
+            vJobs.push_back(SecMsgPowJob(pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload));
+        };
 
-            // -- do proof of work
-            rv = SecureMsgSetHash(pHeader, pPayload, psmsg->nPayload);
-            if (rv == 2)
-                break; // leave message in db, if terminated due to shutdown
+        // -- do proof of work
+        SecureMsgPowBatch(vJobs, nThreads, fSecMsgEnabled);
 
-            // -- message is removed here, no matter what
-            {
-                LOCK(cs_smsgDB);
-                dbOutbox.EraseSmesg(chKey);
-            }
-            if (rv != 0)
-            {
+        // -- finished messages are removed here, no matter what, in one synced write
+        size_t nFinished = 0;
+        while (nFinished < vJobs.size()
+            && vJobs[nFinished].rv != 2) // leave message in db, if terminated due to shutdown
+            nFinished++;
+        if (nFinished > 0)
+        {
+            LOCK(cs_smsgDB);
+            dbOutbox.TxnBegin();
+            for (size_t i = 0; i < nFinished; ++i)
+                dbOutbox.EraseSmesg(&vKeys[i][0]);
+            if (!dbOutbox.TxnCommit())
+                LogPrintf("SecMsgPow: Could not remove messages from the queue.\n");
+        }
+        nQueued -= nFinished;
+        SetSecMsgPowQueued(nQueued);
+
+        for (size_t i = 0; i < nFinished; ++i)
+        {
+            int rv = vJobs[i].rv;
+
+            uint8_t* pHeader = vJobs[i].pHeader;
+            uint8_t* pPayload = vJobs[i].pPayload;
+            SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+            if (rv != 0)
+            {
                 LogPrintf("SecMsgPow: Could not get proof of work hash, message removed.\n");
                 continue;
             };
@@ -764,7 +1275,7 @@ void ThreadSecureMsgPow()
             // -- add to message store
             {
                 LOCK(cs_smsg);
-                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
+                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload) != 0)
                 {
                     LogPrintf("SecMsgPow: Could not place message in buckets, message removed.\n");
                     continue;
@@ -778,17 +1289,255 @@ void ThreadSecureMsgPow()
             };
         };
 
-        delete it;
+        {
+            LOCK(cs_smsg);
+            SecureMsgFlushStore();
+        }
+    };
+};
+
+// -- bucket files SecureMsgStore is appending to, guarded by cs_smsg
+class SecMsgBucketFile
+{
+public:
+    FILE*   fpData;
+    FILE*   fpIndex;
+    int64_t nDataSize;      // next message goes at this offset
+    int64_t nIndexSize;     // and its index record at this one
+};
+
+static std::map<int64_t, SecMsgBucketFile> mapSmsgBucketFiles;
+
+static fs::path SecureMsgBucketPath(int64_t bucket, const char* suffix)
+{
+    return GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + suffix);
+};
+
+static void SecureMsgWriteIndexRecord(uint8_t* p, const SecMsgToken& token)
+{
+    memcpy(p,      &token.timestamp, 8);
+    memcpy(p + 8,  token.sample,     8);
+    memcpy(p + 16, &token.offset,    8);
+    memcpy(p + 24, &token.nPayload,  4);
+};
+
+static void SecureMsgReadIndexRecord(const uint8_t* p, SecMsgToken& token)
+{
+    memcpy(&token.timestamp, p,      8);
+    memcpy(token.sample,     p + 8,  8);
+    memcpy(&token.offset,    p + 16, 8);
+    memcpy(&token.nPayload,  p + 24, 4);
+};
+
+static bool SecureMsgReadIndex(int64_t bucket, int64_t nDataSize, std::set<SecMsgToken>& tokenSet)
+{
+    /*
+    Load the tokens of a bucket from its index file.
+    Returns false if the index is missing or doesn't cover the data file exactly, it must be rebuilt.
+    */
+
+    fs::path pathIndex = SecureMsgBucketPath(bucket, "_01.idx");
+
+    FILE *fp;
+    if (!(fp = fopen(pathIndex.string().c_str(), "rb")))
+        return false;
+
+    std::vector<uint8_t> vchIndex;
+    long int nIndexSize = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        nIndexSize = ftell(fp);
+
+    if (nIndexSize < 0
+        || nIndexSize % SMSG_IDX_RECORD_LEN != 0)
+    {
+        fclose(fp);
+        return false;
+    };
+
+    vchIndex.resize(nIndexSize);
+    if (nIndexSize > 0
+        && (fseek(fp, 0, SEEK_SET) != 0
+            || fread(&vchIndex[0], sizeof(uint8_t), nIndexSize, fp) != (size_t)nIndexSize))
+    {
+        LogPrintf("fread index failed: %s\n", strerror(errno));
+        fclose(fp);
+        return false;
+    };
+    fclose(fp);
+
+    std::vector<SecMsgToken> vTokens(nIndexSize / SMSG_IDX_RECORD_LEN);
+    int64_t nEnd = 0;
+    for (size_t i = 0; i < vTokens.size(); ++i)
+    {
+        SecMsgToken& token = vTokens[i];
+        SecureMsgReadIndexRecord(&vchIndex[i * SMSG_IDX_RECORD_LEN], token);
+
+        if (token.offset < nEnd
+            || token.nPayload > SMSG_MAX_MSG_WORST
+            || token.offset + SMSG_HDR_LEN + token.nPayload > nDataSize)
+            return false;
+        nEnd = token.offset + SMSG_HDR_LEN + token.nPayload;
+    };
+
+    if (nEnd != nDataSize)
+        return false;
+
+    tokenSet.insert(vTokens.begin(), vTokens.end());
+    return true;
+};
+
+static int SecureMsgIndexBucket(int64_t bucket, int64_t nDataSize, std::set<SecMsgToken>& tokenSet)
+{
+    /*
+    Rebuild the index of a bucket by reading its data file, a torn message at the end is cut off.
+    */
 
-        // -- shutdown thread waits 5 seconds, this should be less
-        MilliSleep(2000); // seconds
+    fs::path pathData = SecureMsgBucketPath(bucket, "_01.dat");
+    fs::path pathIndex = SecureMsgBucketPath(bucket, "_01.idx");
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathData.string().c_str(), "rb")))
+        return errorN(1, "%s: Error opening file: %s.", __func__, strerror(errno));
+
+    std::vector<uint8_t> vchIndex;
+    SecureMessage smsg;
+    int64_t nEnd = 0;
+    for (;;)
+    {
+        SecMsgToken token;
+        token.offset = nEnd;
+        errno = 0;
+        if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+                LogPrintf("fread header failed: %s\n", strerror(errno));
+            break;
+        };
+
+        if (smsg.nPayload > SMSG_MAX_MSG_WORST
+            || token.offset + SMSG_HDR_LEN + smsg.nPayload > nDataSize)
+            break;
+
+        token.timestamp = smsg.timestamp;
+        token.nPayload = smsg.nPayload;
+        memset(token.sample, 0, 8);
+        if (smsg.nPayload >= 8
+            && fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
+        {
+            LogPrintf("fread data failed: %s\n", strerror(errno));
+            break;
+        };
+
+        nEnd = token.offset + SMSG_HDR_LEN + smsg.nPayload;
+        if (fseek(fp, nEnd, SEEK_SET) != 0)
+        {
+            LogPrintf("fseek, strerror: %s.\n", strerror(errno));
+            break;
+        };
+
+        // -- every message is indexed, as SecureMsgStore does, else the index never ends at the data size
+        tokenSet.insert(token);
+        vchIndex.resize(vchIndex.size() + SMSG_IDX_RECORD_LEN);
+        SecureMsgWriteIndexRecord(&vchIndex[vchIndex.size() - SMSG_IDX_RECORD_LEN], token);
+    };
+    fclose(fp);
+
+    if (nEnd < nDataSize)
+    {
+        LogPrintf("Bucket %d: dropping %d bytes after the last whole message.\n", bucket, nDataSize - nEnd);
+        try {
+            fs::resize_file(pathData, nEnd);
+        } catch (const fs::filesystem_error& ex)
+        {
+            return errorN(1, "%s: Error truncating bucket file %s.", __func__, ex.what());
+        };
+    };
+
+    errno = 0;
+    if (!(fp = fopen(pathIndex.string().c_str(), "wb")))
+        return errorN(1, "%s: Error opening file: %s.", __func__, strerror(errno));
+
+    if (!vchIndex.empty()
+        && fwrite(&vchIndex[0], sizeof(uint8_t), vchIndex.size(), fp) != vchIndex.size())
+    {
+        fclose(fp);
+        return errorN(1, "%s: fwrite failed: %s.", __func__, strerror(errno));
+    };
+    FileCommit(fp);
+    fclose(fp);
+
+    return 0;
+};
+
+static SecMsgBucketFile* SecureMsgOpenBucket(int64_t bucket)
+{
+    std::map<int64_t, SecMsgBucketFile>::iterator it = mapSmsgBucketFiles.find(bucket);
+    if (it != mapSmsgBucketFiles.end())
+        return &it->second;
+
+    if (mapSmsgBucketFiles.size() >= SMSG_MAX_OPEN_BUCKETS)
+        SecureMsgFlushStore();
+
+    fs::path pathData = SecureMsgBucketPath(bucket, "_01.dat");
+    fs::path pathIndex = SecureMsgBucketPath(bucket, "_01.idx");
+
+    SecMsgBucketFile file;
+    errno = 0;
+    if (!(file.fpData = fopen(pathData.string().c_str(), "ab")))
+    {
+        LogPrintf("fopen failed: %s.\n", strerror(errno));
+        return NULL;
+    };
+
+    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+    errno = 0;
+    if (fseek(file.fpData, 0, SEEK_END) != 0
+        || (file.nDataSize = ftell(file.fpData)) < 0)
+    {
+        LogPrintf("fseek failed: %s.\n", strerror(errno));
+        fclose(file.fpData);
+        return NULL;
+    };
+
+    if (!(file.fpIndex = fopen(pathIndex.string().c_str(), "ab")))
+    {
+        LogPrintf("fopen failed: %s.\n", strerror(errno));
+        fclose(file.fpData);
+        return NULL;
+    };
+
+    errno = 0;
+    if (fseek(file.fpIndex, 0, SEEK_END) != 0
+        || (file.nIndexSize = ftell(file.fpIndex)) < 0)
+    {
+        LogPrintf("fseek failed: %s.\n", strerror(errno));
+        fclose(file.fpData);
+        fclose(file.fpIndex);
+        return NULL;
+    };
+
+    return &(mapSmsgBucketFiles[bucket] = file);
+};
+
+void SecureMsgFlushStore()
+{
+    // -- data before index, an index record never points past synced data
+    for (std::map<int64_t, SecMsgBucketFile>::iterator it = mapSmsgBucketFiles.begin(); it != mapSmsgBucketFiles.end(); ++it)
+    {
+        FileCommit(it->second.fpData);
+        FileCommit(it->second.fpIndex);
+        fclose(it->second.fpData);
+        fclose(it->second.fpIndex);
     };
+    mapSmsgBucketFiles.clear();
 };
 
 int SecureMsgBuildBucketSet()
 {
     /*
-        Build the bucket set by scanning the files in the smsgStore dir.
+        Build the bucket set from the index file of each bucket in the smsgStore dir.
+        Indexes missing or out of step with their data file are rebuilt from it.
 
         smsgBuckets should be empty
     */
@@ -796,9 +1545,11 @@ int SecureMsgBuildBucketSet()
     if (fDebugSmsg)
         LogPrintf("SecureMsgBuildBucketSet()\n");
 
+    int64_t  nStart         = GetTimeMillis();
     int64_t  now            = GetTime();
     uint32_t nFiles         = 0;
     uint32_t nMessages      = 0;
+    uint32_t nRebuilt       = 0;
 
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
     fs::directory_iterator itend;
@@ -819,17 +1570,12 @@ int SecureMsgBuildBucketSet()
 
         std::string fileType = (*itd).path().extension().string();
 
-        if (fileType.compare(".dat") != 0)
+        if (fileType.compare(".dat") != 0
+            && fileType.compare(".idx") != 0)
             continue;
 
         std::string fileName = (*itd).path().filename().string();
 
-        if (fDebugSmsg)
-            LogPrintf("Processing file: %s.\n", fileName.c_str());
-
-        nFiles++;
-
-        // TODO files must be split if > 2GB
         // time_noFile.dat
         size_t sep = fileName.find_first_of("_");
         if (sep == std::string::npos)
@@ -851,6 +1597,9 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
+        if (fileType.compare(".idx") == 0)
+            continue; // read with its data file
+
         if (boost::algorithm::ends_with(fileName, "_wl.dat"))
         {
             if (fDebugSmsg)
@@ -858,60 +1607,34 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
+        if (fDebugSmsg)
+            LogPrintf("Processing file: %s.\n", fileName.c_str());
+
+        nFiles++;
+
+        int64_t nDataSize;
+        try {
+            nDataSize = fs::file_size((*itd).path());
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error reading bucket file %s, %s.\n", fileName.c_str(), ex.what());
+            continue;
+        };
+
         size_t nTokenSetSize = 0;
-        SecureMessage smsg;
         {
             LOCK(cs_smsg);
 
             std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
 
-            FILE *fp;
-
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
-
-            for (;;)
+            if (!SecureMsgReadIndex(fileTime, nDataSize, tokenSet))
             {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-
-                if (smsg.nPayload < 8)
-                    continue;
-
-                if (fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-
-                tokenSet.insert(token);
+                LogPrintf("Rebuilding index of bucket %d.\n", fileTime);
+                tokenSet.clear();
+                SecureMsgIndexBucket(fileTime, nDataSize, tokenSet);
+                nRebuilt++;
             };
 
-            fclose(fp);
-
             smsgBuckets[fileTime].hashBucket();
 
             nTokenSetSize = tokenSet.size();
@@ -922,7 +1645,8 @@ int SecureMsgBuildBucketSet()
             LogPrintf("Bucket %d contains %u messages.\n", fileTime, nTokenSetSize);
     };
 
-    LogPrintf("Processed %u files, loaded %u buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+    LogPrintf("Processed %u files, loaded %u buckets containing %u messages, rebuilt %u indexes, %d ms.\n",
+        nFiles, smsgBuckets.size(), nMessages, nRebuilt, GetTimeMillis() - nStart);
 
     return 0;
 };
@@ -986,6 +1710,7 @@ int SecureMsgAddWalletAddresses()
     if (fDebugSmsg)
         LogPrintf("Added %u addresses to whitelist.\n", nAdded);
 
+    SecureMsgReceiveKeysChanged();
     return 0;
 };
 
@@ -1058,6 +1783,7 @@ int SecureMsgReadIni()
     };
 
     LogPrintf("Loaded %u addresses.\n", smsgAddresses.size());
+    SecureMsgReceiveKeysChanged();
 
     fclose(fp);
 
@@ -1129,6 +1855,15 @@ int SecureMsgWriteIni()
 };
 
 
+static void SecureMsgIndexDB()
+{
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    if (!db.Open("cr+")
+        || !db.BuildSmesgIndex())
+        LogPrintf("SecureMsg could not index stored messages.\n");
+};
+
 /** called from AppInit2() in init.cpp */
 bool SecureMsgStart(bool fDontStart, bool fScanChain)
 {
@@ -1169,8 +1904,11 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
         return false;
     };
 
+    SecureMsgIndexDB();
+
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+    threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-unlock", &ThreadSecureMsgUnlocked));
 
     return true;
 };
@@ -1191,12 +1929,12 @@ bool SecureMsgShutdown()
     threadGroupSmsg.interrupt_all();
     threadGroupSmsg.join_all();
 
-    if (smsgDB)
     {
-        LOCK(cs_smsgDB);
-        delete smsgDB;
-        smsgDB = NULL;
-    };
+        LOCK(cs_smsg);
+        SecureMsgFlushStore();
+    }
+
+    SecureMsgCloseDB();
 
     return true;
 };
@@ -1236,9 +1974,12 @@ bool SecureMsgEnable()
 
     } // cs_smsg
 
+    SecureMsgIndexDB();
+
     // -- start threads
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+    threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-unlock", &ThreadSecureMsgUnlocked));
 
     /*
     if (!NewThread(ThreadSecureMsg, NULL)
@@ -1254,8 +1995,8 @@ bool SecureMsgEnable()
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
         {
-            pnode->PushMessage("smsgPing");
-            pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            pnode->PushMessage("smsgPing", SMSG_PROTO_RECON, pnode->smsgData.nLocalNonce);
+            pnode->PushMessage("smsgPong", SMSG_PROTO_RECON, pnode->smsgData.nLocalNonce); // Send pong as have missed initial ping sent by peer when it connected
         };
     } // cs_vNodes
     LogPrintf("Secure messaging enabled.\n");
@@ -1278,6 +2019,8 @@ bool SecureMsgDisable()
         threadGroupSmsg.interrupt_all();
         threadGroupSmsg.join_all();
 
+        SecureMsgFlushStore();
+
         // -- clear smsgBuckets
         std::map<int64_t, SecMsgBucket>::iterator it;
         it = smsgBuckets.begin();
@@ -1287,6 +2030,7 @@ bool SecureMsgDisable()
         };
         smsgBuckets.clear();
         smsgAddresses.clear();
+        SecureMsgWalletLocked(); // drop the resolved keys with the addresses
     } // cs_smsg
 
     // -- tell each smsg enabled peer that this node is disabling
@@ -1310,12 +2054,7 @@ bool SecureMsgDisable()
     MilliSleep(3000); // seconds
     // TODO be certain that threads have stopped
 
-    if (smsgDB)
-    {
-        LOCK(cs_smsgDB);
-        delete smsgDB;
-        smsgDB = NULL;
-    };
+    SecureMsgCloseDB();
 
 
     LogPrintf("Secure messaging disabled.\n");
@@ -1342,11 +2081,13 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             (3) send smsgShow with list of hashes to request.
 
         + smsgShow =
+        + smsgRecon =
+            peer's sketch of a bucket, reply smsgHave with the tokens it is missing
         + smsgHave =
         + smsgWant =
         + smsgMsg = ??
-        + smsgPing
-        + smsgPong
+        + smsgPing, smsgPong
+            protocol version and a nonce, the nonces of both sides salt the short ids of smsgRecon
         + smsgMatch
 
     */
@@ -1403,10 +2144,21 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             return false;
         };
 
+        bool fRecon;
+        uint64_t nSalt;
+        std::map<int64_t, uint32_t> mapReconLast, mapReconSent;
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            fRecon = pfrom->smsgData.nVersion >= SMSG_PROTO_RECON;
+            nSalt = pfrom->smsgData.GetReconSalt();
+            mapReconLast.swap(pfrom->smsgData.mapReconSent);
+        }
+
         std::vector<uint8_t> vchDataOut;
         vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
         vchDataOut.resize(4);
         uint32_t nShowBuckets = 0;
+        std::vector<std::vector<uint8_t> > vRecon;
 
 
         uint8_t *p = &vchData[4];
@@ -1445,13 +2197,18 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 continue;
             };
 
-            if (fDebugSmsg)
-            {
-                LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
-                LogPrintf("this bucket %d %u %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
-            };
             {
             LOCK(cs_smsg);
+                SecMsgBucket& bkt = smsgBuckets[time];
+                uint32_t nSize = bkt.setTokens.size();
+                uint32_t hashLocal = fRecon ? bkt.GetSetHash32() : bkt.GetHash();
+
+                if (fDebugSmsg)
+                {
+                    LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
+                    LogPrintf("this bucket %d %u %u.\n", time, nSize, hashLocal);
+                };
+
                 if (smsgBuckets[time].nLockCount > 0)
                 {
                     if (fDebugSmsg)
@@ -1462,10 +2219,37 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
 
                 // -- if this node has more than the peer node, peer node will pull from this
                 //    if then peer node has more this node will pull fom peer
-                if (smsgBuckets[time].setTokens.size() < ncontent
-                    || (smsgBuckets[time].setTokens.size() == ncontent
-                        && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
+                if (nSize < ncontent
+                    || (nSize == ncontent
+                        && hashLocal != hash)) // if same amount in buckets check hash
                 {
+                    // -- reconciled last round and nothing arrived since, short ids collide under
+                    //    this connection's salt, the whole bucket is requested instead
+                    std::map<int64_t, uint32_t>::iterator mi = mapReconLast.find(time);
+                    bool fReconStuck = mi != mapReconLast.end() && mi->second == hashLocal;
+
+                    uint64_t nCapacity = (uint64_t)ncontent - nSize + SMSG_RECON_SLACK;
+                    if (fRecon
+                        && !fReconStuck
+                        && nCapacity <= MAX_SKETCH_CAPACITY)
+                    {
+                        // -- send a sketch of this bucket, the peer replies with just the tokens missing here
+                        if (fDebugSmsg)
+                            LogPrintf("Reconciling bucket %d, capacity %u.\n", time, nCapacity);
+
+                        CReconSketch sketch = bkt.GetSketch(nCapacity, nSalt);
+
+                        std::vector<uint8_t> vchRecon(16 + 4 * nCapacity);
+                        memcpy(&vchRecon[0], &time, 8);
+                        memcpy(&vchRecon[8], &nSize, 4);
+                        uint32_t nCapacity32 = nCapacity;
+                        memcpy(&vchRecon[12], &nCapacity32, 4);
+                        memcpy(&vchRecon[16], &sketch.GetSyndromes()[0], 4 * nCapacity);
+                        vRecon.push_back(vchRecon);
+                        mapReconSent[time] = hashLocal;
+                        continue;
+                    };
+
                     if (fDebugSmsg)
                         LogPrintf("Requesting contents of bucket %d.\n", time);
 
@@ -1478,12 +2262,24 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             } // LOCK(cs_smsg);
         };
 
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            pfrom->smsgData.mapReconSent.swap(mapReconSent);
+        }
+
+        for (size_t i = 0; i < vRecon.size(); ++i)
+            pfrom->PushMessage("smsgRecon", vRecon[i]);
+
         // TODO: should include hash?
         memcpy(&vchDataOut[0], &nShowBuckets, 4);
         if (vchDataOut.size() > 4)
         {
             pfrom->PushMessage("smsgShow", vchDataOut);
         } else
+        if (!vRecon.empty())
+        {
+            // -- not matched until the peer answers
+        } else
         if (nLocked < 1) // Don't report buckets as matched if any are locked
         {
             // -- peer has no buckets we want, don't send them again until something changes
@@ -1556,56 +2352,137 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                     p += 16;
                 };
             }
+            {
+                LOCK(cs_smsgSyncStats);
+                smsgSyncStats.nShow++;
+                smsgSyncStats.nTokensSent += (vchDataOut.size() - 8) / 16;
+            }
             pfrom->PushMessage("smsgHave", vchDataOut);
         };
 
 
     } else
-    if (strCommand == "smsgHave")
+    if (strCommand == "smsgRecon")
     {
-        // -- peer has these messages in bucket
+        // -- peer's sketch of a bucket, combined with a sketch of ours it decodes to the tokens in one set and not the other
         std::vector<uint8_t> vchData;
         vRecv >> vchData;
 
-        if (vchData.size() < 8)
+        if (vchData.size() < 16)
+        {
+            pfrom->Misbehaving(1);
             return false;
-
-        int n = (vchData.size() - 8) / 16;
+        };
 
         int64_t time;
+        uint32_t nPeerTokens, nCapacity;
         memcpy(&time, &vchData[0], 8);
+        memcpy(&nPeerTokens, &vchData[8], 4);
+        memcpy(&nCapacity, &vchData[12], 4);
 
-        // -- Check time valid:
-        int64_t now = GetTime();
-        if (time < now - SMSG_RETENTION)
-        {
-            if (fDebugSmsg)
-                LogPrintf("Not interested in peer bucket %d, has expired.\n", time);
-            return false;
-        };
-        if (time > now + SMSG_TIME_LEEWAY)
+        if (nCapacity < 1
+            || nCapacity > MAX_SKETCH_CAPACITY
+            || vchData.size() != 16 + 4 * nCapacity)
         {
-            if (fDebugSmsg)
-                LogPrintf("Not interested in peer bucket %d, in the future.\n", time);
+            LogPrintf("smsgRecon, bad sketch from peer %d.\n", pfrom->id);
             pfrom->Misbehaving(1);
             return false;
         };
 
-        std::vector<uint8_t> vchDataOut;
+        std::vector<uint32_t> vSyndromes(nCapacity);
+        memcpy(&vSyndromes[0], &vchData[16], 4 * nCapacity);
+
+        uint64_t nSalt;
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            nSalt = pfrom->smsgData.GetReconSalt();
+        }
 
+        std::vector<uint8_t> vchDataOut;
+        bool fDecoded = false;
         {
             LOCK(cs_smsg);
-            if (smsgBuckets[time].nLockCount > 0)
+            std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(time);
+            if (itb == smsgBuckets.end())
             {
                 if (fDebugSmsg)
-                    LogPrintf("Bucket %d lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                    LogPrintf("Don't have bucket %d.\n", time);
                 return false;
             };
 
+            // -- on failure the whole bucket is listed, as for smsgShow
+            std::vector<SecMsgToken> vMissing;
+            fDecoded = itb->second.Reconcile(vSyndromes, vMissing, nSalt);
+
             if (fDebugSmsg)
-                LogPrintf("Sifting through bucket %d.\n", time);
+                LogPrintf("smsgRecon bucket %d, peer has %u, this %u, peer is missing %u%s.\n", time, nPeerTokens,
+                    itb->second.setTokens.size(), vMissing.size(), fDecoded ? "" : ", sketch failed");
 
-            vchDataOut.resize(8);
+            vchDataOut.resize(8 + 16 * vMissing.size());
+            memcpy(&vchDataOut[0], &time, 8);
+            for (size_t i = 0; i < vMissing.size(); ++i)
+            {
+                memcpy(&vchDataOut[8 + 16 * i], &vMissing[i].timestamp, 8);
+                memcpy(&vchDataOut[8 + 16 * i + 8], vMissing[i].sample, 8);
+            };
+        } // cs_smsg
+
+        {
+            LOCK(cs_smsgSyncStats);
+            smsgSyncStats.nRecon++;
+            if (!fDecoded)
+                smsgSyncStats.nReconFailed++;
+            smsgSyncStats.nTokensSent += (vchDataOut.size() - 8) / 16;
+        }
+
+        if (vchDataOut.size() > 8)
+            pfrom->PushMessage("smsgHave", vchDataOut);
+    } else
+    if (strCommand == "smsgHave")
+    {
+        // -- peer has these messages in bucket
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 8)
+            return false;
+
+        int n = (vchData.size() - 8) / 16;
+
+        int64_t time;
+        memcpy(&time, &vchData[0], 8);
+
+        // -- Check time valid:
+        int64_t now = GetTime();
+        if (time < now - SMSG_RETENTION)
+        {
+            if (fDebugSmsg)
+                LogPrintf("Not interested in peer bucket %d, has expired.\n", time);
+            return false;
+        };
+        if (time > now + SMSG_TIME_LEEWAY)
+        {
+            if (fDebugSmsg)
+                LogPrintf("Not interested in peer bucket %d, in the future.\n", time);
+            pfrom->Misbehaving(1);
+            return false;
+        };
+
+        std::vector<uint8_t> vchDataOut;
+
+        {
+            LOCK(cs_smsg);
+            if (smsgBuckets[time].nLockCount > 0)
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Bucket %d lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                return false;
+            };
+
+            if (fDebugSmsg)
+                LogPrintf("Sifting through bucket %d.\n", time);
+
+            vchDataOut.resize(8);
             memcpy(&vchDataOut[0], &vchData[0], 8);
 
             std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
@@ -1659,7 +2536,6 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         if (vchData.size() < 8)
             return false;
 
-        std::vector<uint8_t> vchOne;
         std::vector<uint8_t> vchBunch;
 
         vchBunch.resize(4+8); // nmessages + bucketTime
@@ -1686,6 +2562,8 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             std::set<SecMsgToken>& tokenSet = itb->second.setTokens;
             std::set<SecMsgToken>::iterator it;
             SecMsgToken token;
+            std::vector<SecMsgToken> vWanted;
+            size_t nBytes = vchBunch.size();
             uint8_t* p = &vchData[8];
             for (int i = 0; i < n; ++i)
             {
@@ -1699,30 +2577,23 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                         LogPrintf("Don't have wanted message %d.\n", token.timestamp);
                 } else
                 {
-                    //LogPrintf("Have message at %d.\n", it->offset); // DEBUG
-                    token.offset = it->offset;
-                    //LogPrintf("winb before SecureMsgRetrieve %d.\n", token.timestamp);
-
-                    // -- place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
-                    if (SecureMsgRetrieve(token, vchOne) == 0)
-                    {
-                        nBunch++;
-                        vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end()); // append
-                    } else
-                    {
-                        LogPrintf("SecureMsgRetrieve failed %d.\n", token.timestamp);
-                    };
+                    vWanted.push_back(*it);
+                    nBytes += SMSG_HDR_LEN + it->nPayload;
 
-                    if (nBunch >= 500
-                        || vchBunch.size() >= 96000)
+                    if (vWanted.size() >= 500
+                        || nBytes >= 96000)
                     {
                         if (fDebugSmsg)
-                            LogPrintf("Break bunch %u, %u.\n", nBunch, vchBunch.size());
+                            LogPrintf("Break bunch %u, %u.\n", vWanted.size(), nBytes);
                         break; // end here, peer will send more want messages if needed.
                     };
                 };
                 p += 16;
             };
+
+            // -- read the wanted messages from the bucket file in one pass
+            if (SecureMsgRetrieve(time, vWanted, vchBunch, nBunch) != 0)
+                LogPrintf("SecureMsgRetrieve failed for bucket %d, got %u of %u messages.\n", time, nBunch, vWanted.size());
         } // LOCK(cs_smsg);
 
         if (nBunch > 0)
@@ -1786,15 +2657,36 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
     if (strCommand == "smsgPing")
     {
         // -- smsgPing is the initial message, send reply
-        pfrom->PushMessage("smsgPong");
+        //    older nodes send it without a version, and ignore ours
+        uint32_t nVersion = 0;
+        uint64_t nNonce = 0;
+        if (!vRecv.empty())
+            vRecv >> nVersion;
+        if (!vRecv.empty())
+            vRecv >> nNonce;
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            pfrom->smsgData.nVersion = nVersion;
+            pfrom->smsgData.nPeerNonce = nNonce;
+        }
+        pfrom->PushMessage("smsgPong", SMSG_PROTO_RECON, pfrom->smsgData.nLocalNonce);
     } else
     if (strCommand == "smsgPong")
     {
+        uint32_t nVersion = 0;
+        uint64_t nNonce = 0;
+        if (!vRecv.empty())
+            vRecv >> nVersion;
+        if (!vRecv.empty())
+            vRecv >> nNonce;
+
         if (fDebugSmsg)
-             LogPrintf("Peer replied, secure messaging enabled.\n");
+             LogPrintf("Peer replied, secure messaging enabled, version %u.\n", nVersion);
 
         {
             LOCK(pfrom->smsgData.cs_smsg_net);
+            pfrom->smsgData.nVersion = nVersion;
+            pfrom->smsgData.nPeerNonce = nNonce;
             pfrom->smsgData.fEnabled = true;
         }
 
@@ -1864,7 +2756,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
         if (fDebugSmsg)
             LogPrintf("SecureMsgSendData() new node %s, peer id %u.\n", pto->addrName.c_str(), pto->id);
         // -- Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
-        pto->PushMessage("smsgPing");
+        pto->PushMessage("smsgPing", SMSG_PROTO_RECON, pto->smsgData.nLocalNonce);
         pto->smsgData.lastSeen = GetTime();
         return true;
     } else
@@ -1945,7 +2837,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
                     || nMessages < 1)                               // this bucket is empty
                     continue;
 
-                uint32_t hash = bkt.hash;
+                uint32_t hash = pto->smsgData.nVersion >= SMSG_PROTO_RECON ? bkt.GetSetHash32() : bkt.GetHash();
 
                 if(fDebugSmsg)
                     LogPrintf("Preparing bucket with hash %d for transfer to node %u. timeChanged=%d > lastMatched=%d\n", hash, pto->id, bkt.timeChanged, pto->smsgData.lastMatched);
@@ -2038,16 +2930,13 @@ int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey)
 };
 
 
-static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
-    uint32_t& nTransactions, uint32_t& nElements, uint32_t& nPubkeys, uint32_t& nDuplicates)
+void SecureMsgExtractPublicKeys(const CBlock& block, std::vector<CPubKey>& vPubKeys, uint32_t& nTransactions, uint32_t& nElements)
 {
-    AssertLockHeld(cs_smsgDB);
-
     valtype vch;
     opcodetype opcode;
 
     // -- only scan inputs of standard txns and coinstakes
-    BOOST_FOREACH(CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
     {
         // - harvest public keys from coinstake txns
         if (tx.IsCoinStake())
@@ -2070,12 +2959,7 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                         continue;
                     };
 
-                    CKeyID addrKey = pubKey.GetID();
-                    switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
-                    {
-                        case 0: nPubkeys++; break;      // added key
-                        case 4: nDuplicates++; break;   // duplicate key
-                    }
+                    vPubKeys.push_back(pubKey);
                     break;
                 };
             };
@@ -2089,12 +2973,10 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                     && tx.vin[i].IsAnonInput())
                     continue; // skip anon inputs
 
-                CScript *script = &tx.vin[i].scriptSig;
+                const CScript *script = &tx.vin[i].scriptSig;
                 CScript::const_iterator pc = script->begin();
                 CScript::const_iterator pend = script->end();
 
-                CKey key;
-
                 while (pc < pend)
                 {
                     if (!script->GetOp(pc, opcode, vch))
@@ -2111,31 +2993,66 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                             continue;
                         };
 
-                        CKeyID addrKey = pubKey.GetID();
-                        switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
-                        {
-                            case 0: nPubkeys++; break;      // added key
-                            case 4: nDuplicates++; break;   // duplicate key
-                        }
+                        vPubKeys.push_back(pubKey);
                         break;
                     };
-
-                    //LogPrintf("opcode %d, %s, value %s.\n", opcode, GetOpName(opcode), ValueString(vch).c_str());
                 };
                 nElements++;
             };
         };
         nTransactions++;
+    };
+};
+
+static bool SecureMsgWritePublicKeys(SecMsgDB& addrpkdb, const std::vector<CPubKey>& vPubKeys,
+    salted_hash_set<CKeyID>& setSeen, const CBlockIndex* pindexCheckpoint, uint32_t& nPubkeys, uint32_t& nDuplicates)
+{
+    // -- add the keys not in setSeen or the db in one batch, with the scan checkpoint if given
+    //    existence is checked before the batch is begun, ExistsPK would scan it for every key
+    AssertLockHeld(cs_smsgDB);
+
+    std::vector<std::pair<CKeyID, CPubKey> > vNew;
+    BOOST_FOREACH(const CPubKey& pubKey, vPubKeys)
+    {
+        CKeyID addrKey = pubKey.GetID();
+        if (!setSeen.insert(addrKey).second
+            || addrpkdb.ExistsPK(addrKey))
+        {
+            nDuplicates++;
+            continue;
+        };
+        vNew.push_back(std::make_pair(addrKey, pubKey));
+    };
+
+    if (vNew.empty() && !pindexCheckpoint)
+        return true;
 
-        if (nTransactions % 10000 == 0) // for ScanChainForPublicKeys
+    if (!addrpkdb.TxnBegin())
+        return false;
+
+    for (size_t i = 0; i < vNew.size(); ++i)
+    {
+        if (!addrpkdb.WritePK(vNew[i].first, vNew[i].second))
         {
-            LogPrintf("Scanning transaction no. %u.\n", nTransactions);
+            addrpkdb.TxnAbort();
+            return error("%s: WritePK failed.", __func__);
         };
     };
+
+    if (pindexCheckpoint
+        && !addrpkdb.WriteScanCheckpoint(pindexCheckpoint->GetBlockHash()))
+    {
+        addrpkdb.TxnAbort();
+        return error("%s: WriteScanCheckpoint failed.", __func__);
+    };
+
+    if (!addrpkdb.TxnCommit())
+        return false;
+
+    nPubkeys += vNew.size();
     return true;
 };
 
-
 bool SecureMsgScanBlock(CBlock& block)
 {
     // - scan block for public key addresses
@@ -2151,19 +3068,19 @@ bool SecureMsgScanBlock(CBlock& block)
     uint32_t nPubkeys       = 0;
     uint32_t nDuplicates    = 0;
 
+    std::vector<CPubKey> vPubKeys;
+    SecureMsgExtractPublicKeys(block, vPubKeys, nTransactions, nElements);
+
     {
         LOCK(cs_smsgDB);
-        CTxDB txdb("r");
 
         SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
+        if (!addrpkdb.Open("cw"))
             return false;
 
-        ScanBlock(block, txdb, addrpkdb,
-            nTransactions, nElements, nPubkeys, nDuplicates);
-
-        addrpkdb.TxnCommit();
+        salted_hash_set<CKeyID> setSeen;
+        if (!SecureMsgWritePublicKeys(addrpkdb, vPubKeys, setSeen, NULL, nPubkeys, nDuplicates))
+            return false;
     } // cs_smsgDB
 
     if (fDebugSmsg)
@@ -2172,50 +3089,192 @@ bool SecureMsgScanBlock(CBlock& block)
     return true;
 };
 
+
+class CSmsgChainScan
+{
+public:
+    const std::vector<CBlockIndex*>& vBlocks;
+    std::vector<std::vector<CPubKey> > vPubKeys;    // per block of the window
+    size_t nBegin, nEnd;                            // window, indexes into vBlocks
+    size_t nFailed;                                 // first block of the window that couldn't be read, nEnd if none
+    uint32_t nTransactions;
+    uint32_t nInputs;
+
+    CSmsgChainScan(const std::vector<CBlockIndex*>& vBlocksIn) : vBlocks(vBlocksIn)
+    {
+        nBegin = nEnd = nFailed = nNext = 0;
+        nTransactions = nInputs = 0;
+    }
+
+    void SetWindow(size_t nBeginIn, size_t nEndIn)
+    {
+        nBegin = nNext = nBeginIn;
+        nEnd = nFailed = nEndIn;
+        vPubKeys.clear();
+        vPubKeys.resize(nEnd - nBegin);
+    }
+
+    bool Next(size_t& n)
+    {
+        LOCK(cs);
+        if (nNext >= nEnd)
+            return false;
+        n = nNext++;
+        return true;
+    }
+
+    void SetFailed(size_t n)
+    {
+        LOCK(cs);
+        nFailed = std::min(nFailed, n);
+    }
+
+    void AddCounts(uint32_t nTransactionsIn, uint32_t nInputsIn)
+    {
+        LOCK(cs);
+        nTransactions += nTransactionsIn;
+        nInputs += nInputsIn;
+    }
+
+private:
+    CCriticalSection cs;
+    size_t nNext;
+};
+
+static void ThreadSecureMsgScanChain(CSmsgChainScan* pscan)
+{
+    // -- blocks are read and their keys extracted in any order, each into its own slot
+    size_t n;
+    while (pscan->Next(n))
+    {
+        boost::this_thread::interruption_point();
+
+        uint32_t nTransactions = 0;
+        uint32_t nInputs = 0;
+        CBlock block;
+        if (!block.ReadFromDisk(pscan->vBlocks[n], true))
+        {
+            LogPrintf("ScanChainForPublicKeys() Could not read block at height %d.\n", pscan->vBlocks[n]->nHeight);
+            pscan->SetFailed(n);
+        } else
+            SecureMsgExtractPublicKeys(block, pscan->vPubKeys[n - pscan->nBegin], nTransactions, nInputs);
+
+        pscan->AddCounts(nTransactions, nInputs);
+    };
+}
+
 bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
 {
     LogPrintf("Scanning block chain for public keys.\n");
     int64_t nStart = GetTimeMillis();
 
-    if (fDebugSmsg)
-        LogPrintf("From height %u.\n", pindexStart->nHeight);
-
     // -- public keys are in txin.scriptSig
     //    matching addresses are in scriptPubKey of txin's referenced output
 
-    uint32_t nBlocks        = 0;
-    uint32_t nTransactions  = 0;
-    uint32_t nInputs        = 0;
     uint32_t nPubkeys       = 0;
     uint32_t nDuplicates    = 0;
 
     {
         LOCK(cs_smsgDB);
-
-        CTxDB txdb("r");
-
         SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
+        if (!addrpkdb.Open("cw"))
             return false;
 
-        CBlockIndex* pindex = pindexStart;
-        while (pindex)
+        // -- resume an interrupted scan, blocks up to the checkpoint are in the db
+        uint256 hashCheckpoint;
+        if (addrpkdb.ReadScanCheckpoint(hashCheckpoint))
         {
-            nBlocks++;
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashCheckpoint);
+            if (mi != mapBlockIndex.end()
+                && mi->second->IsInMainChain()
+                && mi->second->nHeight >= pindexStart->nHeight
+                && mi->second->pnext)
+            {
+                pindexStart = mi->second->pnext;
+                LogPrintf("Resuming interrupted scan.\n");
+            };
+        };
+    } // cs_smsgDB
+
+    if (fDebugSmsg)
+        LogPrintf("From height %u.\n", pindexStart->nHeight);
+
+    std::vector<CBlockIndex*> vBlocks;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+        vBlocks.push_back(pindex);
+
+    CSmsgChainScan scan(vBlocks);
+    int nThreads = std::max(1, (int)boost::thread::hardware_concurrency());
 
-            ScanBlock(block, txdb, addrpkdb,
-                nTransactions, nInputs, nPubkeys, nDuplicates);
+    bool fInterrupted = false;
+    bool fFailed = false;
+    for (size_t nBegin = 0; nBegin < vBlocks.size(); nBegin += SMSG_SCAN_CHAIN_WINDOW)
+    {
+        if (ShutdownRequested())
+        {
+            fInterrupted = true;
+            break;
+        };
 
-            pindex = pindex->pnext;
+        scan.SetWindow(nBegin, std::min(vBlocks.size(), nBegin + SMSG_SCAN_CHAIN_WINDOW));
+        if (nThreads == 1)
+        {
+            ThreadSecureMsgScanChain(&scan);
+        } else
+        {
+            boost::thread_group threadGroup;
+            try
+            {
+                for (int i = 0; i < nThreads; ++i)
+                    threadGroup.create_thread(boost::bind(&ThreadSecureMsgScanChain, &scan));
+                threadGroup.join_all();
+            } catch (boost::thread_interrupted)
+            {
+                threadGroup.interrupt_all();
+                threadGroup.join_all();
+                throw;
+            };
         };
 
-        addrpkdb.TxnCommit();
-    } // cs_smsgDB
+        // -- keys are written in chain order, the checkpoint is the last block of the window,
+        //    or the last before a block that couldn't be read, which a later scan resumes from
+        std::vector<CPubKey> vPubKeys;
+        for (size_t i = 0; i < scan.nFailed - scan.nBegin; ++i)
+            vPubKeys.insert(vPubKeys.end(), scan.vPubKeys[i].begin(), scan.vPubKeys[i].end());
+
+        {
+            // -- setSeen only dedups within the window, committed keys are found by ExistsPK
+            salted_hash_set<CKeyID> setSeen;
+            LOCK(cs_smsgDB);
+            SecMsgDB addrpkdb;
+            if (!addrpkdb.Open("cw")
+                || !SecureMsgWritePublicKeys(addrpkdb, vPubKeys, setSeen,
+                    scan.nFailed > 0 ? vBlocks[scan.nFailed - 1] : NULL, nPubkeys, nDuplicates))
+                return false;
+        } // cs_smsgDB
 
-    LogPrintf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
+        if (scan.nFailed < scan.nEnd)
+        {
+            fFailed = true;
+            break;
+        };
+
+        LogPrintf("Scanned to height %d, %u transactions.\n", vBlocks[scan.nEnd - 1]->nHeight, scan.nTransactions);
+    };
+
+    if (fFailed)
+        return error("%s: Stopped at unreadable block at height %d.", __func__, vBlocks[scan.nFailed]->nHeight);
+
+    if (!fInterrupted)
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        if (addrpkdb.Open("cw"))
+            addrpkdb.EraseScanCheckpoint();
+    };
+
+    LogPrintf("Scanned %u blocks, %u transactions, %u inputs%s\n", scan.nEnd,
+        scan.nTransactions, scan.nInputs, fInterrupted ? ", interrupted" : "");
     LogPrintf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
     LogPrintf("Took %d ms\n", GetTimeMillis() - nStart);
 
@@ -2400,152 +3459,187 @@ bool SecureMsgScanBuckets()
 }
 
 
-int SecureMsgWalletUnlocked()
-{
-    /*
-    When the wallet is unlocked, scan messages received while wallet was locked.
-    */
-    if (!fSecMsgEnabled)
-        return 0;
+static bool SecureMsgMatchKey(EC_KEY* pkeyDest, const EC_POINT* pointR, SecureMessage* psmsg, uint8_t* pPayload, uint32_t nPayload, std::vector<uint8_t>& key_e);
+static int SecureMsgDecryptPayload(std::vector<uint8_t>& key_e, std::string& address, uint8_t* pHeader, uint8_t* pPayload, uint32_t nPayload, MessageData& msg);
 
-    LogPrintf("SecureMsgWalletUnlocked()\n");
+// -- smsgAddresses resolved to private keys for SecureMsgScanMessage, empty while the wallet is locked
+static boost::shared_mutex cs_smsgReceiveKeys;
+static std::vector<SecMsgReceiveKey> vSmsgReceiveKeys;
+static bool fSmsgReceiveKeysStale = true;
 
-    if (pwalletMain->IsLocked())
-    {
-        LogPrintf("Error: Wallet is locked.\n");
-        return 1;
-    };
+void SecureMsgReceiveKeysChanged()
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_smsgReceiveKeys);
+    fSmsgReceiveKeysStale = true;
+};
 
-    int64_t  now            = GetTime();
-    uint32_t nFiles         = 0;
-    uint32_t nMessages      = 0;
-    uint32_t nFoundMessages = 0;
+void SecureMsgWalletLocked()
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_smsgReceiveKeys);
+    vSmsgReceiveKeys.clear();
+    fSmsgReceiveKeysStale = true;
+};
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
+static void SecureMsgBuildReceiveKeys()
+{
+    LOCK(cs_smsg);
+    boost::unique_lock<boost::shared_mutex> lock(cs_smsgReceiveKeys);
 
-    if (!fs::exists(pathSmsgDir)
-        || !fs::is_directory(pathSmsgDir))
-    {
-        LogPrintf("Message store directory does not exist.\n");
-        return 0; // not an error
-    };
+    if (!fSmsgReceiveKeysStale)
+        return;
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
+    vSmsgReceiveKeys.clear();
+    if (!pwalletMain || pwalletMain->IsLocked())
+        return; // stays stale, built on unlock
 
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    int64_t nStart = GetTimeMicros();
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
     {
-        if (!fs::is_regular_file(itd->status()))
+        if (!it->fReceiveEnabled)
             continue;
 
-        std::string fileName = (*itd).path().filename().string();
-
-        if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
+        CBitcoinAddress coinAddress(it->sAddress);
+        SecMsgReceiveKey rk;
+        CKey key;
+        if (!coinAddress.GetKeyID(rk.keyId)
+            || !pwalletMain->GetKey(rk.keyId, key))
+        {
+            if (fDebugSmsg)
+                LogPrintf("SecureMsgBuildReceiveKeys(): No private key for %s.\n", it->sAddress.c_str());
             continue;
+        };
 
-        if (fDebugSmsg)
-            LogPrintf("Processing file: %s.\n", fileName.c_str());
+        rk.sAddress = coinAddress.ToString();
+        rk.fReceiveAnon = it->fReceiveAnon;
+        rk.pkey.reset(new CECKey());
+        rk.pkey->SetSecretBytes(key.begin());
+        EC_KEY_set_method(rk.pkey->GetECKey(), EC_KEY_OpenSSL());
+        vSmsgReceiveKeys.push_back(rk);
+    };
+    fSmsgReceiveKeysStale = false;
 
-        nFiles++;
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgBuildReceiveKeys(): %u keys in %d us.\n", vSmsgReceiveKeys.size(), GetTimeMicros() - nStart);
+};
 
-        // TODO files must be split if > 2GB
-        // time_noFile_wl.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
+class CSmsgKeyMatch
+{
+public:
+    SecureMessage* psmsg;
+    uint8_t* pPayload;
+    uint32_t nPayload;
+    const EC_POINT* pointR;
+
+    CCriticalSection cs;
+    int nMatch;                 // index into vSmsgReceiveKeys, -1 until found
+    std::vector<uint8_t> key_e;
+
+    CSmsgKeyMatch(uint8_t* pHeader, uint8_t* pPayloadIn, uint32_t nPayloadIn, const EC_POINT* pointRIn)
+    {
+        psmsg = (SecureMessage*) pHeader;
+        pPayload = pPayloadIn;
+        nPayload = nPayloadIn;
+        pointR = pointRIn;
+        nMatch = -1;
+    }
 
-        std::string stime = fileName.substr(0, sep);
+    bool Found()
+    {
+        LOCK(cs);
+        return nMatch >= 0;
+    }
+};
 
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+static void ThreadSecureMsgMatchKeys(CSmsgKeyMatch* pmatch, size_t nFirst, size_t nStep)
+{
+    // -- caller holds cs_smsgReceiveKeys shared
+    std::vector<uint8_t> key_e;
+    for (size_t i = nFirst; i < vSmsgReceiveKeys.size(); i += nStep)
+    {
+        if (pmatch->Found())
+            return;
 
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            LogPrintf("Dropping wallet locked file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
-            {
-                LogPrintf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
+        if (!SecureMsgMatchKey(vSmsgReceiveKeys[i].pkey->GetECKey(), pmatch->pointR,
+            pmatch->psmsg, pmatch->pPayload, pmatch->nPayload, key_e))
             continue;
-        };
 
+        LOCK(pmatch->cs);
+        if (pmatch->nMatch < 0)
         {
-            LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
-
-            for (;;)
-            {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
+            pmatch->nMatch = i;
+            pmatch->key_e = key_e;
+        };
+        return;
+    };
+};
 
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
+int SecureMsgMatchReceiveKeys(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, SecMsgReceiveKey& rkOut, std::vector<uint8_t>& key_e, bool fParallel)
+{
+    /* Find which receive key the message is addressed to.
+       One ECDH per key dominates, large key tables are split over threads which stop at the first match.
+       Callers scanning several messages at once on their own threads pass fParallel false.
 
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
+        returns
+            0 match, rkOut and key_e are set
+            1 error
+            2 no match
+    */
 
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+    if (psmsg->version[0] != 1)
+        return 2;
 
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
+    CPubKey cpkR(psmsg->cpkR, psmsg->cpkR+33);
+    CECKey ecKeyR;
+    if (!cpkR.IsValid()
+        || !ecKeyR.SetPubKey(cpkR))
+    {
+        return errorN(1, "%s: Could not set pubkey for key R.", __func__);
+    };
 
-                nMessages++;
-            };
+    bool fStale;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_smsgReceiveKeys);
+        fStale = fSmsgReceiveKeysStale;
+    }
+    if (fStale)
+        SecureMsgBuildReceiveKeys();
 
-            fclose(fp);
+    boost::shared_lock<boost::shared_mutex> lock(cs_smsgReceiveKeys);
+    size_t nKeys = vSmsgReceiveKeys.size();
+    if (nKeys == 0)
+        return 2;
 
-            // -- remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
-            {
-                LogPrintf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
-        } // cs_smsg
+    CSmsgKeyMatch match(pHeader, pPayload, nPayload, EC_KEY_get0_public_key(ecKeyR.GetECKey()));
+
+    int nThreads = std::min((int)boost::thread::hardware_concurrency(), (int)(nKeys / SMSG_SCAN_KEYS_PER_THREAD));
+    if (!fParallel || nThreads <= 1)
+    {
+        ThreadSecureMsgMatchKeys(&match, 0, 1);
+    } else
+    {
+        boost::thread_group threadGroup;
+        try
+        {
+            for (int i = 0; i < nThreads; ++i)
+                threadGroup.create_thread(boost::bind(&ThreadSecureMsgMatchKeys, &match, i, nThreads));
+            threadGroup.join_all();
+        } catch (boost::thread_interrupted)
+        {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
+        };
     };
 
-    LogPrintf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    if (match.nMatch < 0)
+        return 2;
 
-    // -- notify gui
-    NotifySecMsgWalletUnlocked();
+    rkOut = vSmsgReceiveKeys[match.nMatch];
+    key_e = match.key_e;
     return 0;
 };
 
-
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode)
 {
     /*
@@ -2587,10 +3681,15 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
 
     } // cs_smsg
 
+    SecureMsgReceiveKeysChanged();
+    if (!pwalletMain->IsLocked())
+        SecureMsgBuildReceiveKeys();
 
     return 0;
 };
 
+static int SecureMsgScanUnlocked(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui, bool fParallel, bool& fOwnMessage);
+
 int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui)
 {
     /*
@@ -2615,112 +3714,441 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
         if (fDebugSmsg)
             LogPrintf("ScanMessage: Wallet is locked, storing message to scan later.\n");
 
-        int rv;
-        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
-            return 1;
+        int rv;
+        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
+            return 1;
+
+        return 3;
+    };
+
+    bool fOwnMessage;
+    return SecureMsgScanUnlocked(pHeader, pPayload, nPayload, reportToGui, true, fOwnMessage);
+};
+
+static int SecureMsgScanUnlocked(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui, bool fParallel, bool& fOwnMessage)
+{
+    // -- SecureMsgScanMessage once the wallet is known to be unlocked, fOwnMessage is set if the message is for this node
+    std::string addressTo;
+    MessageData msg; // placeholder
+    fOwnMessage = false;
+
+    SecMsgReceiveKey rk;
+    std::vector<uint8_t> key_e;
+    if (SecureMsgMatchReceiveKeys(pHeader, pPayload, nPayload, rk, key_e, fParallel) == 0)
+    {
+        addressTo = rk.sAddress;
+        if (fDebugSmsg)
+            LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
+
+        if (!rk.fReceiveAnon)
+        {
+            // -- have to do full decrypt to see address from
+            if (SecureMsgDecryptPayload(key_e, addressTo, pHeader, pPayload, nPayload, msg) == 0
+                && msg.sFromAddress.compare("anon") != 0)
+                fOwnMessage = true;
+        } else
+        {
+            fOwnMessage = true;
+        };
+    };
+
+    if (fOwnMessage)
+    {
+        // -- save to inbox
+        SecureMessage* psmsg = (SecureMessage*) pHeader;
+        std::string sPrefix("im");
+        uint8_t chKey[18];
+        memcpy(&chKey[0],  sPrefix.data(),    2);
+        memcpy(&chKey[2],  &psmsg->timestamp, 8);
+        memcpy(&chKey[10], pPayload,          8);
+
+        SecMsgStored smsgInbox;
+        smsgInbox.timeReceived  = GetTime();
+        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
+        smsgInbox.sAddrTo       = addressTo;
+
+        // -- the sender is known if the payload was decrypted, not when received with an anon key
+        if (!msg.sFromAddress.empty())
+        {
+            smsgInbox.status   |= SMSG_MASK_FROM;
+            smsgInbox.sAddrFrom = msg.sFromAddress;
+        };
+
+        // -- data may not be contiguous
+        try {
+            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+        } catch (std::exception& e) {
+            LogPrintf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+            return 1;
+        };
+        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+
+        {
+            LOCK(cs_smsgDB);
+            SecMsgDB dbInbox;
+
+            if (dbInbox.Open("cw"))
+            {
+                if (dbInbox.ExistsSmesg(chKey))
+                {
+                    if (fDebugSmsg)
+                        LogPrintf("Message already exists in inbox db.\n");
+                } else
+                {
+                    dbInbox.WriteSmesg(chKey, smsgInbox);
+
+                    if (reportToGui)
+                        NotifySecMsgInboxChanged(smsgInbox);
+                    LogPrintf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+                };
+            };
+        } // cs_smsgDB
+
+        // notify an external script when a message comes in
+        std::string strCmd = GetArg("-smsgnotify", "");
+
+        //TODO: Format message
+        if (!strCmd.empty())
+        {
+            boost::replace_all(strCmd, "%s", addressTo);
+            boost::thread t(runCommand, strCmd); // thread runs free
+        };
+
+    };
+
+    return 0;
+};
+
+// -- messages received while the wallet was locked are scanned by ThreadSecureMsgUnlocked,
+//    SecureMsgWalletUnlocked only wakes it, it's called from CWallet::Unlock on the gui thread
+static boost::mutex cs_smsgUnlocked;
+static boost::condition_variable condSmsgUnlocked;
+static bool fSmsgUnlockPending = false;
+
+int SecureMsgWalletUnlocked()
+{
+    /*
+    When the wallet is unlocked, scan messages received while wallet was locked.
+    */
+    if (!fSecMsgEnabled)
+        return 0;
+
+    LogPrintf("SecureMsgWalletUnlocked()\n");
+
+    if (pwalletMain->IsLocked())
+    {
+        LogPrintf("Error: Wallet is locked.\n");
+        return 1;
+    };
+
+    SecureMsgReceiveKeysChanged();
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs_smsgUnlocked);
+        fSmsgUnlockPending = true;
+    }
+    condSmsgUnlocked.notify_one();
+    return 0;
+};
+
+static uint32_t SecureMsgCountUnscanned(const fs::path& path)
+{
+    // -- messages in a wl file, only the headers are read
+    AssertLockHeld(cs_smsg);
+
+    FILE *fp;
+    if (!(fp = fopen(path.string().c_str(), "rb")))
+        return 0;
+
+    uint32_t nMessages = 0;
+    SecureMessage smsg;
+    while (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) == (size_t)SMSG_HDR_LEN
+        && fseek(fp, smsg.nPayload, SEEK_CUR) == 0)
+        nMessages++;
+
+    fclose(fp);
+    return nMessages;
+};
+
+static bool SecureMsgReadUnscanned(const fs::path& path, std::vector<uint8_t>& vchData, std::vector<size_t>& vOffsets)
+{
+    // -- whole wl file into vchData, vOffsets gets the start of each message
+    AssertLockHeld(cs_smsg);
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(path.string().c_str(), "rb")))
+        return error("%s: Error opening file: %s", __func__, strerror(errno));
+
+    for (;;)
+    {
+        size_t nOffset = vchData.size();
+        SecureMessage* psmsg;
+        try { vchData.resize(nOffset + SMSG_HDR_LEN); } catch (std::exception& e)
+        {
+            fclose(fp);
+            return error("%s: Could not resize vchData, %s", __func__, e.what());
+        };
+
+        errno = 0;
+        if (fread(&vchData[nOffset], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+                LogPrintf("fread header failed: %s\n", strerror(errno));
+            vchData.resize(nOffset);
+            break;
+        };
+
+        psmsg = (SecureMessage*) &vchData[nOffset];
+        uint32_t nPayload = psmsg->nPayload;
+        try { vchData.resize(nOffset + SMSG_HDR_LEN + nPayload); } catch (std::exception& e)
+        {
+            fclose(fp);
+            return error("%s: Could not resize vchData, %u, %s", __func__, nPayload, e.what());
+        };
+
+        if (fread(&vchData[nOffset + SMSG_HDR_LEN], sizeof(uint8_t), nPayload, fp) != nPayload)
+        {
+            LogPrintf("fread data failed: %s\n", strerror(errno));
+            vchData.resize(nOffset);
+            break;
+        };
+
+        vOffsets.push_back(nOffset);
+    };
+
+    fclose(fp);
+    return true;
+};
+
+
+class CSmsgUnscannedBatch
+{
+public:
+    std::vector<uint8_t>& vchData;
+    const std::vector<size_t>& vOffsets;
+    uint32_t nFound;
+
+    CSmsgUnscannedBatch(std::vector<uint8_t>& vchDataIn, const std::vector<size_t>& vOffsetsIn)
+        : vchData(vchDataIn), vOffsets(vOffsetsIn)
+    {
+        nFound = 0;
+        nNext = 0;
+    }
+
+    bool Next(size_t& n)
+    {
+        LOCK(cs);
+        if (nNext >= vOffsets.size())
+            return false;
+        n = nNext++;
+        return true;
+    }
+
+    void Found()
+    {
+        LOCK(cs);
+        nFound++;
+    }
+
+private:
+    CCriticalSection cs;
+    size_t nNext;
+};
+
+static void ThreadSecureMsgScanUnscanned(CSmsgUnscannedBatch* pbatch)
+{
+    // -- each thread takes the next message, keys are matched on this thread only
+    size_t n;
+    while (pbatch->Next(n))
+    {
+        boost::this_thread::interruption_point();
+
+        uint8_t* pHeader = &pbatch->vchData[pbatch->vOffsets[n]];
+        SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+        bool fFound = false;
+        SecureMsgScanUnlocked(pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload, false, false, fFound);
+        if (fFound)
+            pbatch->Found();
+    };
+}
+
+static void SecureMsgScanUnscannedFiles()
+{
+    if (pwalletMain->IsLocked())
+        return;
+
+    int64_t nStart = GetTimeMillis();
+    int64_t now = GetTime();
+
+    SecureMsgBuildReceiveKeys();
+
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    fs::directory_iterator itend;
+
+    if (!fs::exists(pathSmsgDir)
+        || !fs::is_directory(pathSmsgDir))
+    {
+        LogPrintf("Message store directory does not exist.\n");
+        NotifySecMsgWalletUnlocked(0, 0);
+        return;
+    };
+
+    // -- list the wl files and count their messages, for progress
+    std::vector<fs::path> vFiles;
+    uint32_t nTotal = 0;
+    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    {
+        if (!fs::is_regular_file(itd->status()))
+            continue;
+
+        std::string fileName = (*itd).path().filename().string();
+
+        if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
+            continue;
+
+        // TODO files must be split if > 2GB
+        // time_noFile_wl.dat
+        size_t sep = fileName.find_first_of("_");
+        if (sep == std::string::npos)
+            continue;
+
+        std::string stime = fileName.substr(0, sep);
+
+        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
 
-        return 3;
+        if (fileTime < now - SMSG_RETENTION)
+        {
+            LogPrintf("Dropping wallet locked file %s, expired.\n", fileName.c_str());
+            try {
+                fs::remove((*itd).path());
+            } catch (const boost::filesystem::filesystem_error& ex)
+            {
+                LogPrintf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
+            };
+            continue;
+        };
+
+        LOCK(cs_smsg);
+        nTotal += SecureMsgCountUnscanned((*itd).path());
+        vFiles.push_back((*itd).path());
     };
 
-    std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
+    uint32_t nFiles         = 0;
+    uint32_t nMessages      = 0;
+    uint32_t nFoundMessages = 0;
+    bool fLocked = false;
 
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    BOOST_FOREACH(const fs::path& path, vFiles)
     {
-        if (!it->fReceiveEnabled)
-            continue;
+        if (!fSecMsgEnabled)
+            return;
 
-        CBitcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
+        if (pwalletMain->IsLocked())
+        {
+            fLocked = true;
+            break;
+        };
+
+        if (fDebugSmsg)
+            LogPrintf("Processing file: %s.\n", path.filename().string().c_str());
 
-        if (!it->fReceiveAnon)
+        // -- the file stays until its messages are scanned, if interrupted or locked part way
+        //    through they're scanned again next time, those already saved are skipped
+        std::vector<uint8_t> vchData;
+        std::vector<size_t> vOffsets;
         {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
+            LOCK(cs_smsg);
+            if (!SecureMsgReadUnscanned(path, vchData, vOffsets))
+                continue;
+        } // cs_smsg
 
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
+        CSmsgUnscannedBatch batch(vchData, vOffsets);
+        int nThreads = std::min((int)boost::thread::hardware_concurrency(), (int)vOffsets.size());
+        if (nThreads <= 1)
+        {
+            ThreadSecureMsgScanUnscanned(&batch);
         } else
         {
-
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
+            boost::thread_group threadGroup;
+            try
             {
-                if (fDebugSmsg)
-                    LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
-
-                fOwnMessage = true;
-                break;
+                for (int i = 0; i < nThreads; ++i)
+                    threadGroup.create_thread(boost::bind(&ThreadSecureMsgScanUnscanned, &batch));
+                threadGroup.join_all();
+            } catch (boost::thread_interrupted)
+            {
+                threadGroup.interrupt_all();
+                threadGroup.join_all();
+                throw;
             };
-        }
-    };
-
-    if (fOwnMessage)
-    {
-        // -- save to inbox
-        SecureMessage* psmsg = (SecureMessage*) pHeader;
-        std::string sPrefix("im");
-        uint8_t chKey[18];
-        memcpy(&chKey[0],  sPrefix.data(),    2);
-        memcpy(&chKey[2],  &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload,          8);
-
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived  = GetTime();
-        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
-        smsgInbox.sAddrTo       = addressTo;
+        };
 
-        // -- data may not be contiguous
-        try {
-            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
-        } catch (std::exception& e) {
-            LogPrintf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
+        if (pwalletMain->IsLocked())
+        {
+            // -- locked part way through, the receive keys may have gone, the file is kept
+            fLocked = true;
+            break;
         };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
 
         {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
+            // -- messages stored while the file was scanned were appended after those read, they're kept
+            LOCK(cs_smsg);
+            std::vector<uint8_t> vchAll;
+            std::vector<size_t> vAllOffsets;
+            if (!SecureMsgReadUnscanned(path, vchAll, vAllOffsets))
+                vAllOffsets.clear();
 
-            if (dbInbox.Open("cw"))
+            try {
+                fs::remove(path);
+            } catch (const boost::filesystem::filesystem_error& ex)
             {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    if (fDebugSmsg)
-                        LogPrintf("Message already exists in inbox db.\n");
-                } else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
+                LogPrintf("Error removing wl file %s - %s\n", path.string().c_str(), ex.what());
+                continue;
+            };
 
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    LogPrintf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
-                };
+            for (size_t i = vOffsets.size(); i < vAllOffsets.size(); ++i)
+            {
+                uint8_t* pHeader = &vchAll[vAllOffsets[i]];
+                SecureMsgStoreUnscanned(pHeader, pHeader + SMSG_HDR_LEN, ((SecureMessage*)pHeader)->nPayload);
             };
-        } // cs_smsgDB
+        } // cs_smsg
 
-        // notify an external script when a message comes in
-        std::string strCmd = GetArg("-smsgnotify", "");
+        nFiles++;
+        nMessages += vOffsets.size();
+        nFoundMessages += batch.nFound;
 
-        //TODO: Format message
-        if (!strCmd.empty())
+        if (nMessages < nTotal)
+            NotifySecMsgWalletUnlocked(nMessages, nTotal);
+    };
+
+    LogPrintf("Processed %u files, scanned %u messages, received %u messages in %d ms%s.\n",
+        nFiles, nMessages, nFoundMessages, GetTimeMillis() - nStart, fLocked ? ", wallet locked" : "");
+
+    // -- notify gui, nScanned == nTotal when done
+    if (!fLocked)
+        NotifySecMsgWalletUnlocked(nMessages, nMessages);
+};
+
+static void ThreadSecureMsgUnlocked()
+{
+    // -- waits for SecureMsgWalletUnlocked, the wait is interrupted when secure messaging stops
+    while (fSecMsgEnabled)
+    {
         {
-            boost::replace_all(strCmd, "%s", addressTo);
-            boost::thread t(runCommand, strCmd); // thread runs free
-        };
+            boost::unique_lock<boost::mutex> lock(cs_smsgUnlocked);
+            while (!fSmsgUnlockPending)
+                condSmsgUnlocked.wait(lock);
+            fSmsgUnlockPending = false;
+        }
 
+        SecureMsgScanUnscannedFiles();
     };
-
-    return 0;
 };
 
+
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut)
 {
     if (fDebugSmsg)
@@ -2851,23 +4279,32 @@ int SecureMsgAddAddress(std::string& address, std::string& publicKey)
     return SecureMsgInsertAddress(hashKey, pubKey);
 };
 
-int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData)
+static bool SecMsgTokenOffsetLess(const SecMsgToken& a, const SecMsgToken& b)
+{
+    return a.offset < b.offset;
+};
+
+int SecureMsgRetrieve(int64_t bucket, std::vector<SecMsgToken>& vTokens, std::vector<uint8_t>& vchData, uint32_t& nRetrieved)
 {
+    /*
+    Append the messages of vTokens to vchData in file order, vTokens is sorted.
+    Messages less than SMSG_RETRIEVE_MAX_GAP apart are read together, usually the whole set is one read.
+    */
+
     if (fDebugSmsg)
-        LogPrintf("SecureMsgRetrieve() %d.\n", token.timestamp);
+        LogPrintf("SecureMsgRetrieve() bucket %d, %u messages.\n", bucket, vTokens.size());
 
     // -- has cs_smsg lock from SecureMsgReceiveData
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    nRetrieved = 0;
+    if (vTokens.empty())
+        return 0;
 
-    //LogPrintf("token.offset %d.\n", token.offset); // DEBUG
-    int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
+    std::map<int64_t, SecMsgBucketFile>::iterator itf = mapSmsgBucketFiles.find(bucket);
+    if (itf != mapSmsgBucketFiles.end())
+        fflush(itf->second.fpData);
 
-    //LogPrintf("bucket %d.\n", bucket);
-    //LogPrintf("bucket d %d.\n", bucket);
-    //LogPrintf("fileName %s.\n", fileName.c_str());
+    fs::path fullpath = SecureMsgBucketPath(bucket, "_01.dat");
 
     FILE *fp;
     errno = 0;
@@ -2877,39 +4314,54 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData)
         return 1;
     };
 
-    errno = 0;
-    if (fseek(fp, token.offset, SEEK_SET) != 0)
-    {
-        LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
+    std::sort(vTokens.begin(), vTokens.end(), SecMsgTokenOffsetLess);
 
-    SecureMessage smsg;
-    errno = 0;
-    if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+    std::vector<uint8_t> vchRead;
+    size_t i = 0;
+    while (i < vTokens.size())
     {
-        LogPrintf("fread header failed: %s\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
+        int64_t nRunStart = vTokens[i].offset;
+        int64_t nRunEnd = nRunStart + SMSG_HDR_LEN + vTokens[i].nPayload;
+        size_t j = i + 1;
+        while (j < vTokens.size()
+            && vTokens[j].offset - nRunEnd < SMSG_RETRIEVE_MAX_GAP)
+        {
+            nRunEnd = std::max(nRunEnd, vTokens[j].offset + SMSG_HDR_LEN + vTokens[j].nPayload);
+            j++;
+        };
 
-    try {
-        vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
-    } catch (std::exception& e) {
-        LogPrintf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + smsg.nPayload, e.what());
-        return 1;
-    };
+        try { vchRead.resize(nRunEnd - nRunStart); } catch (std::exception& e)
+        {
+            LogPrintf("SecureMsgRetrieve(): Could not resize vchRead, %d, %s\n", nRunEnd - nRunStart, e.what());
+            fclose(fp);
+            return 1;
+        };
 
-    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
-    errno = 0;
-    if (fread(&vchData[SMSG_HDR_LEN], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-    {
-        LogPrintf("fread data failed: %s. Wanted %u bytes.\n", strerror(errno), smsg.nPayload);
-        fclose(fp);
-        return 1;
-    };
+        errno = 0;
+        if (fseek(fp, nRunStart, SEEK_SET) != 0
+            || fread(&vchRead[0], sizeof(uint8_t), vchRead.size(), fp) != vchRead.size())
+        {
+            LogPrintf("fread data failed: %s. Wanted %u bytes at %d.\n", strerror(errno), vchRead.size(), nRunStart);
+            fclose(fp);
+            return 1;
+        };
+
+        for (; i < j; ++i)
+        {
+            const SecMsgToken& token = vTokens[i];
+            uint8_t* p = &vchRead[token.offset - nRunStart];
+            SecureMessage* psmsg = (SecureMessage*) p;
+            if (psmsg->timestamp != token.timestamp
+                || psmsg->nPayload != token.nPayload)
+            {
+                LogPrintf("SecureMsgRetrieve(): Message at %d does not match its token.\n", token.offset);
+                continue;
+            };
 
+            vchData.insert(vchData.end(), p, p + SMSG_HDR_LEN + token.nPayload);
+            nRetrieved++;
+        };
+    };
 
     fclose(fp);
 
@@ -2997,8 +4449,7 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
 
         {
             LOCK(cs_smsg);
-            // -- store message, but don't hash bucket
-            if (SecureMsgStore(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, false) != 0)
+            if (SecureMsgStore(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload) != 0)
             {
                 // message dropped
                 break; // continue?
@@ -3024,9 +4475,10 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
             return 1;
         };
 
+        SecureMsgFlushStore();
+
         itb->second.nLockCount  = 0; // this node has received data from peer, release lock
         itb->second.nLockPeerId = 0;
-        itb->second.hashBucket();
     } // cs_smsg
     return 0;
 };
@@ -3098,7 +4550,7 @@ int SecureMsgStoreUnscanned(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPaylo
 };
 
 
-int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool fUpdateBucket)
+int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
 {
     if (fDebugSmsg)
     {
@@ -3116,7 +4568,6 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
     SecureMessage* psmsg = (SecureMessage*) pHeader;
 
 
-    long int ofs;
     fs::path pathSmsgDir;
     try {
         pathSmsgDir = GetDataDir() / "smsgStore";
@@ -3142,10 +4593,8 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
 
     SecMsgToken token(psmsg->timestamp, pPayload, nPayload, 0);
 
-    std::set<SecMsgToken>& tokenSet = smsgBuckets[bucket].setTokens;
-    std::set<SecMsgToken>::iterator it;
-    it = tokenSet.find(token);
-    if (it != tokenSet.end())
+    SecMsgBucket& bkt = smsgBuckets[bucket];
+    if (bkt.setTokens.count(token))
     {
         LogPrintf("Already have message.\n");
         if (fDebugSmsg)
@@ -3158,53 +4607,46 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
             vchShow.resize(8);
             memcpy(&vchShow[0], token.sample, 8);
             LogPrintf(" sample %s\n", ValueString(vchShow).c_str());
-            /*
-            LogPrintf("\nmessages in bucket:\n");
-            for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
-            {
-                LogPrintf("message ts: %d", (*it).timestamp);
-                vchShow.resize(8);
-                memcpy(&vchShow[0], (*it).sample, 8);
-                LogPrintf(" sample %s\n", ValueString(vchShow).c_str());
-            };
-            */
         };
         return 1;
     };
 
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
+    SecMsgBucketFile* pfile = SecureMsgOpenBucket(bucket);
+    if (!pfile)
+        return errorN(1, "Could not open bucket %d.", bucket);
 
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "ab")))
-    {
-        return errorN(1, "fopen failed: %s.", strerror(errno));
-    };
+    token.offset = pfile->nDataSize;
+    uint8_t vchRecord[SMSG_IDX_RECORD_LEN];
+    SecureMsgWriteIndexRecord(vchRecord, token);
 
-    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
     errno = 0;
-    if (fseek(fp, 0, SEEK_END) != 0)
-        return errorN(1, "fseek failed: %s.", strerror(errno));
-
-    ofs = ftell(fp);
-
-    if (fwrite(pHeader,  sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
-     || fwrite(pPayload, sizeof(uint8_t),     nPayload, fp) != nPayload)
-    {
-        fclose(fp);
-        return errorN(1, "fwrite failed: %s.", strerror(errno));
+    if (fwrite(pHeader,  sizeof(uint8_t), SMSG_HDR_LEN, pfile->fpData) != (size_t)SMSG_HDR_LEN
+     || fwrite(pPayload, sizeof(uint8_t),     nPayload, pfile->fpData) != nPayload
+     || fwrite(vchRecord, sizeof(uint8_t), SMSG_IDX_RECORD_LEN, pfile->fpIndex) != (size_t)SMSG_IDX_RECORD_LEN)
+    {
+        // -- cut both files back to before this message, a rebuild stops at a partial record mid-file
+        int nErrno = errno;
+        int64_t nDataSize = pfile->nDataSize;
+        int64_t nIndexSize = pfile->nIndexSize;
+        SecureMsgFlushStore();
+        try {
+            fs::path pathData = SecureMsgBucketPath(bucket, "_01.dat");
+            fs::path pathIndex = SecureMsgBucketPath(bucket, "_01.idx");
+            if ((int64_t)fs::file_size(pathData) > nDataSize)
+                fs::resize_file(pathData, nDataSize);
+            if ((int64_t)fs::file_size(pathIndex) > nIndexSize)
+                fs::resize_file(pathIndex, nIndexSize);
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error truncating bucket %d: %s.\n", bucket, ex.what());
+        };
+        return errorN(1, "fwrite failed: %s.", strerror(nErrno));
     };
 
-    fclose(fp);
-
-    token.offset = ofs;
+    pfile->nDataSize += SMSG_HDR_LEN + nPayload;
+    pfile->nIndexSize += SMSG_IDX_RECORD_LEN;
 
-    //LogPrintf("token.offset: %d\n", token.offset); // DEBUG
-    tokenSet.insert(token);
-
-    if (fUpdateBucket)
-        smsgBuckets[bucket].hashBucket();
+    bkt.AddToken(token);
 
     if (fDebugSmsg)
         LogPrintf("SecureMsg added to bucket %d.\n", bucket);
@@ -3212,9 +4654,9 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
     return 0;
 };
 
-int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket)
+int SecureMsgStore(SecureMessage& smsg)
 {
-    return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
+    return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload);
 };
 
 int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
@@ -3265,9 +4707,7 @@ int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
         rv = 1; // error
     } else
     {
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)) ))
+        if (SecureMsgPowCheck(sha256Hash))
         {
             if (fDebugSmsg)
                 LogPrintf("Hash Valid.\n");
@@ -3299,97 +4739,33 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
 
     */
 
-    SecureMessage* psmsg = (SecureMessage*) pHeader;
-
     int64_t nStart = GetTimeMillis();
-    uint8_t civ[32];
-    uint8_t sha256Hash[32];
-
-    bool found = false;
-    HMAC_CTX *ctx;
-    ctx = HMAC_CTX_new();
 
-    uint32_t nonce = 0;
+    std::vector<SecMsgPowJob> vJobs;
+    vJobs.push_back(SecMsgPowJob(pHeader, pPayload, nPayload));
+    SecureMsgPowBatch(vJobs, GetSecMsgPowThreads(), fSecMsgEnabled);
 
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
-
-    // -- break for HMAC_CTX_free
-    for (;;)
-    {
-        if (!fSecMsgEnabled)
-           break;
-
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonce[0], &nonce, 4);
-
-        for (int i = 0; i < 32; i+=4)
-            memcpy(civ+i, &nonce, 4);
-
-        uint32_t nBytes;
-        if (!HMAC_Init_ex(ctx, &civ[0], 32, EVP_sha256(), NULL)
-            || !HMAC_Update(ctx, (uint8_t*) pHeader+4, SMSG_HDR_LEN-4)
-            || !HMAC_Update(ctx, (uint8_t*) pPayload, nPayload)
-            || !HMAC_Update(ctx, pPayload, nPayload)
-            || !HMAC_Final(ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
-        {
-            found = true;
-            if (fDebugSmsg)
-                LogPrintf("Match %u\n", nonce);
-            break;
-        };
-        */
-
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)) ))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebugSmsg)
-            //    LogPrintf("Match %u\n", nonce);
-            break;
-        }
-
-        //if (nonce >= UINT32_MAX)
-        if (nonce >= 4294967295U)
-        {
-            if (fDebugSmsg)
-                LogPrintf("No match %u\n", nonce);
-            break;
-            //return 1;
-        }
-        nonce++;
-    };
-
-    HMAC_CTX_free(ctx);
-
-    if (!fSecMsgEnabled)
+    int rv = vJobs[0].rv;
+    if (rv == 2)
     {
         if (fDebugSmsg)
             LogPrintf("SecureMsgSetHash() stopped, shutdown detected.\n");
         return 2;
     };
 
-    if (!found)
+    if (rv != 0)
     {
         if (fDebugSmsg)
-            LogPrintf("SecureMsgSetHash() failed, took %d ms, nonce %u\n", GetTimeMillis() - nStart, nonce);
+            LogPrintf("SecureMsgSetHash() failed, took %d ms\n", GetTimeMillis() - nStart);
         return 1;
     };
 
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
-
     if (fDebugSmsg)
+    {
+        uint32_t nonce;
+        memcpy(&nonce, &((SecureMessage*)pHeader)->nonce[0], 4);
         LogPrintf("SecureMsgSetHash() took %d ms, nonce %u\n", GetTimeMillis() - nStart, nonce);
+    };
 
     return 0;
 };
@@ -3882,29 +5258,44 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
 
     CECKey ecKeyDest;
     ecKeyDest.SetSecretBytes(keyDest.begin());
+    EC_KEY_set_method(ecKeyDest.GetECKey(), EC_KEY_OpenSSL());
 
-    // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
-    std::vector<uint8_t> vchP;
-    vchP.resize(32);
-    EC_KEY* pkeyk = ecKeyDest.GetECKey();
-    EC_KEY* pkeyR = ecKeyR.GetECKey();
+    std::vector<uint8_t> key_e;
+    if (!SecureMsgMatchKey(ecKeyDest.GetECKey(), EC_KEY_get0_public_key(ecKeyR.GetECKey()), psmsg, pPayload, nPayload, key_e))
+    {
+        if (fDebugSmsg)
+            LogPrintf("MAC does not match.\n"); // expected if message is not to address on node
+
+        return 1;
+    };
+
+    if (fTestOnly)
+        return 0;
+
+    return SecureMsgDecryptPayload(key_e, address, pHeader, pPayload, nPayload, msg);
+};
 
-    EC_KEY_set_method(pkeyk, EC_KEY_OpenSSL());
-    int lenPdec = ECDH_compute_key(&vchP[0], 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
+static bool SecureMsgMatchKey(EC_KEY* pkeyDest, const EC_POINT* pointR, SecureMessage* psmsg, uint8_t* pPayload, uint32_t nPayload, std::vector<uint8_t>& key_e)
+{
+    /* True if the message MAC checks with private key k, key_e is set to decrypt the payload.
+       pkeyDest must have the OpenSSL method set, threads may share it.
+    */
+
+    // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
+    uint8_t vchP[32];
+    int lenPdec = ECDH_compute_key(vchP, 32, pointR, pkeyDest, NULL);
 
     if (lenPdec != 32)
     {
-        return errorN(1, "%s: ECDH_compute_key failed, lenPdec: %d.", __func__, lenPdec);
+        return error("%s: ECDH_compute_key failed, lenPdec: %d.", __func__, lenPdec);
     };
 
 
     // -- Use public key P to calculate the SHA512 hash H.
     //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
-    std::vector<uint8_t> vchHashedDec;
-    vchHashedDec.resize(64);    // 512 bits
-    SHA512(&vchP[0], vchP.size(), (uint8_t*)&vchHashedDec[0]);
-    std::vector<uint8_t> key_e(&vchHashedDec[0], &vchHashedDec[0]+32);
-    std::vector<uint8_t> key_m(&vchHashedDec[32], &vchHashedDec[32]+32);
+    uint8_t vchHashedDec[64];   // 512 bits
+    SHA512(vchP, 32, vchHashedDec);
+    uint8_t* key_m = &vchHashedDec[32];
 
 
     // -- Message authentication code, (hash of timestamp + destination + payload)
@@ -3914,7 +5305,7 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
     HMAC_CTX *ctx;
     ctx = HMAC_CTX_new();
 
-    if (!HMAC_Init_ex(ctx, &key_m[0], 32, EVP_sha256(), NULL)
+    if (!HMAC_Init_ex(ctx, key_m, 32, EVP_sha256(), NULL)
         || !HMAC_Update(ctx, (uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
         || !HMAC_Update(ctx, pPayload, nPayload)
         || !HMAC_Final(ctx, MAC, &nBytes)
@@ -3925,19 +5316,24 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
 
     if (!fHmacOk)
     {
-        return errorN(1, "%s: Could not generate MAC.", __func__);
+        return error("%s: Could not generate MAC.", __func__);
     };
 
     if (spec::memcmp_nta(MAC, psmsg->mac, 32) != 0)
-    {
-        if (fDebugSmsg)
-            LogPrintf("MAC does not match.\n"); // expected if message is not to address on node
+        return false;
 
-        return 1;
-    };
+    key_e.assign(&vchHashedDec[0], &vchHashedDec[0]+32);
+    return true;
+};
 
-    if (fTestOnly)
-        return 0;
+static int SecureMsgDecryptPayload(std::vector<uint8_t>& key_e, std::string& address, uint8_t* pHeader, uint8_t* pPayload, uint32_t nPayload, MessageData& msg)
+{
+    /* Decrypt the payload with key_e from SecureMsgMatchKey and check the sender's signature.
+
+        returns as SecureMsgDecrypt
+    */
+
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
 
     SecMsgCrypter crypter;
     crypter.SetKey(key_e, psmsg->iv);
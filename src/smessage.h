@@ -12,6 +12,7 @@
 #include "db.h"
 #include "wallet.h"
 #include "lz4/lz4.h"
+#include "txreconciliation.h"
 
 const unsigned int SMSG_HDR_LEN        = 104;               // length of unencrypted header, 4 + 2 + 1 + 8 + 16 + 33 + 32 + 4 +4
 const unsigned int SMSG_PL_HDR_LEN     = 1+20+65+4;         // length of encrypted header in payload
@@ -25,6 +26,18 @@ const unsigned int SMSG_THREAD_LOG_GAP = 6;
 const unsigned int SMSG_TIME_LEEWAY    = 60;
 const unsigned int SMSG_TIME_IGNORE    = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
 
+const unsigned int SMSG_IDX_RECORD_LEN  = 8 + 8 + 8 + 4;    // token per message in <bucket>_01.idx: timestamp, sample, offset, nPayload
+const unsigned int SMSG_MAX_OPEN_BUCKETS = 16;              // bucket files held open for appending between flushes
+const unsigned int SMSG_RETRIEVE_MAX_GAP = 16 * 1024;       // bytes read through rather than seeking over when retrieving a set of messages
+
+const unsigned int SMSG_SCAN_KEYS_PER_THREAD = 16;         // receive keys tried per thread when scanning a message
+const unsigned int SMSG_SCAN_CHAIN_WINDOW = 2000;           // blocks read ahead by the chain scan threads, their public keys are committed together
+
+const unsigned int SMSG_DB_CACHE       = 8;                 // MiB of smsgDB blocks cached, -smsgdbcache
+
+const uint32_t SMSG_PROTO_RECON        = 2;                 // version sent in smsgPing/smsgPong, peers at or above reconcile buckets with smsgRecon
+const unsigned int SMSG_RECON_SLACK    = 8;                 // sketch capacity over the difference in bucket sizes
+
 
 const unsigned int SMSG_MAX_MSG_BYTES  = 4096;              // the user input part
 const unsigned int SMSG_MAX_AMSG_BYTES = 512;               // the user input part (ANON)
@@ -33,6 +46,7 @@ const unsigned int SMSG_MAX_AMSG_BYTES = 512;               // the user input pa
 const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMSG_PL_HDR_LEN);
 
 #define SMSG_MASK_UNREAD            (1 << 0)
+#define SMSG_MASK_FROM              (1 << 1)    // SecMsgStored::sAddrFrom is stored
 
 extern bool fSecMsgEnabled;
 
@@ -44,9 +58,11 @@ extern boost::signals2::signal<void (SecMsgStored& inboxHdr)> NotifySecMsgInboxC
 // Outbox db changed, called with lock cs_smsgDB held.
 extern boost::signals2::signal<void (SecMsgStored& outboxHdr)> NotifySecMsgOutboxChanged;
 
-// Wallet Unlocked, called after all messages received while locked have been processed.
-extern boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
+// Wallet Unlocked, called from a background thread as the messages received while locked are processed.
+// nScanned == nTotal once all have been.
+extern boost::signals2::signal<void (uint32_t nScanned, uint32_t nTotal)> NotifySecMsgWalletUnlocked;
 
+class CECKey;
 class SecMsgBucket;
 class SecMsgAddress;
 class SecMsgOptions;
@@ -113,9 +129,14 @@ public:
         else
             memcpy(sample, p, 8);
         offset = o;
+        nPayload = np;
     };
 
-    SecMsgToken() {};
+    SecMsgToken()
+    {
+        offset = 0;
+        nPayload = 0;
+    };
 
     ~SecMsgToken() {};
 
@@ -130,8 +151,16 @@ public:
     int64_t timestamp;    // doesn't need to be full 64 bytes?
     uint8_t sample[8];    // first 8 bytes of payload - a hash
     int64_t offset;       // offset
+    uint32_t nPayload;    // message is SMSG_HDR_LEN + nPayload bytes at offset
 };
 
+/** XXH3 token hash summed into SecMsgBucket::nSetHash, the same on every node with nSeed 0 */
+uint64_t SecureMsgTokenHash(const SecMsgToken& token, uint64_t nSeed = 0);
+/** Element for the reconciliation sketch of a bucket, never 0.
+ *  Salted per connection, so colliding tokens can't be chosen to cancel out in every sketch.
+ */
+uint32_t SecureMsgTokenShortId(const SecMsgToken& token, uint64_t nSalt);
+
 class SecMsgBucket
 {
 public:
@@ -139,21 +168,54 @@ public:
     {
         timeChanged     = 0;
         hash            = 0;
+        fHashStale      = false;
+        nSetHash        = 0;
         nLockCount      = 0;
         nLockPeerId     = 0;
     };
     ~SecMsgBucket() {};
 
+    /** Recompute both hashes from setTokens, after the set was filled directly */
     void hashBucket();
+    /** Insert a token, updates nSetHash in O(1). Returns false if already held */
+    bool AddToken(const SecMsgToken& token);
+    /** XXH32 over the ordered samples, as peers without reconciliation compare */
+    uint32_t GetHash();
+    uint32_t GetSetHash32() const { return (uint32_t)(nSetHash ^ (nSetHash >> 32)); }
+
+    CReconSketch GetSketch(unsigned int nCapacity, uint64_t nSalt) const;
+    /** Tokens held here that aren't in the peer's sketch, or all tokens if the sketches don't decode
+     *  or decode to no difference.
+     */
+    bool Reconcile(const std::vector<uint32_t>& vPeerSyndromes, std::vector<SecMsgToken>& vMissing, uint64_t nSalt) const;
 
     int64_t               timeChanged;
     uint32_t              hash;           // token set should get ordered the same on each node
+    bool                  fHashStale;     // hash must be recomputed by GetHash
+    uint64_t              nSetHash;       // sum of SecureMsgTokenHash over setTokens
     uint32_t              nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
     NodeId                nLockPeerId;    // id of peer that bucket is locked for
     std::set<SecMsgToken> setTokens;
 
 };
 
+/** Bucket sync counters, all peers */
+class SecMsgSyncStats
+{
+public:
+    uint64_t nShow;             // full token lists sent for smsgShow
+    uint64_t nRecon;            // smsgRecon answered
+    uint64_t nReconFailed;      // sketch didn't decode or showed no difference, full token list sent instead
+    uint64_t nTokensSent;       // tokens listed in smsgHave
+
+    SecMsgSyncStats()
+    {
+        nShow = nRecon = nReconFailed = nTokensSent = 0;
+    }
+};
+
+void GetSecMsgSyncStats(SecMsgSyncStats& stats);
+
 // -- get at the data
 class CBitcoinAddress_B : public CBitcoinAddress
 {
@@ -199,6 +261,16 @@ public:
     );
 };
 
+/** An smsgAddresses entry with its private key, ready for trial decryption */
+class SecMsgReceiveKey
+{
+public:
+    std::string sAddress;       // for the inbox, not used to match
+    CKeyID      keyId;
+    bool        fReceiveAnon;
+    boost::shared_ptr<CECKey> pkey;
+};
+
 // Secure Message Options
 class SecMsgOptions
 {
@@ -256,12 +328,20 @@ public:
 class SecMsgStored
 {
 public:
+    SecMsgStored()
+    {
+        timeReceived    = 0;
+        status          = 0;
+        folderId        = 0;
+    };
+
     int64_t              timeReceived;
     char                 status;         // read etc
     uint16_t             folderId;
     std::string          sAddrTo;        // when in owned addr, when sent remote addr
     std::string          sAddrOutbox;    // owned address this copy was encrypted with
     std::vector<uint8_t> vchMessage;     // message header + encryped payload
+    std::string          sAddrFrom;      // inbox, the sender if the message was decrypted when received
 
     IMPLEMENT_SERIALIZE
     (
@@ -271,6 +351,11 @@ public:
         READWRITE(this->sAddrTo);
         READWRITE(this->sAddrOutbox);
         READWRITE(this->vchMessage);
+        if (this->status & SMSG_MASK_FROM)
+            READWRITE(this->sAddrFrom);
+        else
+        if (fRead)
+            const_cast<SecMsgStored*>(this)->sAddrFrom.clear();
     );
 };
 
@@ -280,6 +365,7 @@ public:
     SecMsgDB()
     {
         activeBatch = NULL;
+        fSyncBatch = false;
     };
 
     ~SecMsgDB()
@@ -297,10 +383,19 @@ public:
     bool TxnCommit();
     bool TxnAbort();
 
+    /** Iterator over the db. Scans of whole key spaces pass fFillCache false,
+     *  so they don't push the public keys and index keys out of the block cache.
+     */
+    leveldb::Iterator* NewIterator(bool fFillCache = false);
+
     bool ReadPK(CKeyID& addr, CPubKey& pubkey);
     bool WritePK(CKeyID& addr, CPubKey& pubkey);
     bool ExistsPK(CKeyID& addr);
 
+    bool ReadScanCheckpoint(uint256& hashBlock);
+    bool WriteScanCheckpoint(const uint256& hashBlock);
+    bool EraseScanCheckpoint();
+
     bool NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* vchKey, SecMsgStored& smsgStored);
     bool NextSmesgKey(leveldb::Iterator* it, std::string& prefix, uint8_t* vchKey);
     bool ReadSmesg(uint8_t* chKey, SecMsgStored& smsgStored);
@@ -308,8 +403,19 @@ public:
     bool ExistsSmesg(uint8_t* chKey);
     bool EraseSmesg(uint8_t* chKey);
 
+    /** Keys of "im" or "sm" messages, newest first, nCount 0 for all */
+    bool ListSmesg(const std::string& prefix, uint32_t nSkip, uint32_t nCount, std::vector<std::vector<uint8_t> >& vKeys);
+    /** Keys of "im" messages received from or "sm" messages sent to sAddress, newest first */
+    bool ListSmesgByAddress(const std::string& prefix, const std::string& sAddress, uint32_t nSkip, uint32_t nCount,
+        std::vector<std::vector<uint8_t> >& vKeys);
+    /** Keys of unread inbox messages, newest first */
+    bool ListSmesgUnread(uint32_t nSkip, uint32_t nCount, std::vector<std::vector<uint8_t> >& vKeys);
+    /** Writes the index keys of messages stored before there were any, or under an older index version */
+    bool BuildSmesgIndex();
+
     leveldb::DB *pdb;       // points to the global instance
     leveldb::WriteBatch *activeBatch;
+    bool fSyncBatch;        // activeBatch holds messages, commit with sync
 
 };
 
@@ -328,15 +434,25 @@ bool SecureMsgDisable();
 bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
 bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
 
+void SecureMsgExtractPublicKeys(const CBlock& block, std::vector<CPubKey>& vPubKeys, uint32_t& nTransactions, uint32_t& nElements);
 bool SecureMsgScanBlock(CBlock& block);
+/** Scan from pindexStart to the tip, cs_main must be held.
+ *  Commits every SMSG_SCAN_CHAIN_WINDOW blocks along with a checkpoint, an interrupted
+ *  scan of the whole chain resumes from the checkpoint.
+ */
 bool ScanChainForPublicKeys(CBlockIndex* pindexStart);
 bool SecureMsgScanBlockChain();
 bool SecureMsgScanBuckets();
 
+/** Wakes the thread that scans messages received while the wallet was locked, returns at once */
 int SecureMsgWalletUnlocked();
+void SecureMsgWalletLocked();
+/** smsgAddresses or the receive flags changed, the receive keys are resolved again before the next scan */
+void SecureMsgReceiveKeysChanged();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui);
+int SecureMsgMatchReceiveKeys(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, SecMsgReceiveKey& rkOut, std::vector<uint8_t>& key_e, bool fParallel = true);
 
 int SecureMsgGetStoredKey(CKeyID& ckid, CPubKey& cpkOut);
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut);
@@ -344,13 +460,15 @@ int SecureMsgGetLocalPublicKey(std::string& strAddress, std::string& strPublicKe
 
 int SecureMsgAddAddress(std::string& address, std::string& publicKey);
 
-int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData);
+int SecureMsgRetrieve(int64_t bucket, std::vector<SecMsgToken>& vTokens, std::vector<uint8_t>& vchData, uint32_t& nRetrieved);
 
 int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData);
 
 int SecureMsgStoreUnscanned(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
-int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool fUpdateBucket);
-int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket);
+int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
+int SecureMsgStore(SecureMessage& smsg);
+/** Sync and close the bucket files SecureMsgStore has appended to, called with cs_smsg held */
+void SecureMsgFlushStore();
 
 int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string &message, std::string &sError);
 
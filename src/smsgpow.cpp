@@ -0,0 +1,236 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smsgpow.h"
+
+#include "smessage.h"
+#include "sync.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+#include <boost/thread.hpp>
+
+static CCriticalSection cs_smsgPowStats;
+static SecMsgPowStats smsgPowStats;
+
+void GetSecMsgPowStats(SecMsgPowStats& stats)
+{
+    LOCK(cs_smsgPowStats);
+    stats = smsgPowStats;
+    stats.nThreads = GetSecMsgPowThreads();
+}
+
+void SetSecMsgPowQueued(uint64_t nQueued)
+{
+    LOCK(cs_smsgPowStats);
+    smsgPowStats.nQueued = nQueued;
+}
+
+int GetSecMsgPowThreads()
+{
+    int nThreads = GetArg("-smsgpowthreads", boost::thread::hardware_concurrency());
+    return std::max(1, std::min(nThreads, MAX_SMSG_POW_THREADS));
+}
+
+bool SecureMsgPowCheck(const uint8_t* pHash)
+{
+    return pHash[31] == 0
+        && pHash[30] == 0
+        && (~(pHash[29]) & ((1<<0) | (1<<1) | (1<<2)));
+}
+
+
+// -- the hashed message is the header from version on, then the payload twice
+static const size_t POW_NONCE_OFFSET = offsetof(SecureMessage, nonce) - 4;
+
+static void PowMessage(const SecMsgPowJob& job, std::vector<uint8_t>& vchData)
+{
+    vchData.resize(SMSG_HDR_LEN - 4 + 2 * (size_t)job.nPayload);
+    memcpy(&vchData[0], job.pHeader + 4, SMSG_HDR_LEN - 4);
+    if (job.nPayload > 0)
+    {
+        memcpy(&vchData[SMSG_HDR_LEN - 4], job.pPayload, job.nPayload);
+        memcpy(&vchData[SMSG_HDR_LEN - 4 + job.nPayload], job.pPayload, job.nPayload);
+    };
+}
+
+// HMAC-SHA256 keyed by nonce repeated over 32 bytes, the same as SecureMsgValidate computes
+static void PowHash(uint32_t nonce, std::vector<uint8_t>& vchData, uint8_t* pHash)
+{
+    memcpy(&vchData[POW_NONCE_OFFSET], &nonce, 4);
+
+    uint8_t vchPad[64];
+    for (int i = 0; i < 32; i += 4)
+        memcpy(&vchPad[i], &nonce, 4);
+    memset(&vchPad[32], 0, 32);
+
+    uint8_t vchInner[32];
+    SHA256_CTX ctx;
+    for (int i = 0; i < 64; ++i)
+        vchPad[i] ^= 0x36;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, vchPad, 64);
+    SHA256_Update(&ctx, &vchData[0], vchData.size());
+    SHA256_Final(vchInner, &ctx);
+
+    for (int i = 0; i < 64; ++i)
+        vchPad[i] ^= 0x36 ^ 0x5c;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, vchPad, 64);
+    SHA256_Update(&ctx, vchInner, 32);
+    SHA256_Final(pHash, &ctx);
+}
+
+
+class CPowBatch
+{
+public:
+    std::vector<SecMsgPowJob>& vJobs;
+    const volatile bool& fRun;
+
+    CPowBatch(std::vector<SecMsgPowJob>& vJobsIn, const volatile bool& fRunIn) : vJobs(vJobsIn), fRun(fRunIn)
+    {
+        nJob = 0;
+        nNext = 0;
+    }
+
+    /** Next chunk of nonces to try, vchData is refilled when the job changes */
+    bool NextChunk(size_t& nJobInOut, uint64_t& nStart, std::vector<uint8_t>& vchData)
+    {
+        LOCK(cs);
+        while (nJob < vJobs.size()
+            && (vJobs[nJob].rv != -1 || nNext > 0xFFFFFFFFULL))
+        {
+            // -- the last chunks of a job may still be running, they can still solve it
+            if (vJobs[nJob].rv == -1)
+                vJobs[nJob].rv = 1;
+            nJob++;
+            nNext = 0;
+        };
+
+        if (nJob >= vJobs.size() || !fRun)
+            return false;
+
+        if (nJobInOut != nJob)
+        {
+            PowMessage(vJobs[nJob], vchData);
+            nJobInOut = nJob;
+        };
+        nStart = nNext;
+        nNext += SMSG_POW_CHUNK;
+        return true;
+    }
+
+    bool IsSolved(size_t nJobIn)
+    {
+        LOCK(cs);
+        return vJobs[nJobIn].rv == 0;
+    }
+
+    void Solved(size_t nJobIn, uint32_t nonce, const uint8_t* pHash)
+    {
+        LOCK(cs);
+        SecMsgPowJob& job = vJobs[nJobIn];
+        if (job.rv == 0)
+            return;
+        memcpy(job.pHeader + offsetof(SecureMessage, nonce), &nonce, 4);
+        memcpy(job.pHeader, pHash, 4);
+        job.rv = 0;
+    }
+
+    void AddHashes(size_t nJobIn, uint64_t nHashes)
+    {
+        LOCK(cs);
+        vJobs[nJobIn].nHashes += nHashes;
+    }
+
+private:
+    CCriticalSection cs;
+    size_t nJob;        // first job that may be unsolved
+    uint64_t nNext;     // next nonce of vJobs[nJob] to hand out
+};
+
+static void ThreadSecureMsgPowWorker(CPowBatch* pbatch)
+{
+    std::vector<uint8_t> vchData;
+    uint8_t vchHash[32];
+    size_t nJob = (size_t)-1;
+    uint64_t nStart;
+
+    while (pbatch->NextChunk(nJob, nStart, vchData))
+    {
+        boost::this_thread::interruption_point();
+
+        uint64_t nEnd = std::min(nStart + SMSG_POW_CHUNK, (uint64_t)0xFFFFFFFFULL + 1);
+        uint64_t nonce;
+        for (nonce = nStart; nonce < nEnd; ++nonce)
+        {
+            PowHash((uint32_t)nonce, vchData, vchHash);
+            if (SecureMsgPowCheck(vchHash))
+            {
+                pbatch->Solved(nJob, (uint32_t)nonce, vchHash);
+                nonce++;
+                break;
+            };
+        };
+        pbatch->AddHashes(nJob, nonce - nStart);
+    };
+}
+
+int SecureMsgPowBatch(std::vector<SecMsgPowJob>& vJobs, int nThreads, const volatile bool& fRun)
+{
+    if (vJobs.empty())
+        return 0;
+
+    int64_t nStart = GetTimeMicros();
+    CPowBatch batch(vJobs, fRun);
+
+    nThreads = std::max(1, std::min(nThreads, MAX_SMSG_POW_THREADS));
+    if (nThreads == 1)
+    {
+        ThreadSecureMsgPowWorker(&batch);
+    } else
+    {
+        boost::thread_group threadGroup;
+        try
+        {
+            for (int i = 0; i < nThreads; ++i)
+                threadGroup.create_thread(boost::bind(&ThreadSecureMsgPowWorker, &batch));
+            threadGroup.join_all();
+        } catch (boost::thread_interrupted)
+        {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
+        };
+    };
+
+    int nSolved = 0;
+    uint64_t nHashes = 0;
+    for (size_t i = 0; i < vJobs.size(); ++i)
+    {
+        if (vJobs[i].rv == -1)
+            vJobs[i].rv = 2; // stopped
+        if (vJobs[i].rv == 0)
+            nSolved++;
+        nHashes += vJobs[i].nHashes;
+    };
+
+    int64_t nTime = GetTimeMicros() - nStart;
+    {
+        LOCK(cs_smsgPowStats);
+        smsgPowStats.nSolved += nSolved;
+        smsgPowStats.nHashes += nHashes;
+        smsgPowStats.nTime += nTime;
+        smsgPowStats.dLastRate = nHashes * 1000000.0 / std::max((int64_t)1, nTime);
+    }
+
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgPowBatch() %u messages, %d solved, %u hashes in %d ms, %d threads\n",
+            vJobs.size(), nSolved, nHashes, nTime / 1000, nThreads);
+
+    return nSolved;
+}
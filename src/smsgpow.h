@@ -0,0 +1,82 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef TPAY_SMSGPOW_H
+#define TPAY_SMSGPOW_H
+
+#include <stdint.h>
+#include <vector>
+
+/** Proof of work for outgoing secure messages.
+ *
+ *  The hash is HMAC-SHA256 over the header after the checksum and the payload twice, keyed
+ *  with the nonce repeated to 32 bytes. As the key changes with every nonce no hash state
+ *  carries over between attempts, each is two SHA-256 runs over the whole message. The
+ *  message is laid out once per thread and hashed with SHA256_* directly, rather than
+ *  setting up a HMAC_CTX and passing the payload in again for every nonce.
+ *
+ *  The nonce space of a message is handed out in chunks to a pool of threads. Queued
+ *  messages are worked in order, threads move on to the next as soon as one is solved.
+ */
+
+/** Nonces handed to a thread at a time */
+static const uint32_t SMSG_POW_CHUNK = 256;
+static const int MAX_SMSG_POW_THREADS = 64;
+/** Queued messages read from the outbox per batch */
+static const unsigned int SMSG_POW_BATCH = 32;
+
+
+class SecMsgPowJob
+{
+public:
+    uint8_t* pHeader;       // SMSG_HDR_LEN bytes, nonce and hash are set when solved
+    uint8_t* pPayload;
+    uint32_t nPayload;
+    int rv;                 // as SecureMsgSetHash, -1 until the job is finished
+    uint64_t nHashes;
+
+    SecMsgPowJob(uint8_t* pHeaderIn, uint8_t* pPayloadIn, uint32_t nPayloadIn)
+    {
+        pHeader = pHeaderIn;
+        pPayload = pPayloadIn;
+        nPayload = nPayloadIn;
+        rv = -1;
+        nHashes = 0;
+    }
+};
+
+
+class SecMsgPowStats
+{
+public:
+    int nThreads;
+    uint64_t nQueued;       // messages waiting in the outbox
+    uint64_t nSolved;
+    uint64_t nHashes;
+    int64_t nTime;          // microseconds spent working batches
+    double dLastRate;       // hashes per second over the last batch
+
+    SecMsgPowStats()
+    {
+        nThreads = 0;
+        nQueued = nSolved = nHashes = 0;
+        nTime = 0;
+        dLastRate = 0.0;
+    }
+};
+
+void GetSecMsgPowStats(SecMsgPowStats& stats);
+void SetSecMsgPowQueued(uint64_t nQueued);
+
+/** -smsgpowthreads, all cores by default */
+int GetSecMsgPowThreads();
+
+/** True if the HMAC result meets the target */
+bool SecureMsgPowCheck(const uint8_t* pHash);
+
+/** Find a nonce for each job on nThreads threads, returns the number solved.
+ *  Jobs left when fRun turns false get rv 2.
+ */
+int SecureMsgPowBatch(std::vector<SecMsgPowJob>& vJobs, int nThreads, const volatile bool& fRun);
+
+#endif // TPAY_SMSGPOW_H
@@ -46,6 +46,9 @@ enum
     THIN_STAKE   = (1 << 2),  // deprecated
     THIN_STEALTH = (1 << 3),
     SMSG_RELAY   = (1 << 4),
+    NODE_COMPACT = (1 << 5),  // relays compact blocks (cmpctblock, getblocktxn, blocktxn)
+    NODE_TXRECON = (1 << 6),  // relays txns by set reconciliation (sendtxrcncl, reqrecon, sketch, reconcildiff)
+    NODE_COMPRESS = (1 << 7), // accepts lz4msg, large block and header messages compressed with LZ4
 };
 
 const int64_t GENESIS_BLOCK_TIME = 1503628005;
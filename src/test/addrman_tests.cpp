@@ -0,0 +1,115 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addrman.h"
+#include "util.h"
+
+static CAddress RandomAddress(int64_t nTime)
+{
+    // -- public IPv4 from 1.0.0.0 to 126.255.255.255
+    struct in_addr ip;
+    ip.s_addr = htonl(0x01000000 + GetRandInt(0x7e000000));
+    CAddress addr(CService(CNetAddr(ip), 8333));
+    addr.nTime = nTime;
+    return addr;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_simple)
+{
+    CAddrMan addrman;
+    int64_t nNow = GetAdjustedTime();
+    CNetAddr source("250.1.2.1");
+
+    BOOST_CHECK(addrman.Select().nTime == CAddress().nTime);
+
+    CAddress addr1 = RandomAddress(nNow - 60);
+    BOOST_CHECK(addrman.Add(addr1, source));
+    BOOST_CHECK(!addrman.Add(addr1, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK((CService)addrman.Select() == (CService)addr1);
+
+    // -- unroutable addresses are ignored
+    CAddress addrLocal(CService("10.0.0.1", 8333));
+    addrLocal.nTime = nNow;
+    BOOST_CHECK(!addrman.Add(addrLocal, source));
+
+    std::vector<CAddress> vAddr;
+    for (int i = 0; i < 1000; ++i)
+        vAddr.push_back(RandomAddress(nNow - GetRandInt(86400)));
+    BOOST_CHECK(addrman.Add(vAddr, source));
+    int nSize = addrman.size();
+    BOOST_CHECK(nSize > 1 && nSize <= 1001);
+
+    // -- good addresses move to tried and are still found
+    addrman.Good(addr1, nNow);
+    for (int i = 0; i < 100; ++i)
+        addrman.Good(vAddr[i], nNow);
+    BOOST_CHECK_EQUAL(addrman.size(), nSize);
+    bool fTried = false;
+    for (int i = 0; i < 200 && !fTried; ++i)
+    {
+        CAddress addr = addrman.Select(0);
+        fTried = addr.IsValid() && addr.nTime == nNow;
+    };
+    BOOST_CHECK(fTried);
+
+    std::vector<CAddress> vGet = addrman.GetAddr();
+    BOOST_CHECK(!vGet.empty() && (int)vGet.size() <= nSize * ADDRMAN_GETADDR_MAX_PCT / 100);
+
+    // -- round trip through peers.dat serialization
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), nSize);
+    BOOST_CHECK(addrman2.Select().IsValid());
+    BOOST_CHECK(!addrman2.Add(addr1, source));
+}
+
+// Run with --log_level=message --run_test=addrman_tests/addrman_bench to see results
+BOOST_AUTO_TEST_CASE(addrman_bench, *boost::unit_test::disabled())
+{
+    CAddrMan addrman;
+    int64_t nNow = GetAdjustedTime();
+
+    const int nAddresses = 100000;
+    std::vector<CAddress> vAddr;
+    std::vector<CNetAddr> vSource;
+    for (int i = 0; i < nAddresses; ++i)
+        vAddr.push_back(RandomAddress(nNow - GetRandInt(86400)));
+    for (int i = 0; i < 1000; ++i)
+        vSource.push_back(RandomAddress(nNow));
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nAddresses; i += 100)
+    {
+        std::vector<CAddress> vBatch(vAddr.begin() + i, vAddr.begin() + i + 100);
+        addrman.Add(vBatch, vSource[(i / 100) % vSource.size()]);
+    };
+    int64_t nAdded = GetTimeMicros();
+
+    for (int i = 0; i < nAddresses; i += 10)
+        addrman.Good(vAddr[i], nNow);
+    int64_t nGood = GetTimeMicros();
+
+    int nValid = 0;
+    for (int i = 0; i < nAddresses; ++i)
+        if (addrman.Select(10 + (i % 9) * 10).IsValid())
+            nValid++;
+    int64_t nSelected = GetTimeMicros();
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    int64_t nWritten = GetTimeMicros();
+
+    BOOST_CHECK_EQUAL(nValid, nAddresses);
+    BOOST_TEST_MESSAGE(strprintf("addrman %d addresses, %d kept: add %.0f/s, good %.0f/s, select %.0f/s, serialize %u bytes %.2f ms",
+        nAddresses, addrman.size(),
+        nAddresses * 1000000.0 / std::max((int64_t)1, nAdded - nStart),
+        nAddresses / 10 * 1000000.0 / std::max((int64_t)1, nGood - nAdded),
+        nAddresses * 1000000.0 / std::max((int64_t)1, nSelected - nGood),
+        ss.size(), (nWritten - nSelected) / 1000.0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,160 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockdownload.h"
+
+static const NodeId HEADERS_PEER = 7;
+
+static void QueueHeaders(CBlockDownload& download, std::vector<uint256>& vHashes, int nCount)
+{
+    uint256 hashPrev = vHashes.empty() ? GetRandHash() : vHashes.back();
+    int nHeight = download.Empty() ? 1 : download.Back().nHeight + 1;
+    for (int i = 0; i < nCount; ++i, ++nHeight)
+    {
+        uint256 hash = GetRandHash();
+        BOOST_REQUIRE(download.AddHeader(hash, hashPrev, nHeight, nHeight, 0, true, HEADERS_PEER));
+        vHashes.push_back(hash);
+        hashPrev = hash;
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(blockdownload_tests)
+
+BOOST_AUTO_TEST_CASE(blockdownload_headers)
+{
+    CBlockDownload download;
+    std::vector<uint256> vHashes;
+    QueueHeaders(download, vHashes, 10);
+    BOOST_CHECK_EQUAL(download.Size(), 10U);
+
+    // -- must extend the last header
+    BOOST_CHECK(!download.AddHeader(GetRandHash(), vHashes[5], 7, 7, 0, true, HEADERS_PEER));
+    BOOST_CHECK(!download.AddHeader(GetRandHash(), vHashes[9], 12, 12, 0, true, HEADERS_PEER));
+    BOOST_CHECK(!download.AddHeader(vHashes[3], vHashes[9], 11, 11, 0, true, HEADERS_PEER));
+    BOOST_CHECK(download.HaveHeader(vHashes[9]));
+
+    download.PopFront();
+    BOOST_CHECK(!download.HaveHeader(vHashes[0]));
+    BOOST_CHECK(download.Front().hash == vHashes[1]);
+
+    // -- lookups stay valid after pops
+    BOOST_CHECK(download.MarkReceived(vHashes[8], 1));
+    BOOST_CHECK(!download.MarkReceived(vHashes[0], 1));
+
+    download.Clear();
+    BOOST_CHECK(download.Empty());
+    BOOST_CHECK(!download.HaveHeader(vHashes[8]));
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_parallel)
+{
+    CBlockDownload download;
+    std::vector<uint256> vHashes;
+    QueueHeaders(download, vHashes, BLOCK_DOWNLOAD_WINDOW + 100);
+
+    // -- peers get disjoint runs, up to the per peer limit
+    std::vector<uint256> vPeer0, vPeer1;
+    download.GetBlocksToRequest(0, 100, vPeer0);
+    download.GetBlocksToRequest(1, 100, vPeer1);
+    BOOST_REQUIRE_EQUAL(vPeer0.size(), (size_t)MAX_BLOCKS_IN_FLIGHT_PER_PEER);
+    BOOST_REQUIRE_EQUAL(vPeer1.size(), (size_t)MAX_BLOCKS_IN_FLIGHT_PER_PEER);
+    BOOST_CHECK(vPeer0[0] == vHashes[0]);
+    BOOST_CHECK(vPeer1[0] == vHashes[MAX_BLOCKS_IN_FLIGHT_PER_PEER]);
+
+    std::vector<uint256> vMore;
+    download.GetBlocksToRequest(0, 100, vMore);
+    BOOST_CHECK(vMore.empty());
+
+    BOOST_CHECK(download.MarkReceived(vPeer0[3], 101));
+    BOOST_CHECK_EQUAL(download.GetInFlight(0), MAX_BLOCKS_IN_FLIGHT_PER_PEER - 1);
+    download.GetBlocksToRequest(0, 101, vMore);
+    BOOST_CHECK_EQUAL(vMore.size(), 1U);
+
+    // -- nothing past the window is requested
+    for (NodeId id = 2; id < 1000; ++id)
+        download.GetBlocksToRequest(id, 102, vMore);
+    size_t nRequested = 2 * MAX_BLOCKS_IN_FLIGHT_PER_PEER + vMore.size();
+    BOOST_CHECK_EQUAL(nRequested, (size_t)BLOCK_DOWNLOAD_WINDOW);
+
+    // -- the window moves as blocks connect
+    download.PopFront();
+    vMore.clear();
+    download.GetBlocksToRequest(2000, 103, vMore);
+    BOOST_REQUIRE_EQUAL(vMore.size(), 1U);
+    BOOST_CHECK(vMore[0] == vHashes[BLOCK_DOWNLOAD_WINDOW]);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_stalling)
+{
+    CBlockDownload download;
+    std::vector<uint256> vHashes;
+    QueueHeaders(download, vHashes, BLOCK_DOWNLOAD_WINDOW + 100);
+
+    // -- fill the window, peer 0 holds its front
+    const NodeId nPeers = BLOCK_DOWNLOAD_WINDOW / MAX_BLOCKS_IN_FLIGHT_PER_PEER;
+    std::vector<std::vector<uint256> > vPeers(nPeers);
+    for (NodeId id = 0; id < nPeers; ++id)
+        download.GetBlocksToRequest(id, 100, vPeers[id]);
+
+    // -- a slow peer isn't stalling while no other peer is kept waiting
+    BOOST_CHECK(download.CheckTimeouts(100 + 2 * BLOCK_STALLING_TIMEOUT));
+    BOOST_CHECK(!download.PopStalling(0));
+
+    // -- peer 1 delivers and finds the window closed, the stall is measured from then
+    BOOST_FOREACH(const uint256& hash, vPeers[1])
+        download.MarkReceived(hash, 150);
+    std::vector<uint256> vMore;
+    download.GetBlocksToRequest(1, 150, vMore);
+    BOOST_CHECK(vMore.empty());
+
+    BOOST_CHECK(download.CheckTimeouts(150 + BLOCK_STALLING_TIMEOUT));
+    BOOST_CHECK(!download.PopStalling(0));
+
+    BOOST_CHECK(download.CheckTimeouts(151 + BLOCK_STALLING_TIMEOUT));
+    BOOST_CHECK(download.PopStalling(0));
+    BOOST_CHECK(!download.PopStalling(0));
+    BOOST_CHECK(!download.PopStalling(1));
+    BOOST_CHECK_EQUAL(download.GetInFlight(0), 0);
+
+    // -- released blocks go to the waiting peer
+    download.GetBlocksToRequest(1, 200, vMore);
+    BOOST_REQUIRE(!vMore.empty());
+    BOOST_CHECK(vMore[0] == vHashes[0]);
+
+    // -- a block that stalled before isn't blamed on the next peer asked for it
+    BOOST_FOREACH(const uint256& hash, vPeers[2])
+        download.MarkReceived(hash, 200);
+    vMore.clear();
+    download.GetBlocksToRequest(2, 200, vMore);
+    BOOST_CHECK(vMore.empty());
+    BOOST_CHECK(download.CheckTimeouts(201 + BLOCK_STALLING_TIMEOUT));
+    BOOST_CHECK(!download.PopStalling(1));
+    BOOST_CHECK_EQUAL(download.GetInFlight(1), 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_retries)
+{
+    CBlockDownload download;
+    std::vector<uint256> vHashes;
+    QueueHeaders(download, vHashes, 100);
+
+    std::vector<uint256> vPeer0;
+    download.GetBlocksToRequest(0, 100, vPeer0);
+
+    // -- a front block received but never connected is fetched again, then the header chain given up on
+    int64_t nNow = 200;
+    for (int i = 0; i <= MAX_BLOCK_DOWNLOAD_RETRIES; ++i)
+    {
+        BOOST_CHECK(download.MarkReceived(vHashes[0], nNow));
+        nNow += BLOCK_STALLING_TIMEOUT + 1;
+        bool fRetry = download.CheckTimeouts(nNow);
+        BOOST_CHECK_EQUAL(fRetry, i < MAX_BLOCK_DOWNLOAD_RETRIES);
+    };
+    BOOST_CHECK(download.Empty());
+
+    // -- and blamed on the peer that sent it, not the one that delivered
+    BOOST_CHECK(!download.PopMisbehaving(0));
+    BOOST_CHECK(download.PopMisbehaving(HEADERS_PEER));
+    BOOST_CHECK(!download.PopMisbehaving(HEADERS_PEER));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
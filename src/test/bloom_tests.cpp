@@ -0,0 +1,54 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // -- last nElements are always found, false positives near the rate
+    CRollingBloomFilter rb1(100, 0.01);
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 399; ++i)
+    {
+        uint256 hash = GetRandHash();
+        rb1.insert(hash);
+        vHashes.push_back(hash);
+        BOOST_CHECK(rb1.contains(hash));
+    };
+    for (int i = 299; i < 399; ++i)
+        BOOST_CHECK(rb1.contains(vHashes[i]));
+
+    int nHits = 0;
+    for (int i = 0; i < 10000; ++i)
+        if (rb1.contains(GetRandHash()))
+            nHits++;
+    BOOST_CHECK(nHits < 200);
+
+    // -- the extra value is part of the key
+    uint256 hash = GetRandHash();
+    rb1.insert(hash, 1);
+    BOOST_CHECK(rb1.contains(hash, 1));
+    BOOST_CHECK(!rb1.contains(hash, 2) || !rb1.contains(hash, 3));
+
+    std::vector<unsigned char> vKey(16, 0xab);
+    rb1.insert(vKey);
+    BOOST_CHECK(rb1.contains(vKey));
+
+    // -- old generations are forgotten
+    for (int i = 0; i < 200; ++i)
+        rb1.insert(GetRandHash());
+    int nOld = 0;
+    for (int i = 0; i < 200; ++i)
+        if (rb1.contains(vHashes[i]))
+            nOld++;
+    BOOST_CHECK(nOld < 10);
+
+    size_t nMemory = rb1.GetMemoryUsage();
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(vKey));
+    BOOST_CHECK_EQUAL(rb1.GetMemoryUsage(), nMemory);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,223 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+// test_tokenpay --log_level=message --run_test=compactblocks_tests
+
+static CTransaction MakeTransaction(unsigned int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), n);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, n & 0xff);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[1].nValue = n + 1;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static void MakeBlock(CBlock& block, unsigned int nTxns)
+{
+    block.SetNull();
+    block.nVersion = 7;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = GetTime();
+    block.nBits = 0x1d00ffff;
+
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << nTxns;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    for (unsigned int i = 1; i < nTxns; ++i)
+        block.vtx.push_back(MakeTransaction(i));
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+}
+
+// Add every txn of the block except the coinbase to pool, skipping one in nSkipEvery
+static void FillMempool(CTxMemPool& pool, const CBlock& block, unsigned int nSkipEvery)
+{
+    LOCK(pool.cs);
+    for (unsigned int i = 1; i < block.vtx.size(); ++i)
+    {
+        if (nSkipEvery != 0 && i % nSkipEvery == 0)
+            continue;
+        CTransaction tx(block.vtx[i]);
+        pool.addUnchecked(tx.GetHash(), tx);
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(compactblocks_tests)
+
+BOOST_AUTO_TEST_CASE(cmpctblock_serialization)
+{
+    CTxIndexes indexes;
+    indexes.vIndexes.push_back(0);
+    indexes.vIndexes.push_back(1);
+    indexes.vIndexes.push_back(300);
+    indexes.vIndexes.push_back(65535);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << indexes;
+    CTxIndexes indexesRead;
+    ss >> indexesRead;
+    BOOST_CHECK(indexesRead.vIndexes == indexes.vIndexes);
+
+    CBlock block;
+    MakeBlock(block, 50);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIds.size(), 49U);
+
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctRead;
+    ss >> cmpctRead;
+    BOOST_CHECK(cmpctRead.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctRead.vShortTxIds == cmpctblock.vShortTxIds);
+    BOOST_CHECK(cmpctRead.GetShortID(block.vtx[1].GetHash()) == cmpctblock.vShortTxIds[0]);
+
+    // -- 6 bytes per short id
+    CBlockHeaderAndShortTxIDs cmpctMore(cmpctblock);
+    cmpctMore.vShortTxIds.push_back(0xffffffffffffULL);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(cmpctMore, SER_NETWORK, PROTOCOL_VERSION)
+        - ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION), 6U);
+
+    // -- an index past 16 bits is rejected
+    CDataStream ssBad(SER_NETWORK, PROTOCOL_VERSION);
+    ssBad << VARINT((uint64_t)2) << VARINT((uint64_t)65535) << VARINT((uint64_t)0);
+    BOOST_CHECK_THROW(ssBad >> indexesRead, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_reconstruct)
+{
+    CBlock block;
+    MakeBlock(block, 100);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    CTxMemPool pool;
+    FillMempool(pool, block, 10);
+
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.nPrefilled, 1U);
+    BOOST_CHECK_EQUAL(partialBlock.nMempool, 90U);
+
+    std::vector<uint16_t> vMissing;
+    partialBlock.GetMissing(vMissing);
+    BOOST_REQUIRE_EQUAL(vMissing.size(), 9U);
+    BOOST_CHECK_EQUAL(vMissing[0], 10);
+
+    CBlock blockOut;
+    std::vector<CTransaction> vtxMissing;
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_INVALID);
+
+    for (size_t i = 0; i < vMissing.size(); ++i)
+        vtxMissing.push_back(block.vtx[vMissing[i]]);
+
+    // -- a wrong txn fails the merkle root check, the full block is then requested
+    std::vector<CTransaction> vtxWrong(vtxMissing);
+    vtxWrong[0] = MakeTransaction(1000);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxWrong) == READ_STATUS_FAILED);
+
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // -- prefilled index out of range
+    CBlockHeaderAndShortTxIDs cmpctBad(cmpctblock);
+    cmpctBad.prefilledIndexes.vIndexes[0] = 100;
+    BOOST_CHECK(partialBlock.InitData(cmpctBad, pool) == READ_STATUS_INVALID);
+}
+
+// Relay a block over a chain of nodes, each missing a few txns from its mempool.
+// Compares bytes on the wire and time to rebuild at each hop for full and compact
+// blocks, run with --log_level=message to see results
+BOOST_AUTO_TEST_CASE(cmpctblock_propagation)
+{
+    const int nHops = 6;
+    const unsigned int nTxns = 2000;
+    const unsigned int nSkipEvery = 50; // 2% of txns not yet seen
+
+    CBlock block;
+    MakeBlock(block, nTxns);
+    uint256 hashBlock = block.GetHash();
+
+    std::vector<CTxMemPool*> vPools;
+    for (int i = 0; i < nHops; ++i)
+    {
+        vPools.push_back(new CTxMemPool());
+        FillMempool(*vPools[i], block, nSkipEvery);
+    };
+
+    // -- full blocks, every hop deserialises and checks the merkle root
+    uint64_t nBytesFull = 0;
+    int64_t nStart = GetTimeMicros();
+    CBlock blockRelay(block);
+    for (int i = 0; i < nHops; ++i)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << blockRelay;
+        nBytesFull += ss.size();
+        ss >> blockRelay;
+        BOOST_CHECK(blockRelay.BuildMerkleTree() == blockRelay.hashMerkleRoot);
+    };
+    int64_t nTimeFull = GetTimeMicros() - nStart;
+
+    // -- compact blocks, cmpctblock then getblocktxn/blocktxn per hop
+    uint64_t nBytesCmpct = 0;
+    nStart = GetTimeMicros();
+    blockRelay = block;
+    for (int i = 0; i < nHops; ++i)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CBlockHeaderAndShortTxIDs(blockRelay);
+        nBytesCmpct += ss.size();
+
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        ss >> cmpctblock;
+
+        CPartialBlock partialBlock;
+        BOOST_REQUIRE(partialBlock.InitData(cmpctblock, *vPools[i]) == READ_STATUS_OK);
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        partialBlock.GetMissing(req.indexes.vIndexes);
+        BOOST_CHECK_EQUAL(req.indexes.vIndexes.size(), (nTxns - 1) / nSkipEvery);
+        ss << req;
+        nBytesCmpct += ss.size();
+        ss >> req;
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        BOOST_FOREACH(uint16_t nIndex, req.indexes.vIndexes)
+            resp.vtx.push_back(blockRelay.vtx[nIndex]);
+        ss << resp;
+        nBytesCmpct += ss.size();
+        ss >> resp;
+
+        BOOST_REQUIRE(partialBlock.FillBlock(blockRelay, resp.vtx) == READ_STATUS_OK);
+        BOOST_CHECK(blockRelay.GetHash() == hashBlock);
+    };
+    int64_t nTimeCmpct = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(nBytesCmpct * 4 < nBytesFull);
+
+    BOOST_TEST_MESSAGE(strprintf("%d hops, %u txns, %u%% missing: full %u bytes %.2f ms, compact %u bytes %.2f ms",
+        nHops, nTxns, 100 / nSkipEvery,
+        nBytesFull, nTimeFull / 1000.0,
+        nBytesCmpct, nTimeCmpct / 1000.0));
+
+    for (int i = 0; i < nHops; ++i)
+        delete vPools[i];
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -44,4 +44,32 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1,2,3,4,5,6,7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x3f2acc7f57c29bdbull);
+
+    // Check that the specialized uint256 versions match the generic hasher
+    uint256 x;
+    for (int i = 0; i < 32; ++i)
+        x.begin()[i] = i;
+    CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    hasher2.Write(x.Get64(0)).Write(x.Get64(1)).Write(x.Get64(2)).Write(x.Get64(3));
+    BOOST_CHECK_EQUAL(hasher2.Finalize(), 0x7127512f72f27cceull);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, x), 0x7127512f72f27cceull);
+
+    static const unsigned char extra[4] = {0x78, 0x56, 0x34, 0x12};
+    CSipHasher hasher3(1, 2);
+    hasher3.Write(x.begin(), 32).Write(extra, 4);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(1, 2, x, 0x12345678), hasher3.Finalize());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,146 @@
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+
+#include "hashmap.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hashmap_tests)
+
+// A salted_hash_map must agree with std::map for any mix of inserts and erases
+BOOST_AUTO_TEST_CASE(hashmap_like_map)
+{
+    salted_hash_map<uint256, int> hmap;
+    std::map<uint256, int> map;
+
+    std::vector<uint256> vKeys;
+    for (int i = 0; i < 2000; ++i)
+        vKeys.push_back(GetRandHash());
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        const uint256& key = vKeys[insecure_rand() % vKeys.size()];
+        if (insecure_rand() % 3 == 0)
+        {
+            BOOST_CHECK_EQUAL(hmap.erase(key), map.erase(key));
+        } else
+        {
+            hmap[key] = i;
+            map[key] = i;
+        };
+    };
+
+    BOOST_CHECK_EQUAL(hmap.size(), map.size());
+    for (std::map<uint256, int>::iterator it = map.begin(); it != map.end(); ++it)
+    {
+        salted_hash_map<uint256, int>::iterator hit = hmap.find(it->first);
+        BOOST_CHECK(hit != hmap.end());
+        if (hit != hmap.end())
+            BOOST_CHECK_EQUAL(hit->second, it->second);
+    };
+}
+
+BOOST_AUTO_TEST_CASE(hashmap_outpoint_keyimage)
+{
+    salted_hash_map<COutPoint, int> mapOut;
+    uint256 hash = GetRandHash();
+    for (unsigned int n = 0; n < 100; ++n)
+        mapOut[COutPoint(hash, n)] = n;
+    BOOST_CHECK_EQUAL(mapOut.size(), 100U);
+    BOOST_CHECK_EQUAL(mapOut[COutPoint(hash, 42)], 42);
+    BOOST_CHECK(mapOut.count(COutPoint(GetRandHash(), 42)) == 0);
+
+    // -- key images extracted from an input match the ec_point form
+    CTxIn txin(COutPoint(hash, 0x00010203));
+    ec_point vchImage;
+    CKeyImage ki;
+    txin.ExtractKeyImage(vchImage);
+    txin.ExtractKeyImage(ki);
+    BOOST_CHECK(CKeyImage(vchImage) == ki);
+    BOOST_CHECK(ki.Get() == vchImage);
+
+    salted_hash_map<CKeyImage, int> mapKi;
+    mapKi[ki] = 1;
+    BOOST_CHECK(mapKi.count(CKeyImage(vchImage)) == 1);
+    ki.data[32] ^= 1;
+    BOOST_CHECK(mapKi.count(ki) == 0);
+}
+
+// CInPoint and COrphanBlock* users keep pointers to mapped values
+BOOST_AUTO_TEST_CASE(hashmap_reference_stability)
+{
+    salted_hash_map<uint256, int> hmap;
+    uint256 first = GetRandHash();
+    int* p = &hmap[first];
+    *p = 7;
+    for (int i = 0; i < 10000; ++i)
+        hmap[GetRandHash()] = i;
+    BOOST_CHECK(p == &hmap[first]);
+    BOOST_CHECK_EQUAL(*p, 7);
+}
+
+static void MakeTransactions(std::vector<CTransaction>& vtx, unsigned int nCount)
+{
+    vtx.resize(nCount);
+    for (unsigned int i = 0; i < nCount; ++i)
+    {
+        CTransaction& tx = vtx[i];
+        tx.vin.resize(2);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[1].prevout = COutPoint(GetRandHash(), 1);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    };
+}
+
+// Throughput of addUnchecked/remove at 100k entries.
+// Run with --log_level=message --run_test=hashmap_tests/mempool_accept_remove_bench to see results
+BOOST_AUTO_TEST_CASE(mempool_accept_remove_bench, *boost::unit_test::disabled())
+{
+    const unsigned int nEntries = 100000;
+    std::vector<CTransaction> vtx;
+    MakeTransactions(vtx, nEntries);
+
+    std::vector<uint256> vHashes;
+    vHashes.reserve(nEntries);
+    for (unsigned int i = 0; i < nEntries; ++i)
+        vHashes.push_back(vtx[i].GetHash());
+
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nEntries; ++i)
+        pool.addUnchecked(vHashes[i], vtx[i]);
+    int64_t nAdded = GetTimeMicros();
+
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), nEntries);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 2 * nEntries);
+
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < nEntries; ++i)
+        if (pool.mapNextTx.count(vtx[i].vin[1].prevout))
+            nFound++;
+    int64_t nLookedUp = GetTimeMicros();
+    BOOST_CHECK_EQUAL(nFound, nEntries);
+
+    for (unsigned int i = 0; i < nEntries; ++i)
+        pool.remove(vtx[i]);
+    int64_t nRemoved = GetTimeMicros();
+
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 0U);
+
+    BOOST_TEST_MESSAGE(strprintf("mempool %u entries: add %.0f tx/s, spent lookup %.0f/s, remove %.0f tx/s",
+        nEntries,
+        nEntries * 1e6 / std::max((int64_t)1, nAdded - nStart),
+        nEntries * 1e6 / std::max((int64_t)1, nLookedUp - nAdded),
+        nEntries * 1e6 / std::max((int64_t)1, nRemoved - nLookedUp)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,550 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// test_tokenpay --log_level=message --run_test=netmessage_tests
+
+static void AppendMessage(CSerializeData& vchStream, const char* pszCommand, const std::vector<char>& vchPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(pszCommand, vchPayload.size());
+    uint256 hash = Hash(vchPayload.begin(), vchPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ss << hdr;
+    vchStream.insert(vchStream.end(), ss.begin(), ss.end());
+    vchStream.insert(vchStream.end(), vchPayload.begin(), vchPayload.end());
+}
+
+static std::vector<char> RandomPayload(unsigned int nSize)
+{
+    std::vector<char> vch(nSize);
+    for (unsigned int i = 0; i < nSize; ++i)
+        vch[i] = (char)insecure_rand();
+    return vch;
+}
+
+// Feed vchStream to pnode as SocketRecvData would, reading up to nRead bytes at a time
+static bool FeedNode(CNode* pnode, const CSerializeData& vchStream, unsigned int nRead)
+{
+    char pchBuf[0x10000];
+    size_t nPos = 0;
+    while (nPos < vchStream.size())
+    {
+        unsigned int nDirect = 0;
+        char* pchDirect = pnode->GetRecvDirect(nDirect);
+        unsigned int nWant = std::min(pchDirect ? nDirect : (unsigned int)sizeof(pchBuf), nRead);
+        unsigned int nBytes = std::min((size_t)nWant, vchStream.size() - nPos);
+
+        if (pchDirect)
+        {
+            memcpy(pchDirect, &vchStream[nPos], nBytes);
+            pnode->ReceivedDirect(nBytes);
+        } else
+        {
+            memcpy(pchBuf, &vchStream[nPos], nBytes);
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                return false;
+        };
+        nPos += nBytes;
+    };
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(netmessage_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_reassembly)
+{
+    std::vector<std::vector<char> > vPayloads;
+    vPayloads.push_back(RandomPayload(0));
+    vPayloads.push_back(RandomPayload(8));
+    vPayloads.push_back(RandomPayload(MIN_RECV_DIRECT - 1));
+    vPayloads.push_back(RandomPayload(MIN_RECV_DIRECT + 1));
+    vPayloads.push_back(RandomPayload(MAX_RECV_PREALLOC + 12345));
+    vPayloads.push_back(RandomPayload(1000));
+
+    CSerializeData vchStream;
+    for (size_t i = 0; i < vPayloads.size(); ++i)
+        AppendMessage(vchStream, "block", vPayloads[i]);
+
+    // -- odd read sizes split headers and switch between direct and copied reads mid message
+    unsigned int vReads[] = { 1, 7, 23, 24, 1000, 4097, 0x10000 };
+    for (size_t r = 0; r < sizeof(vReads) / sizeof(vReads[0]); ++r)
+    {
+        CNode node(INVALID_SOCKET, CAddress(), "", true);
+        LOCK(node.cs_vRecvMsg);
+        BOOST_REQUIRE(FeedNode(&node, vchStream, vReads[r]));
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), vPayloads.size());
+
+        for (size_t i = 0; i < vPayloads.size(); ++i)
+        {
+            const CNetMessage& msg = node.vRecvMsg[i];
+            BOOST_CHECK(msg.complete());
+            BOOST_CHECK(msg.hdr.IsValid());
+            BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+            BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, vPayloads[i].size());
+            BOOST_CHECK_EQUAL(msg.vRecv.size(), vPayloads[i].size());
+            BOOST_CHECK(std::equal(vPayloads[i].begin(), vPayloads[i].end(), msg.vRecv.begin()));
+        };
+    };
+
+    // -- a size over MAX_SIZE is rejected at the header
+    CSerializeData vchBad;
+    AppendMessage(vchBad, "block", RandomPayload(10));
+    unsigned int nSize = MAX_SIZE + 1;
+    memcpy(&vchBad[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+    BOOST_CHECK(!FeedNode(&node, vchBad, 0x10000));
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_pool)
+{
+    CNetMessagePool pool;
+    CSerializeData vch;
+    pool.Get(vch, 1000);
+    BOOST_CHECK(vch.empty());
+    BOOST_CHECK_EQUAL(vch.capacity(), 1024U);
+    BOOST_CHECK_EQUAL(pool.nAllocated, 1U);
+
+    vch.insert(vch.end(), 1000, 'x');
+    char* pchData = &vch[0];
+    pool.Put(vch);
+    BOOST_CHECK_EQUAL(vch.capacity(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetFreeBytes(), 1024U);
+
+    // -- the same buffer comes back for any size in its class
+    pool.Get(vch, 600);
+    BOOST_CHECK(vch.empty());
+    vch.push_back('y');
+    BOOST_CHECK(&vch[0] == pchData);
+    BOOST_CHECK_EQUAL(pool.nReused, 1U);
+    BOOST_CHECK_EQUAL(pool.GetFreeBytes(), 0U);
+
+    // -- an odd sized buffer is kept in the largest class it covers
+    CSerializeData vchOdd;
+    vchOdd.reserve(3000);
+    pool.Put(vchOdd);
+    pool.Get(vchOdd, 2048);
+    BOOST_CHECK_EQUAL(pool.nReused, 2U);
+    BOOST_CHECK(vchOdd.capacity() >= 3000U);
+
+    // -- too large to keep
+    CSerializeData vchLarge;
+    vchLarge.reserve((size_t)8 << CNetMessagePool::MAX_CLASS);
+    pool.Put(vchLarge);
+    BOOST_CHECK_EQUAL(pool.nDropped, 1U);
+}
+
+// Receive a stream of typical messages through the pooled path and through the previous
+// one, a header CDataStream and a data stream grown per read and freed per message.
+// Run with --log_level=message --run_test=netmessage_tests/netmessage_benchmark to see results
+BOOST_AUTO_TEST_CASE(netmessage_benchmark, *boost::unit_test::disabled())
+{
+    const int nMessages = 20000;
+    unsigned int vSizes[] = { 32, 61, 250, 500, 1000, 2000, 37000, 1000000 }; // ping .. inv, tx .. block
+    const int nSizes = sizeof(vSizes) / sizeof(vSizes[0]);
+
+    CSerializeData vchStream;
+    for (int i = 0; i < nMessages; ++i)
+    {
+        // -- mostly small messages, one large block in a few hundred
+        unsigned int nSize = vSizes[(i % 499 == 0) ? nSizes - 1 : i % (nSizes - 1)];
+        AppendMessage(vchStream, "tx", std::vector<char>(nSize, (char)i));
+    };
+
+    // -- pooled, messages are handled and dropped as they complete
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    uint64_t nAllocatedBefore = netMessagePool.nAllocated;
+    int64_t nStart = GetTimeMicros();
+    {
+        LOCK(node.cs_vRecvMsg);
+        char pchBuf[0x10000];
+        size_t nPos = 0;
+        while (nPos < vchStream.size())
+        {
+            unsigned int nDirect = 0;
+            char* pchDirect = node.GetRecvDirect(nDirect);
+            unsigned int nBytes = std::min((size_t)(pchDirect ? nDirect : sizeof(pchBuf)), vchStream.size() - nPos);
+            if (pchDirect)
+            {
+                memcpy(pchDirect, &vchStream[nPos], nBytes); // stands in for recv()
+                node.ReceivedDirect(nBytes);
+            } else
+            {
+                memcpy(pchBuf, &vchStream[nPos], nBytes);
+                BOOST_REQUIRE(node.ReceiveMsgBytes(pchBuf, nBytes));
+            };
+            nPos += nBytes;
+
+            while (!node.vRecvMsg.empty() && node.vRecvMsg.front().complete())
+                node.vRecvMsg.pop_front();
+        };
+    }
+    int64_t nTimePooled = GetTimeMicros() - nStart;
+    uint64_t nAllocated = netMessagePool.nAllocated - nAllocatedBefore;
+
+    // -- previous path
+    nStart = GetTimeMicros();
+    uint64_t nLegacyAllocs = 0;
+    {
+        std::deque<std::pair<CDataStream, CDataStream> > vRecvMsg;
+        char pchBuf[0x10000];
+        size_t nPos = 0;
+        unsigned int nHdrPos = 0, nDataPos = 0, nMessageSize = 0;
+        bool fInData = false;
+        while (nPos < vchStream.size())
+        {
+            unsigned int nBytes = std::min(sizeof(pchBuf), vchStream.size() - nPos);
+            memcpy(pchBuf, &vchStream[nPos], nBytes);
+            nPos += nBytes;
+
+            const char* pch = pchBuf;
+            while (nBytes > 0)
+            {
+                if (!fInData)
+                {
+                    if (nHdrPos == 0)
+                    {
+                        vRecvMsg.push_back(std::make_pair(CDataStream(SER_NETWORK, PROTOCOL_VERSION), CDataStream(SER_NETWORK, PROTOCOL_VERSION)));
+                        vRecvMsg.back().first.resize(24);
+                        nLegacyAllocs++;
+                    };
+                    unsigned int nCopy = std::min(24 - nHdrPos, nBytes);
+                    memcpy(&vRecvMsg.back().first[nHdrPos], pch, nCopy);
+                    nHdrPos += nCopy; pch += nCopy; nBytes -= nCopy;
+                    if (nHdrPos < 24)
+                        continue;
+                    CMessageHeader hdr;
+                    vRecvMsg.back().first >> hdr;
+                    nMessageSize = hdr.nMessageSize;
+                    fInData = true;
+                    nDataPos = 0;
+                };
+
+                CDataStream& vRecv = vRecvMsg.back().second;
+                unsigned int nCopy = std::min(nMessageSize - nDataPos, nBytes);
+                if (vRecv.size() < nDataPos + nCopy)
+                {
+                    vRecv.resize(std::min(nMessageSize, nDataPos + nCopy + 256 * 1024));
+                    nLegacyAllocs++;
+                };
+                if (nCopy > 0)
+                    memcpy(&vRecv[nDataPos], pch, nCopy);
+                nDataPos += nCopy; pch += nCopy; nBytes -= nCopy;
+
+                if (nDataPos == nMessageSize)
+                {
+                    fInData = false;
+                    nHdrPos = 0;
+                    vRecvMsg.pop_front();
+                };
+            };
+        };
+    }
+    int64_t nTimeLegacy = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(nAllocated < (uint64_t)nMessages / 100);
+
+    double dMB = vchStream.size() / (1024.0 * 1024.0);
+    BOOST_TEST_MESSAGE(strprintf("%d messages, %.1f MiB: pooled %.3f buffer allocs/msg %.0f MiB/s, previous %.3f allocs/msg %.0f MiB/s",
+        nMessages, dMB,
+        (double)nAllocated / nMessages, dMB / (nTimePooled / 1e6),
+        (double)nLegacyAllocs / nMessages, dMB / (nTimeLegacy / 1e6)));
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(netmessage_shared_send)
+{
+    int vSockets[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, vSockets) == 0);
+
+    std::vector<char> vchBlock = RandomPayload(300000);
+    CSharedMessage msg = MakeSharedMessage("block", vchBlock);
+    BOOST_CHECK(msg.unique());
+
+    CSendQueueStats statsBefore;
+    GetSendQueueStats(statsBefore);
+
+    // -- the same buffer is queued to both nodes, between messages serialized per node
+    CNode nodeA(vSockets[0], CAddress(), "", true);
+    CNode nodeB(INVALID_SOCKET, CAddress(), "", true);
+    nodeA.PushMessage("ping", (uint64_t)1);
+    nodeA.PushMessage(msg);
+    nodeB.PushMessage(msg);
+    nodeA.PushMessage("ping", (uint64_t)2);
+    BOOST_CHECK(&(*nodeB.vSendMsg.back())[0] == &(*msg)[0]);
+
+    CSendQueueStats stats;
+    GetSendQueueStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlockBytesShared - statsBefore.nBlockBytesShared, 2 * msg->size());
+    BOOST_CHECK_EQUAL(stats.nBlockBytesCopied, statsBefore.nBlockBytesCopied);
+
+    // -- read everything the socket pair carried and check it reassembles
+    CNode nodeRecv(INVALID_SOCKET, CAddress(), "", true);
+    {
+        LOCK2(nodeA.cs_vSend, nodeRecv.cs_vRecvMsg);
+        char pchBuf[0x10000];
+        while (!nodeA.vSendMsg.empty())
+        {
+            SocketSendData(&nodeA);
+            int nBytes;
+            while ((nBytes = recv(vSockets[1], pchBuf, sizeof(pchBuf), MSG_DONTWAIT)) > 0)
+                BOOST_REQUIRE(nodeRecv.ReceiveMsgBytes(pchBuf, nBytes));
+        };
+        BOOST_CHECK_EQUAL(nodeA.nSendSize, 0U);
+    }
+
+    BOOST_REQUIRE_EQUAL(nodeRecv.vRecvMsg.size(), 3U);
+    BOOST_CHECK_EQUAL(nodeRecv.vRecvMsg[1].hdr.GetCommand(), "block");
+    std::vector<char> vchRecv;
+    nodeRecv.vRecvMsg[1].vRecv >> vchRecv;
+    BOOST_CHECK(vchRecv == vchBlock);
+    uint64_t nPing = 0;
+    nodeRecv.vRecvMsg[2].vRecv >> nPing;
+    BOOST_CHECK_EQUAL(nPing, 2U);
+
+    close(vSockets[1]);
+}
+#endif
+
+// Blocks of typical pay to pubkey hash txns, random hashes, keys and signatures
+static std::vector<CBlock> SyntheticBlocks(int nBlocks, int nTxPerBlock)
+{
+    std::vector<CBlock> vBlocks(nBlocks);
+    uint256 hashPrev = GetRandHash();
+    for (int b = 0; b < nBlocks; ++b)
+    {
+        CBlock& block = vBlocks[b];
+        block.nVersion = 7;
+        block.hashPrevBlock = hashPrev;
+        block.nTime = 1503628005 + b * 64;
+        block.nBits = 0x1e0fffff;
+        block.nNonce = insecure_rand();
+        for (int t = 0; t < nTxPerBlock; ++t)
+        {
+            CTransaction tx;
+            tx.nTime = block.nTime;
+            for (int i = 0; i < 2; ++i)
+            {
+                std::vector<char> vchSig = RandomPayload(72), vchPubKey = RandomPayload(33);
+                CScript scriptSig;
+                scriptSig << std::vector<unsigned char>(vchSig.begin(), vchSig.end())
+                    << std::vector<unsigned char>(vchPubKey.begin(), vchPubKey.end());
+                tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), i), scriptSig));
+            };
+            for (int i = 0; i < 2; ++i)
+            {
+                std::vector<char> vchHash = RandomPayload(20);
+                CScript scriptPubKey;
+                scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(vchHash.begin(), vchHash.end())
+                    << OP_EQUALVERIFY << OP_CHECKSIG;
+                tx.vout.push_back(CTxOut((1 + GetRandInt(1000)) * CENT, scriptPubKey));
+            };
+            block.vtx.push_back(tx);
+        };
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        hashPrev = block.GetHash();
+    };
+    return vBlocks;
+}
+
+// The lz4msg queued for a node, as a received message
+static bool ReceiveQueued(CNode& nodeFrom, CNode& nodeTo)
+{
+    CSerializeData vchStream;
+    {
+        LOCK(nodeFrom.cs_vSend);
+        BOOST_FOREACH(const CSharedMessage& msg, nodeFrom.vSendMsg)
+            vchStream.insert(vchStream.end(), msg->begin(), msg->end());
+    }
+    LOCK(nodeTo.cs_vRecvMsg);
+    return FeedNode(&nodeTo, vchStream, 0x10000);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_compress)
+{
+    std::vector<CBlock> vBlocks = SyntheticBlocks(20, 10);
+    std::vector<CBlockThin> vHeaders;
+    BOOST_FOREACH(CBlock& block, vBlocks)
+        vHeaders.push_back(CBlockThin(block));
+
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.fCompress = true;
+    node.PushMessage("headers", vHeaders);
+    node.PushMessage("mblk", vBlocks);
+    node.PushMessage("ping", (uint64_t)1);
+    node.PushMessage("tx", vBlocks[0].vtx[0]);
+
+    CNode nodeRecv(INVALID_SOCKET, CAddress(), "", true);
+    BOOST_REQUIRE(ReceiveQueued(node, nodeRecv));
+    BOOST_REQUIRE_EQUAL(nodeRecv.vRecvMsg.size(), 4U);
+
+    // -- only the large block and header messages are compressed
+    BOOST_CHECK_EQUAL(nodeRecv.vRecvMsg[0].hdr.GetCommand(), "lz4msg");
+    BOOST_CHECK_EQUAL(nodeRecv.vRecvMsg[1].hdr.GetCommand(), "lz4msg");
+    BOOST_CHECK_EQUAL(nodeRecv.vRecvMsg[2].hdr.GetCommand(), "ping");
+    BOOST_CHECK_EQUAL(nodeRecv.vRecvMsg[3].hdr.GetCommand(), "tx");
+
+    std::string strCommand;
+    CDataStream& vRecvHeaders = nodeRecv.vRecvMsg[0].vRecv;
+    BOOST_REQUIRE(DecompressMessage(vRecvHeaders, strCommand));
+    BOOST_CHECK_EQUAL(strCommand, "headers");
+    std::vector<CBlockThin> vHeadersRecv;
+    vRecvHeaders >> vHeadersRecv;
+    BOOST_REQUIRE_EQUAL(vHeadersRecv.size(), vHeaders.size());
+    BOOST_CHECK(vHeadersRecv.back().GetHash() == vHeaders.back().GetHash());
+
+    CDataStream& vRecvBlocks = nodeRecv.vRecvMsg[1].vRecv;
+    BOOST_REQUIRE(DecompressMessage(vRecvBlocks, strCommand));
+    BOOST_CHECK_EQUAL(strCommand, "mblk");
+    std::vector<CBlock> vBlocksRecv;
+    vRecvBlocks >> vBlocksRecv;
+    BOOST_REQUIRE_EQUAL(vBlocksRecv.size(), vBlocks.size());
+    BOOST_CHECK(vBlocksRecv[7].GetHash() == vBlocks[7].GetHash());
+    BOOST_CHECK(vBlocksRecv[7].BuildMerkleTree() == vBlocks[7].hashMerkleRoot);
+
+    // -- incompressible payloads are sent as they are
+    CNode nodeRandom(INVALID_SOCKET, CAddress(), "", true);
+    nodeRandom.fCompress = true;
+    nodeRandom.PushMessage("block", RandomPayload(100000));
+    BOOST_CHECK_EQUAL(std::string(&(*nodeRandom.vSendMsg.back())[MESSAGE_START_SIZE]), "block");
+
+    // -- shared messages compress once, a copy
+    CSharedMessage msg = MakeSharedMessage("block", vBlocks[0]);
+    CSharedMessage msgCompressed = CompressSharedMessage(msg);
+    BOOST_CHECK(msgCompressed != msg);
+    BOOST_CHECK(msgCompressed->size() < msg->size());
+    BOOST_CHECK(CompressSharedMessage(MakeSharedMessage("inv", RandomPayload(5000)))->size() > 5000);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_decompress_bounds)
+{
+    std::vector<char> vchPayload(100000, 'a');
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("block", 0);
+    ss.write(&vchPayload[0], vchPayload.size());
+    BOOST_REQUIRE(CompressMessage(ss));
+
+    CDataStream ssGood(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end(), SER_NETWORK, PROTOCOL_VERSION);
+    std::string strCommand;
+    BOOST_CHECK(DecompressMessage(ssGood, strCommand));
+    BOOST_CHECK_EQUAL(ssGood.size(), vchPayload.size());
+
+    const unsigned int nSizeOffset = CMessageHeader::COMMAND_SIZE;
+    unsigned int vBadSizes[] = { MAX_SIZE + 1, 100001, 99999, 0xffffffff };
+    for (size_t i = 0; i < sizeof(vBadSizes) / sizeof(vBadSizes[0]); ++i)
+    {
+        CDataStream ssBad(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end(), SER_NETWORK, PROTOCOL_VERSION);
+        memcpy(&ssBad[nSizeOffset], &vBadSizes[i], sizeof(vBadSizes[i]));
+        BOOST_CHECK(!DecompressMessage(ssBad, strCommand));
+    };
+
+    // -- a small message can't claim a large payload, checked before anything is allocated
+    CDataStream ssBomb(ss.begin() + CMessageHeader::HEADER_SIZE, ss.begin() + CMessageHeader::HEADER_SIZE + 30, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nBomb = MAX_SIZE;
+    memcpy(&ssBomb[nSizeOffset], &nBomb, sizeof(nBomb));
+    BOOST_CHECK(!DecompressMessage(ssBomb, strCommand));
+
+    // -- truncated
+    CDataStream ssShort(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end() - 10, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(!DecompressMessage(ssShort, strCommand));
+
+    // -- lz4msg doesn't nest and carries block and header commands only
+    CDataStream ssNested(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end(), SER_NETWORK, PROTOCOL_VERSION);
+    strncpy(&ssNested[0], "lz4msg", CMessageHeader::COMMAND_SIZE);
+    BOOST_CHECK(!DecompressMessage(ssNested, strCommand));
+    strncpy(&ssNested[0], "tx", CMessageHeader::COMMAND_SIZE);
+    BOOST_CHECK(!DecompressMessage(ssNested, strCommand));
+}
+
+// Block download over a slow link, mblk batches as a syncing peer receives them.
+// Time is the link time for the bytes sent plus compression and decompression.
+// Run with --log_level=message --run_test=netmessage_tests/netmessage_compress_benchmark to see results
+BOOST_AUTO_TEST_CASE(netmessage_compress_benchmark, *boost::unit_test::disabled())
+{
+    const int nBatches = 20;
+    const double dLinkBytesPerSec = 1000000 / 8.0 * 2; // 2 Mbit/s, a typical Tor circuit
+
+    std::vector<std::vector<CBlock> > vBatches;
+    for (int i = 0; i < nBatches; ++i)
+        vBatches.push_back(SyntheticBlocks(16, 1 + i % 40));
+
+    uint64_t nRaw = 0, nWire = 0;
+    int64_t nTimeCompress = 0, nTimeDecompress = 0;
+    for (int i = 0; i < nBatches; ++i)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CMessageHeader("mblk", 0) << vBatches[i];
+        nRaw += ss.size();
+
+        int64_t nStart = GetTimeMicros();
+        bool fCompressed = CompressMessage(ss);
+        nTimeCompress += GetTimeMicros() - nStart;
+        nWire += ss.size();
+        if (!fCompressed)
+            continue;
+
+        CDataStream vRecv(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end(), SER_NETWORK, PROTOCOL_VERSION);
+        std::string strCommand;
+        nStart = GetTimeMicros();
+        BOOST_REQUIRE(DecompressMessage(vRecv, strCommand));
+        nTimeDecompress += GetTimeMicros() - nStart;
+    };
+
+    double dTimeRaw = nRaw / dLinkBytesPerSec;
+    double dTimeCompressed = nWire / dLinkBytesPerSec + (nTimeCompress + nTimeDecompress) / 1e6;
+    BOOST_CHECK(nWire < nRaw);
+    BOOST_TEST_MESSAGE(strprintf("mblk %u bytes, lz4msg %u bytes (%.1f%%), compress %.0f MiB/s, decompress %.0f MiB/s, at 2 Mbit/s %.2fs raw %.2fs compressed",
+        nRaw, nWire, 100.0 * nWire / nRaw,
+        nRaw / (1024.0 * 1024.0) / std::max(1e-6, nTimeCompress / 1e6),
+        nRaw / (1024.0 * 1024.0) / std::max(1e-6, nTimeDecompress / 1e6),
+        dTimeRaw, dTimeCompressed));
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_upload_limits)
+{
+    // -- 1000 bytes a second, a message may take the bucket into debt
+    CTokenBucket bucket;
+    BOOST_CHECK(bucket.Available(1));
+    bucket.Consume(1 << 30, 1);
+    BOOST_CHECK(bucket.Available(2));
+
+    bucket.SetRate(1000, 1000);
+    int64_t nNow = 1000000;
+    BOOST_CHECK(bucket.Available(nNow));
+    bucket.Consume(3000, nNow);
+    BOOST_CHECK(!bucket.Available(nNow));
+    int64_t nWait = bucket.TimeUntilAvailable(nNow);
+    BOOST_CHECK(nWait > 1900000 && nWait <= 2002000);
+    BOOST_CHECK(!bucket.Available(nNow + nWait / 2));
+    BOOST_CHECK(bucket.Available(nNow + nWait));
+
+    // -- refills stop at the burst size
+    nNow += 100 * 1000000;
+    BOOST_CHECK(bucket.Available(nNow));
+    bucket.Consume(1000, nNow);
+    BOOST_CHECK(!bucket.Available(nNow));
+
+    // -- historical blocks stop before the target, leaving the reserve for new blocks
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+
+    CNode::SetMaxOutboundTarget(10 * 1024 * 1024);
+    CNode::RecordBytesSent(1);
+    uint64_t nLeft = CNode::GetOutboundTargetBytesLeft();
+    BOOST_CHECK(nLeft <= 10 * 1024 * 1024);
+    BOOST_CHECK(CNode::GetMaxOutboundTimeLeftInCycle() > 0);
+
+    CNode::RecordBytesSent(nLeft - 1024 * 1024);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    CNode::RecordBytesSent(1024 * 1024);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+    CNode::SetMaxOutboundTarget(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,13 +2,60 @@
 
 #include <boost/atomic.hpp>
 
+#include "hash.h"
 #include "smessage.h"
+#include "smsgpow.h"
+#define XXH_INLINE_ALL
+#include "xxhash/xxhash.h"
 #include "init.h" // for pwalletMain
 
 // test_tokenpay --log_level=all  --run_test=smsg_tests
 
 BOOST_AUTO_TEST_SUITE(smsg_tests)
 
+// Enables smsg with keystore in place of pwalletMain and no smsg addresses, restores both when it goes out of scope.
+struct SmsgWalletSetup
+{
+    CWallet keystore;
+    CWallet* pwalletMainOld;
+    std::vector<SecMsgAddress> smsgAddressesOld;
+
+    SmsgWalletSetup()
+    {
+        fSecMsgEnabled = true;
+        pwalletMainOld = pwalletMain;
+        UnregisterWallet(pwalletMain);
+        pwalletMain = &keystore;
+        RegisterWallet(&keystore);
+
+        LOCK(cs_smsg);
+        smsgAddressesOld.swap(smsgAddresses);
+    }
+
+    ~SmsgWalletSetup()
+    {
+        {
+            LOCK(cs_smsg);
+            smsgAddresses.swap(smsgAddressesOld);
+        }
+        SecureMsgWalletLocked();
+
+        UnregisterWallet(&keystore);
+        pwalletMain = pwalletMainOld;
+        RegisterWallet(pwalletMain);
+        fSecMsgEnabled = false;
+    }
+
+    std::string NewAddress()
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        LOCK(keystore.cs_wallet);
+        keystore.AddKey(key);
+        return CBitcoinAddress(key.GetPubKey().GetID()).ToString();
+    }
+};
+
 BOOST_AUTO_TEST_CASE(smsg_test)
 {
     
@@ -17,10 +64,10 @@ BOOST_AUTO_TEST_CASE(smsg_test)
         "Unlike a traditional payment service, there is no centralized handling of user funds at any point in time. "
         "TokenPay has incorporated a peer to peer encrypted instant messaging system using algorithms to maintain private conversations when using the TokenPay Wallets.";
     
-    fSecMsgEnabled = true;
+    SmsgWalletSetup setup;
+    CWallet& keystore = setup.keystore;
     int rv;
     int nKeys = 4;
-    CWallet keystore;
     CKey keyOwn[nKeys];
     for (int i = 0; i < nKeys; i++)
     {
@@ -37,11 +84,6 @@ BOOST_AUTO_TEST_CASE(smsg_test)
         keystore.AddKey(keyRemote[i]); // need pubkey
     };
     
-    CWallet *pwalletMainOld = pwalletMain;
-    UnregisterWallet(pwalletMain);
-    pwalletMain = &keystore;
-    RegisterWallet(&keystore);
-    
     for (int i = 0; i < nKeys; i++)
     {
         SecureMessage smsg;
@@ -73,12 +115,854 @@ BOOST_AUTO_TEST_CASE(smsg_test)
         
         BOOST_CHECK_MESSAGE(1 == (rv = SecureMsgDecrypt(false, sAddrFail, smsg, msg)), "SecureMsgDecrypt " << rv);
     };
-    
-    
-    UnregisterWallet(&keystore);
-    pwalletMain = pwalletMainOld;
-    RegisterWallet(pwalletMain);
+}
+
+static void RandomSmsg(std::vector<uint8_t>& vchMessage, uint32_t nPayload)
+{
+    vchMessage.resize(SMSG_HDR_LEN + nPayload);
+    for (size_t i = 0; i < vchMessage.size(); ++i)
+        vchMessage[i] = insecure_rand();
+    SecureMessage* psmsg = (SecureMessage*) &vchMessage[0];
+    psmsg->version[0] = 1;
+    psmsg->nPayload = nPayload;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_pow)
+{
+    fSecMsgEnabled = true;
+
+    // -- every job is solved and passes SecureMsgValidate, whatever the thread count
+    int vThreads[] = { 1, 3 };
+    for (int t = 0; t < 2; ++t)
+    {
+        std::vector<std::vector<uint8_t> > vMessages(5);
+        std::vector<SecMsgPowJob> vJobs;
+        for (size_t i = 0; i < vMessages.size(); ++i)
+        {
+            RandomSmsg(vMessages[i], i * 300);
+            vJobs.push_back(SecMsgPowJob(&vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], i * 300));
+        };
+
+        BOOST_CHECK_EQUAL(SecureMsgPowBatch(vJobs, vThreads[t], fSecMsgEnabled), (int)vJobs.size());
+        for (size_t i = 0; i < vJobs.size(); ++i)
+        {
+            BOOST_CHECK_EQUAL(vJobs[i].rv, 0);
+            BOOST_CHECK(vJobs[i].nHashes > 0);
+            BOOST_CHECK_EQUAL(SecureMsgValidate(&vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], i * 300), 0);
+        };
+    };
+
+    // -- stopped jobs are left unsolved
+    bool fStop = false;
+    std::vector<uint8_t> vchMessage;
+    RandomSmsg(vchMessage, 100);
+    std::vector<SecMsgPowJob> vJobs(1, SecMsgPowJob(&vchMessage[0], &vchMessage[SMSG_HDR_LEN], 100));
+    BOOST_CHECK_EQUAL(SecureMsgPowBatch(vJobs, 2, fStop), 0);
+    BOOST_CHECK_EQUAL(vJobs[0].rv, 2);
+
+    fSecMsgEnabled = false;
+}
+
+// Proof of work for a queue of full size messages, one thread against all cores.
+// Run with --log_level=message --run_test=smsg_tests/smsg_pow_benchmark to see results
+BOOST_AUTO_TEST_CASE(smsg_pow_benchmark, *boost::unit_test::disabled())
+{
+    fSecMsgEnabled = true;
+
+    const int nMessages = 8;
+    int nCores = std::max(2, (int)boost::thread::hardware_concurrency());
+    int vThreads[] = { 1, nCores };
+    double vRate[2];
+    int64_t vTime[2];
+    for (int t = 0; t < 2; ++t)
+    {
+        std::vector<std::vector<uint8_t> > vMessages(nMessages);
+        std::vector<SecMsgPowJob> vJobs;
+        for (int i = 0; i < nMessages; ++i)
+        {
+            RandomSmsg(vMessages[i], SMSG_MAX_MSG_BYTES);
+            vJobs.push_back(SecMsgPowJob(&vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], SMSG_MAX_MSG_BYTES));
+        };
+
+        int64_t nStart = GetTimeMicros();
+        BOOST_CHECK_EQUAL(SecureMsgPowBatch(vJobs, vThreads[t], fSecMsgEnabled), nMessages);
+        vTime[t] = GetTimeMicros() - nStart;
+
+        uint64_t nHashes = 0;
+        for (int i = 0; i < nMessages; ++i)
+            nHashes += vJobs[i].nHashes;
+        vRate[t] = nHashes * 1000000.0 / std::max((int64_t)1, vTime[t]);
+    };
+
+    BOOST_TEST_MESSAGE(strprintf("smsg pow %d messages of %u bytes: 1 thread %.0f hashes/s %.2f msg/s, %d threads %.0f hashes/s %.2f msg/s",
+        nMessages, SMSG_MAX_MSG_BYTES,
+        vRate[0], nMessages * 1000000.0 / vTime[0],
+        nCores, vRate[1], nMessages * 1000000.0 / vTime[1]));
+
+    fSecMsgEnabled = false;
+}
+
+// Match a message against many receive keys, the resolved table against SecureMsgDecrypt per address.
+// Run with --log_level=message to see results
+BOOST_AUTO_TEST_CASE(smsg_receive_keys)
+{
+    SmsgWalletSetup setup;
+
+    const int nKeys = 64;
+    std::vector<std::string> vAddresses;
+    for (int i = 0; i < nKeys + 1; i++)
+        vAddresses.push_back(setup.NewAddress());
+
+    {
+        LOCK(cs_smsg);
+        // -- the last key is in the wallet but not receiving
+        for (int i = 0; i < nKeys; i++)
+            smsgAddresses.push_back(SecMsgAddress(vAddresses[i], true, i % 2 == 0));
+    }
+    SecureMsgReceiveKeysChanged();
+
+    std::string sMessage("receive keys");
+    SecureMessage smsgLast, smsgOther;
+    BOOST_CHECK_EQUAL(SecureMsgEncrypt(smsgLast, vAddresses[0], vAddresses[nKeys - 1], sMessage), 0);
+    BOOST_CHECK_EQUAL(SecureMsgEncrypt(smsgOther, vAddresses[0], vAddresses[nKeys], sMessage), 0);
+
+    SecMsgReceiveKey rk;
+    std::vector<uint8_t> key_e;
+    int64_t nStart = GetTimeMicros();
+    BOOST_CHECK_EQUAL(SecureMsgMatchReceiveKeys(&smsgLast.hash[0], smsgLast.pPayload, smsgLast.nPayload, rk, key_e), 0);
+    int64_t nMatched = GetTimeMicros();
+    BOOST_CHECK_EQUAL(rk.sAddress, vAddresses[nKeys - 1]);
+    BOOST_CHECK(!rk.fReceiveAnon);
+    BOOST_CHECK_EQUAL(key_e.size(), 32);
+    BOOST_CHECK_EQUAL(SecureMsgMatchReceiveKeys(&smsgOther.hash[0], smsgOther.pPayload, smsgOther.nPayload, rk, key_e), 2);
+
+    // -- the per address scan it replaces
+    int64_t nStartOld = GetTimeMicros();
+    MessageData msg;
+    int nFound = 0;
+    for (int i = 0; i < nKeys; i++)
+        if (SecureMsgDecrypt(true, vAddresses[i], smsgLast, msg) == 0)
+            nFound++;
+    int64_t nMatchedOld = GetTimeMicros();
+    BOOST_CHECK_EQUAL(nFound, 1);
+
+    // -- receiving turned off for the address
+    {
+        LOCK(cs_smsg);
+        smsgAddresses[nKeys - 1].fReceiveEnabled = false;
+    }
+    SecureMsgReceiveKeysChanged();
+    BOOST_CHECK_EQUAL(SecureMsgMatchReceiveKeys(&smsgLast.hash[0], smsgLast.pPayload, smsgLast.nPayload, rk, key_e), 2);
+
+    BOOST_TEST_MESSAGE(strprintf("smsg match %d receive keys: table %.2f ms, per address %.2f ms",
+        nKeys, (nMatched - nStart) / 1000.0, (nMatchedOld - nStartOld) / 1000.0));
+}
+
+static bool SameBuckets(std::map<int64_t, SecMsgBucket>& a, std::map<int64_t, SecMsgBucket>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    std::map<int64_t, SecMsgBucket>::iterator ita, itb;
+    for (ita = a.begin(), itb = b.begin(); ita != a.end(); ++ita, ++itb)
+    {
+        if (ita->first != itb->first
+            || ita->second.setTokens.size() != itb->second.setTokens.size()
+            || ita->second.hash != itb->second.hash
+            || ita->second.nSetHash != itb->second.nSetHash)
+            return false;
+        std::set<SecMsgToken>::iterator ta, tb;
+        for (ta = ita->second.setTokens.begin(), tb = itb->second.setTokens.begin(); ta != ita->second.setTokens.end(); ++ta, ++tb)
+            if (ta->offset != tb->offset || ta->nPayload != tb->nPayload)
+                return false;
+    };
+    return true;
+}
+
+static int RemoveBucketIndexes()
+{
+    int nRemoved = 0;
+    boost::filesystem::directory_iterator itend;
+    for (boost::filesystem::directory_iterator itd(GetDataDir() / "smsgStore"); itd != itend; ++itd)
+        if (itd->path().extension() == ".idx")
+            nRemoved += boost::filesystem::remove(itd->path());
+    return nRemoved;
+}
+
+// Store 48 hours of messages, load the bucket set from the indexes and from the data files alone.
+// Run with --log_level=message to see results
+BOOST_AUTO_TEST_CASE(smsg_store)
+{
+    fSecMsgEnabled = true;
+    bool fDebugSmsgOld = fDebugSmsg;
+    fDebugSmsg = false;
+
+    boost::filesystem::path pathSmsgDir = GetDataDir() / "smsgStore";
+    boost::filesystem::remove_all(pathSmsgDir);
+
+    std::map<int64_t, SecMsgBucket> smsgBucketsOld, smsgBucketsStored;
+    {
+        LOCK(cs_smsg);
+        smsgBucketsOld.swap(smsgBuckets);
+    }
+
+    const int nPerBucket = 50;
+    int64_t now = GetTime();
+    int nStored = 0;
+    uint64_t nBytes = 0;
+    std::vector<uint8_t> vchMessage;
+    {
+        LOCK(cs_smsg);
+        for (int64_t t = now - SMSG_RETENTION + SMSG_BUCKET_LEN; t < now; t += SMSG_BUCKET_LEN)
+        {
+            for (int i = 0; i < nPerBucket; ++i)
+            {
+                uint32_t nPayload = 100 + insecure_rand() % 2000;
+                RandomSmsg(vchMessage, nPayload);
+                ((SecureMessage*)&vchMessage[0])->timestamp = std::min(now, t + (int64_t)(insecure_rand() % SMSG_BUCKET_LEN));
+                if (SecureMsgStore(&vchMessage[0], &vchMessage[SMSG_HDR_LEN], nPayload) == 0)
+                {
+                    nStored++;
+                    nBytes += SMSG_HDR_LEN + nPayload;
+                };
+            };
+        };
+        SecureMsgFlushStore();
+
+        for (std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+            it->second.hashBucket();
+        smsgBucketsStored.swap(smsgBuckets);
+    }
+    BOOST_CHECK(smsgBucketsStored.size() >= SMSG_RETENTION / SMSG_BUCKET_LEN - 1);
+
+    int64_t nStart = GetTimeMicros();
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    int64_t nFromIndex = GetTimeMicros() - nStart;
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(SameBuckets(smsgBuckets, smsgBucketsStored));
+        smsgBuckets.clear();
+    }
+
+    // -- without indexes every data file is read through, as before indexes were kept
+    BOOST_CHECK_EQUAL(RemoveBucketIndexes(), (int)smsgBucketsStored.size());
+    nStart = GetTimeMicros();
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    int64_t nFromData = GetTimeMicros() - nStart;
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(SameBuckets(smsgBuckets, smsgBucketsStored));
+    }
+
+    // -- a message too short to sample is indexed too, else the index never ends at the data size
+    //    and is rebuilt on every start
+    int64_t nBucket = smsgBucketsStored.rbegin()->first;
+    boost::filesystem::path pathIndex = pathSmsgDir / (strprintf("%d", nBucket) + "_01.idx");
+    {
+        LOCK(cs_smsg);
+        std::vector<uint8_t> vchShort;
+        RandomSmsg(vchShort, 4);
+        ((SecureMessage*)&vchShort[0])->timestamp = nBucket;
+        BOOST_CHECK_EQUAL(SecureMsgStore(&vchShort[0], &vchShort[SMSG_HDR_LEN], 4), 0);
+        SecureMsgFlushStore();
+        smsgBucketsStored[nBucket] = smsgBuckets[nBucket];
+        smsgBucketsStored[nBucket].hashBucket();
+        smsgBuckets.clear();
+    }
+    BOOST_CHECK_EQUAL(RemoveBucketIndexes(), (int)smsgBucketsStored.size());
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    std::time_t nIndexTime = boost::filesystem::last_write_time(pathIndex) - 1000;
+    boost::filesystem::last_write_time(pathIndex, nIndexTime);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(SameBuckets(smsgBuckets, smsgBucketsStored));
+        smsgBuckets.clear();
+    }
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    BOOST_CHECK_EQUAL(boost::filesystem::last_write_time(pathIndex), nIndexTime);
+
+    // -- a torn message at the end of a data file is cut off when the index is rebuilt
+    boost::filesystem::path pathData = pathSmsgDir / (strprintf("%d", nBucket) + "_01.dat");
+    uintmax_t nDataSize = boost::filesystem::file_size(pathData);
+    {
+        FILE* fp = fopen(pathData.string().c_str(), "ab");
+        BOOST_REQUIRE(fp);
+        fwrite(&vchMessage[0], 1, SMSG_HDR_LEN + 10, fp);
+        fclose(fp);
+    }
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.clear();
+    }
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathData), nDataSize);
+
+    // -- a set of wanted messages comes back whole
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK(SameBuckets(smsgBuckets, smsgBucketsStored));
+
+        std::set<SecMsgToken>& tokenSet = smsgBuckets[nBucket].setTokens;
+        std::vector<SecMsgToken> vWanted(tokenSet.begin(), tokenSet.end());
+        size_t nWantedBytes = 0;
+        for (size_t i = 0; i < vWanted.size(); ++i)
+            nWantedBytes += SMSG_HDR_LEN + vWanted[i].nPayload;
+
+        std::vector<uint8_t> vchData;
+        uint32_t nRetrieved;
+        BOOST_CHECK_EQUAL(SecureMsgRetrieve(nBucket, vWanted, vchData, nRetrieved), 0);
+        BOOST_CHECK_EQUAL(nRetrieved, vWanted.size());
+        BOOST_CHECK_EQUAL(vchData.size(), nWantedBytes);
+
+        SecMsgToken token(((SecureMessage*)&vchData[0])->timestamp, &vchData[SMSG_HDR_LEN], vWanted[0].nPayload, 0);
+        BOOST_CHECK(tokenSet.count(token) == 1);
+
+        smsgBuckets.swap(smsgBucketsOld);
+    }
+
+    BOOST_TEST_MESSAGE(strprintf("smsg store %d messages, %.1f MB in %u buckets: load from indexes %.2f ms, from data files %.2f ms",
+        nStored, nBytes / 1048576.0, smsgBucketsStored.size(), nFromIndex / 1000.0, nFromData / 1000.0));
+
+    boost::filesystem::remove_all(pathSmsgDir);
+    fDebugSmsg = fDebugSmsgOld;
     fSecMsgEnabled = false;
 }
 
+static SecMsgToken RandomToken(int64_t nTime)
+{
+    uint8_t sample[8];
+    for (int i = 0; i < 8; ++i)
+        sample[i] = insecure_rand();
+    return SecMsgToken(nTime, sample, 8, 0);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_bucket_sync)
+{
+    int64_t nTime = GetTime();
+
+    // -- the set hash is kept up to date on insert and doesn't depend on order
+    SecMsgBucket bktA, bktB;
+    std::vector<SecMsgToken> vTokens;
+    for (int i = 0; i < 2000; ++i)
+        vTokens.push_back(RandomToken(nTime + i % 600));
+    for (size_t i = 0; i < vTokens.size(); ++i)
+        BOOST_CHECK(bktA.AddToken(vTokens[i]));
+    BOOST_CHECK(!bktA.AddToken(vTokens[0]));
+    for (size_t i = vTokens.size(); i-- > 0; )
+        bktB.AddToken(vTokens[i]);
+    BOOST_CHECK_EQUAL(bktA.nSetHash, bktB.nSetHash);
+    BOOST_CHECK_EQUAL(bktA.GetHash(), bktB.GetHash());
+
+    uint64_t nSetHash = bktA.nSetHash;
+    uint32_t nHash = bktA.GetHash();
+    bktA.hashBucket();
+    BOOST_CHECK_EQUAL(bktA.nSetHash, nSetHash);
+    BOOST_CHECK_EQUAL(bktA.hash, nHash);
+
+    // -- B is missing 5 of A's messages and has 3 A doesn't
+    std::set<SecMsgToken> setMissing;
+    for (int i = 0; i < 5; ++i)
+    {
+        std::set<SecMsgToken>::iterator it = bktB.setTokens.find(vTokens[i * 300]);
+        bktB.nSetHash -= SecureMsgTokenHash(*it);
+        bktB.setTokens.erase(it);
+        setMissing.insert(vTokens[i * 300]);
+    };
+    for (int i = 0; i < 3; ++i)
+        bktB.AddToken(RandomToken(nTime));
+    BOOST_CHECK(bktA.GetSetHash32() != bktB.GetSetHash32());
+
+    // -- B sketches for the size difference plus slack, A sends back only what B lacks
+    uint64_t nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+    unsigned int nCapacity = bktA.setTokens.size() - bktB.setTokens.size() + SMSG_RECON_SLACK;
+    std::vector<SecMsgToken> vMissing;
+    BOOST_CHECK(bktA.Reconcile(bktB.GetSketch(nCapacity, nSalt).GetSyndromes(), vMissing, nSalt));
+    BOOST_CHECK_EQUAL(vMissing.size(), setMissing.size());
+    for (size_t i = 0; i < vMissing.size(); ++i)
+    {
+        BOOST_CHECK(setMissing.count(vMissing[i]) == 1);
+        bktB.AddToken(vMissing[i]);
+    };
+    BOOST_CHECK_EQUAL(bktB.setTokens.size(), bktA.setTokens.size() + 3);
+
+    // -- a difference beyond the capacity falls back to the whole bucket
+    BOOST_CHECK(!bktA.Reconcile(bktB.GetSketch(2, nSalt).GetSyndromes(), vMissing, nSalt));
+    BOOST_CHECK_EQUAL(vMissing.size(), bktA.setTokens.size());
+
+    BOOST_TEST_MESSAGE(strprintf("smsg bucket sync %u messages: sketch %u bytes, token list %u bytes",
+        bktA.setTokens.size(), 16 + 4 * nCapacity, 8 + 16 * bktA.setTokens.size()));
+
+    // -- the ordered hash is still XXH32 of the samples end to end, as older peers compute it
+    std::vector<uint8_t> vchSamples;
+    for (std::set<SecMsgToken>::iterator it = bktA.setTokens.begin(); it != bktA.setTokens.end(); ++it)
+        vchSamples.insert(vchSamples.end(), it->sample, it->sample + 8);
+    BOOST_CHECK_EQUAL(bktA.GetHash(), XXH32(&vchSamples[0], vchSamples.size(), 1));
+
+    // -- two tokens with the same short id cancel out, the whole bucket is sent instead of nothing
+    std::map<uint32_t, SecMsgToken> mapIds;
+    SecMsgToken tokenX, tokenY;
+    for (;;)
+    {
+        SecMsgToken token = RandomToken(nTime);
+        std::pair<std::map<uint32_t, SecMsgToken>::iterator, bool> ret =
+            mapIds.insert(std::make_pair(SecureMsgTokenShortId(token, nSalt), token));
+        if (!ret.second && memcmp(ret.first->second.sample, token.sample, 8) != 0)
+        {
+            tokenX = ret.first->second;
+            tokenY = token;
+            break;
+        };
+    };
+    SecMsgBucket bktX, bktY;
+    bktX.AddToken(tokenX);
+    bktY.AddToken(tokenY);
+    BOOST_CHECK(!bktX.Reconcile(bktY.GetSketch(SMSG_RECON_SLACK, nSalt).GetSyndromes(), vMissing, nSalt));
+    BOOST_REQUIRE_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK(memcmp(vMissing[0].sample, tokenX.sample, 8) == 0);
+
+    // -- another connection's salt separates them
+    uint64_t nSaltOther = nSalt ^ 1;
+    BOOST_CHECK(SecureMsgTokenShortId(tokenX, nSaltOther) != SecureMsgTokenShortId(tokenY, nSaltOther));
+    BOOST_CHECK(bktX.Reconcile(bktY.GetSketch(SMSG_RECON_SLACK, nSaltOther).GetSyndromes(), vMissing, nSaltOther));
+    BOOST_REQUIRE_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK(memcmp(vMissing[0].sample, tokenX.sample, 8) == 0);
+}
+
+// Token and bucket hashing at 200k tokens.
+// Run with --log_level=message --run_test=smsg_tests/smsg_hash_benchmark to see results
+BOOST_AUTO_TEST_CASE(smsg_hash_benchmark, *boost::unit_test::disabled())
+{
+    int64_t nTime = GetTime();
+    const int nTokens = 200000;
+    SecMsgBucket bkt;
+    for (int i = 0; i < nTokens; ++i)
+        bkt.setTokens.insert(RandomToken(nTime + i % SMSG_BUCKET_LEN));
+
+    // -- per token cost from a vector, walking the set costs more than either hash
+    std::vector<SecMsgToken> vTokens(bkt.setTokens.begin(), bkt.setTokens.end());
+    int64_t nStart = GetTimeMicros();
+    // -- SipHash for reference, the token hash before XXH3
+    uint64_t nSip = 0;
+    for (size_t i = 0; i < vTokens.size(); ++i)
+        nSip += CSipHasher(0, 0).Write((uint64_t)vTokens[i].timestamp).Write(vTokens[i].sample, 8).Finalize();
+    int64_t nSipDone = GetTimeMicros();
+    uint64_t nXXH3 = 0;
+    for (size_t i = 0; i < vTokens.size(); ++i)
+        nXXH3 += SecureMsgTokenHash(vTokens[i]);
+    int64_t nXXH3Done = GetTimeMicros();
+    bkt.hashBucket();
+    int64_t nBucketDone = GetTimeMicros();
+    bkt.fHashStale = true;
+    uint32_t nHash = bkt.GetHash();
+    int64_t nOrderedDone = GetTimeMicros();
+    CReconSketch sketch = bkt.GetSketch(MAX_SKETCH_CAPACITY, 0);
+    int64_t nSketchDone = GetTimeMicros();
+
+    BOOST_CHECK_EQUAL(bkt.nSetHash, nXXH3);
+    BOOST_CHECK_EQUAL(bkt.hash, nHash);
+    BOOST_TEST_MESSAGE(strprintf("smsg hash %u tokens: siphash %.1f ns, xxh3 %.1f ns, hashBucket %.2f ms, ordered xxh32 %.2f ms, sketch %u %.2f ms",
+        bkt.setTokens.size(),
+        (nSipDone - nStart) * 1000.0 / vTokens.size(),
+        (nXXH3Done - nSipDone) * 1000.0 / vTokens.size(),
+        (nBucketDone - nXXH3Done) / 1000.0,
+        (nOrderedDone - nBucketDone) / 1000.0,
+        sketch.GetCapacity(), (nSketchDone - nOrderedDone) / 1000.0));
+}
+
+BOOST_AUTO_TEST_CASE(smsg_scan_public_keys)
+{
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+    CKey keyUncompressed;
+    keyUncompressed.MakeNewKey(false);
+
+    std::vector<unsigned char> vchSig(71, 0x30);
+    CBlock block;
+    for (int i = 0; i < 3; i++)
+    {
+        // -- key 0 spends in every txn, the uncompressed key is skipped
+        CTransaction tx;
+        tx.vin.resize(2);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig = CScript() << vchSig << key[0].GetPubKey();
+        tx.vin[1].prevout = COutPoint(GetRandHash(), 1);
+        tx.vin[1].scriptSig = CScript() << vchSig << (i == 2 ? keyUncompressed.GetPubKey() : key[i + 1].GetPubKey());
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        tx.vout[0].scriptPubKey.SetDestination(key[0].GetPubKey().GetID());
+        block.vtx.push_back(tx);
+    };
+
+    std::vector<CPubKey> vPubKeys;
+    uint32_t nTransactions = 0, nInputs = 0;
+    SecureMsgExtractPublicKeys(block, vPubKeys, nTransactions, nInputs);
+    BOOST_CHECK_EQUAL(nTransactions, 3);
+    BOOST_CHECK_EQUAL(nInputs, 6);
+    BOOST_CHECK_EQUAL(vPubKeys.size(), 5);
+
+    bool fScanIncomingOld = smsgOptions.fScanIncoming;
+    smsgOptions.fScanIncoming = true;
+    BOOST_CHECK(SecureMsgScanBlock(block));
+    smsgOptions.fScanIncoming = fScanIncomingOld;
+
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        BOOST_REQUIRE(addrpkdb.Open("cw"));
+        for (int i = 0; i < 3; i++)
+        {
+            CKeyID keyId = key[i].GetPubKey().GetID();
+            CPubKey pubKey;
+            BOOST_CHECK(addrpkdb.ReadPK(keyId, pubKey));
+            BOOST_CHECK(pubKey == key[i].GetPubKey());
+        };
+        CKeyID keyId = keyUncompressed.GetPubKey().GetID();
+        BOOST_CHECK(!addrpkdb.ExistsPK(keyId));
+
+        // -- checkpoint is written in the same batch as the keys
+        uint256 hash = GetRandHash(), hashRead;
+        BOOST_CHECK(addrpkdb.TxnBegin());
+        BOOST_CHECK(addrpkdb.WriteScanCheckpoint(hash));
+        BOOST_CHECK(!addrpkdb.ReadScanCheckpoint(hashRead));
+        BOOST_CHECK(addrpkdb.TxnCommit());
+        BOOST_CHECK(addrpkdb.ReadScanCheckpoint(hashRead));
+        BOOST_CHECK(hashRead == hash);
+        BOOST_CHECK(addrpkdb.EraseScanCheckpoint());
+        BOOST_CHECK(!addrpkdb.ReadScanCheckpoint(hashRead));
+    }
+}
+
+static std::vector<uint8_t> SmesgKey(const char* pszPrefix, int64_t timestamp)
+{
+    std::vector<uint8_t> vchKey(18);
+    memcpy(&vchKey[0], pszPrefix, 2);
+    memcpy(&vchKey[2], &timestamp, 8);
+    uint64_t nSample = GetRand(std::numeric_limits<uint64_t>::max());
+    memcpy(&vchKey[10], &nSample, 8);
+    return vchKey;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_index)
+{
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    BOOST_REQUIRE(db.Open("cr+"));
+    BOOST_CHECK(db.BuildSmesgIndex()); // as SecureMsgStart
+
+    const std::string sAddrA = "addressA", sAddrB = "addressB", sAddrOwn = "addressOwn";
+    std::vector<std::vector<uint8_t> > vInboxA, vAll, vKeys;
+    SecMsgStored smsgStored;
+    smsgStored.timeReceived = GetTime();
+    smsgStored.sAddrTo = sAddrOwn;
+    for (int i = 0; i < 10; i++)
+    {
+        // -- even messages are unread, all from A
+        std::vector<uint8_t> vchKey = SmesgKey("im", 1000 + i * 300);
+        smsgStored.sAddrFrom = sAddrA;
+        smsgStored.status = (i % 2 == 0 ? SMSG_MASK_UNREAD : 0) | SMSG_MASK_FROM;
+        BOOST_CHECK(db.WriteSmesg(&vchKey[0], smsgStored));
+        vInboxA.push_back(vchKey);
+        vAll.push_back(vchKey);
+    };
+    std::vector<uint8_t> vchKeyB = SmesgKey("im", 1150);
+    smsgStored.sAddrFrom = sAddrB;
+    smsgStored.status = SMSG_MASK_UNREAD | SMSG_MASK_FROM;
+    BOOST_CHECK(db.WriteSmesg(&vchKeyB[0], smsgStored));
+    vAll.push_back(vchKeyB);
+    std::vector<uint8_t> vchKeySent = SmesgKey("sm", 1200);
+    SecMsgStored smsgSent;
+    smsgSent.sAddrTo = sAddrA;
+    BOOST_CHECK(db.WriteSmesg(&vchKeySent[0], smsgSent));
+    vAll.push_back(vchKeySent);
+
+    // -- the sender is stored with the message
+    BOOST_CHECK(db.ReadSmesg(&vchKeyB[0], smsgStored));
+    BOOST_CHECK_EQUAL(smsgStored.sAddrFrom, sAddrB);
+    BOOST_CHECK(db.ReadSmesg(&vchKeySent[0], smsgSent));
+    BOOST_CHECK(smsgSent.sAddrFrom.empty());
+
+    // -- all messages newest first, primary keys don't sort by time
+    BOOST_CHECK(db.ListSmesg("im", 0, 3, vKeys));
+    BOOST_REQUIRE_EQUAL(vKeys.size(), 3);
+    BOOST_CHECK(vKeys[0] == vInboxA[9] && vKeys[1] == vInboxA[8] && vKeys[2] == vInboxA[7]);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesg("im", 8, 0, vKeys));
+    BOOST_REQUIRE_EQUAL(vKeys.size(), 3);
+    BOOST_CHECK(vKeys[0] == vInboxA[1] && vKeys[1] == vchKeyB && vKeys[2] == vInboxA[0]);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesg("sm", 0, 0, vKeys));
+    BOOST_CHECK(vKeys.size() == 1 && vKeys[0] == vchKeySent);
+    vKeys.clear();
+
+    // -- newest first, paged
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrA, 0, 3, vKeys));
+    BOOST_REQUIRE_EQUAL(vKeys.size(), 3);
+    BOOST_CHECK(vKeys[0] == vInboxA[9] && vKeys[1] == vInboxA[8] && vKeys[2] == vInboxA[7]);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrA, 8, 0, vKeys));
+    BOOST_REQUIRE_EQUAL(vKeys.size(), 2);
+    BOOST_CHECK(vKeys[0] == vInboxA[1] && vKeys[1] == vInboxA[0]);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("sm", sAddrA, 0, 0, vKeys));
+    BOOST_CHECK(vKeys.size() == 1 && vKeys[0] == vchKeySent);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("im", "address", 0, 0, vKeys));
+    BOOST_CHECK(vKeys.empty());
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrOwn, 0, 0, vKeys));
+    BOOST_CHECK(vKeys.empty());
+
+    BOOST_CHECK(db.ListSmesgUnread(0, 0, vKeys));
+    BOOST_REQUIRE_EQUAL(vKeys.size(), 6);
+    BOOST_CHECK(vKeys[0] == vInboxA[8] && vKeys[4] == vchKeyB && vKeys[5] == vInboxA[0]);
+
+    // -- marking read and erasing update the index, in a batch too
+    BOOST_CHECK(db.ReadSmesg(&vInboxA[8][0], smsgStored));
+    smsgStored.status &= ~SMSG_MASK_UNREAD;
+    BOOST_CHECK(db.TxnBegin());
+    BOOST_CHECK(db.WriteSmesg(&vInboxA[8][0], smsgStored));
+    BOOST_CHECK(db.EraseSmesg(&vInboxA[9][0]));
+    BOOST_CHECK(db.TxnCommit());
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgUnread(0, 1, vKeys));
+    BOOST_CHECK(vKeys.size() == 1 && vKeys[0] == vInboxA[6]);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrA, 0, 1, vKeys));
+    BOOST_CHECK(vKeys.size() == 1 && vKeys[0] == vInboxA[8]);
+
+    // -- messages stored without index keys are indexed once, without a sender by time and unread only
+    std::vector<uint8_t> vchKeyOld = SmesgKey("im", 900);
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    smsgStored.sAddrFrom.clear();
+    smsgStored.status = SMSG_MASK_UNREAD;
+    ssValue << smsgStored;
+    BOOST_CHECK(db.pdb->Put(leveldb::WriteOptions(), std::string(vchKeyOld.begin(), vchKeyOld.end()), ssValue.str()).ok());
+    vAll.push_back(vchKeyOld);
+    BOOST_CHECK(db.BuildSmesgIndex());
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgUnread(0, 0, vKeys));
+    BOOST_CHECK(vKeys.empty() || vKeys.back() != vchKeyOld);
+    BOOST_CHECK(db.pdb->Delete(leveldb::WriteOptions(), "ix").ok());
+    BOOST_CHECK(db.BuildSmesgIndex());
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgUnread(0, 0, vKeys));
+    BOOST_CHECK(!vKeys.empty() && vKeys.back() == vchKeyOld);
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesg("im", 0, 0, vKeys));
+    BOOST_CHECK(!vKeys.empty() && vKeys.back() == vchKeyOld);
+
+    // -- keys of an older index version are replaced
+    std::string sStale = "ia" + std::string(1, (char)sAddrOwn.size()) + sAddrOwn + std::string(8, '\0')
+        + std::string(vchKeyOld.begin(), vchKeyOld.end());
+    BOOST_CHECK(db.pdb->Put(leveldb::WriteOptions(), sStale, "").ok());
+    CDataStream ssVersion(SER_DISK, CLIENT_VERSION);
+    ssVersion << (uint32_t)1;
+    BOOST_CHECK(db.pdb->Put(leveldb::WriteOptions(), "ix", ssVersion.str()).ok());
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrOwn, 0, 0, vKeys));
+    BOOST_CHECK_EQUAL(vKeys.size(), 1U);
+    BOOST_CHECK(db.BuildSmesgIndex());
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrOwn, 0, 0, vKeys));
+    BOOST_CHECK(vKeys.empty());
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrA, 0, 0, vKeys));
+    BOOST_CHECK_EQUAL(vKeys.size(), 9U);
+
+    for (size_t i = 0; i < vAll.size(); i++)
+        BOOST_CHECK(db.EraseSmesg(&vAll[i][0]));
+    vKeys.clear();
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrA, 0, 0, vKeys));
+    BOOST_CHECK(db.ListSmesgByAddress("im", sAddrB, 0, 0, vKeys));
+    BOOST_CHECK(db.ListSmesgByAddress("sm", sAddrA, 0, 0, vKeys));
+    BOOST_CHECK(db.ListSmesgUnread(0, 0, vKeys));
+    BOOST_CHECK(db.ListSmesg("im", 0, 0, vKeys));
+    BOOST_CHECK(db.ListSmesg("sm", 0, 0, vKeys));
+    BOOST_CHECK(vKeys.empty());
+}
+
+static void ReportStage(const char* pszStage, std::vector<int64_t>& vTimes, int64_t nTotal)
+{
+    if (vTimes.empty())
+        return;
+    std::sort(vTimes.begin(), vTimes.end());
+    size_t n = vTimes.size();
+    BOOST_TEST_MESSAGE(strprintf("  %-8s p50 %8.2f ms  p90 %8.2f ms  p99 %8.2f ms  max %8.2f ms  %9.1f msg/s",
+        pszStage, vTimes[n / 2] / 1000.0, vTimes[n * 9 / 10] / 1000.0, vTimes[n * 99 / 100] / 1000.0, vTimes[n - 1] / 1000.0,
+        n * 1000000.0 / std::max((int64_t)1, nTotal)));
+}
+
+// The secure message pipeline end to end: encrypt, proof of work, store, relay to a peer by
+// smsgWant/smsgMsg, scan against the local receive keys and decrypt.
+// Synthetic senders and receivers have nAddresses each, all keys are in one wallet and the
+// relay goes through a CNode without a socket.
+// Run with --log_level=message --run_test=smsg_tests/smsg_pipeline_benchmark to see results
+BOOST_AUTO_TEST_CASE(smsg_pipeline_benchmark, *boost::unit_test::disabled())
+{
+    SmsgWalletSetup setup;
+    bool fDebugSmsgOld = fDebugSmsg;
+    fDebugSmsg = false;
+
+    const int nSenders = 4;
+    const int nReceivers = 4;
+    const int nAddresses = 8;
+    const int nMessages = 32;
+    const size_t nRelayBatch = 8;   // messages per smsgWant
+
+    std::vector<std::string> vSenders, vReceivers;
+    for (int i = 0; i < nSenders * nAddresses; i++)
+        vSenders.push_back(setup.NewAddress());
+    for (int i = 0; i < nReceivers * nAddresses; i++)
+        vReceivers.push_back(setup.NewAddress());
+
+    boost::filesystem::remove_all(GetDataDir() / "smsgStore");
+    std::map<int64_t, SecMsgBucket> smsgBucketsOld;
+    {
+        LOCK(cs_smsg);
+        smsgBucketsOld.swap(smsgBuckets);
+        // -- anon on, the scan only matches the MAC and decrypt is its own stage
+        for (size_t i = 0; i < vReceivers.size(); i++)
+            smsgAddresses.push_back(SecMsgAddress(vReceivers[i], true, true));
+    }
+    SecureMsgReceiveKeysChanged();
+
+    std::vector<int64_t> vEncrypt, vPow, vStore, vRelay, vScan, vDecrypt;
+    int64_t nTimeEncrypt = 0, nTimePow = 0, nTimeStore = 0, nTimeRelay = 0, nTimeScan = 0, nTimeDecrypt = 0;
+
+    std::map<SecMsgToken, std::pair<std::string, std::string> > mapSent; // to address, text
+    int64_t nStartAll = GetTimeMicros();
+    for (int i = 0; i < nMessages; i++)
+    {
+        std::string sFrom = vSenders[insecure_rand() % vSenders.size()];
+        std::string sTo = vReceivers[insecure_rand() % vReceivers.size()];
+        std::string sText(100 + insecure_rand() % 900, ' ');
+        for (size_t k = 0; k < sText.size(); k++)
+            sText[k] = 'a' + insecure_rand() % 26;
+
+        SecureMessage smsg;
+        int64_t nStart = GetTimeMicros();
+        BOOST_REQUIRE_EQUAL(SecureMsgEncrypt(smsg, sFrom, sTo, sText), 0);
+        int64_t nEncrypted = GetTimeMicros();
+        BOOST_REQUIRE_EQUAL(SecureMsgSetHash(&smsg.hash[0], smsg.pPayload, smsg.nPayload), 0);
+        int64_t nSolved = GetTimeMicros();
+        {
+            LOCK(cs_smsg);
+            BOOST_REQUIRE_EQUAL(SecureMsgStore(smsg), 0);
+        }
+        int64_t nStored = GetTimeMicros();
+
+        vEncrypt.push_back(nEncrypted - nStart);
+        vPow.push_back(nSolved - nEncrypted);
+        vStore.push_back(nStored - nSolved);
+        nTimeEncrypt += nEncrypted - nStart;
+        nTimePow += nSolved - nEncrypted;
+        nTimeStore += nStored - nSolved;
+
+        mapSent[SecMsgToken(smsg.timestamp, smsg.pPayload, smsg.nPayload, 0)] = std::make_pair(sTo, sText);
+    };
+    {
+        LOCK(cs_smsg);
+        SecureMsgFlushStore();
+    }
+
+    // -- a peer asks for the new messages, each smsgMsg it gets back is received as by SecureMsgReceive
+    CNode nodePeer(INVALID_SOCKET, CAddress(), "", true);
+    std::map<SecMsgToken, std::pair<std::string, std::string> >::iterator it = mapSent.begin();
+    int nReceived = 0;
+    while (it != mapSent.end())
+    {
+        int64_t nBucket = it->first.timestamp - (it->first.timestamp % SMSG_BUCKET_LEN);
+        std::vector<uint8_t> vchWant(8);
+        memcpy(&vchWant[0], &nBucket, 8);
+        for (; it != mapSent.end() && vchWant.size() < 8 + 16 * nRelayBatch
+            && it->first.timestamp - (it->first.timestamp % SMSG_BUCKET_LEN) == nBucket; ++it)
+        {
+            vchWant.resize(vchWant.size() + 16);
+            memcpy(&vchWant[vchWant.size() - 16], &it->first.timestamp, 8);
+            memcpy(&vchWant[vchWant.size() - 8], it->first.sample, 8);
+        };
+        size_t nWanted = (vchWant.size() - 8) / 16;
+
+        CDataStream ssWant(SER_NETWORK, PROTOCOL_VERSION);
+        ssWant << vchWant;
+        std::vector<uint8_t> vchData;
+
+        int64_t nStart = GetTimeMicros();
+        SecureMsgReceiveData(&nodePeer, "smsgWant", ssWant);
+        {
+            LOCK(nodePeer.cs_vSend);
+            BOOST_REQUIRE(!nodePeer.vSendMsg.empty());
+            const CSharedMessage& msg = nodePeer.vSendMsg.back();
+            CDataStream ssMsg(msg->begin() + CMessageHeader::HEADER_SIZE, msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+            ssMsg >> vchData;
+        }
+        int64_t nRelayed = GetTimeMicros();
+        vRelay.insert(vRelay.end(), nWanted, nRelayed - nStart);
+        nTimeRelay += nRelayed - nStart;
+
+        uint32_t nBunch;
+        memcpy(&nBunch, &vchData[0], 4);
+        BOOST_CHECK_EQUAL(nBunch, nWanted);
+
+        size_t n = 12;
+        for (uint32_t i = 0; i < nBunch; i++)
+        {
+            uint8_t* pHeader = &vchData[n];
+            uint8_t* pPayload = &vchData[n + SMSG_HDR_LEN];
+            SecureMessage* psmsg = (SecureMessage*) pHeader;
+            uint32_t nPayload = psmsg->nPayload;
+            n += SMSG_HDR_LEN + nPayload;
+
+            nStart = GetTimeMicros();
+            BOOST_CHECK_EQUAL(SecureMsgValidate(pHeader, pPayload, nPayload), 0);
+            BOOST_CHECK_EQUAL(SecureMsgScanMessage(pHeader, pPayload, nPayload, false), 0);
+            int64_t nScanned = GetTimeMicros();
+
+            std::pair<std::string, std::string>& sent = mapSent[SecMsgToken(psmsg->timestamp, pPayload, nPayload, 0)];
+            MessageData msg;
+            BOOST_CHECK_EQUAL(SecureMsgDecrypt(false, sent.first, pHeader, pPayload, nPayload, msg), 0);
+            int64_t nDecrypted = GetTimeMicros();
+            BOOST_CHECK(std::string((char*)&msg.vchMessage[0]) == sent.second);
+
+            vScan.push_back(nScanned - nStart);
+            vDecrypt.push_back(nDecrypted - nScanned);
+            nTimeScan += nScanned - nStart;
+            nTimeDecrypt += nDecrypted - nScanned;
+            nReceived++;
+        };
+    };
+    int64_t nTimeAll = GetTimeMicros() - nStartAll;
+    BOOST_CHECK_EQUAL(nReceived, nMessages);
+
+    BOOST_TEST_MESSAGE(strprintf("smsg pipeline %d messages, %d senders and %d receivers with %d addresses each: %.2f s, %.1f msg/s",
+        nMessages, nSenders, nReceivers, nAddresses, nTimeAll / 1000000.0, nMessages * 1000000.0 / std::max((int64_t)1, nTimeAll)));
+    ReportStage("encrypt", vEncrypt, nTimeEncrypt);
+    ReportStage("pow", vPow, nTimePow);
+    ReportStage("store", vStore, nTimeStore);
+    ReportStage("relay", vRelay, nTimeRelay);
+    ReportStage("scan", vScan, nTimeScan);
+    ReportStage("decrypt", vDecrypt, nTimeDecrypt);
+
+    // -- SecureMsgScanMessage saved each message to the inbox
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB dbInbox;
+        BOOST_REQUIRE(dbInbox.Open("cw"));
+        for (it = mapSent.begin(); it != mapSent.end(); ++it)
+        {
+            uint8_t chKey[18];
+            memcpy(&chKey[0], "im", 2);
+            memcpy(&chKey[2], &it->first.timestamp, 8);
+            memcpy(&chKey[10], it->first.sample, 8);
+            BOOST_CHECK(dbInbox.ExistsSmesg(chKey));
+            dbInbox.EraseSmesg(chKey);
+        };
+    }
+
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.swap(smsgBucketsOld);
+    }
+    boost::filesystem::remove_all(GetDataDir() / "smsgStore");
+    fDebugSmsg = fDebugSmsgOld;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,410 @@
+#include <boost/test/unit_test.hpp>
+
+#include "txreconciliation.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+
+// test_tokenpay --log_level=message --run_test=txreconciliation_tests
+
+static uint32_t RandElement()
+{
+    uint32_t n;
+    while ((n = insecure_rand()) == 0);
+    return n;
+}
+
+BOOST_AUTO_TEST_SUITE(txreconciliation_tests)
+
+BOOST_AUTO_TEST_CASE(txrecon_sketch)
+{
+    seed_insecure_rand(true);
+
+    for (unsigned int nCapacity = 1; nCapacity <= 64; nCapacity *= 2)
+    {
+        for (unsigned int nDiff = 0; nDiff <= nCapacity + 4; ++nDiff)
+        {
+            // -- common elements cancel, only the difference is decoded
+            CReconSketch sketchA(nCapacity), sketchB(nCapacity);
+            for (int i = 0; i < 200; ++i)
+            {
+                uint32_t n = RandElement();
+                sketchA.Add(n);
+                sketchB.Add(n);
+            };
+
+            std::set<uint32_t> setDiff;
+            while (setDiff.size() < nDiff)
+                setDiff.insert(RandElement());
+            int i = 0;
+            for (std::set<uint32_t>::iterator it = setDiff.begin(); it != setDiff.end(); ++it, ++i)
+                (i % 2 ? sketchA : sketchB).Add(*it);
+
+            sketchA.Merge(sketchB);
+            std::vector<uint32_t> vDecoded;
+            bool fDecoded = sketchA.Decode(vDecoded);
+            if (nDiff >= nCapacity)
+            {
+                BOOST_CHECK(!fDecoded);
+                continue;
+            };
+
+            BOOST_REQUIRE(fDecoded);
+            BOOST_CHECK(std::set<uint32_t>(vDecoded.begin(), vDecoded.end()) == setDiff);
+            BOOST_CHECK_EQUAL(vDecoded.size(), nDiff);
+        };
+    };
+
+    // -- peers must send the sketch capacity asked for
+    CReconSketch sketch;
+    std::vector<uint32_t> vSyndromes(4, 1);
+    BOOST_CHECK(!sketch.SetSyndromes(vSyndromes, 3));
+    BOOST_CHECK(sketch.SetSyndromes(vSyndromes, 4));
+}
+
+BOOST_AUTO_TEST_CASE(txrecon_round)
+{
+    CTxReconState stateA, stateB;
+    stateA.Init(true, stateB.nLocalSalt, 0);
+    stateB.Init(false, stateA.nLocalSalt, 0);
+    BOOST_CHECK_EQUAL(stateA.k0, stateB.k0);
+    BOOST_CHECK_EQUAL(stateA.GetShortID(~uint256(0)), stateB.GetShortID(~uint256(0)));
+
+    std::vector<uint256> vCommon, vOnlyA, vOnlyB;
+    for (int i = 0; i < 100; ++i)
+    {
+        vCommon.push_back(GetRandHash());
+        BOOST_CHECK(stateA.AddToSet(vCommon.back()));
+        BOOST_CHECK(stateB.AddToSet(vCommon.back()));
+    };
+    for (int i = 0; i < 5; ++i)
+    {
+        vOnlyA.push_back(GetRandHash());
+        stateA.AddToSet(vOnlyA.back());
+        vOnlyB.push_back(GetRandHash());
+        stateB.AddToSet(vOnlyB.back());
+    };
+
+    uint16_t nSetSize, nQ;
+    stateA.StartRound(1, nSetSize, nQ);
+    BOOST_CHECK_EQUAL(nSetSize, 105);
+    BOOST_CHECK(stateA.mapSet.empty());
+
+    std::vector<uint32_t> vSyndromes;
+    stateB.RespondRound(2, nSetSize, nQ, vSyndromes);
+    BOOST_CHECK_EQUAL(vSyndromes.size(), CTxReconState::EstimateCapacity(105, 105, DEFAULT_TXRECON_Q));
+
+    // -- added after the snapshot, not asked for
+    stateA.AddToSet(vOnlyB[0]);
+
+    std::vector<uint256> vAnnounceA, vAnnounceB;
+    std::vector<uint32_t> vAsk;
+    BOOST_CHECK(stateA.FinishRound(vSyndromes, vAnnounceA, vAsk));
+    BOOST_CHECK(std::set<uint256>(vAnnounceA.begin(), vAnnounceA.end()) == std::set<uint256>(vOnlyA.begin(), vOnlyA.end()));
+    BOOST_CHECK_EQUAL(vAsk.size(), 4U);
+    BOOST_CHECK(stateA.mapSet.empty());
+    BOOST_CHECK(stateA.q < DEFAULT_TXRECON_Q);
+
+    stateB.FinishResponse(true, vAsk, vAnnounceB);
+    BOOST_CHECK_EQUAL(vAnnounceB.size(), 4U);
+    BOOST_CHECK(!stateB.fRoundActive);
+    BOOST_CHECK(stateB.mapSnapshot.empty());
+
+    // -- too small a sketch fails, both sides announce everything
+    for (int i = 0; i < 20; ++i)
+        stateA.AddToSet(GetRandHash());
+    stateA.StartRound(1 + TXRECON_INTERVAL, nSetSize, nQ);
+    BOOST_CHECK(!stateB.RespondRound(1 + TXRECON_INTERVAL, nSetSize, nQ, vSyndromes));
+    BOOST_CHECK(stateB.RespondRound(2 + TXRECON_INTERVAL, nSetSize, nQ, vSyndromes));
+    BOOST_CHECK_EQUAL(vSyndromes.size(), 21U);
+    vSyndromes.resize(2);
+    vAnnounceA.clear();
+    vAsk.clear();
+    BOOST_CHECK(!stateA.FinishRound(vSyndromes, vAnnounceA, vAsk));
+    BOOST_CHECK_EQUAL(vAnnounceA.size(), 20U);
+
+    // -- unanswered rounds time out
+    int64_t nTime = 2 + 2 * TXRECON_INTERVAL;
+    stateB.AddToSet(GetRandHash());
+    BOOST_CHECK(stateB.RespondRound(nTime, 0, 0, vSyndromes));
+    vAnnounceB.clear();
+    BOOST_CHECK(!stateB.CheckTimeout(nTime + TXRECON_TIMEOUT - 1, vAnnounceB));
+    BOOST_CHECK(stateB.CheckTimeout(nTime + TXRECON_TIMEOUT, vAnnounceB));
+    BOOST_CHECK_EQUAL(vAnnounceB.size(), 1U);
+
+    // -- the responder's set expires once the initiator stops asking
+    stateB.AddToSet(GetRandHash());
+    stateB.AddToSet(GetRandHash());
+    vAnnounceB.clear();
+    BOOST_CHECK(stateB.CheckTimeout(nTime + TXRECON_TIMEOUT, vAnnounceB));
+    BOOST_CHECK_EQUAL(vAnnounceB.size(), 2U);
+    BOOST_CHECK(stateB.mapSet.empty());
+    BOOST_CHECK(!stateB.CheckTimeout(nTime + TXRECON_TIMEOUT, vAnnounceB));
+
+    // -- an initiator's set is reconciled on its own schedule
+    stateA.AddToSet(GetRandHash());
+    vAnnounceA.clear();
+    BOOST_CHECK(!stateA.CheckTimeout(nTime + TXRECON_TIMEOUT, vAnnounceA));
+    BOOST_CHECK_EQUAL(stateA.mapSet.size(), 1U);
+
+    // -- a new responder's set expires from when reconciliation was enabled
+    CTxReconState stateC;
+    stateC.Init(false, stateA.nLocalSalt, nTime);
+    stateC.AddToSet(GetRandHash());
+    vAnnounceB.clear();
+    BOOST_CHECK(!stateC.CheckTimeout(nTime + TXRECON_TIMEOUT - 1, vAnnounceB));
+    BOOST_CHECK(stateC.CheckTimeout(nTime + TXRECON_TIMEOUT, vAnnounceB));
+    BOOST_CHECK_EQUAL(vAnnounceB.size(), 1U);
+}
+
+
+// Multi-node relay simulation, run with --log_level=message to see results.
+// Txns appear at random nodes and spread over a random graph, announced either by
+// inv to every peer, or by inv to a few outbound peers and reconciliation with the rest.
+// Counts the bytes of announcement messages, inv and the reconciliation messages.
+namespace {
+
+static const size_t MSG_HEADER_BYTES = 24;
+static const size_t INV_BYTES = 36;
+
+class CSimNode
+{
+public:
+    std::set<uint256> setHave;
+    std::vector<uint256> vNew;
+    std::vector<int> vPeers;
+    std::map<int, bool> mapOutbound;
+    std::map<int, std::set<uint256> > mapKnown;    // txns each peer is known to have
+    std::map<int, CTxReconState> mapRecon;
+};
+
+class CSimulation
+{
+public:
+    std::vector<CSimNode> vNodes;
+    std::vector<std::pair<int, int> > vLinks;  // initiator, responder
+    uint64_t nBytes;
+    bool fReconcile;
+
+    CSimulation(int nNodes, int nOutbound, bool fReconcileIn)
+    {
+        vNodes.resize(nNodes);
+        nBytes = 0;
+        fReconcile = fReconcileIn;
+        for (int i = 0; i < nNodes; ++i)
+        {
+            int nConnected = 0;
+            while (nConnected < nOutbound)
+            {
+                int j = insecure_rand() % nNodes;
+                if (j == i || vNodes[i].mapOutbound.count(j) || vNodes[j].mapOutbound.count(i))
+                    continue;
+                vNodes[i].mapOutbound[j] = true;
+                vNodes[j].mapOutbound[i] = false;
+                vNodes[i].vPeers.push_back(j);
+                vNodes[j].vPeers.push_back(i);
+                vLinks.push_back(std::make_pair(i, j));
+                nConnected++;
+            };
+        };
+
+        for (size_t i = 0; i < vLinks.size(); ++i)
+        {
+            CTxReconState& stateA = vNodes[vLinks[i].first].mapRecon[vLinks[i].second];
+            CTxReconState& stateB = vNodes[vLinks[i].second].mapRecon[vLinks[i].first];
+            stateA.Init(true, stateB.nLocalSalt, 0);
+            stateB.Init(false, stateA.nLocalSalt, 0);
+        };
+    }
+
+    void Receive(int nFrom, int nTo, const uint256& hash)
+    {
+        vNodes[nFrom].mapKnown[nTo].insert(hash);
+        vNodes[nTo].mapKnown[nFrom].insert(hash);
+        if (vNodes[nTo].setHave.insert(hash).second)
+            vNodes[nTo].vNew.push_back(hash);
+    }
+
+    void Announce(int nFrom, int nTo, const std::vector<uint256>& vHashes)
+    {
+        if (vHashes.empty())
+            return;
+        nBytes += MSG_HEADER_BYTES + GetSizeOfCompactSize(vHashes.size()) + INV_BYTES * vHashes.size();
+        for (size_t i = 0; i < vHashes.size(); ++i)
+            Receive(nFrom, nTo, vHashes[i]);
+    }
+
+    void Relay()
+    {
+        std::vector<std::vector<uint256> > vNewByNode(vNodes.size());
+        for (size_t i = 0; i < vNodes.size(); ++i)
+            vNewByNode[i].swap(vNodes[i].vNew);
+
+        for (size_t i = 0; i < vNodes.size(); ++i)
+        {
+            CSimNode& node = vNodes[i];
+            BOOST_FOREACH(int nPeer, node.vPeers)
+            {
+                std::vector<uint256> vInv;
+                BOOST_FOREACH(const uint256& hash, vNewByNode[i])
+                {
+                    if (node.mapKnown[nPeer].count(hash))
+                        continue;
+
+                    CTxReconState& state = node.mapRecon[nPeer];
+                    if (fReconcile
+                        && !IsFloodPeer(i, nPeer, hash)
+                        && state.AddToSet(hash))
+                        continue;
+                    vInv.push_back(hash);
+                };
+                Announce(i, nPeer, vInv);
+            };
+        };
+    }
+
+    // -- lowest keyed hash of the outbound peers, as RelayTransaction
+    bool IsFloodPeer(int nNode, int nPeer, const uint256& hash)
+    {
+        CSimNode& node = vNodes[nNode];
+        if (!node.mapOutbound[nPeer])
+            return false;
+
+        int nLower = 0;
+        uint64_t nKey = node.mapRecon[nPeer].GetShortID(hash);
+        BOOST_FOREACH(int nOther, node.vPeers)
+            if (nOther != nPeer && node.mapOutbound[nOther]
+                && node.mapRecon[nOther].GetShortID(hash) < nKey)
+                nLower++;
+        return nLower < TXRECON_FLOOD_OUTBOUND;
+    }
+
+    void DropKnown(int nNode, int nPeer)
+    {
+        CTxReconState& state = vNodes[nNode].mapRecon[nPeer];
+        const std::set<uint256>& setKnown = vNodes[nNode].mapKnown[nPeer];
+        for (std::map<uint32_t, uint256>::iterator mi = state.mapSet.begin(); mi != state.mapSet.end(); )
+        {
+            if (setKnown.count(mi->second))
+                state.mapSet.erase(mi++);
+            else
+                ++mi;
+        };
+    }
+
+    void Reconcile(int nStep, int nInterval)
+    {
+        for (size_t i = 0; i < vLinks.size(); ++i)
+        {
+            if ((nStep + i) % nInterval != 0)
+                continue;
+
+            int nA = vLinks[i].first, nB = vLinks[i].second;
+            CTxReconState& stateA = vNodes[nA].mapRecon[nB];
+            CTxReconState& stateB = vNodes[nB].mapRecon[nA];
+            DropKnown(nA, nB);
+            DropKnown(nB, nA);
+            if (stateA.mapSet.empty() && stateB.mapSet.empty())
+                continue;
+
+            // -- each link reconciles every nInterval steps, at most once per TXRECON_INTERVAL
+            int64_t nTime = (int64_t)nStep * TXRECON_INTERVAL;
+            uint16_t nSetSize, nQ;
+            stateA.StartRound(nTime, nSetSize, nQ);
+            nBytes += MSG_HEADER_BYTES + 4;
+
+            std::vector<uint32_t> vSyndromes;
+            stateB.RespondRound(nTime, nSetSize, nQ, vSyndromes);
+            nBytes += MSG_HEADER_BYTES + GetSizeOfCompactSize(vSyndromes.size()) + 4 * vSyndromes.size();
+
+            std::vector<uint256> vAnnounceA, vAnnounceB;
+            std::vector<uint32_t> vAsk;
+            bool fSuccess = stateA.FinishRound(vSyndromes, vAnnounceA, vAsk);
+            nBytes += MSG_HEADER_BYTES + 1 + GetSizeOfCompactSize(vAsk.size()) + 4 * vAsk.size();
+            stateB.FinishResponse(fSuccess, vAsk, vAnnounceB);
+
+            Announce(nA, nB, vAnnounceA);
+            Announce(nB, nA, vAnnounceB);
+        };
+    }
+
+    bool Complete(size_t nTxns)
+    {
+        for (size_t i = 0; i < vNodes.size(); ++i)
+            if (vNodes[i].setHave.size() < nTxns)
+                return false;
+        return true;
+    }
+
+    // Returns the steps taken for every node to have every txn
+    int Run(const std::vector<std::pair<int, uint256> >& vTxns, int nTxnsPerStep, int nInterval)
+    {
+        int nStep = 0;
+        size_t nNext = 0;
+        for (; nStep < 10000; ++nStep)
+        {
+            for (int i = 0; i < nTxnsPerStep && nNext < vTxns.size(); ++i, ++nNext)
+            {
+                CSimNode& node = vNodes[vTxns[nNext].first];
+                node.setHave.insert(vTxns[nNext].second);
+                node.vNew.push_back(vTxns[nNext].second);
+            };
+
+            Relay();
+            if (fReconcile)
+                Reconcile(nStep, nInterval);
+
+            if (nNext == vTxns.size() && Complete(vTxns.size()))
+                break;
+        };
+        return nStep;
+    }
+};
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(txrecon_simulation)
+{
+    const int nNodes = 40;
+    const int nOutbound = 8;
+    const int nTxns = 2000;
+    const int nTxnsPerStep = 5;
+    const int nInterval = 8;    // steps between reconciliations on each link
+
+    seed_insecure_rand(true);
+    std::vector<std::pair<int, uint256> > vTxns;
+    for (int i = 0; i < nTxns; ++i)
+        vTxns.push_back(std::make_pair(insecure_rand() % nNodes, GetRandHash()));
+
+    seed_insecure_rand(true);
+    CSimulation simFlood(nNodes, nOutbound, false);
+    int nStepsFlood = simFlood.Run(vTxns, nTxnsPerStep, nInterval);
+
+    CTxReconStats statsBefore;
+    GetTxReconStats(statsBefore);
+
+    seed_insecure_rand(true);
+    CSimulation simRecon(nNodes, nOutbound, true);
+    int nStepsRecon = simRecon.Run(vTxns, nTxnsPerStep, nInterval);
+
+    CTxReconStats stats;
+    GetTxReconStats(stats);
+
+    BOOST_CHECK(simFlood.Complete(nTxns));
+    BOOST_CHECK(simRecon.Complete(nTxns));
+    BOOST_CHECK(simRecon.nBytes * 2 < simFlood.nBytes);
+
+    BOOST_TEST_MESSAGE(strprintf("%d nodes, %d links, %d txns: inv flooding %u bytes in %d steps, "
+        "reconciliation %u bytes in %d steps, %.1f%% saved",
+        nNodes, simFlood.vLinks.size(), nTxns,
+        simFlood.nBytes, nStepsFlood, simRecon.nBytes, nStepsRecon,
+        100.0 * (1.0 - (double)simRecon.nBytes / simFlood.nBytes)));
+    BOOST_TEST_MESSAGE(strprintf("reconciliation rounds %u, failed %u, sketch bytes %u, txns announced %u, cancelled %u",
+        stats.nRounds - statsBefore.nRounds, stats.nFailed - statsBefore.nFailed,
+        stats.nSketchBytes - statsBefore.nSketchBytes, stats.nAnnounced - statsBefore.nAnnounced,
+        stats.nCancelled - statsBefore.nCancelled));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "ringsig.h"
+#include "chainparams.h"
+#include "init.h"
+#include "wallet.h"
+
+// test_tokenpay --log_level=message --run_test=txvalidation_tests
+
+static const int nBenchRingSize = 4;
+
+// Build an anon txn spending one ring signed input, as CWallet::AddAnonInputs lays out RING_SIG_1
+static void MakeAnonTransaction(CTransaction &tx)
+{
+    tx.nVersion = ANON_TXN_VERSION;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+
+    CKey keyOut;
+    keyOut.MakeNewKey(true);
+    tx.vout[0].nValue = 1 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(keyOut.GetPubKey().GetID());
+
+    CTxIn &txin = tx.vin[0];
+    txin.scriptSig.resize(2 + (EC_COMPRESSED_SIZE + EC_SECRET_SIZE + EC_SECRET_SIZE) * nBenchRingSize);
+    txin.scriptSig[0] = OP_RETURN;
+    txin.scriptSig[1] = OP_ANON_MARKER;
+
+    std::vector<CKey> vKeys(nBenchRingSize);
+    for (int i = 0; i < nBenchRingSize; ++i)
+    {
+        vKeys[i].MakeNewKey(true);
+        CPubKey pk = vKeys[i].GetPubKey();
+        memcpy(&txin.scriptSig[2 + i * EC_COMPRESSED_SIZE], pk.begin(), EC_COMPRESSED_SIZE);
+    };
+
+    int nSecretOffset = GetRandInt(nBenchRingSize);
+    ec_secret sSpend;
+    ec_point pkSpend;
+    ec_point keyImage;
+    memcpy(&sSpend.e[0], vKeys[nSecretOffset].begin(), EC_SECRET_SIZE);
+    BOOST_REQUIRE(0 == SecretToPublicKey(sSpend, pkSpend));
+    BOOST_REQUIRE(0 == generateKeyImage(pkSpend, sSpend, keyImage));
+
+    memcpy(txin.prevout.hash.begin(), &keyImage[0], 32);
+    txin.prevout.n = keyImage[32] | (nBenchRingSize << 16);
+
+    uint256 preimage;
+    BOOST_REQUIRE(0 == pwalletMain->GetTxnPreImage(tx, preimage));
+
+    uint8_t *pPubkeys = &txin.scriptSig[2];
+    uint8_t *pSigc    = &txin.scriptSig[2 + EC_COMPRESSED_SIZE * nBenchRingSize];
+    uint8_t *pSigr    = &txin.scriptSig[2 + (EC_COMPRESSED_SIZE + EC_SECRET_SIZE) * nBenchRingSize];
+    BOOST_REQUIRE(0 == generateRingSignature(keyImage, preimage, nBenchRingSize, nSecretOffset, sSpend, pPubkeys, pSigc, pSigr));
+}
+
+static void PreValidateRange(std::vector<CTransaction> *pvtx, size_t nBegin, size_t nStep, boost::atomic<int> *pnValid)
+{
+    for (size_t i = nBegin; i < pvtx->size(); i += nStep)
+        if (PreValidateTransaction((*pvtx)[i]))
+            (*pnValid)++;
+}
+
+static int64_t PreValidateAll(std::vector<CTransaction> &vtx, int nThreads, int &nValid)
+{
+    boost::atomic<int> nValidAtomic(0);
+    int64_t nStart = GetTimeMicros();
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; ++i)
+        threads.create_thread(boost::bind(&PreValidateRange, &vtx, i, nThreads, &nValidAtomic));
+    threads.join_all();
+    nValid = nValidAtomic;
+    return std::max((int64_t)1, GetTimeMicros() - nStart);
+}
+
+BOOST_AUTO_TEST_SUITE(txvalidation_tests)
+
+BOOST_AUTO_TEST_CASE(prevalidate_ringsig)
+{
+    SelectParams(CChainParams::TESTNET);
+    BOOST_REQUIRE(0 == initialiseRingSigs());
+
+    CTransaction tx;
+    MakeAnonTransaction(tx);
+    BOOST_CHECK(PreValidateTransaction(tx));
+    BOOST_CHECK(PreValidateTransaction(tx)); // cached
+
+    // -- a flipped bit in the signature must not be served from the cache
+    CTransaction txBad(tx);
+    txBad.vin[0].scriptSig[2 + EC_COMPRESSED_SIZE * nBenchRingSize] ^= 1;
+    BOOST_CHECK(!PreValidateTransaction(txBad));
+    BOOST_CHECK_EQUAL(txBad.nDoS, 100);
+
+    // -- a txn already in the pool is dropped before any checks, without blame
+    CTransaction txPool(txBad);
+    txPool.nDoS = 0;
+    mempool.addUnchecked(txPool.GetHash(), txPool);
+    BOOST_CHECK(!PreValidateTransaction(txPool));
+    BOOST_CHECK_EQUAL(txPool.nDoS, 0);
+    mempool.remove(txPool);
+
+    BOOST_CHECK(0 == finaliseRingSigs());
+    SelectParams(CChainParams::MAIN);
+}
+
+// Throughput of the stateless stage.
+// Run with --log_level=message --run_test=txvalidation_tests/prevalidate_bench to see results
+BOOST_AUTO_TEST_CASE(prevalidate_bench, *boost::unit_test::disabled())
+{
+    SelectParams(CChainParams::TESTNET);
+    BOOST_REQUIRE(0 == initialiseRingSigs());
+
+    const int nTxns = 200;
+    const int nThreads = std::max(2, std::min((int)boost::thread::hardware_concurrency(), MAX_TX_PREVALIDATE_THREADS));
+
+    // -- separate sets, the second pass would otherwise hit the ring signature cache
+    std::vector<CTransaction> vtxSerial(nTxns), vtxParallel(nTxns);
+    for (int i = 0; i < nTxns; ++i)
+    {
+        MakeAnonTransaction(vtxSerial[i]);
+        MakeAnonTransaction(vtxParallel[i]);
+    };
+
+    int nValidSerial, nValidParallel;
+    int64_t nSerial = PreValidateAll(vtxSerial, 1, nValidSerial);
+    int64_t nParallel = PreValidateAll(vtxParallel, nThreads, nValidParallel);
+
+    BOOST_CHECK_EQUAL(nValidSerial, nTxns);
+    BOOST_CHECK_EQUAL(nValidParallel, nTxns);
+
+    BOOST_TEST_MESSAGE(strprintf("prevalidate %d txns, ring size %d: 1 thread %.0f tx/s, %d threads %.0f tx/s",
+        nTxns, nBenchRingSize,
+        nTxns * 1e6 / nSerial,
+        nThreads, nTxns * 1e6 / nParallel));
+
+    BOOST_CHECK(0 == finaliseRingSigs());
+    SelectParams(CChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
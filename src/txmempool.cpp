@@ -166,9 +166,9 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        CTransaction* ptx = &(mapTx[hash] = tx);
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(ptx, i);
         nTransactionsUpdated++;
     }
     return true;
@@ -187,14 +187,13 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             {
                 for (unsigned int i = 0; i < tx.vout.size(); i++)
                 {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    nextTxMap::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it != mapNextTx.end())
                         remove(*it->second.ptx, true);
                 };
             };
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
 
             if (tx.nVersion == ANON_TXN_VERSION)
             {
@@ -206,13 +205,16 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                     if (!txin.IsAnonInput())
                         continue;
                     
-                    ec_point vchImage;
-                    txin.ExtractKeyImage(vchImage);
+                    CKeyImage ki;
+                    txin.ExtractKeyImage(ki);
                     
-                    mapKeyImage.erase(vchImage);
+                    mapKeyImage.erase(ki);
                 };
             };
 
+            // -- tx may refer to the entry itself, erase it last
+            mapTx.erase(hash);
+
             removeAddressIndex(hash);
             removeSpentIndex(hash);
             nTransactionsUpdated++;
@@ -227,7 +229,7 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin)
     {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        nextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end())
         {
             const CTransaction &txConflict = *it->second.ptx;
@@ -253,14 +255,14 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (txMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    txMap::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end())
         return false;
     result = i->second;
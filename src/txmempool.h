@@ -6,6 +6,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "hashmap.h"
 #include "addressindex.h"
 #include "spentindex.h"
 
@@ -25,10 +26,13 @@ private:
     unsigned int nTransactionsUpdated;
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    typedef salted_hash_map<uint256, CTransaction> txMap;
+    txMap mapTx;
+    typedef salted_hash_map<COutPoint, CInPoint> nextTxMap;
+    nextTxMap mapNextTx;
     
-    std::map<std::vector<uint8_t>, CKeyImageSpent> mapKeyImage;
+    typedef salted_hash_map<CKeyImage, CKeyImageSpent> keyImageMap;
+    keyImageMap mapKeyImage;
 
     typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
     addressDeltaMap mapAddress;
@@ -85,19 +89,25 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
     
-    bool insertKeyImage(const std::vector<uint8_t>& vchImage, CKeyImageSpent& kis)
+    bool insertKeyImage(const CKeyImage& ki, CKeyImageSpent& kis)
     {
         LOCK(cs);
         
-        mapKeyImage[vchImage] = kis;
+        mapKeyImage[ki] = kis;
         
         return true;
     }
-    bool lookupKeyImage(const std::vector<uint8_t>& vchImage, CKeyImageSpent& result) const
+    bool insertKeyImage(const std::vector<uint8_t>& vchImage, CKeyImageSpent& kis)
+    {
+        if (vchImage.size() != EC_COMPRESSED_SIZE)
+            return false;
+        return insertKeyImage(CKeyImage(vchImage), kis);
+    }
+    bool lookupKeyImage(const CKeyImage& ki, CKeyImageSpent& result) const
     {
         LOCK(cs);
         
-        std::map<std::vector<uint8_t>, CKeyImageSpent>::const_iterator it = mapKeyImage.find(vchImage);
+        keyImageMap::const_iterator it = mapKeyImage.find(ki);
         if (it == mapKeyImage.end())
             return false;
         
@@ -105,6 +115,12 @@ public:
         
         return true;
     }
+    bool lookupKeyImage(const std::vector<uint8_t>& vchImage, CKeyImageSpent& result) const
+    {
+        if (vchImage.size() != EC_COMPRESSED_SIZE)
+            return false;
+        return lookupKeyImage(CKeyImage(vchImage), result);
+    }
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -0,0 +1,531 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txreconciliation.h"
+
+#include "hash.h"
+#include "sync.h"
+#include "util.h"
+
+#include <limits>
+
+static CCriticalSection cs_txReconStats;
+static CTxReconStats txReconStats;
+
+void GetTxReconStats(CTxReconStats& stats)
+{
+    LOCK(cs_txReconStats);
+    stats = txReconStats;
+}
+
+
+// -- GF(2^32) modulo x^32 + x^7 + x^3 + x^2 + 1
+static const uint32_t GF_MODULUS = 0x8D;
+
+static uint32_t GFMul(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+    while (b)
+    {
+        if (b & 1)
+            r ^= a;
+        b >>= 1;
+        a = (a << 1) ^ ((a & 0x80000000) ? GF_MODULUS : 0);
+    };
+    return r;
+}
+
+static uint32_t GFInv(uint32_t a)
+{
+    // -- a^(2^32 - 2)
+    uint32_t r = 1;
+    for (int i = 31; i >= 0; --i)
+    {
+        r = GFMul(r, r);
+        if (i != 0)
+            r = GFMul(r, a);
+    };
+    return r;
+}
+
+
+// -- polynomials over GF(2^32), coefficient i is of z^i, no trailing zeros
+typedef std::vector<uint32_t> GFPoly;
+
+static void PolyTrim(GFPoly& a)
+{
+    while (!a.empty() && a.back() == 0)
+        a.pop_back();
+}
+
+static void PolyAdd(GFPoly& a, const GFPoly& b)
+{
+    if (a.size() < b.size())
+        a.resize(b.size(), 0);
+    for (size_t i = 0; i < b.size(); ++i)
+        a[i] ^= b[i];
+    PolyTrim(a);
+}
+
+static void PolyMakeMonic(GFPoly& a)
+{
+    if (a.empty() || a.back() == 1)
+        return;
+    uint32_t nInv = GFInv(a.back());
+    for (size_t i = 0; i < a.size(); ++i)
+        a[i] = GFMul(a[i], nInv);
+}
+
+// Reduce a modulo m, the quotient is put in pq if set
+static void PolyDivMod(GFPoly& a, const GFPoly& m, GFPoly* pq)
+{
+    size_t nDegM = m.size() - 1;
+    if (pq)
+        pq->assign(a.size() > nDegM ? a.size() - nDegM : 0, 0);
+
+    uint32_t nInvLead = GFInv(m.back());
+    while (a.size() > nDegM)
+    {
+        uint32_t c = GFMul(a.back(), nInvLead);
+        size_t nShift = a.size() - 1 - nDegM;
+        if (pq)
+            (*pq)[nShift] = c;
+        for (size_t i = 0; i < nDegM; ++i)
+            a[nShift + i] ^= GFMul(c, m[i]);
+        a.pop_back();
+        PolyTrim(a);
+    };
+}
+
+static void PolySqrMod(GFPoly& a, const GFPoly& m)
+{
+    if (a.empty())
+        return;
+
+    // -- cross terms cancel in characteristic 2
+    GFPoly r(a.size() * 2 - 1, 0);
+    for (size_t i = 0; i < a.size(); ++i)
+        r[2 * i] = GFMul(a[i], a[i]);
+    PolyDivMod(r, m, NULL);
+    a.swap(r);
+}
+
+static GFPoly PolyGCD(GFPoly a, GFPoly b)
+{
+    while (!b.empty())
+    {
+        PolyDivMod(a, b, NULL);
+        a.swap(b);
+    };
+    PolyMakeMonic(a);
+    return a;
+}
+
+// f is monic with distinct roots in GF(2^32), split it by gcd with Tr(a.z) for random a
+static bool PolyFindRoots(const GFPoly& f, std::vector<uint32_t>& vRoots, uint64_t& nRand)
+{
+    if (f.size() <= 1)
+        return true;
+    if (f.size() == 2)
+    {
+        vRoots.push_back(f[0]);
+        return true;
+    };
+
+    for (int nTry = 0; nTry < 64; ++nTry)
+    {
+        nRand ^= nRand << 13;
+        nRand ^= nRand >> 7;
+        nRand ^= nRand << 17;
+        uint32_t a = nRand & 0xffffffff;
+        if (a == 0)
+            continue;
+
+        GFPoly t(2, 0);
+        t[1] = a;
+        PolyDivMod(t, f, NULL);
+        GFPoly trace(t);
+        for (int i = 1; i < 32; ++i)
+        {
+            PolySqrMod(t, f);
+            PolyAdd(trace, t);
+        };
+
+        GFPoly g = PolyGCD(f, trace);
+        if (g.size() <= 1 || g.size() == f.size())
+            continue;
+
+        GFPoly q, r(f);
+        PolyDivMod(r, g, &q);
+        return PolyFindRoots(g, vRoots, nRand)
+            && PolyFindRoots(q, vRoots, nRand);
+    };
+
+    return false;
+}
+
+// Shortest linear recurrence for s, the error locator polynomial
+static int BerlekampMassey(const std::vector<uint32_t>& s, GFPoly& c)
+{
+    GFPoly b(1, 1);
+    c.assign(1, 1);
+    int nL = 0, m = 1;
+    uint32_t nB = 1;
+
+    for (size_t n = 0; n < s.size(); ++n)
+    {
+        uint32_t d = s[n];
+        for (int i = 1; i <= nL && i < (int)c.size(); ++i)
+            d ^= GFMul(c[i], s[n - i]);
+
+        if (d == 0)
+        {
+            m++;
+            continue;
+        };
+
+        uint32_t nCoef = GFMul(d, GFInv(nB));
+        GFPoly t(c);
+        if (c.size() < b.size() + m)
+            c.resize(b.size() + m, 0);
+        for (size_t i = 0; i < b.size(); ++i)
+            c[i + m] ^= GFMul(nCoef, b[i]);
+
+        if (2 * nL <= (int)n)
+        {
+            nL = n + 1 - nL;
+            b.swap(t);
+            nB = d;
+            m = 1;
+        } else
+        {
+            m++;
+        };
+    };
+
+    c.resize(nL + 1, 0);
+    return nL;
+}
+
+
+bool CReconSketch::SetSyndromes(const std::vector<uint32_t>& vIn, unsigned int nCapacity)
+{
+    if (vIn.size() != nCapacity)
+        return false;
+    vSyndromes = vIn;
+    return true;
+}
+
+void CReconSketch::Add(uint32_t nElement)
+{
+    if (nElement == 0)
+        return;
+
+    uint32_t nSqr = GFMul(nElement, nElement);
+    uint32_t nPow = nElement;
+    for (size_t i = 0; i < vSyndromes.size(); ++i)
+    {
+        vSyndromes[i] ^= nPow;
+        nPow = GFMul(nPow, nSqr);
+    };
+}
+
+void CReconSketch::Merge(const CReconSketch& other)
+{
+    for (size_t i = 0; i < vSyndromes.size() && i < other.vSyndromes.size(); ++i)
+        vSyndromes[i] ^= other.vSyndromes[i];
+}
+
+bool CReconSketch::Decode(std::vector<uint32_t>& vElements) const
+{
+    vElements.clear();
+    if (vSyndromes.empty())
+        return true;
+
+    // -- the last syndrome is kept back to check the result, a set larger than the
+    //    sketch can otherwise decode to a wrong one
+    size_t nUse = vSyndromes.size() - 1;
+
+    // -- even power sums follow from the odd, S(2k) = S(k)^2
+    std::vector<uint32_t> s(nUse * 2);
+    for (size_t n = 0; n < s.size(); ++n)
+        s[n] = (n & 1) ? GFMul(s[n / 2], s[n / 2]) : vSyndromes[n / 2];
+
+    GFPoly c;
+    int nL = BerlekampMassey(s, c);
+    if (nL > (int)nUse
+        || c[nL] == 0) // zero is never an element
+        return false;
+
+    if (nL > 0)
+    {
+        // -- roots of the reversed locator are the elements
+        GFPoly f(nL + 1);
+        for (int i = 0; i <= nL; ++i)
+            f[i] = c[nL - i];
+
+        // -- all roots must be distinct and in the field, f divides z^(2^32) - z
+        GFPoly z(2, 0);
+        z[1] = 1;
+        PolyDivMod(z, f, NULL);
+        GFPoly t(z);
+        for (int i = 0; i < 32; ++i)
+            PolySqrMod(t, f);
+        if (t != z)
+            return false;
+
+        uint64_t nRand = 0x9e3779b97f4a7c15ULL;
+        if (!PolyFindRoots(f, vElements, nRand)
+            || vElements.size() != (size_t)nL)
+        {
+            vElements.clear();
+            return false;
+        };
+    };
+
+    CReconSketch check(vSyndromes.size());
+    for (size_t i = 0; i < vElements.size(); ++i)
+        check.Add(vElements[i]);
+    if (check.vSyndromes.back() != vSyndromes.back())
+    {
+        vElements.clear();
+        return false;
+    };
+
+    return true;
+}
+
+
+CTxReconState::CTxReconState()
+{
+    fEnabled = false;
+    fInitiator = false;
+    nLocalSalt = GetRand(std::numeric_limits<uint64_t>::max());
+    k0 = k1 = 0;
+    fRoundActive = false;
+    nRoundStart = 0;
+    nNextRound = 0;
+    nLastRequest = 0;
+    q = DEFAULT_TXRECON_Q;
+}
+
+void CTxReconState::Init(bool fInitiatorIn, uint64_t nRemoteSalt, int64_t nTimeMicros)
+{
+    // -- both sides get the same keys
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << std::min(nLocalSalt, nRemoteSalt) << std::max(nLocalSalt, nRemoteSalt);
+    uint256 hashKey = ss.GetHash();
+    k0 = hashKey.Get64(0);
+    k1 = hashKey.Get64(1);
+
+    fInitiator = fInitiatorIn;
+    fEnabled = true;
+    nRoundStart = nTimeMicros;
+    nNextRound = nTimeMicros + GetRand(TXRECON_INTERVAL);
+}
+
+uint32_t CTxReconState::GetShortID(const uint256& hash) const
+{
+    uint32_t nShortID = SipHashUint256(k0, k1, hash) & 0xffffffff;
+    return nShortID == 0 ? 1 : nShortID;
+}
+
+bool CTxReconState::AddToSet(const uint256& hash)
+{
+    if (mapSet.size() >= MAX_TXRECON_SET_SIZE)
+        return false;
+
+    std::pair<std::map<uint32_t, uint256>::iterator, bool> ret = mapSet.insert(std::make_pair(GetShortID(hash), hash));
+    return ret.second || ret.first->second == hash;
+}
+
+void CTxReconState::RemoveFromSet(const uint256& hash)
+{
+    std::map<uint32_t, uint256>::iterator mi = mapSet.find(GetShortID(hash));
+    if (mi != mapSet.end() && mi->second == hash)
+        mapSet.erase(mi);
+}
+
+unsigned int CTxReconState::EstimateCapacity(size_t nLocal, size_t nRemote, double q)
+{
+    if (nLocal == 0 && nRemote == 0)
+        return 0;
+
+    size_t nDiff = nLocal > nRemote ? nLocal - nRemote : nRemote - nLocal;
+    size_t nMin = std::min(nLocal, nRemote);
+    size_t nCapacity = nDiff + (size_t)(q * nMin) + 1;
+    return std::min(nCapacity, (size_t)MAX_SKETCH_CAPACITY);
+}
+
+CReconSketch CTxReconState::GetSketch(unsigned int nCapacity) const
+{
+    CReconSketch sketch(nCapacity);
+    for (std::map<uint32_t, uint256>::const_iterator mi = mapSnapshot.begin(); mi != mapSnapshot.end(); ++mi)
+        sketch.Add(mi->first);
+    return sketch;
+}
+
+void CTxReconState::StartRound(int64_t nTimeMicros, uint16_t& nSetSize, uint16_t& nQ)
+{
+    mapSnapshot.swap(mapSet);
+    mapSet.clear();
+
+    nSetSize = std::min(mapSnapshot.size(), (size_t)std::numeric_limits<uint16_t>::max());
+    nQ = std::min(q, MAX_TXRECON_Q) * TXRECON_Q_PRECISION;
+    fRoundActive = true;
+    nRoundStart = nTimeMicros;
+    nNextRound = nTimeMicros + TXRECON_INTERVAL;
+}
+
+bool CTxReconState::FinishRound(const std::vector<uint32_t>& vRemoteSyndromes,
+    std::vector<uint256>& vAnnounce, std::vector<uint32_t>& vAsk)
+{
+    fRoundActive = false;
+    unsigned int nCapacity = vRemoteSyndromes.size();
+
+    CReconSketch sketchRemote;
+    sketchRemote.SetSyndromes(vRemoteSyndromes, nCapacity);
+    CReconSketch sketch = GetSketch(nCapacity);
+    sketch.Merge(sketchRemote);
+
+    std::vector<uint32_t> vDiff;
+    bool fSuccess = (nCapacity > 0 || mapSnapshot.empty())
+        && nCapacity <= MAX_SKETCH_CAPACITY
+        && sketch.Decode(vDiff);
+
+    size_t nLocal = mapSnapshot.size();
+    if (!fSuccess)
+    {
+        for (std::map<uint32_t, uint256>::iterator mi = mapSnapshot.begin(); mi != mapSnapshot.end(); ++mi)
+            vAnnounce.push_back(mi->second);
+        q = std::min(MAX_TXRECON_Q, q * 2);
+    } else
+    {
+        for (size_t i = 0; i < vDiff.size(); ++i)
+        {
+            std::map<uint32_t, uint256>::iterator mi = mapSnapshot.find(vDiff[i]);
+            if (mi != mapSnapshot.end())
+            {
+                vAnnounce.push_back(mi->second);
+                continue;
+            };
+
+            // -- added since the snapshot, the peer has it too
+            mi = mapSet.find(vDiff[i]);
+            if (mi != mapSet.end())
+            {
+                mapSet.erase(mi);
+                continue;
+            };
+
+            vAsk.push_back(vDiff[i]);
+        };
+
+        // -- q is the part of the difference not explained by the set sizes,
+        //    averaged over rounds as a single round is often exact
+        size_t nCommon = nLocal - vAnnounce.size();
+        size_t nRemote = nCommon + vAsk.size();
+        size_t nMin = std::min(nLocal, nRemote);
+        if (nMin > 0)
+        {
+            size_t nSizeDiff = nLocal > nRemote ? nLocal - nRemote : nRemote - nLocal;
+            double qRound = (double)(vDiff.size() - nSizeDiff) / nMin;
+            q = std::max(MIN_TXRECON_Q, std::min(MAX_TXRECON_Q, (3 * q + qRound) / 4));
+        };
+    };
+    mapSnapshot.clear();
+
+    {
+        LOCK(cs_txReconStats);
+        txReconStats.nRounds++;
+        txReconStats.nSketchBytes += nCapacity * sizeof(uint32_t);
+        txReconStats.nAnnounced += vAnnounce.size();
+        txReconStats.nAsked += vAsk.size();
+        if (fSuccess)
+            txReconStats.nCancelled += nLocal - vAnnounce.size();
+        else
+            txReconStats.nFailed++;
+    }
+
+    return fSuccess;
+}
+
+bool CTxReconState::RespondRound(int64_t nTimeMicros, uint16_t nRemoteSetSize, uint16_t nRemoteQ, std::vector<uint32_t>& vSyndromes)
+{
+    // -- the initiator asks once per TXRECON_INTERVAL, more often would have the set sketched for nothing
+    if (nLastRequest != 0
+        && nTimeMicros - nLastRequest < TXRECON_INTERVAL)
+        return false;
+    nLastRequest = nTimeMicros;
+
+    // -- an unfinished round is folded into this one
+    mapSet.insert(mapSnapshot.begin(), mapSnapshot.end());
+    mapSnapshot.swap(mapSet);
+    mapSet.clear();
+
+    double qRemote = (double)nRemoteQ / TXRECON_Q_PRECISION;
+    unsigned int nCapacity = EstimateCapacity(mapSnapshot.size(), nRemoteSetSize, qRemote);
+    vSyndromes = GetSketch(nCapacity).GetSyndromes();
+
+    fRoundActive = true;
+    nRoundStart = nTimeMicros;
+
+    {
+        LOCK(cs_txReconStats);
+        txReconStats.nSketchBytes += nCapacity * sizeof(uint32_t);
+    }
+    return true;
+}
+
+void CTxReconState::FinishResponse(bool fSuccess, const std::vector<uint32_t>& vAsk, std::vector<uint256>& vAnnounce)
+{
+    if (!fRoundActive)
+        return;
+    fRoundActive = false;
+
+    if (!fSuccess)
+    {
+        for (std::map<uint32_t, uint256>::iterator mi = mapSnapshot.begin(); mi != mapSnapshot.end(); ++mi)
+            vAnnounce.push_back(mi->second);
+    } else
+    {
+        for (size_t i = 0; i < vAsk.size(); ++i)
+        {
+            std::map<uint32_t, uint256>::iterator mi = mapSnapshot.find(vAsk[i]);
+            if (mi != mapSnapshot.end())
+                vAnnounce.push_back(mi->second);
+        };
+    };
+    mapSnapshot.clear();
+
+    {
+        LOCK(cs_txReconStats);
+        txReconStats.nAnnounced += vAnnounce.size();
+    }
+}
+
+bool CTxReconState::CheckTimeout(int64_t nTimeMicros, std::vector<uint256>& vAnnounce)
+{
+    if (nTimeMicros - nRoundStart < TXRECON_TIMEOUT)
+        return false;
+
+    if (fRoundActive)
+    {
+        for (std::map<uint32_t, uint256>::iterator mi = mapSnapshot.begin(); mi != mapSnapshot.end(); ++mi)
+            vAnnounce.push_back(mi->second);
+        mapSnapshot.clear();
+        fRoundActive = false;
+        return true;
+    };
+
+    // -- the initiator stopped asking, announce the set rather than hold it until it's full
+    if (!fInitiator && !mapSet.empty())
+    {
+        for (std::map<uint32_t, uint256>::iterator mi = mapSet.begin(); mi != mapSet.end(); ++mi)
+            vAnnounce.push_back(mi->second);
+        mapSet.clear();
+        return true;
+    };
+    return false;
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2018 The TokenPay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef TPAY_TXRECONCILIATION_H
+#define TPAY_TXRECONCILIATION_H
+
+#include "uint256.h"
+
+#include <map>
+#include <vector>
+
+/** Transaction relay by set reconciliation (Erlay).
+ *
+ *  Txns are announced by inv to a few outbound peers only, the rest are added to
+ *  a set per peer. Periodically the peer that made the connection asks for a
+ *  sketch of the other side's set, combines it with a sketch of its own and
+ *  decodes the short ids in one set but not the other. Both sides then inv just
+ *  the txns the other is missing, txns in both sets cost nothing.
+ */
+
+/** Reconciliation protocol version, sent in sendtxrcncl */
+static const uint32_t TXRECON_VERSION = 1;
+/** Microseconds between reconciliations with each outbound peer */
+static const int64_t TXRECON_INTERVAL = 8 * 1000000;
+/** Microseconds a round may be left unanswered, the set is then announced by inv.
+ *  A responder not asked for this long announces its set the same way. */
+static const int64_t TXRECON_TIMEOUT = 60 * 1000000;
+/** Outbound reconciling peers each txn is still announced to by inv */
+static const int TXRECON_FLOOD_OUTBOUND = 1;
+/** Txns waiting for reconciliation with one peer, further txns are announced by inv */
+static const unsigned int MAX_TXRECON_SET_SIZE = 3000;
+/** Largest sketch sent, larger differences fall back to inv */
+static const unsigned int MAX_SKETCH_CAPACITY = 128;
+/** q is sent as a fixed point number, q * TXRECON_Q_PRECISION */
+static const unsigned int TXRECON_Q_PRECISION = (2 << 14) - 1;
+/** Starting estimate of the difference between sets, relative to the smaller set */
+static const double DEFAULT_TXRECON_Q = 0.25;
+static const double MIN_TXRECON_Q = 0.2;
+static const double MAX_TXRECON_Q = 2.0;
+
+
+/** Sketch of a set of 32 bit values (PinSketch, a BCH code over GF(2^32)).
+ *  Holds the odd power sums of the elements, sketches of two sets combined by xor
+ *  give the sketch of their symmetric difference, which decodes while it has fewer
+ *  elements than the capacity. Zero can't be added.
+ */
+class CReconSketch
+{
+private:
+    std::vector<uint32_t> vSyndromes;   // sum of x^1, x^3, x^5, ...
+
+public:
+    CReconSketch(unsigned int nCapacity = 0)
+    {
+        vSyndromes.resize(nCapacity, 0);
+    }
+
+    unsigned int GetCapacity() const { return vSyndromes.size(); }
+    const std::vector<uint32_t>& GetSyndromes() const { return vSyndromes; }
+    /** Sketch as received from a peer, must have nCapacity syndromes */
+    bool SetSyndromes(const std::vector<uint32_t>& vIn, unsigned int nCapacity);
+
+    void Add(uint32_t nElement);
+    void Merge(const CReconSketch& other);
+
+    /** Returns false unless the set has fewer elements than the capacity */
+    bool Decode(std::vector<uint32_t>& vElements) const;
+};
+
+
+/** Reconciliation counters, all peers */
+class CTxReconStats
+{
+public:
+    uint64_t nRounds;
+    uint64_t nFailed;           // sketch didn't decode, sets announced by inv
+    uint64_t nSketchBytes;      // sketches sent and received
+    uint64_t nAnnounced;        // txns announced as a result of reconciliation
+    uint64_t nAsked;            // short ids asked for
+    uint64_t nCancelled;        // txns both sides had, not announced
+
+    CTxReconStats()
+    {
+        nRounds = nFailed = nSketchBytes = 0;
+        nAnnounced = nAsked = nCancelled = 0;
+    }
+};
+
+void GetTxReconStats(CTxReconStats& stats);
+
+
+/** Reconciliation with one peer, guarded by CNode::cs_inventory */
+class CTxReconState
+{
+public:
+    bool fEnabled;          // both sides sent sendtxrcncl
+    bool fInitiator;        // we made the connection, we ask for sketches
+    uint64_t nLocalSalt;
+    uint64_t k0, k1;        // short id keys, from both salts
+
+    std::map<uint32_t, uint256> mapSet;         // txns to reconcile by short id
+    std::map<uint32_t, uint256> mapSnapshot;    // mapSet at the start of the round in progress
+    bool fRoundActive;
+    int64_t nRoundStart;    // responder: also set when enabled, the set expires TXRECON_TIMEOUT after
+    int64_t nNextRound;
+    int64_t nLastRequest;   // responder: last reqrecon answered, 0 if none
+    double q;
+
+    CTxReconState();
+
+    void Init(bool fInitiatorIn, uint64_t nRemoteSalt, int64_t nTimeMicros);
+    uint32_t GetShortID(const uint256& hash) const;
+
+    /** Returns false if the txn must be announced by inv, the set is full or its short id is taken */
+    bool AddToSet(const uint256& hash);
+    void RemoveFromSet(const uint256& hash);
+
+    static unsigned int EstimateCapacity(size_t nLocal, size_t nRemote, double q);
+    CReconSketch GetSketch(unsigned int nCapacity) const;
+
+    // Initiator: snapshot the set, send reqrecon
+    void StartRound(int64_t nTimeMicros, uint16_t& nSetSize, uint16_t& nQ);
+    /** Initiator: decode the peer's sketch.
+     *  vAnnounce gets the txns to inv, vAsk the short ids to send in reconcildiff.
+     *  On failure the whole snapshot is announced.
+     */
+    bool FinishRound(const std::vector<uint32_t>& vRemoteSyndromes,
+        std::vector<uint256>& vAnnounce, std::vector<uint32_t>& vAsk);
+
+    /** Responder: snapshot the set and sketch it for reqrecon.
+     *  Returns false, and leaves the set alone, if the last request was less than TXRECON_INTERVAL ago.
+     */
+    bool RespondRound(int64_t nTimeMicros, uint16_t nRemoteSetSize, uint16_t nRemoteQ, std::vector<uint32_t>& vSyndromes);
+    /** Responder: txns asked for in reconcildiff, or the whole snapshot on failure */
+    void FinishResponse(bool fSuccess, const std::vector<uint32_t>& vAsk, std::vector<uint256>& vAnnounce);
+
+    /** Abandon a round the peer didn't complete, returns the snapshot to announce.
+     *  A responder whose peer stopped asking returns its set.
+     */
+    bool CheckTimeout(int64_t nTimeMicros, std::vector<uint256>& vAnnounce);
+};
+
+#endif // TPAY_TXRECONCILIATION_H
@@ -237,7 +237,14 @@ bool CWallet::Lock()
         };
         ExtKeyLock();
     }
-    return LockKeyStore();
+
+    if (!LockKeyStore())
+        return false;
+
+    // -- after the key store is locked, a SecureMsgBuildReceiveKeys running now finishes before
+    //    the keys are dropped, and any started later finds the wallet locked
+    SecureMsgWalletLocked();
+    return true;
 };
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)